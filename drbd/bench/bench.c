@@ -0,0 +1,962 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * drbd-bench: userspace microbenchmarks for DRBD's pure-logic hot paths.
+ *
+ * lru_cache.c and drbd_interval.c are linked in unmodified, drbd_vli.h is
+ * included unmodified; the kernel API they need comes from shim/.  The
+ * bitmap RLE encoder and decoder below are line by line copies of
+ * fill_bitmap_rle_bits() and recv_bm_rle_bits() and their window helpers,
+ * with the bitmap accessors replaced by operations on a flat, native endian
+ * bitmap.
+ *
+ * All inputs come from a fixed-seed PRNG, so two runs of the same binary
+ * on the same machine do the same work.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include <linux/lru_cache.h>
+#include "drbd_interval.h"
+#include "drbd_vli.h"
+
+static u64 seed = 0x5eed5eed5eed5eedULL;
+static unsigned int scale = 1;
+static const char *filter;
+static bool verbose;
+
+/* xorshift64*, good enough for access patterns and reproducible */
+static u64 rnd_state;
+
+static void rnd_reset(void)
+{
+	rnd_state = seed ? seed : 1;
+}
+
+static u64 rnd(void)
+{
+	rnd_state ^= rnd_state >> 12;
+	rnd_state ^= rnd_state << 25;
+	rnd_state ^= rnd_state >> 27;
+	return rnd_state * 0x2545f4914f6cdd1dULL;
+}
+
+static u64 rnd_below(u64 n)
+{
+	return rnd() % n;
+}
+
+static u64 now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* cache misses via perf, if the kernel and our privileges allow it */
+static int perf_fd = -1;
+
+static void perf_open(void)
+{
+	struct perf_event_attr attr = {
+		.type = PERF_TYPE_HARDWARE,
+		.size = sizeof(attr),
+		.config = PERF_COUNT_HW_CACHE_MISSES,
+		.disabled = 1,
+		.exclude_kernel = 1,
+		.exclude_hv = 1,
+		.inherit = 1,	/* for the al/contention threads */
+	};
+
+	perf_fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+struct measurement {
+	u64 t0;
+	u64 misses;
+};
+
+static void measure_start(struct measurement *m)
+{
+	if (perf_fd >= 0) {
+		ioctl(perf_fd, PERF_EVENT_IOC_RESET, 0);
+		ioctl(perf_fd, PERF_EVENT_IOC_ENABLE, 0);
+	}
+	m->t0 = now_ns();
+}
+
+static void measure_end(struct measurement *m, const char *name, u64 ops, const char *extra)
+{
+	u64 ns = now_ns() - m->t0;
+	char misses[32] = "n/a";
+
+	if (perf_fd >= 0) {
+		u64 count = 0;
+
+		ioctl(perf_fd, PERF_EVENT_IOC_DISABLE, 0);
+		if (read(perf_fd, &count, sizeof(count)) == sizeof(count))
+			snprintf(misses, sizeof(misses), "%.3f", ops ? (double)count / ops : 0.0);
+	}
+	if (!ops)
+		ops = 1;
+	printf("%-28s %12llu %10.1f %14.0f %10s  %s\n", name,
+	       (unsigned long long)ops, (double)ns / ops,
+	       ns ? ops * 1e9 / ns : 0.0, misses, extra ? extra : "");
+}
+
+static bool selected(const char *name)
+{
+	return !filter || strstr(name, filter);
+}
+
+/*
+ * lru_cache as used for the activity log: 1237 extents (the al-extents
+ * default) of 4MiB, at most AL_UPDATES_PER_TRANSACTION pending changes, and
+ * a window of in-flight requests holding references.  When lc_get() hands out an element with a
+ * pending change, or refuses, the "transaction" is committed the way
+ * drbd_al_begin_io_commit() does, minus the IO.
+ */
+#define AL_ELEMENTS	1237
+#define AL_MAX_PENDING	64
+#define AL_IN_FLIGHT	32
+#define AL_EXTENT_BLOCKS_SHIFT	10	/* 4KiB blocks per 4MiB extent */
+
+struct bench_al_extent {
+	struct lc_element lce;
+	unsigned long payload;
+};
+
+enum al_pattern { AL_HOT, AL_UNIFORM, AL_SEQUENTIAL };
+
+/* The 4KiB block written by request i */
+static u64 al_next_block(enum al_pattern pattern, u64 i)
+{
+	switch (pattern) {
+	case AL_HOT:
+		/* 90% into a 1GiB working set, rest over 4TiB */
+		if (rnd_below(10))
+			return rnd_below(1 << 18);
+		return rnd_below(1ULL << 30);
+	case AL_UNIFORM:
+		/* 16GiB, roughly 3x what the AL covers */
+		return rnd_below(1 << 22);
+	case AL_SEQUENTIAL:
+		return i;
+	}
+	return 0;
+}
+
+static void al_commit(struct lru_cache *lc, u64 *transactions)
+{
+	if (lc->pending_changes == 0)
+		return;
+	if (!lc_try_lock_for_transaction(lc))
+		BUG();
+	lc_committed(lc);
+	lc_unlock(lc);
+	(*transactions)++;
+}
+
+static void bench_al(const char *name, enum al_pattern pattern)
+{
+	struct lc_element *held[AL_IN_FLIGHT] = { NULL, };
+	struct kmem_cache *cache;
+	struct lru_cache *lc;
+	struct measurement m;
+	u64 i, n = 4000000ULL * scale, transactions = 0;
+	char extra[96];
+
+	if (!selected(name))
+		return;
+
+	cache = kmem_cache_create("bench_al", sizeof(struct bench_al_extent), 0, 0, NULL);
+	lc = lc_create("act_log", cache, AL_MAX_PENDING, AL_ELEMENTS,
+		       sizeof(struct bench_al_extent), offsetof(struct bench_al_extent, lce));
+	BUG_ON(!lc);
+	rnd_reset();
+
+	measure_start(&m);
+	for (i = 0; i < n; i++) {
+		unsigned int slot = i % AL_IN_FLIGHT;
+		unsigned int enr = al_next_block(pattern, i) >> AL_EXTENT_BLOCKS_SHIFT;
+		struct lc_element *e;
+
+		/* the request that used this slot has completed */
+		if (held[slot]) {
+			if (held[slot]->lc_number != held[slot]->lc_new_number)
+				al_commit(lc, &transactions);
+			lc_put(lc, held[slot]);
+			held[slot] = NULL;
+		}
+
+		e = lc_get(lc, enr);
+		if (!e) {
+			al_commit(lc, &transactions);
+			e = lc_get(lc, enr);
+			BUG_ON(!e);
+		}
+		if (e->lc_number != enr && lc->pending_changes >= AL_MAX_PENDING)
+			al_commit(lc, &transactions);
+		held[slot] = e;
+	}
+	al_commit(lc, &transactions);
+	snprintf(extra, sizeof(extra), "hits:%lu misses:%lu transactions:%llu",
+		 lc->hits, lc->misses, (unsigned long long)transactions);
+	measure_end(&m, name, n, extra);
+
+	for (i = 0; i < AL_IN_FLIGHT; i++)
+		if (held[i])
+			lc_put(lc, held[i]);
+	if (verbose) {
+		struct seq_file seq = { .file = stdout };
+
+		lc_seq_printf_stats(&seq, lc);
+	}
+	lc_destroy(lc);
+	kmem_cache_destroy(cache);
+}
+
+/*
+ * Writers on all CPUs into a small working set: each op takes and gives back
+ * a reference to one of a few extents that other requests in flight keep in
+ * the active set.  "locked" does that with lc_try_get() and lc_put() under a
+ * spinlock, the way _al_get_nonblock() and put_actlog() do under al_lock;
+ * "rcu" tries lc_try_get_rcu() and lc_put_rcu() first, as al_get_rcu() and
+ * al_complete_io_rcu() do, and falls back to the lock.
+ */
+#define AL_HOT_EXTENTS	4
+
+struct al_contention {
+	struct lru_cache *lc;
+	pthread_spinlock_t lock;
+	bool rcu;
+	u64 ops;		/* per thread */
+};
+
+struct al_contention_thread {
+	struct al_contention *c;
+	pthread_t thread;
+	unsigned int id;
+	u64 fallbacks;
+};
+
+static void *al_contention_fn(void *arg)
+{
+	struct al_contention_thread *t = arg;
+	struct al_contention *c = t->c;
+	u64 i;
+
+	for (i = 0; i < c->ops; i++) {
+		unsigned int enr = (i + t->id) % AL_HOT_EXTENTS;
+		struct lc_element *e = NULL;
+
+		if (c->rcu) {
+			rcu_read_lock();
+			e = lc_try_get_rcu(c->lc, enr);
+			rcu_read_unlock();
+			if (!e)
+				t->fallbacks++;
+		}
+		if (!e) {
+			pthread_spin_lock(&c->lock);
+			e = lc_try_get(c->lc, enr);
+			pthread_spin_unlock(&c->lock);
+			BUG_ON(!e);
+		}
+
+		if (c->rcu && lc_put_rcu(c->lc, e))
+			continue;
+		pthread_spin_lock(&c->lock);
+		lc_put(c->lc, e);
+		pthread_spin_unlock(&c->lock);
+	}
+	return NULL;
+}
+
+static void bench_al_contention(const char *name, bool rcu, unsigned int threads)
+{
+	struct lc_element *held[AL_HOT_EXTENTS];
+	struct al_contention c = { .rcu = rcu };
+	struct al_contention_thread *t;
+	struct kmem_cache *cache;
+	struct measurement m;
+	u64 n = 4000000ULL * scale, fallbacks = 0, transactions = 0;
+	unsigned int i;
+	char extra[96];
+
+	if (!selected(name))
+		return;
+
+	cache = kmem_cache_create("bench_al", sizeof(struct bench_al_extent), 0, 0, NULL);
+	c.lc = lc_create("act_log", cache, AL_MAX_PENDING, AL_ELEMENTS,
+			 sizeof(struct bench_al_extent), offsetof(struct bench_al_extent, lce));
+	BUG_ON(!c.lc);
+	for (i = 0; i < AL_HOT_EXTENTS; i++) {
+		held[i] = lc_get(c.lc, i);
+		BUG_ON(!held[i]);
+	}
+	al_commit(c.lc, &transactions);
+	pthread_spin_init(&c.lock, PTHREAD_PROCESS_PRIVATE);
+	c.ops = n / threads;
+	t = calloc(threads, sizeof(*t));
+	BUG_ON(!t);
+
+	/* threads are started after the counter, so that they inherit it */
+	measure_start(&m);
+	for (i = 0; i < threads; i++) {
+		t[i].c = &c;
+		t[i].id = i;
+		if (pthread_create(&t[i].thread, NULL, al_contention_fn, &t[i]))
+			BUG();
+	}
+	for (i = 0; i < threads; i++) {
+		pthread_join(t[i].thread, NULL);
+		fallbacks += t[i].fallbacks;
+	}
+	if (rcu)
+		snprintf(extra, sizeof(extra), "threads:%u fallbacks:%llu", threads,
+			 (unsigned long long)fallbacks);
+	else
+		snprintf(extra, sizeof(extra), "threads:%u", threads);
+	measure_end(&m, name, c.ops * threads, extra);
+
+	free(t);
+	pthread_spin_destroy(&c.lock);
+	for (i = 0; i < AL_HOT_EXTENTS; i++)
+		lc_put(c.lc, held[i]);
+	lc_destroy(c.lc);
+	kmem_cache_destroy(cache);
+}
+
+static void bench_al_contention_all(void)
+{
+	unsigned int cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	unsigned int threads;
+	char name[64];
+
+	for (threads = 1; ; threads = threads * 4 < cpus ? threads * 4 : cpus) {
+		snprintf(name, sizeof(name), "al/contention/locked/%u", threads);
+		bench_al_contention(name, false, threads);
+		snprintf(name, sizeof(name), "al/contention/rcu/%u", threads);
+		bench_al_contention(name, true, threads);
+		if (threads >= cpus)
+			break;
+	}
+}
+
+/*
+ * Interval tree with a steady population of in-flight requests: each step
+ * completes a random request, submits a new one and looks for conflicts,
+ * like drbd_insert_interval()/drbd_find_overlap() on device->write_requests.
+ */
+static void interval_random(struct drbd_interval *i, u64 dev_sectors)
+{
+	unsigned int size = (1 + rnd_below(256)) << 12;	/* 4KiB .. 1MiB */
+
+	i->sector = rnd_below(dev_sectors - (size >> 9)) & ~7ULL;
+	i->size = size;
+	drbd_clear_interval(i);
+}
+
+static struct drbd_interval *
+interval_brute_force(struct drbd_interval *set, unsigned int count, sector_t sector,
+		     unsigned int size)
+{
+	struct drbd_interval *found = NULL;
+	sector_t end = sector + (size >> 9);
+	unsigned int i;
+
+	for (i = 0; i < count; i++) {
+		struct drbd_interval *it = &set[i];
+
+		if (it->sector < end && sector < it->sector + (it->size >> 9) &&
+		    (!found || it->sector < found->sector ||
+		     (it->sector == found->sector && it->size < found->size)))
+			found = it;
+	}
+	return found;
+}
+
+static void bench_interval(const char *name, unsigned int population, u64 dev_sectors)
+{
+	struct rb_root root = RB_ROOT;
+	struct drbd_interval *set;
+	struct measurement m;
+	u64 i, n = 2000000ULL * scale, conflicts = 0, verify_errors = 0;
+	char extra[96];
+
+	if (!selected(name))
+		return;
+
+	set = calloc(population, sizeof(*set));
+	BUG_ON(!set);
+	rnd_reset();
+	for (i = 0; i < population; i++) {
+		interval_random(&set[i], dev_sectors);
+		drbd_insert_interval(&root, &set[i]);
+	}
+
+	measure_start(&m);
+	for (i = 0; i < n; i++) {
+		struct drbd_interval *it = &set[rnd_below(population)];
+		struct drbd_interval probe;
+
+		drbd_remove_interval(&root, it);
+		interval_random(it, dev_sectors);
+		drbd_insert_interval(&root, it);
+
+		interval_random(&probe, dev_sectors);
+		if (drbd_find_overlap(&root, probe.sector, probe.size))
+			conflicts++;
+	}
+	snprintf(extra, sizeof(extra), "conflicts:%llu", (unsigned long long)conflicts);
+	measure_end(&m, name, n, extra);
+
+	/* the lowest-starting overlap must be what the tree finds */
+	for (i = 0; i < 10000; i++) {
+		struct drbd_interval probe, *a, *b;
+
+		interval_random(&probe, dev_sectors);
+		a = drbd_find_overlap(&root, probe.sector, probe.size);
+		b = interval_brute_force(set, population, probe.sector, probe.size);
+		if (!a != !b || (a && a->sector != b->sector))
+			verify_errors++;
+	}
+	if (verify_errors) {
+		fprintf(stderr, "%s: %llu mismatches against brute force search\n",
+			name, (unsigned long long)verify_errors);
+		exit(1);
+	}
+	free(set);
+}
+
+/*
+ * Bitmap exchange.  One op is one full bitmap sent (encoded) or received
+ * (decoded), split into packets exactly like send_bitmap_rle_or_plain().
+ */
+#define BM_PACKET_SIZE	(4096 - 16)	/* DRBD_SOCKET_BUFFER_SIZE - header - p_compressed_bm */
+
+struct bm_xfer_ctx {
+	unsigned long bm_bits;
+	unsigned long bm_words;
+	unsigned long bit_offset;
+	unsigned long word_offset;
+};
+
+struct bm_packet {
+	bool rle;		/* P_COMPRESSED_BITMAP, else P_BITMAP */
+	u8 encoding;		/* 0x80: first run is set bits, 0x70: pad bits */
+	unsigned int len;
+	u8 code[BM_PACKET_SIZE];
+};
+
+static void bm_xfer_ctx_bit_to_word_offset(struct bm_xfer_ctx *c)
+{
+	c->word_offset = c->bit_offset / BITS_PER_LONG;
+}
+
+static void dcbp_set_start(struct bm_packet *p, int set)
+{
+	p->encoding = (p->encoding & ~0x80) | (set ? 0x80 : 0);
+}
+
+static int dcbp_get_start(struct bm_packet *p)
+{
+	return (p->encoding & 0x80) != 0;
+}
+
+static void dcbp_set_pad_bits(struct bm_packet *p, int n)
+{
+	BUG_ON(n & ~0x7);
+	p->encoding = (p->encoding & (~0x7 << 4)) | (n << 4);
+}
+
+static int dcbp_get_pad_bits(struct bm_packet *p)
+{
+	return (p->encoding >> 4) & 0x7;
+}
+
+/*
+ * Stand-ins for _drbd_bm_find_next() and _drbd_bm_find_next_zero().  The
+ * bitmap slots are interleaved in 32 bit words, so ____bm_op() looks at one
+ * word at a time and calls the out of line find_next_bit_le() on each.
+ */
+static __attribute__((noinline)) unsigned long
+find_next_bit_le32(const u32 *addr, unsigned long size, unsigned long offset, bool zero)
+{
+	u32 word = addr[offset / 32];
+
+	if (zero)
+		word = ~word;
+	word &= ~0U << (offset & 31);
+	return word ? (offset & ~31UL) + __builtin_ctz(word) : size;
+}
+
+static unsigned long bm_find(const unsigned long *bm, unsigned long nbits,
+			     unsigned long start, bool zero)
+{
+	const u32 *addr = (const u32 *)bm;
+
+	for (; start < nbits; start = (start | 31) + 1) {
+		unsigned long found = find_next_bit_le32(addr, (start | 31) + 1, start, zero);
+
+		if (found <= (start | 31))
+			return found < nbits ? found : nbits;
+	}
+	return nbits;
+}
+
+/* bm_rle_window, drbd_int.h; the bitmap is native, not little endian, here */
+#define BM_RLE_WINDOW_WORDS	16
+#define BM_RLE_WINDOW_BITS	(BM_RLE_WINDOW_WORDS * 64)
+
+struct bm_rle_window {
+	unsigned long start;
+	unsigned long end;
+	u64 words[BM_RLE_WINDOW_WORDS];
+};
+
+/* bm_rle_window_fill(), drbd_main.c; _drbd_bm_get_lel() is a memcpy */
+static void bm_rle_window_fill(const unsigned long *bm, struct bm_rle_window *w,
+			       unsigned long bit, struct bm_xfer_ctx *c)
+{
+	unsigned long offset, number;
+
+	w->start = bit & ~63UL;
+	w->end = w->start + BM_RLE_WINDOW_BITS;
+	offset = w->start / BITS_PER_LONG;
+	number = min_t(unsigned long, BM_RLE_WINDOW_BITS / BITS_PER_LONG, c->bm_words - offset);
+	if (number < BM_RLE_WINDOW_BITS / BITS_PER_LONG)
+		memset(w->words, 0, sizeof(w->words));
+	memcpy(w->words, bm + offset, number * sizeof(long));
+}
+
+/* bm_rle_run_end(), drbd_main.c */
+static unsigned long bm_rle_run_end(const unsigned long *bm, struct bm_rle_window *w,
+				    unsigned long bit, bool set, struct bm_xfer_ctx *c)
+{
+	while (bit < c->bm_bits) {
+		unsigned int i;
+		bool whole_window;
+
+		if (bit < w->start || bit >= w->end)
+			bm_rle_window_fill(bm, w, bit, c);
+
+		i = (bit - w->start) / 64;
+		whole_window = i == 0 && !(bit & 63);
+		for (; i < BM_RLE_WINDOW_WORDS; i++, bit = (bit | 63) + 1) {
+			u64 word = w->words[i];
+
+			if (set)
+				word = ~word;
+			word &= ~0ULL << (bit & 63);
+			if (word)
+				return min_t(unsigned long, (bit & ~63UL) + __builtin_ctzll(word), c->bm_bits);
+		}
+
+		if (whole_window && bit < c->bm_bits) {
+			return bm_find(bm, c->bm_bits, bit, set);
+		}
+	}
+	return c->bm_bits;
+}
+
+/* fill_bitmap_rle_bits(), drbd_main.c */
+static int fill_bitmap_rle_bits(const unsigned long *bm, struct bm_packet *p,
+				unsigned int size, struct bm_xfer_ctx *c)
+{
+	struct bm_rle_window w = { };
+	struct bitstream bs;
+	unsigned long plain_bits;
+	unsigned long tmp;
+	unsigned long rl;
+	unsigned len;
+	unsigned toggle;
+	int bits;
+
+	if (c->bit_offset >= c->bm_bits)
+		return 0; /* nothing to do. */
+
+	/* use at most thus many bytes */
+	bitstream_init(&bs, p->code, size, 0);
+	memset(p->code, 0, size);
+	/* plain bits covered in this code string */
+	plain_bits = 0;
+
+	toggle = 2;
+
+	do {
+		tmp = bm_rle_run_end(bm, &w, c->bit_offset, toggle == 0, c);
+		rl = tmp - c->bit_offset;
+
+		if (toggle == 2) { /* first iteration */
+			if (rl == 0) {
+				dcbp_set_start(p, 1);
+				toggle = !toggle;
+				continue;
+			}
+			dcbp_set_start(p, 0);
+		}
+
+		if (rl == 0)
+			return -1;
+
+		bits = vli_encode_bits(&bs, rl);
+		if (bits == -ENOBUFS) /* buffer full */
+			break;
+		if (bits <= 0)
+			return 0;
+
+		toggle = !toggle;
+		plain_bits += rl;
+		c->bit_offset = tmp;
+
+		if (bs.cur.b - p->code > size / 8 &&
+		    plain_bits < ((unsigned long)(bs.cur.b - p->code) << 3))
+			break;
+	} while (c->bit_offset < c->bm_bits);
+
+	len = bs.cur.b - p->code + !!bs.cur.bit;
+
+	if (plain_bits < (len << 3)) {
+		/* incompressible with this method. */
+		c->bit_offset -= plain_bits;
+		bm_xfer_ctx_bit_to_word_offset(c);
+		c->bit_offset = c->word_offset * BITS_PER_LONG;
+		return 0;
+	}
+
+	bm_xfer_ctx_bit_to_word_offset(c);
+	dcbp_set_pad_bits(p, (8 - bs.cur.bit) & 0x7);
+
+	return len;
+}
+
+/* the plain fallback of send_bitmap_rle_or_plain() */
+static void fill_bitmap_plain(const unsigned long *bm, struct bm_packet *p,
+			      struct bm_xfer_ctx *c)
+{
+	unsigned long num_words = min_t(unsigned long, BM_PACKET_SIZE / sizeof(long),
+					c->bm_words - c->word_offset);
+
+	p->rle = false;
+	p->len = num_words * sizeof(long);
+	memcpy(p->code, bm + c->word_offset, p->len);
+	c->word_offset += num_words;
+	c->bit_offset = c->word_offset * BITS_PER_LONG;
+	if (c->bit_offset > c->bm_bits)
+		c->bit_offset = c->bm_bits;
+}
+
+/* drbd_bm_set_many_bits() */
+static void bm_set_many_bits(unsigned long *bm, unsigned long s, unsigned long e)
+{
+	for (; s <= e && (s % BITS_PER_LONG); s++)
+		__set_bit(s, bm);
+	for (; s + BITS_PER_LONG - 1 <= e; s += BITS_PER_LONG)
+		bm[BIT_WORD(s)] = ~0UL;
+	for (; s <= e; s++)
+		__set_bit(s, bm);
+}
+
+/* bm_rle_window_flush(), drbd_receiver.c; drbd_bm_merge_lel() is an OR */
+static void bm_rle_window_flush(unsigned long *bm, struct bm_rle_window *w,
+				struct bm_xfer_ctx *c)
+{
+	unsigned long offset, number, i;
+
+	if (w->start == w->end)
+		return;
+	offset = w->start / BITS_PER_LONG;
+	number = min_t(unsigned long, BM_RLE_WINDOW_BITS / BITS_PER_LONG, c->bm_words - offset);
+	for (i = 0; i < number; i++)
+		bm[offset + i] |= ((unsigned long *)w->words)[i];
+	w->start = w->end = 0;
+}
+
+/* bm_rle_window_set_bits(), drbd_receiver.c */
+static void bm_rle_window_set_bits(unsigned long *bm, struct bm_rle_window *w,
+				   unsigned long s, unsigned long e, struct bm_xfer_ctx *c)
+{
+	if (e - s + 1 >= BM_RLE_WINDOW_BITS) {
+		bm_rle_window_flush(bm, w, c);
+		bm_set_many_bits(bm, s, e);
+		return;
+	}
+
+	while (s <= e) {
+		unsigned long last;
+		u64 mask;
+
+		if (s < w->start || s >= w->end) {
+			bm_rle_window_flush(bm, w, c);
+			w->start = s & ~63UL;
+			w->end = w->start + BM_RLE_WINDOW_BITS;
+			memset(w->words, 0, sizeof(w->words));
+		}
+		last = min_t(unsigned long, e, s | 63);
+		mask = (~0ULL << (s & 63)) & (~0ULL >> (63 - (last & 63)));
+		w->words[(s - w->start) / 64] |= mask;
+		s = last + 1;
+	}
+}
+
+/* recv_bm_rle_bits(), drbd_receiver.c */
+static int recv_bm_rle_bits(unsigned long *bm, struct bm_packet *p,
+			    struct bm_xfer_ctx *c, unsigned int len)
+{
+	struct bm_rle_window w = { };
+	struct bitstream bs;
+	u64 look_ahead;
+	u64 rl;
+	u64 tmp;
+	unsigned long s = c->bit_offset;
+	unsigned long e;
+	int toggle = dcbp_get_start(p);
+	int have;
+	int bits;
+
+	bitstream_init(&bs, p->code, len, dcbp_get_pad_bits(p));
+
+	bits = bitstream_get_bits(&bs, &look_ahead, 64);
+	if (bits < 0)
+		return -EIO;
+
+	for (have = bits; have > 0; s += rl, toggle = !toggle) {
+		bits = vli_decode_bits(&rl, look_ahead);
+		if (bits <= 0)
+			return -EIO;
+
+		if (toggle) {
+			e = s + rl -1;
+			if (e >= c->bm_bits)
+				return -EIO;
+			bm_rle_window_set_bits(bm, &w, s, e, c);
+		}
+
+		if (have < bits)
+			return -EIO;
+		if (likely(bits < 64))
+			look_ahead >>= bits;
+		else
+			look_ahead = 0;
+		have -= bits;
+
+		bits = bitstream_get_bits(&bs, &tmp, 64 - have);
+		if (bits < 0)
+			return -EIO;
+		look_ahead |= tmp << have;
+		have += bits;
+	}
+	bm_rle_window_flush(bm, &w, c);
+
+	c->bit_offset = s;
+	bm_xfer_ctx_bit_to_word_offset(c);
+
+	return (s != c->bm_bits);
+}
+
+enum bm_density { BM_SPARSE, BM_CLUSTERED, BM_DENSE, BM_FRAGMENTED };
+
+/* 1<<24 bits: a 64GiB device at 4KiB per bit */
+#define BM_BITS		(1UL << 24)
+#define BM_WORDS	(BM_BITS / BITS_PER_LONG)
+
+static void bm_generate(unsigned long *bm, enum bm_density density)
+{
+	unsigned long i;
+
+	memset(bm, 0, BM_WORDS * sizeof(long));
+	switch (density) {
+	case BM_SPARSE:
+		/* scattered 4KiB writes while disconnected, 0.1% */
+		for (i = 0; i < BM_BITS / 1000; i++)
+			__set_bit(rnd_below(BM_BITS), bm);
+		break;
+	case BM_CLUSTERED:
+		/* activity log extents after a primary crash, plus some noise */
+		for (i = 0; i < 1237; i++) {
+			unsigned long s = rnd_below(BM_BITS >> 10) << 10;
+
+			bm_set_many_bits(bm, s, s + 1023);
+		}
+		for (i = 0; i < BM_BITS / 10000; i++)
+			__set_bit(rnd_below(BM_BITS), bm);
+		break;
+	case BM_FRAGMENTED:
+		/* many short runs, the worst case that still compresses */
+		for (i = 0; i < BM_BITS / 64; i++) {
+			unsigned long s = rnd_below(BM_BITS - 8);
+
+			bm_set_many_bits(bm, s, s + rnd_below(8));
+		}
+		break;
+	case BM_DENSE:
+		/* random 50%, incompressible: every packet falls back to plain */
+		for (i = 0; i < BM_WORDS; i++)
+			bm[i] = rnd();
+		break;
+	}
+}
+
+static unsigned int bm_encode(const unsigned long *bm, struct bm_packet *packets,
+			      unsigned int max_packets, u64 *rle_packets)
+{
+	struct bm_xfer_ctx c = { .bm_bits = BM_BITS, .bm_words = BM_WORDS };
+	unsigned int n = 0;
+
+	while (c.bit_offset < c.bm_bits) {
+		struct bm_packet *p = &packets[n++];
+		int len;
+
+		BUG_ON(n > max_packets);
+		len = fill_bitmap_rle_bits(bm, p, BM_PACKET_SIZE, &c);
+		BUG_ON(len < 0);
+		if (len) {
+			p->rle = true;
+			p->len = len;
+			(*rle_packets)++;
+		} else {
+			fill_bitmap_plain(bm, p, &c);
+		}
+	}
+	return n;
+}
+
+static void bm_decode(unsigned long *bm, struct bm_packet *packets, unsigned int n)
+{
+	struct bm_xfer_ctx c = { .bm_bits = BM_BITS, .bm_words = BM_WORDS };
+	unsigned int i;
+
+	memset(bm, 0, BM_WORDS * sizeof(long));
+	for (i = 0; i < n; i++) {
+		struct bm_packet *p = &packets[i];
+
+		if (p->rle) {
+			if (recv_bm_rle_bits(bm, p, &c, p->len) < 0)
+				BUG();
+		} else {
+			memcpy(bm + c.word_offset, p->code, p->len);
+			c.word_offset += p->len / sizeof(long);
+			c.bit_offset = c.word_offset * BITS_PER_LONG;
+			if (c.bit_offset > c.bm_bits)
+				c.bit_offset = c.bm_bits;
+		}
+	}
+	BUG_ON(c.bit_offset != c.bm_bits);
+}
+
+static void bench_bitmap(const char *name, enum bm_density density)
+{
+	unsigned long *bm, *out;
+	unsigned int max_packets = BM_WORDS * sizeof(long) / (BM_PACKET_SIZE / sizeof(long) * sizeof(long)) + 2;
+	struct bm_packet *packets;
+	struct measurement m;
+	unsigned int i, nr = 0, rounds = 8 * scale;
+	u64 rle_packets = 0, bytes = 0;
+	char ename[64], dname[64], extra[128];
+
+	snprintf(ename, sizeof(ename), "%s/encode", name);
+	snprintf(dname, sizeof(dname), "%s/decode", name);
+	if (!selected(ename) && !selected(dname))
+		return;
+
+	bm = malloc(BM_WORDS * sizeof(long));
+	out = malloc(BM_WORDS * sizeof(long));
+	packets = malloc(max_packets * sizeof(*packets));
+	BUG_ON(!bm || !out || !packets);
+	rnd_reset();
+	bm_generate(bm, density);
+
+	measure_start(&m);
+	for (i = 0; i < rounds; i++) {
+		rle_packets = 0;
+		nr = bm_encode(bm, packets, max_packets, &rle_packets);
+	}
+	for (i = 0; i < nr; i++)
+		bytes += packets[i].len;
+	snprintf(extra, sizeof(extra), "packets:%u rle:%llu wire:%lluKiB of %luKiB",
+		 nr, (unsigned long long)rle_packets, (unsigned long long)bytes >> 10,
+		 (unsigned long)(BM_WORDS * sizeof(long)) >> 10);
+	if (selected(ename))
+		measure_end(&m, ename, rounds, extra);
+
+	measure_start(&m);
+	for (i = 0; i < rounds; i++)
+		bm_decode(out, packets, nr);
+	if (selected(dname))
+		measure_end(&m, dname, rounds, NULL);
+
+	if (memcmp(bm, out, BM_WORDS * sizeof(long))) {
+		fprintf(stderr, "%s: decoded bitmap differs from the original\n", name);
+		exit(1);
+	}
+	free(packets);
+	free(out);
+	free(bm);
+}
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr,
+		"usage: %s [-s seed] [-n scale] [-v] [filter]\n"
+		"  -s seed   PRNG seed, default 0x5eed5eed5eed5eed\n"
+		"  -n scale  multiply iteration counts, default 1\n"
+		"  -v        dump lru_cache statistics\n"
+		"  filter    only run benchmarks whose name contains this\n", argv0);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	int c;
+
+	while ((c = getopt(argc, argv, "s:n:vh")) != -1) {
+		switch (c) {
+		case 's':
+			seed = strtoull(optarg, NULL, 0);
+			break;
+		case 'n':
+			scale = strtoul(optarg, NULL, 0);
+			if (!scale)
+				usage(argv[0]);
+			break;
+		case 'v':
+			verbose = true;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind < argc)
+		filter = argv[optind];
+
+	perf_open();
+	printf("%-28s %12s %10s %14s %10s  %s\n",
+	       "benchmark", "ops", "ns/op", "ops/s", "miss/op", "");
+
+	bench_al("al/hot", AL_HOT);
+	bench_al("al/uniform", AL_UNIFORM);
+	bench_al("al/sequential", AL_SEQUENTIAL);
+	bench_al_contention_all();
+
+	bench_interval("interval/64", 64, 1ULL << 31);
+	bench_interval("interval/4096", 4096, 1ULL << 31);
+
+	bench_bitmap("bitmap/sparse", BM_SPARSE);
+	bench_bitmap("bitmap/clustered", BM_CLUSTERED);
+	bench_bitmap("bitmap/fragmented", BM_FRAGMENTED);
+	bench_bitmap("bitmap/dense", BM_DENSE);
+
+	return 0;
+}
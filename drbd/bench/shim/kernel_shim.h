@@ -0,0 +1,215 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Minimal userspace stand-ins for the kernel API used by the DRBD sources
+ * that drbd-bench compiles unmodified (lru_cache.c, drbd_interval.c,
+ * drbd_vli.h).  Only what those files need, nothing more.
+ *
+ * Atomic bitops are real atomic RMW operations, as in the kernel, so that
+ * the cost of e.g. the PARANOIA_ENTRY() of lru_cache.c is represented.
+ * The same holds for atomic_t, used from several threads by the
+ * al/contention benchmark.
+ */
+#ifndef KERNEL_SHIM_H
+#define KERNEL_SHIM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <endian.h>
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef int64_t s64;
+typedef u64 sector_t;
+typedef unsigned int gfp_t;
+
+#define GFP_KERNEL 0
+#define GFP_NOIO 0
+
+#define likely(x)	__builtin_expect(!!(x), 1)
+#define unlikely(x)	__builtin_expect(!!(x), 0)
+
+#define container_of(ptr, type, member) \
+	((type *)((char *)(ptr) - offsetof(type, member)))
+
+#define BUG() do { \
+	fprintf(stderr, "BUG at %s:%d\n", __FILE__, __LINE__); abort(); } while (0)
+#define BUG_ON(c) do { if (unlikely(c)) BUG(); } while (0)
+#define WARN_ON(c) ({ int __c = !!(c); \
+	if (unlikely(__c)) fprintf(stderr, "WARNING at %s:%d\n", __FILE__, __LINE__); \
+	unlikely(__c); })
+
+#define IS_ALIGNED(x, a)	(((x) & ((typeof(x))(a) - 1)) == 0)
+#define DIV_ROUND_UP(n, d)	(((n) + (d) - 1) / (d))
+#define min_t(type, x, y)	({ type __x = (x); type __y = (y); __x < __y ? __x : __y; })
+#define max_t(type, x, y)	({ type __x = (x); type __y = (y); __x > __y ? __x : __y; })
+
+#define le64_to_cpu(x)		le64toh(x)
+#define cpu_to_le64(x)		htole64(x)
+
+#define EXPORT_SYMBOL(x)
+#define EXPORT_SYMBOL_GPL(x)
+
+#define BITS_PER_LONG		(8 * sizeof(long))
+#define BIT_WORD(nr)		((nr) / BITS_PER_LONG)
+#define BIT_MASK(nr)		(1UL << ((nr) % BITS_PER_LONG))
+
+/* atomic bitops */
+static inline void set_bit(long nr, volatile unsigned long *addr)
+{
+	__atomic_fetch_or(addr + BIT_WORD(nr), BIT_MASK(nr), __ATOMIC_RELAXED);
+}
+
+static inline void clear_bit(long nr, volatile unsigned long *addr)
+{
+	__atomic_fetch_and(addr + BIT_WORD(nr), ~BIT_MASK(nr), __ATOMIC_RELAXED);
+}
+
+static inline void clear_bit_unlock(long nr, volatile unsigned long *addr)
+{
+	__atomic_fetch_and(addr + BIT_WORD(nr), ~BIT_MASK(nr), __ATOMIC_RELEASE);
+}
+
+static inline int test_and_set_bit(long nr, volatile unsigned long *addr)
+{
+	return !!(__atomic_fetch_or(addr + BIT_WORD(nr), BIT_MASK(nr), __ATOMIC_SEQ_CST) &
+		  BIT_MASK(nr));
+}
+
+static inline int test_bit(long nr, const volatile unsigned long *addr)
+{
+	return !!(addr[BIT_WORD(nr)] & BIT_MASK(nr));
+}
+
+static inline void __set_bit(long nr, volatile unsigned long *addr)
+{
+	addr[BIT_WORD(nr)] |= BIT_MASK(nr);
+}
+
+#define READ_ONCE(x)		(*(const volatile typeof(x) *)&(x))
+#define WRITE_ONCE(x, val)	do { *(volatile typeof(x) *)&(x) = (val); } while (0)
+
+/* atomic_t; value returning operations are fully ordered, as in the kernel */
+typedef struct {
+	int counter;
+} atomic_t;
+
+static inline int atomic_read(const atomic_t *v)
+{
+	return __atomic_load_n(&v->counter, __ATOMIC_RELAXED);
+}
+
+static inline void atomic_inc(atomic_t *v)
+{
+	__atomic_fetch_add(&v->counter, 1, __ATOMIC_RELAXED);
+}
+
+static inline int atomic_inc_return(atomic_t *v)
+{
+	return __atomic_add_fetch(&v->counter, 1, __ATOMIC_SEQ_CST);
+}
+
+static inline int atomic_dec_return(atomic_t *v)
+{
+	return __atomic_sub_fetch(&v->counter, 1, __ATOMIC_SEQ_CST);
+}
+
+static inline bool atomic_add_unless(atomic_t *v, int a, int u)
+{
+	int c = atomic_read(v);
+
+	do {
+		if (c == u)
+			return false;
+	} while (!__atomic_compare_exchange_n(&v->counter, &c, c + a, false,
+					      __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+	return true;
+}
+
+#define atomic_inc_not_zero(v)	atomic_add_unless((v), 1, 0)
+
+/* RCU: the benchmarks never free what a reader may still look at */
+#define rcu_read_lock()		do { } while (0)
+#define rcu_read_unlock()	do { } while (0)
+
+#define cmpxchg(ptr, old, new) ({					\
+	typeof(*(ptr)) __old = (old);					\
+	__atomic_compare_exchange_n((ptr), &__old, (new), false,	\
+				    __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);\
+	__old; })
+
+/* find_bit, word at a time, like lib/find_bit.c */
+static inline unsigned long __find_next_bit(const unsigned long *addr, unsigned long nbits,
+					    unsigned long start, unsigned long invert)
+{
+	unsigned long tmp;
+
+	if (start >= nbits)
+		return nbits;
+
+	tmp = addr[start / BITS_PER_LONG] ^ invert;
+	tmp &= ~0UL << (start % BITS_PER_LONG);
+	start -= start % BITS_PER_LONG;
+
+	while (!tmp) {
+		start += BITS_PER_LONG;
+		if (start >= nbits)
+			return nbits;
+		tmp = addr[start / BITS_PER_LONG] ^ invert;
+	}
+
+	start += __builtin_ctzl(tmp);
+	return start < nbits ? start : nbits;
+}
+
+static inline unsigned long find_next_bit(const unsigned long *addr, unsigned long size,
+					  unsigned long offset)
+{
+	return __find_next_bit(addr, size, offset, 0UL);
+}
+
+static inline unsigned long find_next_zero_bit(const unsigned long *addr, unsigned long size,
+					       unsigned long offset)
+{
+	return __find_next_bit(addr, size, offset, ~0UL);
+}
+
+/* slab */
+struct kmem_cache {
+	size_t size;
+};
+
+static inline void *kmalloc(size_t size, gfp_t flags) { return malloc(size); }
+static inline void *kzalloc(size_t size, gfp_t flags) { return calloc(1, size); }
+static inline void *kcalloc(size_t n, size_t size, gfp_t flags) { return calloc(n, size); }
+static inline void kfree(const void *p) { free((void *)p); }
+
+static inline struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+		size_t align, unsigned long flags, void *ctor)
+{
+	struct kmem_cache *c = malloc(sizeof(*c));
+
+	if (c)
+		c->size = size;
+	return c;
+}
+static inline void kmem_cache_destroy(struct kmem_cache *c) { free(c); }
+static inline unsigned int kmem_cache_size(struct kmem_cache *c) { return c->size; }
+static inline void *kmem_cache_alloc(struct kmem_cache *c, gfp_t flags) { return malloc(c->size); }
+static inline void kmem_cache_free(struct kmem_cache *c, void *p) { free(p); }
+
+/* seq_file, backed by stdio */
+struct seq_file {
+	FILE *file;
+};
+
+#define seq_printf(m, fmt...)	fprintf((m)->file, fmt)
+#define seq_putc(m, c)		fputc(c, (m)->file)
+
+#endif
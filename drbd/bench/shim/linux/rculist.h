@@ -0,0 +1 @@
+#include "list.h"
@@ -489,6 +489,73 @@ static inline void shash_desc_zero(struct shash_desc *desc)
 #endif
 #endif
 
+#ifndef COMPAT_HAVE_CRYPTO_WAIT_REQ
+#include <linux/completion.h>
+/* Waiting for an asynchronous crypto request, as introduced with 4.15 */
+struct crypto_wait {
+	struct completion completion;
+	int err;
+};
+
+#define DECLARE_CRYPTO_WAIT(_wait) \
+	struct crypto_wait _wait = { \
+		COMPLETION_INITIALIZER_ONSTACK((_wait).completion), 0 }
+
+static inline void crypto_req_done(struct crypto_async_request *req, int err)
+{
+	struct crypto_wait *wait = req->data;
+
+	if (err == -EINPROGRESS)
+		return;
+	wait->err = err;
+	complete(&wait->completion);
+}
+
+static inline int crypto_wait_req(int err, struct crypto_wait *wait)
+{
+	switch (err) {
+	case -EINPROGRESS:
+	case -EBUSY:
+		wait_for_completion(&wait->completion);
+		reinit_completion(&wait->completion);
+		err = wait->err;
+		break;
+	}
+	return err;
+}
+#endif
+
+#ifndef COMPAT_HAVE_MEMDUP_USER_NUL
+#include <linux/uaccess.h>
+static inline void *memdup_user_nul(const void __user *src, size_t len)
+{
+	char *p;
+
+	p = kmalloc(len + 1, GFP_KERNEL);
+	if (!p)
+		return ERR_PTR(-ENOMEM);
+	if (copy_from_user(p, src, len)) {
+		kfree(p);
+		return ERR_PTR(-EFAULT);
+	}
+	p[len] = '\0';
+	return p;
+}
+#endif
+
+#ifndef COMPAT_HAVE___SYSFS_MATCH_STRING
+static inline int __sysfs_match_string(const char * const *array, size_t n, const char *str)
+{
+	size_t index;
+
+	for (index = 0; index < n; index++) {
+		if (array[index] && sysfs_streq(array[index], str))
+			return index;
+	}
+	return -EINVAL;
+}
+#endif
+
 #ifdef COMPAT_HAVE_ATOMIC_DEC_IF_POSITIVE_LINUX
 #include <linux/atomic.h>
 #else
@@ -290,6 +290,18 @@ int main(int argc, char **argv)
 	patch(1, "allow_kernel_signal", true, false,
 	      COMPAT_HAVE_ALLOW_KERNEL_SIGNAL, "present");
 
+	patch(1, "tcp_sock_bytes_acked", true, false,
+	      COMPAT_HAVE_TCP_SOCK_BYTES_ACKED, "present");
+
+	patch(1, "net_ipv4_sysctl_tcp_wmem", true, false,
+	      COMPAT_HAVE_NET_IPV4_SYSCTL_TCP_WMEM, "present");
+
+	patch(1, "tcp_under_memory_pressure", true, false,
+	      COMPAT_HAVE_TCP_UNDER_MEMORY_PRESSURE, "present");
+
+	patch(1, "task_struct_cpus_ptr", true, false,
+	      COMPAT_HAVE_TASK_STRUCT_CPUS_PTR, "present");
+
 /* #define BLKDEV_ISSUE_ZEROOUT_EXPORTED */
 /* #define BLKDEV_ZERO_NOUNMAP */
 
@@ -0,0 +1,7 @@
+/* {"version": "4.13", "comment": "__sysfs_match_string() was added"} */
+#include <linux/string.h>
+
+int foo(const char * const *array, size_t n, const char *str)
+{
+	return __sysfs_match_string(array, n, str);
+}
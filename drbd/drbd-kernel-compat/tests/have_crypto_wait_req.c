@@ -0,0 +1,11 @@
+/* {"version": "4.15", "comment": "struct crypto_wait, DECLARE_CRYPTO_WAIT(), crypto_req_done() and crypto_wait_req() were added"} */
+#include <linux/crypto.h>
+
+int foo(int err)
+{
+	DECLARE_CRYPTO_WAIT(wait);
+	crypto_completion_t done = crypto_req_done;
+
+	(void)done;
+	return crypto_wait_req(err, &wait);
+}
@@ -0,0 +1,7 @@
+/* {"version": "4.5", "comment": "memdup_user_nul() was added"} */
+#include <linux/string.h>
+
+void *foo(const void __user *src, size_t len)
+{
+	return memdup_user_nul(src, len);
+}
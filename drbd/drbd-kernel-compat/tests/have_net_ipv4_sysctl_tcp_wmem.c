@@ -0,0 +1,7 @@
+/* {"version": "4.15", "comment": "sysctl_tcp_wmem became per network namespace"} */
+#include <net/net_namespace.h>
+
+int foo(struct net *net)
+{
+	return net->ipv4.sysctl_tcp_wmem[2];
+}
@@ -0,0 +1,7 @@
+/* {"version": "5.3", "comment": "task_struct->cpus_ptr was added, cpus_allowed became cpus_mask"} */
+#include <linux/sched.h>
+
+const struct cpumask *foo(struct task_struct *p)
+{
+	return p->cpus_ptr;
+}
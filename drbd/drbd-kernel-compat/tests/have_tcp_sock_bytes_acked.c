@@ -0,0 +1,7 @@
+/* {"version": "4.1", "comment": "tcp_sock.bytes_acked was added for tcpi_bytes_acked"} */
+#include <linux/tcp.h>
+
+u64 foo(struct tcp_sock *tp)
+{
+	return tp->bytes_acked;
+}
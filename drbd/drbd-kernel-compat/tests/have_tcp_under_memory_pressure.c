@@ -0,0 +1,7 @@
+/* {"version": "4.2", "comment": "tcp_under_memory_pressure() was added; before, there is only sk_under_memory_pressure()"} */
+#include <net/tcp.h>
+
+bool foo(const struct sock *sk)
+{
+	return tcp_under_memory_pressure(sk);
+}
@@ -20,6 +20,7 @@
 #include "drbd_wrappers.h"
 #include "drbd_meta_data.h"
 #include "drbd_dax_pmem.h"
+#include "drbd_intent.h"
 
 struct update_peers_work {
        struct drbd_work w;
@@ -164,60 +165,121 @@ int drbd_md_sync_page_io(struct drbd_device *device, struct drbd_backing_dev *bd
 struct get_activity_log_ref_ctx {
 	/* in: which extent on which device? */
 	struct drbd_device *device;
+	struct drbd_interval *i;
 	unsigned int enr;
 	bool nonblock;
+	/* in: last extent of i, count it as active write once we got it */
+	bool account;
 
 	/* out: do we need to wake_up(&device->al_wait)? */
 	bool wake_up;
 };
 
-static struct bm_extent*
-find_active_resync_extent(struct get_activity_log_ref_ctx *al_ctx)
+/* The node of the application write with interval i in device->active_writes */
+static struct drbd_interval *active_write_node(struct drbd_interval *i)
 {
-	struct drbd_peer_device *peer_device;
-	struct lc_element *tmp;
+	if (i->local)
+		return &container_of(i, struct drbd_request, i)->active_write;
+	return &container_of(i, struct drbd_peer_request, i)->active_write;
+}
 
-	rcu_read_lock();
-	for_each_peer_device_rcu(peer_device, al_ctx->device) {
-		tmp = lc_find(peer_device->resync_lru, al_ctx->enr/AL_EXT_PER_BM_SECT);
-		if (unlikely(tmp != NULL)) {
-			struct bm_extent  *bm_ext = lc_entry(tmp, struct bm_extent, lce);
-			if (test_bit(BME_NO_WRITES, &bm_ext->flags)) {
-				if (peer_device->resync_wenr == tmp->lc_number) {
-					peer_device->resync_wenr = LC_FREE;
-					if (lc_put(peer_device->resync_lru, &bm_ext->lce) == 0) {
-						bm_ext->flags = 0;
-						al_ctx->wake_up = true;
-						peer_device->resync_locked--;
-						continue;
-					}
-				}
-				rcu_read_unlock();
-				return bm_ext;
-			}
-		}
+/* must hold al_lock */
+static void active_writes_get(struct drbd_device *device, struct drbd_interval *i)
+{
+	struct drbd_interval *node = active_write_node(i);
+
+	node->sector = i->sector;
+	node->size = i->size;
+	drbd_insert_interval(&device->active_writes, node);
+}
+
+/* Without al_lock, see al_get_rcu() */
+static void active_writes_get_rcu(struct drbd_device *device)
+{
+	atomic_inc(&device->active_writes_rcu);
+}
+
+/* must hold al_lock; returns true if a resync request may proceed now */
+static bool active_writes_put(struct drbd_device *device, struct drbd_interval *i)
+{
+	struct drbd_interval *node = active_write_node(i);
+
+	if (!drbd_interval_empty(node)) {
+		drbd_remove_interval(&device->active_writes, node);
+		drbd_clear_interval(node);
+		return true;
 	}
-	rcu_read_unlock();
-	return NULL;
+	/* got it in al_get_rcu(); may have been reset by drbd_ldev_destroy() */
+	return atomic_dec_if_positive(&device->active_writes_rcu) == 0;
 }
 
-void
-set_bme_priority(struct get_activity_log_ref_ctx *al_ctx)
+/* Is an application write in flight that overlaps i?  Those from
+ * al_get_rcu() are not in the tree, so any of them counts.  They drain
+ * quickly: al_get_rcu() takes no new ones while there are resync requests.
+ * must hold al_lock */
+static bool active_writes_in(struct drbd_device *device, struct drbd_interval *i)
 {
-	struct drbd_peer_device *peer_device;
-	struct lc_element *tmp;
+	return atomic_read(&device->active_writes_rcu) ||
+		drbd_find_overlap(&device->active_writes, i->sector, i->size);
+}
 
-	rcu_read_lock();
-	for_each_peer_device_rcu(peer_device, al_ctx->device) {
-		tmp = lc_find(peer_device->resync_lru, al_ctx->enr/AL_EXT_PER_BM_SECT);
-		if (tmp) {
-			struct bm_extent  *bm_ext = lc_entry(tmp, struct bm_extent, lce);
-			if (test_bit(BME_NO_WRITES, &bm_ext->flags)
-			&& !test_and_set_bit(BME_PRIORITY, &bm_ext->flags))
-				al_ctx->wake_up = true;
+/* Forget the writes of a backing device that is going away, they do not
+ * give back their references.  must hold al_lock */
+void drbd_active_writes_reset(struct drbd_device *device)
+{
+	struct rb_node *rb;
+
+	while ((rb = rb_first(&device->active_writes))) {
+		struct drbd_interval *node = rb_entry(rb, struct drbd_interval, rb);
+
+		drbd_remove_interval(&device->active_writes, node);
+		drbd_clear_interval(node);
+	}
+	atomic_set(&device->active_writes_rcu, 0);
+}
+
+static void remove_rs_interval(struct drbd_device *device, struct drbd_rs_interval *rsi)
+{
+	drbd_remove_interval(&device->resync_requests, &rsi->i);
+	drbd_clear_interval(&rsi->i);
+}
+
+/* Will the sender try the resync request it is waiting for again soon? */
+static bool resync_retries(struct drbd_peer_device *peer_device)
+{
+	enum drbd_repl_state repl_state = peer_device->repl_state[NOW];
+
+	return (repl_state == L_SYNC_TARGET || repl_state == L_VERIFY_S) &&
+		!test_bit(SYNC_TARGET_TO_BEHIND, &peer_device->flags);
+}
+
+/* Is resync active in the range of al_ctx->i?  Flag all overlapping resync
+ * requests, so the resync steps aside or hurries up.  must hold al_lock */
+static bool resync_conflict(struct get_activity_log_ref_ctx *al_ctx)
+{
+	struct drbd_device *device = al_ctx->device;
+	struct drbd_interval *i;
+	bool conflict = false;
+
+	if (RB_EMPTY_ROOT(&device->resync_requests))
+		return false;
+
+restart:
+	drbd_for_each_overlap(i, &device->resync_requests, al_ctx->i->sector, al_ctx->i->size) {
+		struct drbd_rs_interval *rsi = container_of(i, struct drbd_rs_interval, i);
+		struct drbd_peer_device *peer_device = rsi->peer_device;
+
+		if (rsi == peer_device->resync_waiting && !resync_retries(peer_device)) {
+			peer_device->resync_waiting = NULL;
+			remove_rs_interval(device, rsi);
+			kfree(rsi);
+			goto restart;
 		}
+		if (!test_and_set_bit(RSI_PRIORITY, &rsi->flags))
+			al_ctx->wake_up = true;
+		conflict = true;
 	}
-	rcu_read_unlock();
+	return conflict;
 }
 
 static
@@ -225,18 +287,23 @@ struct lc_element *__al_get(struct get_activity_log_ref_ctx *al_ctx)
 {
 	struct drbd_device *device = al_ctx->device;
 	struct lc_element *al_ext = NULL;
-	struct bm_extent *bm_ext;
 
 	spin_lock_irq(&device->al_lock);
-	bm_ext = find_active_resync_extent(al_ctx);
-	if (bm_ext) {
-		set_bme_priority(al_ctx);
+	if (resync_conflict(al_ctx))
 		goto out;
-	}
 	if (al_ctx->nonblock)
 		al_ext = lc_try_get(device->act_log, al_ctx->enr);
 	else
 		al_ext = lc_get(device->act_log, al_ctx->enr);
+	/* The fast path does not write the intent table; leave a write to a
+	 * sub-extent not yet on disk to the submitter. */
+	if (al_ext && !drbd_intent_get(device, al_ext, al_ctx->i, !al_ctx->nonblock)) {
+		if (lc_put(device->act_log, al_ext) == 0)
+			al_ctx->wake_up = true;
+		al_ext = NULL;
+	}
+	if (al_ext && al_ctx->account)
+		active_writes_get(device, al_ctx->i);
  out:
 	spin_unlock_irq(&device->al_lock);
 	if (al_ctx->wake_up)
@@ -245,24 +312,80 @@ struct lc_element *__al_get(struct get_activity_log_ref_ctx *al_ctx)
 }
 
 static
-struct lc_element *_al_get_nonblock(struct drbd_device *device, unsigned int enr)
+struct lc_element *_al_get_nonblock(struct drbd_device *device, struct drbd_interval *i,
+				    unsigned int enr, bool account)
 {
 	struct get_activity_log_ref_ctx al_ctx =
-		{ .device = device, .enr = enr, .nonblock = true };
+		{ .device = device, .i = i, .enr = enr, .nonblock = true, .account = account };
 	return __al_get(&al_ctx);
 }
 
 static
-struct lc_element *_al_get(struct drbd_device *device, unsigned int enr)
+struct lc_element *_al_get(struct drbd_device *device, struct drbd_interval *i,
+			   unsigned int enr, bool account)
 {
 	struct get_activity_log_ref_ctx al_ctx =
-		{ .device = device, .enr = enr, .nonblock = false };
+		{ .device = device, .i = i, .enr = enr, .nonblock = false, .account = account };
 	return __al_get(&al_ctx);
 }
 
+static bool put_actlog(struct drbd_device *device, unsigned int first, unsigned int last,
+		       struct drbd_interval *i);
+
+/* Give back a reference that al_get_rcu() got by mistake */
+static void al_put_rcu(struct drbd_device *device, struct lc_element *al_ext)
+{
+	bool wake;
+
+	if (lc_put_rcu(device->act_log, al_ext))
+		return;
+	spin_lock_irq(&device->al_lock);
+	wake = lc_put(device->act_log, al_ext) == 0;
+	spin_unlock_irq(&device->al_lock);
+	if (wake)
+		wake_up(&device->al_wait);
+}
+
+/* _al_get_nonblock() without al_lock, for an extent other writes hold
+ * already.  Leaves everything else to _al_get_nonblock(): the activity log
+ * locked or starving, a sub-extent not yet in the write intent table, and
+ * resync requests anywhere on the device. */
+static
+struct lc_element *al_get_rcu(struct drbd_device *device, struct drbd_interval *i,
+			      unsigned int enr)
+{
+	struct lc_element *al_ext;
+
+	/* resync requests wait for all writes from here, see active_writes_in() */
+	if (!RB_EMPTY_ROOT(&device->resync_requests))
+		return NULL;
+
+	rcu_read_lock();
+	al_ext = lc_try_get_rcu(device->act_log, enr);
+	rcu_read_unlock();
+	if (!al_ext)
+		return NULL;
+	if (READ_ONCE(al_ext->lc_number) != enr || READ_ONCE(al_ext->lc_new_number) != enr ||
+	    !drbd_intent_recorded(device, al_ext, i)) {
+		al_put_rcu(device, al_ext);
+		return NULL;
+	}
+
+	active_writes_get_rcu(device);
+	/* Either this sees the resync request, or __rs_interval_lock()
+	 * sees the active write. */
+	smp_mb__after_atomic();
+	if (!RB_EMPTY_ROOT(&device->resync_requests)) {
+		put_actlog(device, enr, enr, i);
+		return NULL;
+	}
+	return al_ext;
+}
+
 #if IS_ENABLED(CONFIG_DEV_DAX_PMEM) && !defined(DAX_PMEM_IS_INCOMPLETE)
 static bool
-drbd_dax_begin_io_fp(struct drbd_device *device, unsigned int first, unsigned int last)
+drbd_dax_begin_io_fp(struct drbd_device *device, struct drbd_interval *i,
+		     unsigned int first, unsigned int last)
 {
 	struct lc_element *al_ext;
 	unsigned long flags;
@@ -271,7 +394,7 @@ drbd_dax_begin_io_fp(struct drbd_device *device, unsigned int first, unsigned in
 	bool wake = 0;
 
 	for (enr = first; enr <= last; enr++) {
-		al_ext = _al_get(device, enr);
+		al_ext = _al_get(device, i, enr, enr == last);
 		if (!al_ext)
 			goto abort;
 
@@ -297,7 +420,8 @@ abort:
 }
 #else
 static bool
-drbd_dax_begin_io_fp(struct drbd_device *device, unsigned int first, unsigned int last)
+drbd_dax_begin_io_fp(struct drbd_device *device, struct drbd_interval *i,
+		     unsigned int first, unsigned int last)
 {
 	return false;
 }
@@ -307,20 +431,22 @@ bool drbd_al_begin_io_fastpath(struct drbd_device *device, struct drbd_interval
 {
 	/* for bios crossing activity log extent boundaries,
 	 * we may need to activate two extents in one go */
-	unsigned first = i->sector >> (AL_EXTENT_SHIFT-9);
-	unsigned last = i->size == 0 ? first : (i->sector + (i->size >> 9) - 1) >> (AL_EXTENT_SHIFT-9);
+	unsigned first, last;
 
+	interval_to_al_range(i, &first, &last);
 	D_ASSERT(device, first <= last);
 	D_ASSERT(device, atomic_read(&device->local_cnt) > 0);
 
 	if (drbd_md_dax_active(device->ldev))
-		return drbd_dax_begin_io_fp(device, first, last);
+		return drbd_dax_begin_io_fp(device, i, first, last);
 
 	/* FIXME figure out a fast path for bios crossing AL extent boundaries */
 	if (first != last)
 		return false;
 
-	return _al_get_nonblock(device, first) != NULL;
+	if (al_get_rcu(device, i, first))
+		return true;
+	return _al_get_nonblock(device, i, first, true) != NULL;
 }
 
 #if (PAGE_SHIFT + 3) < (AL_EXTENT_SHIFT - BM_BLOCK_SHIFT)
@@ -523,7 +649,7 @@ void drbd_al_begin_io_commit(struct drbd_device *device)
 	}
 
 	wait_event(device->al_wait,
-			device->act_log->pending_changes == 0 ||
+			(device->act_log->pending_changes == 0 && !drbd_intent_pending(device)) ||
 			(locked = drbd_al_try_lock_for_transaction(device)));
 
 	if (locked) {
@@ -546,31 +672,56 @@ void drbd_al_begin_io_commit(struct drbd_device *device)
 			lc_committed(device->act_log);
 			spin_unlock_irq(&device->al_lock);
 		}
+		drbd_intent_commit(device);
 		lc_unlock(device->act_log);
 		wake_up(&device->al_wait);
 	}
 }
 
-static bool put_actlog(struct drbd_device *device, unsigned int first, unsigned int last)
+/* A resync request that is waiting for application writes to drain
+ * is retried from the resync timer; don't wait for that to expire.
+ * must hold al_lock */
+static void kick_waiting_resync(struct drbd_device *device)
+{
+	struct drbd_peer_device *peer_device;
+
+	rcu_read_lock();
+	for_each_peer_device_rcu(peer_device, device) {
+		struct drbd_rs_interval *rsi = peer_device->resync_waiting;
+
+		if (rsi && !active_writes_in(device, &rsi->i))
+			drbd_queue_work_if_unqueued(&peer_device->connection->sender_work,
+						    &peer_device->resync_work);
+	}
+	rcu_read_unlock();
+}
+
+/* i: the write counted in active_writes, or NULL */
+static bool put_actlog(struct drbd_device *device, unsigned int first, unsigned int last,
+		       struct drbd_interval *i)
 {
 	struct lc_element *extent;
 	unsigned long flags;
 	unsigned int enr;
-	bool wake = false;
+	bool wake = false, wake_resync = false;
 
 	D_ASSERT(device, first <= last);
 	spin_lock_irqsave(&device->al_lock, flags);
 	for (enr = first; enr <= last; enr++) {
 		extent = lc_find(device->act_log, enr);
-		if (!extent || extent->refcnt == 0) {
+		if (!extent || atomic_read(&extent->refcnt) == 0) {
 			drbd_err(device, "al_complete_io() called on inactive extent %u\n", enr);
 			continue;
 		}
 		if (lc_put(device->act_log, extent) == 0)
 			wake = true;
 	}
+	if (i && active_writes_put(device, i) && !RB_EMPTY_ROOT(&device->resync_requests)) {
+		kick_waiting_resync(device);
+		wake_resync = true;
+	}
 	spin_unlock_irqrestore(&device->al_lock, flags);
-	if (wake)
+	if (wake || wake_resync)
 		wake_up(&device->al_wait);
 	return wake;
 }
@@ -588,12 +739,13 @@ int drbd_al_begin_io_for_peer(struct drbd_peer_device *peer_device, struct drbd_
 {
 	struct drbd_device *device = peer_device->device;
 	struct drbd_connection *connection = peer_device->connection;
-	unsigned first = i->sector >> (AL_EXTENT_SHIFT-9);
-	unsigned last = i->size == 0 ? first : (i->sector + (i->size >> 9) - 1) >> (AL_EXTENT_SHIFT-9);
+	unsigned first, last;
 	unsigned enr;
 	bool need_transaction = false;
 	long timeout = MAX_SCHEDULE_TIMEOUT;
 
+	interval_to_al_range(i, &first, &last);
+
 	if (connection->agreed_pro_version < 114) {
 		struct net_conf *nc;
 		rcu_read_lock();
@@ -609,7 +761,7 @@ int drbd_al_begin_io_for_peer(struct drbd_peer_device *peer_device, struct drbd_
 	for (enr = first; enr <= last; enr++) {
 		struct lc_element *al_ext;
 		timeout = wait_event_timeout(device->al_wait,
-				(al_ext = _al_get(device, enr)) != NULL ||
+				(al_ext = _al_get(device, i, enr, enr == last)) != NULL ||
 				connection->cstate[NOW] < C_CONNECTED,
 				timeout);
 		/* If we ran into the timeout, we have been unresponsive to the
@@ -624,14 +776,14 @@ int drbd_al_begin_io_for_peer(struct drbd_peer_device *peer_device, struct drbd_
 		}
 		if (al_ext == NULL) {
 			if (enr > first)
-				put_actlog(device, first, enr-1);
+				put_actlog(device, first, enr-1, NULL);
 			return -ECONNABORTED;
 		}
 		if (al_ext->lc_number != enr)
 			need_transaction = true;
 	}
 
-	if (need_transaction)
+	if (need_transaction || drbd_intent_pending(device))
 		drbd_al_begin_io_commit(device);
 	return 0;
 
@@ -640,16 +792,16 @@ int drbd_al_begin_io_for_peer(struct drbd_peer_device *peer_device, struct drbd_
 int drbd_al_begin_io_nonblock(struct drbd_device *device, struct drbd_interval *i)
 {
 	struct lru_cache *al = device->act_log;
-	struct bm_extent *bm_ext;
 	/* for bios crossing activity log extent boundaries,
 	 * we may need to activate two extents in one go */
-	unsigned first = i->sector >> (AL_EXTENT_SHIFT-9);
-	unsigned last = i->size == 0 ? first : (i->sector + (i->size >> 9) - 1) >> (AL_EXTENT_SHIFT-9);
+	unsigned first, last;
 	unsigned nr_al_extents;
 	unsigned available_update_slots;
-	struct get_activity_log_ref_ctx al_ctx = { .device = device, };
+	struct get_activity_log_ref_ctx al_ctx = { .device = device, .i = i, };
 	unsigned enr;
 
+	interval_to_al_range(i, &first, &last);
+
 	D_ASSERT(device, first <= last);
 
 	nr_al_extents = 1 + last - first; /* worst case: all touched extends are cold. */
@@ -674,15 +826,10 @@ int drbd_al_begin_io_nonblock(struct drbd_device *device, struct drbd_interval *
 	}
 
 	/* Is resync active in this area? */
-	for (enr = first; enr <= last; enr++) {
-		al_ctx.enr = enr;
-		bm_ext = find_active_resync_extent(&al_ctx);
-		if (unlikely(bm_ext != NULL)) {
-			set_bme_priority(&al_ctx);
-			if (al_ctx.wake_up)
-				return -EBUSY;
-			return -EWOULDBLOCK;
-		}
+	if (unlikely(resync_conflict(&al_ctx))) {
+		if (al_ctx.wake_up)
+			return -EBUSY;
+		return -EWOULDBLOCK;
 	}
 
 	/* Checkout the refcounts.
@@ -693,20 +840,57 @@ int drbd_al_begin_io_nonblock(struct drbd_device *device, struct drbd_interval *
 		al_ext = lc_get_cumulative(device->act_log, enr);
 		if (!al_ext)
 			drbd_err(device, "LOGIC BUG for enr=%u\n", enr);
+		else
+			drbd_intent_get(device, al_ext, i, true);
 	}
+	active_writes_get(device, i);
 	return 0;
 }
 
+/* drbd_al_complete_io() of an interval in one extent, without al_lock
+ * unless it drops the last reference of the extent, or the write is in
+ * device->active_writes. */
+static bool al_complete_io_rcu(struct drbd_device *device, unsigned int enr,
+			       struct drbd_interval *i)
+{
+	struct lc_element *al_ext;
+
+	if (!drbd_interval_empty(active_write_node(i)))
+		return false;
+
+	/* the reference we hold keeps it from changing */
+	rcu_read_lock();
+	al_ext = lc_find_rcu(device->act_log, enr);
+	rcu_read_unlock();
+	if (!al_ext || !lc_put_rcu(device->act_log, al_ext))
+		return false;
+
+	/* a fully ordered atomic pairs with the smp_mb() in
+	 * __rs_interval_lock(), as in al_get_rcu() */
+	if (atomic_dec_if_positive(&device->active_writes_rcu) == 0 &&
+	    !RB_EMPTY_ROOT(&device->resync_requests)) {
+		unsigned long flags;
+
+		spin_lock_irqsave(&device->al_lock, flags);
+		kick_waiting_resync(device);
+		spin_unlock_irqrestore(&device->al_lock, flags);
+		wake_up(&device->al_wait);
+	}
+	return true;
+}
+
 /* put activity log extent references corresponding to interval i, return true
  * if at least one extent is now unreferenced. */
 bool drbd_al_complete_io(struct drbd_device *device, struct drbd_interval *i)
 {
 	/* for bios crossing activity log extent boundaries,
 	 * we may need to activate two extents in one go */
-	unsigned first = i->sector >> (AL_EXTENT_SHIFT-9);
-	unsigned last = i->size == 0 ? first : (i->sector + (i->size >> 9) - 1) >> (AL_EXTENT_SHIFT-9);
+	unsigned first, last;
 
-	return put_actlog(device, first, last);
+	interval_to_al_range(i, &first, &last);
+	if (first == last && al_complete_io_rcu(device, first, i))
+		return false;
+	return put_actlog(device, first, last, i);
 }
 
 static int _try_lc_del(struct drbd_device *device, struct lc_element *al_ext)
@@ -714,7 +898,7 @@ static int _try_lc_del(struct drbd_device *device, struct lc_element *al_ext)
 	int rv;
 
 	spin_lock_irq(&device->al_lock);
-	rv = (al_ext->refcnt == 0);
+	rv = (atomic_read(&al_ext->refcnt) == 0);
 	if (likely(rv))
 		lc_del(device->act_log, al_ext);
 	spin_unlock_irq(&device->al_lock);
@@ -757,16 +941,13 @@ static bool extent_in_sync(struct drbd_peer_device *peer_device, unsigned int rs
 			return true;
 	} else if (peer_device->repl_state[NOW] == L_SYNC_SOURCE ||
 		   peer_device->repl_state[NOW] == L_SYNC_TARGET) {
+		sector_t sector = BM_EXT_TO_SECT(rs_enr);
 		bool rv = false;
 
-		if (!drbd_try_rs_begin_io(peer_device, BM_EXT_TO_SECT(rs_enr), false)) {
-			struct bm_extent *bm_ext;
-			struct lc_element *e;
-
-			e = lc_find(peer_device->resync_lru, rs_enr);
-			bm_ext = lc_entry(e, struct bm_extent, lce);
-			rv = (bm_ext->rs_left == 0);
-			drbd_rs_complete_io(peer_device, BM_EXT_TO_SECT(rs_enr));
+		/* only with no application writes in flight on this extent */
+		if (!drbd_try_rs_begin_io(peer_device, sector, BM_SECT_PER_EXT << 9, false)) {
+			rv = bm_e_weight(peer_device, rs_enr) == 0;
+			drbd_rs_complete_io(peer_device, sector);
 		}
 
 		return rv;
@@ -909,9 +1090,8 @@ static bool update_rs_extent(struct drbd_peer_device *peer_device,
 	 * we don't need it cached (lc_find).
 	 * But if it is present in the cache,
 	 * we should update the cached bit count.
-	 * Otherwise, that extent should be in the resync extent lru cache
-	 * already -- or we want to pull it in if necessary -- (lc_get),
-	 * then update and check rs_left and rs_failed. */
+	 * Otherwise, we want to pull it into the resync extent lru cache
+	 * if necessary (lc_get), then update and check rs_left and rs_failed. */
 	if (mode == SET_OUT_OF_SYNC)
 		e = lc_find(peer_device->resync_lru, enr);
 	else
@@ -943,20 +1123,8 @@ static bool update_rs_extent(struct drbd_peer_device *peer_device,
 				ext->rs_left = bm_e_weight(peer_device, enr);
 			}
 		} else {
-			/* Normally this element should be in the cache,
-			 * since drbd_rs_begin_io() pulled it already in.
-			 *
-			 * But maybe an application write finished, and we set
-			 * something outside the resync lru_cache in sync.
-			 */
+			/* Pulled into the cache just now, (re)count the bits. */
 			int rs_left = bm_e_weight(peer_device, enr);
-			if (ext->flags != 0) {
-				drbd_warn(device, "changing resync lce: %d[%u;%02lx]"
-				     " -> %d[%u;00]\n",
-				     ext->lce.lc_number, ext->rs_left,
-				     ext->flags, enr, rs_left);
-				ext->flags = 0;
-			}
 			if (ext->rs_failed) {
 				drbd_warn(device, "Kicking resync_lru element enr=%u "
 				     "out with rs_failed=%d\n",
@@ -998,8 +1166,8 @@ static bool update_rs_extent(struct drbd_peer_device *peer_device,
 		}
 	} else if (mode != SET_OUT_OF_SYNC) {
 		/* be quiet if lc_find() did not find it. */
-		drbd_err(device, "lc_get() failed! locked=%d/%d flags=%lu\n",
-		    peer_device->resync_locked,
+		drbd_err(device, "lc_get() failed! used=%d/%d flags=%lu\n",
+		    peer_device->resync_lru->used,
 		    peer_device->resync_lru->nr_elements,
 		    peer_device->resync_lru->flags);
 	}
@@ -1272,280 +1440,230 @@ out:
 	return set;
 }
 
-static
-struct bm_extent *_bme_get(struct drbd_peer_device *peer_device, unsigned int enr)
+/* Try to turn a reserved resync range into a locked one.  Application writes
+ * overlapping it already wait in resync_conflict(), once the ones in flight
+ * are done, resync IO may proceed.  must hold al_lock */
+static bool __rs_interval_lock(struct drbd_device *device, struct drbd_rs_interval *rsi)
 {
-	struct drbd_device *device = peer_device->device;
-	struct lc_element *e;
-	struct bm_extent *bm_ext;
-	int wakeup = 0;
-	unsigned long rs_flags;
+	/* rsi is in resync_requests already; pairs with the barrier
+	 * after active_writes_get_rcu() in al_get_rcu() */
+	smp_mb();
+	if (active_writes_in(device, &rsi->i))
+		return false;
+	set_bit(RSI_LOCKED, &rsi->flags);
+	return true;
+}
+
+static bool rs_interval_lock(struct drbd_device *device, struct drbd_rs_interval *rsi)
+{
+	bool locked;
 
 	spin_lock_irq(&device->al_lock);
-	if (peer_device->resync_locked > peer_device->resync_lru->nr_elements/2) {
-		spin_unlock_irq(&device->al_lock);
-		return NULL;
-	}
-	e = lc_get(peer_device->resync_lru, enr);
-	bm_ext = e ? lc_entry(e, struct bm_extent, lce) : NULL;
-	if (bm_ext) {
-		if (bm_ext->lce.lc_number != enr) {
-			bm_ext->rs_left = bm_e_weight(peer_device, enr);
-			bm_ext->rs_failed = 0;
-			lc_committed(peer_device->resync_lru);
-			wakeup = 1;
-		}
-		if (bm_ext->lce.refcnt == 1)
-			peer_device->resync_locked++;
-		set_bit(BME_NO_WRITES, &bm_ext->flags);
-	}
-	rs_flags = peer_device->resync_lru->flags;
+	locked = __rs_interval_lock(device, rsi);
 	spin_unlock_irq(&device->al_lock);
-	if (wakeup)
-		wake_up(&device->al_wait);
-
-	if (!bm_ext) {
-		if (rs_flags & LC_STARVING)
-			drbd_warn(peer_device, "Have to wait for element"
-			     " (resync LRU too small?)\n");
-		BUG_ON(rs_flags & LC_LOCKED);
-	}
 
-	return bm_ext;
+	return locked;
 }
 
-static int _is_in_al(struct drbd_device *device, unsigned int enr)
+static struct drbd_rs_interval *
+alloc_rs_interval(struct drbd_peer_device *peer_device, sector_t sector, unsigned int size)
 {
-	int rv;
+	struct drbd_rs_interval *rsi;
 
-	spin_lock_irq(&device->al_lock);
-	rv = lc_is_used(device->act_log, enr);
-	spin_unlock_irq(&device->al_lock);
-
-	return rv;
+	rsi = kzalloc(sizeof(*rsi), GFP_NOIO);
+	if (!rsi)
+		return NULL;
+	drbd_clear_interval(&rsi->i);
+	rsi->i.sector = sector;
+	rsi->i.size = size;
+	rsi->peer_device = peer_device;
+	return rsi;
 }
 
 /**
- * drbd_rs_begin_io() - Gets an extent in the resync LRU cache and sets it to BME_LOCKED
+ * drbd_rs_begin_io() - Locks a range of the device for resync IO
+ * @peer_device:	DRBD peer device the resync request is for
+ * @sector:		start of the range
+ * @size:		size of the range in bytes
  *
- * This functions sleeps on al_wait. Returns 0 on success, -EINTR if interrupted.
+ * Keeps new application writes out of the range, and waits for the ones
+ * in flight.  This functions sleeps on al_wait.  Returns 0 on success,
+ * -EINTR if interrupted.
  */
-int drbd_rs_begin_io(struct drbd_peer_device *peer_device, sector_t sector)
+int drbd_rs_begin_io(struct drbd_peer_device *peer_device, sector_t sector, unsigned int size)
 {
 	struct drbd_device *device = peer_device->device;
-	unsigned int enr = BM_SECT_TO_EXT(sector);
-	struct bm_extent *bm_ext;
-	int i, sig;
+	struct drbd_rs_interval *rsi;
+	int sig;
 	bool sa;
 
-retry:
-	sig = wait_event_interruptible(device->al_wait,
-			(bm_ext = _bme_get(peer_device, enr)));
-	if (sig)
-		return -EINTR;
+	rsi = alloc_rs_interval(peer_device, sector, size);
+	if (!rsi)
+		return -ENOMEM;
 
-	if (test_bit(BME_LOCKED, &bm_ext->flags))
-		return 0;
+retry:
+	spin_lock_irq(&device->al_lock);
+	drbd_insert_interval(&device->resync_requests, &rsi->i);
+	spin_unlock_irq(&device->al_lock);
 
 	/* step aside only while we are above c-min-rate; unless disabled. */
 	sa = drbd_rs_c_min_rate_throttle(peer_device);
 
-	for (i = 0; i < AL_EXT_PER_BM_SECT; i++) {
-		sig = wait_event_interruptible(device->al_wait,
-					       !_is_in_al(device, enr * AL_EXT_PER_BM_SECT + i) ||
-					       (sa && test_bit(BME_PRIORITY, &bm_ext->flags)));
+	sig = wait_event_interruptible(device->al_wait,
+				       rs_interval_lock(device, rsi) ||
+				       (sa && test_bit(RSI_PRIORITY, &rsi->flags)));
+	if (test_bit(RSI_LOCKED, &rsi->flags))
+		return 0;
 
-		if (sig || (sa && test_bit(BME_PRIORITY, &bm_ext->flags))) {
-			spin_lock_irq(&device->al_lock);
-			if (lc_put(peer_device->resync_lru, &bm_ext->lce) == 0) {
-				bm_ext->flags = 0; /* clears BME_NO_WRITES and eventually BME_PRIORITY */
-				peer_device->resync_locked--;
-				wake_up(&device->al_wait);
-			}
-			spin_unlock_irq(&device->al_lock);
-			if (sig)
-				return -EINTR;
-			if (schedule_timeout_interruptible(HZ/10))
-				return -EINTR;
-			goto retry;
-		}
+	spin_lock_irq(&device->al_lock);
+	remove_rs_interval(device, rsi);
+	rsi->flags = 0;
+	spin_unlock_irq(&device->al_lock);
+	wake_up(&device->al_wait);
+
+	if (sig || schedule_timeout_interruptible(HZ/10)) {
+		kfree(rsi);
+		return -EINTR;
 	}
-	set_bit(BME_LOCKED, &bm_ext->flags);
-	return 0;
+	goto retry;
 }
 
 /**
- * drbd_try_rs_begin_io() - Gets an extent in the resync LRU cache, does not sleep
+ * drbd_try_rs_begin_io() - Locks a range of the device for resync IO, does not sleep
+ * @peer_device:	DRBD peer device the resync request is for
+ * @sector:		start of the range
+ * @size:		size of the range in bytes
+ * @retry:		the caller will try again with the same range
+ *
+ * Returns 0 upon success, and -EAGAIN if there is still application IO going
+ * on in this range.
  *
- * Gets an extent in the resync LRU cache, sets it to BME_NO_WRITES, then
- * tries to set it to BME_LOCKED. Returns 0 upon success, and -EAGAIN
- * if there is still application IO going on in this area.
+ * With @retry, the range is kept reserved against new application writes in
+ * the meantime, unless resync should slow down.  There is at most one such
+ * reserved range per peer device, remembered in resync_waiting.  The sender
+ * gets kicked as soon as the application writes in it are done.
  */
-int drbd_try_rs_begin_io(struct drbd_peer_device *peer_device, sector_t sector, bool throttle)
+int drbd_try_rs_begin_io(struct drbd_peer_device *peer_device, sector_t sector,
+			 unsigned int size, bool retry)
 {
 	struct drbd_device *device = peer_device->device;
-	unsigned int enr = BM_SECT_TO_EXT(sector);
-	const unsigned int al_enr = enr*AL_EXT_PER_BM_SECT;
-	struct lc_element *e;
-	struct bm_extent *bm_ext;
-	int i;
+	struct drbd_rs_interval *rsi, *new;
+	bool throttle = false;
+	bool wake = false;
+	int err = 0;
 
-	if (throttle)
+	if (retry)
 		throttle = drbd_rs_should_slow_down(peer_device, sector, true);
 
-	/* If we need to throttle, a half-locked (only marked BME_NO_WRITES,
-	 * not yet BME_LOCKED) extent needs to be kicked out explicitly if we
-	 * need to throttle. There is at most one such half-locked extent,
-	 * which is remembered in resync_wenr. */
-
-	if (throttle && peer_device->resync_wenr != enr)
+	new = alloc_rs_interval(peer_device, sector, size);
+	if (!new)
 		return -EAGAIN;
 
 	spin_lock_irq(&device->al_lock);
-	if (peer_device->resync_wenr != LC_FREE && peer_device->resync_wenr != enr) {
-		/* in case you have very heavy scattered io, it may
-		 * stall the syncer undefined if we give up the ref count
-		 * when we try again and requeue.
-		 *
-		 * if we don't give up the refcount, but the next time
-		 * we are scheduled this extent has been "synced" by new
-		 * application writes, we'd miss the lc_put on the
-		 * extent we keep the refcount on.
-		 * so we remembered which extent we had to try again, and
-		 * if the next requested one is something else, we do
-		 * the lc_put here...
-		 * we also have to wake_up
-		 */
-
-		e = lc_find(peer_device->resync_lru, peer_device->resync_wenr);
-		bm_ext = e ? lc_entry(e, struct bm_extent, lce) : NULL;
-		if (bm_ext) {
-			D_ASSERT(device, !test_bit(BME_LOCKED, &bm_ext->flags));
-			D_ASSERT(device, test_bit(BME_NO_WRITES, &bm_ext->flags));
-			clear_bit(BME_NO_WRITES, &bm_ext->flags);
-			peer_device->resync_wenr = LC_FREE;
-			if (lc_put(peer_device->resync_lru, &bm_ext->lce) == 0) {
-				bm_ext->flags = 0;
-				peer_device->resync_locked--;
-			}
-			wake_up(&device->al_wait);
-		} else {
-			drbd_alert(device, "LOGIC BUG\n");
+	rsi = peer_device->resync_waiting;
+	if (rsi) {
+		peer_device->resync_waiting = NULL;
+		if (rsi->i.sector != sector || rsi->i.size != size) {
+			remove_rs_interval(device, rsi);
+			kfree(rsi);
+			rsi = NULL;
+			wake = true;
 		}
 	}
-	/* TRY. */
-	e = lc_try_get(peer_device->resync_lru, enr);
-	bm_ext = e ? lc_entry(e, struct bm_extent, lce) : NULL;
-	if (bm_ext) {
-		if (test_bit(BME_LOCKED, &bm_ext->flags))
-			goto proceed;
-		if (!test_and_set_bit(BME_NO_WRITES, &bm_ext->flags)) {
-			peer_device->resync_locked++;
-		} else {
-			/* we did set the BME_NO_WRITES,
-			 * but then could not set BME_LOCKED,
-			 * so we tried again.
-			 * drop the extra reference. */
-			bm_ext->lce.refcnt--;
-			D_ASSERT(device, bm_ext->lce.refcnt > 0);
-		}
-		goto check_al;
-	} else {
-		/* do we rather want to try later? */
-		if (peer_device->resync_locked > peer_device->resync_lru->nr_elements-3)
-			goto try_again;
-		/* Do or do not. There is no try. -- Yoda */
-		e = lc_get(peer_device->resync_lru, enr);
-		bm_ext = e ? lc_entry(e, struct bm_extent, lce) : NULL;
-		if (!bm_ext) {
-			const unsigned long rs_flags = peer_device->resync_lru->flags;
-			if (rs_flags & LC_STARVING)
-				drbd_warn(device, "Have to wait for element"
-				     " (resync LRU too small?)\n");
-			BUG_ON(rs_flags & LC_LOCKED);
-			goto try_again;
-		}
-		if (bm_ext->lce.lc_number != enr) {
-			bm_ext->rs_left = bm_e_weight(peer_device, enr);
-			bm_ext->rs_failed = 0;
-			lc_committed(peer_device->resync_lru);
-			wake_up(&device->al_wait);
-			D_ASSERT(device, test_bit(BME_LOCKED, &bm_ext->flags) == 0);
+	if (!rsi) {
+		if (throttle) {
+			err = -EAGAIN;
+			goto out;
 		}
-		set_bit(BME_NO_WRITES, &bm_ext->flags);
-		D_ASSERT(device, bm_ext->lce.refcnt == 1);
-		peer_device->resync_locked++;
-		goto check_al;
+		rsi = new;
+		new = NULL;
+		drbd_insert_interval(&device->resync_requests, &rsi->i);
 	}
-check_al:
-	for (i = 0; i < AL_EXT_PER_BM_SECT; i++) {
-		if (lc_is_used(device->act_log, al_enr+i))
-			goto try_again;
-	}
-	set_bit(BME_LOCKED, &bm_ext->flags);
-proceed:
-	peer_device->resync_wenr = LC_FREE;
-	spin_unlock_irq(&device->al_lock);
-	return 0;
 
-try_again:
-	if (bm_ext) {
-		if (throttle ||
-		    (test_bit(BME_PRIORITY, &bm_ext->flags) && bm_ext->lce.refcnt == 1)) {
-			D_ASSERT(peer_device, !test_bit(BME_LOCKED, &bm_ext->flags));
-			D_ASSERT(peer_device, test_bit(BME_NO_WRITES, &bm_ext->flags));
-			clear_bit(BME_NO_WRITES, &bm_ext->flags);
-			clear_bit(BME_PRIORITY, &bm_ext->flags);
-			peer_device->resync_wenr = LC_FREE;
-			if (lc_put(peer_device->resync_lru, &bm_ext->lce) == 0) {
-				bm_ext->flags = 0;
-				peer_device->resync_locked--;
-			}
-			wake_up(&device->al_wait);
-		} else
-			peer_device->resync_wenr = enr;
+	if (__rs_interval_lock(device, rsi))
+		goto out;
+
+	err = -EAGAIN;
+	if (retry && !throttle) {
+		peer_device->resync_waiting = rsi;
+	} else {
+		remove_rs_interval(device, rsi);
+		kfree(rsi);
+		wake = true;
 	}
+out:
 	spin_unlock_irq(&device->al_lock);
-	return -EAGAIN;
+	kfree(new);
+	if (wake)
+		wake_up(&device->al_wait);
+	return err;
 }
 
+/* Completes the resync request starting at sector; must have been locked
+ * with drbd_rs_begin_io() or drbd_try_rs_begin_io(). */
 void drbd_rs_complete_io(struct drbd_peer_device *peer_device, sector_t sector)
 {
 	struct drbd_device *device = peer_device->device;
-	unsigned int enr = BM_SECT_TO_EXT(sector);
-	struct lc_element *e;
-	struct bm_extent *bm_ext;
+	struct drbd_rs_interval *rsi = NULL;
+	struct drbd_interval *i;
 	unsigned long flags;
+	bool wake;
 
 	spin_lock_irqsave(&device->al_lock, flags);
-	e = lc_find(peer_device->resync_lru, enr);
-	bm_ext = e ? lc_entry(e, struct bm_extent, lce) : NULL;
-	if (!bm_ext) {
-		spin_unlock_irqrestore(&device->al_lock, flags);
-		if (drbd_ratelimit())
-			drbd_err(device, "drbd_rs_complete_io() called, but extent not found\n");
-		return;
-	}
+	drbd_for_each_overlap(i, &device->resync_requests, sector, 1 << 9) {
+		struct drbd_rs_interval *tmp = container_of(i, struct drbd_rs_interval, i);
 
-	if (bm_ext->lce.refcnt == 0) {
+		if (tmp->peer_device == peer_device && i->sector == sector &&
+		    test_bit(RSI_LOCKED, &tmp->flags)) {
+			rsi = tmp;
+			break;
+		}
+	}
+	if (!rsi) {
 		spin_unlock_irqrestore(&device->al_lock, flags);
-		drbd_err(device, "drbd_rs_complete_io(,%llu [=%u]) called, "
-		    "but refcnt is 0!?\n",
-		    (unsigned long long)sector, enr);
+		if (drbd_ratelimit())
+			drbd_err(device, "drbd_rs_complete_io(,%llu) called, but range not locked\n",
+				 (unsigned long long)sector);
 		return;
 	}
+	remove_rs_interval(device, rsi);
+	spin_unlock_irqrestore(&device->al_lock, flags);
 
-	if (lc_put(peer_device->resync_lru, &bm_ext->lce) == 0) {
-		bm_ext->flags = 0; /* clear BME_LOCKED, BME_NO_WRITES and BME_PRIORITY */
-		peer_device->resync_locked--;
+	wake = test_bit(RSI_PRIORITY, &rsi->flags);
+	kfree(rsi);
+	if (wake)
 		wake_up(&device->al_wait);
-	}
+}
 
-	spin_unlock_irqrestore(&device->al_lock, flags);
+/**
+ * __drbd_rs_drop_intervals() - Forget all resync requests of a peer device
+ *
+ * Ranges still waiting in drbd_rs_begin_io() belong to that sleeper and are
+ * left alone.  Caller must hold al_lock.
+ */
+void __drbd_rs_drop_intervals(struct drbd_peer_device *peer_device)
+{
+	struct drbd_device *device = peer_device->device;
+	struct drbd_rs_interval *waiting = peer_device->resync_waiting;
+	struct rb_node *node, *next;
+
+	peer_device->resync_waiting = NULL;
+	for (node = rb_first(&device->resync_requests); node; node = next) {
+		struct drbd_rs_interval *rsi =
+			rb_entry(node, struct drbd_rs_interval, i.rb);
+
+		next = rb_next(node);
+		if (rsi->peer_device != peer_device)
+			continue;
+		if (!test_bit(RSI_LOCKED, &rsi->flags) && rsi != waiting)
+			continue;
+		remove_rs_interval(device, rsi);
+		kfree(rsi);
+	}
 }
 
 /**
- * drbd_rs_cancel_all() - Removes all extents from the resync LRU (even BME_LOCKED)
+ * drbd_rs_cancel_all() - Removes all extents from the resync LRU and all resync requests
  */
 void drbd_rs_cancel_all(struct drbd_peer_device *peer_device)
 {
@@ -1556,8 +1674,7 @@ void drbd_rs_cancel_all(struct drbd_peer_device *peer_device)
 		lc_reset(peer_device->resync_lru);
 		put_ldev(device);
 	}
-	peer_device->resync_locked = 0;
-	peer_device->resync_wenr = LC_FREE;
+	__drbd_rs_drop_intervals(peer_device);
 	spin_unlock_irq(&device->al_lock);
 	wake_up(&device->al_wait);
 }
@@ -1565,45 +1682,47 @@ void drbd_rs_cancel_all(struct drbd_peer_device *peer_device)
 /**
  * drbd_rs_del_all() - Gracefully remove all extents from the resync LRU
  *
- * Returns 0 upon success, -EAGAIN if at least one reference count was
- * not zero.
+ * Returns 0 upon success, -EAGAIN if resync requests are still in flight.
  */
 int drbd_rs_del_all(struct drbd_peer_device *peer_device)
 {
 	struct drbd_device *device = peer_device->device;
+	struct drbd_rs_interval *rsi;
 	struct lc_element *e;
-	struct bm_extent *bm_ext;
+	struct rb_node *node;
 	int i;
 
 	spin_lock_irq(&device->al_lock);
 
+	rsi = peer_device->resync_waiting;
+	if (rsi) {
+		drbd_info(peer_device, "dropping resync request %llu+%u in drbd_rs_del_all, "
+			  "apparently got 'synced' by application io\n",
+			  (unsigned long long)rsi->i.sector, rsi->i.size);
+		peer_device->resync_waiting = NULL;
+		remove_rs_interval(device, rsi);
+		kfree(rsi);
+	}
+
+	for (node = rb_first(&device->resync_requests); node; node = rb_next(node)) {
+		rsi = rb_entry(node, struct drbd_rs_interval, i.rb);
+		if (rsi->peer_device == peer_device) {
+			drbd_info(peer_device, "Retrying drbd_rs_del_all() later. "
+				  "resync request %llu+%u in flight\n",
+				  (unsigned long long)rsi->i.sector, rsi->i.size);
+			spin_unlock_irq(&device->al_lock);
+			return -EAGAIN;
+		}
+	}
+
 	if (get_ldev_if_state(device, D_DETACHING)) {
 		/* ok, ->resync is there. */
 		for (i = 0; i < peer_device->resync_lru->nr_elements; i++) {
 			e = lc_element_by_index(peer_device->resync_lru, i);
-			bm_ext = lc_entry(e, struct bm_extent, lce);
-			if (bm_ext->lce.lc_number == LC_FREE)
+			if (e->lc_number == LC_FREE)
 				continue;
-			if (bm_ext->lce.lc_number == peer_device->resync_wenr) {
-				drbd_info(peer_device, "dropping %u in drbd_rs_del_all, apparently"
-				     " got 'synced' by application io\n",
-				     peer_device->resync_wenr);
-				D_ASSERT(peer_device, !test_bit(BME_LOCKED, &bm_ext->flags));
-				D_ASSERT(peer_device, test_bit(BME_NO_WRITES, &bm_ext->flags));
-				clear_bit(BME_NO_WRITES, &bm_ext->flags);
-				peer_device->resync_wenr = LC_FREE;
-				lc_put(peer_device->resync_lru, &bm_ext->lce);
-			}
-			if (bm_ext->lce.refcnt != 0) {
-				drbd_info(peer_device, "Retrying drbd_rs_del_all() later. "
-				     "refcnt=%d\n", bm_ext->lce.refcnt);
-				put_ldev(device);
-				spin_unlock_irq(&device->al_lock);
-				return -EAGAIN;
-			}
-			D_ASSERT(peer_device, !test_bit(BME_LOCKED, &bm_ext->flags));
-			D_ASSERT(peer_device, !test_bit(BME_NO_WRITES, &bm_ext->flags));
-			lc_del(peer_device->resync_lru, &bm_ext->lce);
+			D_ASSERT(peer_device, atomic_read(&e->refcnt) == 0);
+			lc_del(peer_device->resync_lru, e);
 		}
 		D_ASSERT(peer_device, peer_device->resync_lru->used == 0);
 		put_ldev(device);
@@ -1617,14 +1736,17 @@ int drbd_rs_del_all(struct drbd_peer_device *peer_device)
 bool drbd_sector_has_priority(struct drbd_peer_device *peer_device, sector_t sector)
 {
 	struct drbd_device *device = peer_device->device;
-	struct lc_element *tmp;
+	struct drbd_interval *i;
 	bool has_priority = false;
 
 	spin_lock_irq(&device->al_lock);
-	tmp = lc_find(peer_device->resync_lru, BM_SECT_TO_EXT(sector));
-	if (tmp) {
-		struct bm_extent *bm_ext = lc_entry(tmp, struct bm_extent, lce);
-		has_priority = test_bit(BME_PRIORITY, &bm_ext->flags);
+	drbd_for_each_overlap(i, &device->resync_requests, sector, 1 << 9) {
+		struct drbd_rs_interval *rsi = container_of(i, struct drbd_rs_interval, i);
+
+		if (rsi->peer_device == peer_device && test_bit(RSI_PRIORITY, &rsi->flags)) {
+			has_priority = true;
+			break;
+		}
 	}
 	spin_unlock_irq(&device->al_lock);
 	return has_priority;
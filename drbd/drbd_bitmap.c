@@ -19,6 +19,7 @@
 #include <linux/slab.h>
 #include <linux/dynamic_debug.h>
 #include <linux/libnvdimm.h>
+#include <linux/sort.h>
 #include <asm/kmap_types.h>
 
 #include "drbd_int.h"
@@ -32,6 +33,10 @@
 # endif
 #endif
 
+/* bits per counter of the out-of-sync summary, 4 MiB of storage */
+#define BM_UNION_SHIFT	(22 - BM_BLOCK_SHIFT)
+#define BM_UNION_MASK	((1UL << BM_UNION_SHIFT) - 1)
+
 /* OPAQUE outside this file!
  * interface defined in drbd_int.h
 
@@ -78,6 +83,11 @@
  *	and out against their on-disk location as necessary, but need to make
  *	sure we don't cause too much meta data IO, and must not deadlock in
  *	tight memory situations. This needs some more work.
+ *
+ *	On disk, the bitmaps of all bm_max_peers bitmap indices are interleaved
+ *	by 32 bit words.  In core, only the assigned ones, plus one shared by
+ *	the vacant ones, see struct drbd_bitmap.  If that is fewer, bm_rw()
+ *	converts between the two through bounce pages.
  */
 
 /*
@@ -344,12 +354,11 @@ static void bm_free_pages(struct page **pages, unsigned long number)
 /*
  * "have" and "want" are NUMBER OF PAGES.
  */
-static struct page **bm_realloc_pages(struct drbd_bitmap *b, unsigned long want)
+static struct page **bm_realloc_pages(struct page **old_pages, unsigned long have,
+				      unsigned long want)
 {
-	struct page **old_pages = b->bm_pages;
 	struct page **new_pages, *page;
 	unsigned int i, bytes;
-	unsigned long have = b->bm_number_of_pages;
 
 	BUG_ON(have == 0 && old_pages != NULL);
 	BUG_ON(have != 0 && old_pages == NULL);
@@ -397,10 +406,29 @@ static struct page **bm_realloc_pages(struct drbd_bitmap *b, unsigned long want)
 	return new_pages;
 }
 
+static unsigned long bm_union_chunks(unsigned long bits)
+{
+	return (bits + BM_UNION_MASK) >> BM_UNION_SHIFT;
+}
+
+/* Same as for the page array, see bm_realloc_pages() */
+static u16 *bm_alloc_union(unsigned long chunks)
+{
+	size_t bytes = chunks * sizeof(u16);
+	u16 *counts;
+
+	counts = kzalloc(bytes, GFP_NOIO | __GFP_NOWARN);
+	if (!counts)
+		counts = __vmalloc(bytes, GFP_NOIO | __GFP_ZERO, PAGE_KERNEL);
+	return counts;
+}
+
 struct drbd_bitmap *drbd_bm_alloc(void)
 {
 	struct drbd_bitmap *b;
 
+	BUILD_BUG_ON((DRBD_PEERS_MAX << BM_UNION_SHIFT) > U16_MAX);
+
 	b = kzalloc(sizeof(struct drbd_bitmap), GFP_KERNEL);
 	if (!b)
 		return NULL;
@@ -408,8 +436,10 @@ struct drbd_bitmap *drbd_bm_alloc(void)
 	spin_lock_init(&b->bm_lock);
 	mutex_init(&b->bm_change);
 	init_waitqueue_head(&b->bm_io_wait);
+	init_rwsem(&b->bm_io_sem);
 
 	b->bm_max_peers = 1;
+	b->bm_slots = 1;
 
 	return b;
 }
@@ -423,6 +453,7 @@ sector_t drbd_bm_capacity(struct drbd_device *device)
 
 void drbd_bm_free(struct drbd_bitmap *bitmap)
 {
+	kvfree(bitmap->bm_union);
 	if (bitmap->bm_flags & BM_ON_DAX_PMEM)
 		return;
 
@@ -431,11 +462,17 @@ void drbd_bm_free(struct drbd_bitmap *bitmap)
 	kfree(bitmap);
 }
 
+static inline unsigned int bm_slot(struct drbd_bitmap *bitmap, unsigned int bitmap_index)
+{
+	return bitmap->bm_slot[bitmap_index];
+}
+
+/* In core, by slot.  On disk, the same with bm_max_peers and the bitmap index. */
 static inline unsigned long interleaved_word32(struct drbd_bitmap *bitmap,
-					       unsigned int bitmap_index,
+					       unsigned int slot,
 					       unsigned long bit)
 {
-	return (bit >> 5) * bitmap->bm_max_peers + bitmap_index;
+	return (bit >> 5) * bitmap->bm_slots + slot;
 }
 
 static inline unsigned long word32_to_page(unsigned long word)
@@ -449,19 +486,19 @@ static inline unsigned int word32_in_page(unsigned long word)
 }
 
 static inline unsigned long last_bit_on_page(struct drbd_bitmap *bitmap,
-					     unsigned int bitmap_index,
+					     unsigned int slot,
 					     unsigned long bit)
 {
-	unsigned long word = interleaved_word32(bitmap, bitmap_index, bit);
+	unsigned long word = interleaved_word32(bitmap, slot, bit);
 
-	return (bit | 31) + ((word32_in_page(-(word + 1)) / bitmap->bm_max_peers) << 5);
+	return (bit | 31) + ((word32_in_page(-(word + 1)) / bitmap->bm_slots) << 5);
 }
 
 static inline unsigned long bit_to_page_interleaved(struct drbd_bitmap *bitmap,
-						    unsigned int bitmap_index,
+						    unsigned int slot,
 						    unsigned long bit)
 {
-	return word32_to_page(interleaved_word32(bitmap, bitmap_index, bit));
+	return word32_to_page(interleaved_word32(bitmap, slot, bit));
 }
 
 static void *bm_map(struct drbd_bitmap *bitmap, unsigned int page)
@@ -478,12 +515,78 @@ static void bm_unmap(struct drbd_bitmap *bitmap, void *addr)
 		kunmap_atomic(addr);
 }
 
+/* 32 bit words per slot, the same in core and on disk */
+static unsigned long bm_words32_per_slot(struct drbd_bitmap *bitmap)
+{
+	return bitmap->bm_words * (BITS_PER_LONG / 32) / bitmap->bm_slots;
+}
+
+static unsigned long bm_disk_pages(struct drbd_bitmap *bitmap)
+{
+	unsigned long words32 = bm_words32_per_slot(bitmap) * bitmap->bm_max_peers;
+
+	return word32_to_page(words32 + (1 << (PAGE_SHIFT - 2)) - 1);
+}
+
+/* first and last on-disk page with words of in-core page @page_nr */
+static void bm_disk_page_range(struct drbd_bitmap *bitmap, unsigned int page_nr,
+			       unsigned long *first, unsigned long *last)
+{
+	unsigned long word = (unsigned long)page_nr << (PAGE_SHIFT - 2);
+	unsigned long last_word = word + (1 << (PAGE_SHIFT - 2)) - 1;
+	unsigned long last_group = bm_words32_per_slot(bitmap) - 1;
+
+	*first = word32_to_page(word / bitmap->bm_slots * bitmap->bm_max_peers);
+	*last = word32_to_page(min(last_word / bitmap->bm_slots, last_group) * bitmap->bm_max_peers +
+			       bitmap->bm_max_peers - 1);
+}
+
+/* Convert one page of the on-disk bitmap from (@from_disk), or to, the
+ * in-core layout.  Vacant bitmap indices share a slot, reading or-s them
+ * into it.  Since there are never more slots than bitmap indices, an
+ * on-disk page spans at most two in-core pages.  */
+static void bm_translate_page(struct drbd_bitmap *bitmap, unsigned long disk_page,
+			      __le32 *disk, bool from_disk)
+{
+	unsigned long word = disk_page << (PAGE_SHIFT - 2);
+	unsigned long group = word / bitmap->bm_max_peers;
+	unsigned int bitmap_index = word % bitmap->bm_max_peers;
+	unsigned long groups = bm_words32_per_slot(bitmap);
+	unsigned int i, page_nr = -1U;
+	__le32 *addr = NULL;
+
+	for (i = 0; i < PAGE_SIZE / sizeof(__le32); i++) {
+		if (group < groups) {
+			unsigned long in_core = group * bitmap->bm_slots + bm_slot(bitmap, bitmap_index);
+
+			if (word32_to_page(in_core) != page_nr) {
+				if (addr)
+					bm_unmap(bitmap, addr);
+				page_nr = word32_to_page(in_core);
+				addr = bm_map(bitmap, page_nr);
+			}
+			if (from_disk)
+				addr[word32_in_page(in_core)] |= disk[i];
+			else
+				disk[i] = addr[word32_in_page(in_core)];
+		} else if (!from_disk) {
+			disk[i] = 0;
+		}
+		if (++bitmap_index == bitmap->bm_max_peers) {
+			bitmap_index = 0;
+			group++;
+		}
+	}
+	if (addr)
+		bm_unmap(bitmap, addr);
+}
+
 static __always_inline unsigned long
-____bm_op(struct drbd_device *device, unsigned int bitmap_index, unsigned long start, unsigned long end,
+____bm_op(struct drbd_device *device, unsigned int slot, unsigned long start, unsigned long end,
 	 enum bitmap_operations op, __le32 *buffer)
 {
 	struct drbd_bitmap *bitmap = device->bitmap;
-	unsigned int word32_skip = 32 * bitmap->bm_max_peers;
+	unsigned int word32_skip = 32 * bitmap->bm_slots;
 	unsigned long total = 0;
 	unsigned long word;
 	unsigned int page, bit_in_page;
@@ -491,7 +594,7 @@ ____bm_op(struct drbd_device *device, unsigned int bitmap_index, unsigned long s
 	if (end >= bitmap->bm_bits)
 		end = bitmap->bm_bits - 1;
 
-	word = interleaved_word32(bitmap, bitmap_index, start);
+	word = interleaved_word32(bitmap, slot, start);
 	page = word32_to_page(word);
 	bit_in_page = (word32_in_page(word) << 5) | (start & 31);
 
@@ -691,12 +794,12 @@ ____bm_op(struct drbd_device *device, unsigned int bitmap_index, unsigned long s
 	switch(op) {
 	case BM_OP_CLEAR:
 		if (total)
-			bitmap->bm_set[bitmap_index] -= total;
+			bitmap->bm_set[slot] -= total;
 		break;
 	case BM_OP_SET:
 	case BM_OP_MERGE:
 		if (total)
-			bitmap->bm_set[bitmap_index] += total;
+			bitmap->bm_set[slot] += total;
 		break;
 	case BM_OP_FIND_BIT:
 	case BM_OP_FIND_ZERO_BIT:
@@ -708,6 +811,39 @@ ____bm_op(struct drbd_device *device, unsigned int bitmap_index, unsigned long s
 	return total;
 }
 
+/* ____bm_op() on the slot of a bitmap index assigned to a peer, one chunk
+ * of the out-of-sync summary at a time, to keep that up to date.  Chunks not
+ * counted yet are left to bm_count_union(). */
+static __always_inline unsigned long
+bm_union_op(struct drbd_device *device, unsigned int slot, unsigned long start, unsigned long end,
+	    enum bitmap_operations op, __le32 *buffer)
+{
+	struct drbd_bitmap *bitmap = device->bitmap;
+	unsigned long total = 0;
+
+	if (end >= bitmap->bm_bits)
+		end = bitmap->bm_bits - 1;
+
+	while (start <= end) {
+		unsigned long last = min(end, start | BM_UNION_MASK);
+		unsigned long count = ____bm_op(device, slot, start, last, op, buffer);
+		unsigned long chunk = start >> BM_UNION_SHIFT;
+
+		if (chunk < bitmap->bm_union_valid) {
+			if (op == BM_OP_CLEAR)
+				bitmap->bm_union[chunk] -= count;
+			else
+				bitmap->bm_union[chunk] += count;
+		}
+		/* BM_OP_MERGE starts word aligned, and so do the chunks */
+		if (buffer)
+			buffer += (last - start + 1) >> 5;
+		total += count;
+		start = last + 1;
+	}
+	return total;
+}
+
 /* Returns the number of bits changed.  */
 static __always_inline unsigned long
 __bm_op(struct drbd_device *device, unsigned int bitmap_index, unsigned long start, unsigned long end,
@@ -715,6 +851,7 @@ __bm_op(struct drbd_device *device, unsigned int bitmap_index, unsigned long sta
 /* kmap compat: KM_IRQ1 */
 {
 	struct drbd_bitmap *bitmap = device->bitmap;
+	unsigned int slot;
 
 	if (!expect(device, bitmap))
 		return 1;
@@ -745,7 +882,19 @@ __bm_op(struct drbd_device *device, unsigned int bitmap_index, unsigned long sta
 			break;
 		}
 	}
-	return ____bm_op(device, bitmap_index, start, end, op, buffer);
+
+	slot = bm_slot(bitmap, bitmap_index);
+	switch(op) {
+	case BM_OP_CLEAR:
+	case BM_OP_SET:
+	case BM_OP_MERGE:
+		if (bitmap->bm_union_slots & (1UL << slot))
+			return bm_union_op(device, slot, start, end, op, buffer);
+		break;
+	default:
+		break;
+	}
+	return ____bm_op(device, slot, start, end, op, buffer);
 }
 
 static __always_inline unsigned long
@@ -781,38 +930,78 @@ bm_op(struct drbd_device *device, unsigned int bitmap_index, unsigned long start
 #endif
 
 #ifdef BITMAP_DEBUG
-#define ___bm_op(device, bitmap_index, start, end, op, buffer) \
+#define ___bm_op(device, slot, start, end, op, buffer) \
 	({ unsigned long ret; \
 	   drbd_info(device, "%s: ___bm_op(..., %u, %lu, %lu, %u, %p)\n", \
-		     __func__, bitmap_index, start, end, op, buffer); \
-	   ret = ____bm_op(device, bitmap_index, start, end, op, buffer); \
+		     __func__, slot, start, end, op, buffer); \
+	   ret = ____bm_op(device, slot, start, end, op, buffer); \
 	   drbd_info(device, "= %lu\n", ret); \
 	   ret; })
 #else
-#define ___bm_op(device, bitmap_index, start, end, op, buffer) \
-	____bm_op(device, bitmap_index, start, end, op, buffer)
+#define ___bm_op(device, slot, start, end, op, buffer) \
+	____bm_op(device, slot, start, end, op, buffer)
 #endif
 
+/* Bits set in chunk @chunk of the out-of-sync summary.  Hold bm_lock. */
+static unsigned int bm_count_chunk(struct drbd_device *device, unsigned long chunk)
+{
+	struct drbd_bitmap *bitmap = device->bitmap;
+	unsigned long first = chunk << BM_UNION_SHIFT;
+	unsigned int slot, count = 0;
+
+	for_each_set_bit(slot, &bitmap->bm_union_slots, bitmap->bm_slots)
+		count += ___bm_op(device, slot, first, first | BM_UNION_MASK, BM_OP_COUNT, NULL);
+	return count;
+}
+
+/* Unlike bm_count_bits(), this may run while the bitmap changes: each chunk
+ * is counted under bm_lock, and after that kept up to date by bm_union_op().
+ * bm_lock is dropped between chunks, so re-check the size every time.
+ * Counts from bm_union_valid on; whoever changes bm_union_slots resets that
+ * in the same bm_lock section, which restarts a count in progress. */
+static void bm_count_union(struct drbd_device *device)
+{
+	struct drbd_bitmap *bitmap = device->bitmap;
+
+	spin_lock_irq(&bitmap->bm_lock);
+	while (bitmap->bm_union_valid < bm_union_chunks(bitmap->bm_bits)) {
+		unsigned long chunk = bitmap->bm_union_valid;
+
+		bitmap->bm_union[chunk] = bm_count_chunk(device, chunk);
+		bitmap->bm_union_valid = chunk + 1;
+		if (need_resched()) {
+			spin_unlock_irq(&bitmap->bm_lock);
+			cond_resched();
+			spin_lock_irq(&bitmap->bm_lock);
+		}
+	}
+	spin_unlock_irq(&bitmap->bm_lock);
+}
+
 /* you better not modify the bitmap while this is running,
  * or its results will be stale */
 static void bm_count_bits(struct drbd_device *device)
 /* kmap compat: KM_USER0 */
 {
 	struct drbd_bitmap *bitmap = device->bitmap;
-	unsigned int bitmap_index;
+	unsigned int slot;
 
-	for (bitmap_index = 0; bitmap_index < bitmap->bm_max_peers; bitmap_index++) {
+	for (slot = 0; slot < bitmap->bm_slots; slot++) {
 		unsigned long bit = 0, bits_set = 0;
 
 		while (bit < bitmap->bm_bits) {
-			unsigned long last_bit = last_bit_on_page(bitmap, bitmap_index, bit);
+			unsigned long last_bit = last_bit_on_page(bitmap, slot, bit);
 
-			bits_set += ___bm_op(device, bitmap_index, bit, last_bit, BM_OP_COUNT, NULL);
+			bits_set += ___bm_op(device, slot, bit, last_bit, BM_OP_COUNT, NULL);
 			bit = last_bit + 1;
 			cond_resched();
 		}
-		bitmap->bm_set[bitmap_index] = bits_set;
+		bitmap->bm_set[slot] = bits_set;
 	}
+	spin_lock_irq(&bitmap->bm_lock);
+	bitmap->bm_union_valid = 0;
+	spin_unlock_irq(&bitmap->bm_lock);
+	bm_count_union(device);
 }
 
 /* For the layout, see comment above drbd_md_set_sector_offsets(). */
@@ -847,6 +1036,8 @@ int drbd_bm_resize(struct drbd_device *device, sector_t capacity, bool set_new_b
 	unsigned long bits, words, obits;
 	unsigned long want, have, onpages; /* number of pages */
 	struct page **npages = NULL, **opages = NULL;
+	u16 *nunion, *ounion;
+	unsigned long chunk;
 	void *bm_on_pmem = NULL;
 	int err = 0;
 	bool growing;
@@ -863,19 +1054,23 @@ int drbd_bm_resize(struct drbd_device *device, sector_t capacity, bool set_new_b
 		goto out;
 
 	if (capacity == 0) {
-		unsigned int bitmap_index;
+		unsigned int slot;
 
 		spin_lock_irq(&b->bm_lock);
 		opages = b->bm_pages;
 		onpages = b->bm_number_of_pages;
 		b->bm_pages = NULL;
 		b->bm_number_of_pages = 0;
-		for (bitmap_index = 0; bitmap_index < b->bm_max_peers; bitmap_index++)
-			b->bm_set[bitmap_index] = 0;
+		for (slot = 0; slot < b->bm_slots; slot++)
+			b->bm_set[slot] = 0;
 		b->bm_bits = 0;
 		b->bm_words = 0;
 		b->bm_dev_capacity = 0;
+		ounion = b->bm_union;
+		b->bm_union = NULL;
+		b->bm_union_valid = 0;
 		spin_unlock_irq(&b->bm_lock);
+		kvfree(ounion);
 		if (!(b->bm_flags & BM_ON_DAX_PMEM)) {
 			bm_free_pages(opages, onpages);
 			kvfree(opages);
@@ -883,7 +1078,7 @@ int drbd_bm_resize(struct drbd_device *device, sector_t capacity, bool set_new_b
 		goto out;
 	}
 	bits  = BM_SECT_TO_BIT(ALIGN(capacity, BM_SECT_PER_BIT));
-	words = (ALIGN(bits, 64) * b->bm_max_peers) / BITS_PER_LONG;
+	words = (ALIGN(bits, 64) * b->bm_slots) / BITS_PER_LONG;
 
 	if (get_ldev(device)) {
 		u64 bits_on_disk = drbd_md_on_disk_bits(device);
@@ -896,6 +1091,12 @@ int drbd_bm_resize(struct drbd_device *device, sector_t capacity, bool set_new_b
 		}
 	}
 
+	nunion = bm_alloc_union(bm_union_chunks(bits));
+	if (!nunion) {
+		err = -ENOMEM;
+		goto out;
+	}
+
 	want = ALIGN(words*sizeof(long), PAGE_SIZE) >> PAGE_SHIFT;
 	have = b->bm_number_of_pages;
 	if (drbd_md_dax_active(device->ldev)) {
@@ -908,10 +1109,11 @@ int drbd_bm_resize(struct drbd_device *device, sector_t capacity, bool set_new_b
 			if (drbd_insert_fault(device, DRBD_FAULT_BM_ALLOC))
 				npages = NULL;
 			else
-				npages = bm_realloc_pages(b, want);
+				npages = bm_realloc_pages(b->bm_pages, have, want);
 		}
 
 		if (!npages) {
+			kvfree(nunion);
 			err = -ENOMEM;
 			goto out;
 		}
@@ -919,6 +1121,11 @@ int drbd_bm_resize(struct drbd_device *device, sector_t capacity, bool set_new_b
 
 	spin_lock_irq(&b->bm_lock);
 	obits  = b->bm_bits;
+	ounion = b->bm_union;
+	if (ounion)
+		memcpy(nunion, ounion,
+		       min(bm_union_chunks(obits), bm_union_chunks(bits)) * sizeof(u16));
+	b->bm_union = nunion;
 
 	growing = bits > obits;
 
@@ -940,20 +1147,25 @@ int drbd_bm_resize(struct drbd_device *device, sector_t capacity, bool set_new_b
 	b->bm_dev_capacity = capacity;
 
 	if (growing) {
-		unsigned int bitmap_index;
+		unsigned int slot;
 
-		for (bitmap_index = 0; bitmap_index < b->bm_max_peers; bitmap_index++) {
-			unsigned long bm_set = b->bm_set[bitmap_index];
+		for (slot = 0; slot < b->bm_slots; slot++) {
+			unsigned long bm_set = b->bm_set[slot];
 
 			if (set_new_bits) {
-				___bm_op(device, bitmap_index, obits, -1UL, BM_OP_SET, NULL);
+				___bm_op(device, slot, obits, -1UL, BM_OP_SET, NULL);
 				bm_set += bits - obits;
 			}
 			else
-				___bm_op(device, bitmap_index, obits, -1UL, BM_OP_CLEAR, NULL);
+				___bm_op(device, slot, obits, -1UL, BM_OP_CLEAR, NULL);
 
-			b->bm_set[bitmap_index] = bm_set;
+			b->bm_set[slot] = bm_set;
 		}
+		for (chunk = obits >> BM_UNION_SHIFT; chunk < bm_union_chunks(bits); chunk++)
+			b->bm_union[chunk] = bm_count_chunk(device, chunk);
+		/* unless bm_count_union() is still on its way there */
+		if (b->bm_union_valid >= obits >> BM_UNION_SHIFT)
+			b->bm_union_valid = bm_union_chunks(bits);
 	}
 
 	if (want < have && !(b->bm_flags & BM_ON_DAX_PMEM)) {
@@ -964,9 +1176,11 @@ int drbd_bm_resize(struct drbd_device *device, sector_t capacity, bool set_new_b
 	spin_unlock_irq(&b->bm_lock);
 	if (opages != npages)
 		kvfree(opages);
+	kvfree(ounion);
 	if (!growing)
 		bm_count_bits(device);
-	drbd_info(device, "resync bitmap: bits=%lu words=%lu pages=%lu\n", bits, words, want);
+	drbd_info(device, "resync bitmap: bits=%lu words=%lu pages=%lu slots=%u\n",
+		  bits, words, want, b->bm_slots);
 
  out:
 	drbd_bm_unlock(device);
@@ -991,7 +1205,7 @@ unsigned long _drbd_bm_total_weight(struct drbd_device *device, int bitmap_index
 		return 0;
 
 	spin_lock_irqsave(&b->bm_lock, flags);
-	s = b->bm_set[bitmap_index];
+	s = b->bm_set[bm_slot(b, bitmap_index)];
 	spin_unlock_irqrestore(&b->bm_lock, flags);
 
 	return s;
@@ -1022,7 +1236,7 @@ size_t drbd_bm_words(struct drbd_device *device)
 	if (!expect(device, b->bm_pages))
 		return 0;
 
-	return b->bm_words / b->bm_max_peers;
+	return b->bm_words / b->bm_slots;
 }
 
 unsigned long drbd_bm_bits(struct drbd_device *device)
@@ -1062,6 +1276,19 @@ void drbd_bm_get_lel(struct drbd_peer_device *peer_device, size_t offset, size_t
 	bm_op(peer_device->device, peer_device->bitmap_index, start, end, BM_OP_EXTRACT, (__le32 *)buffer);
 }
 
+/* does not spin_lock_irqsave.
+ * you must take drbd_bm_lock() first */
+void _drbd_bm_get_lel(struct drbd_peer_device *peer_device, size_t offset, size_t number,
+		      unsigned long *buffer)
+{
+	unsigned long start, end;
+
+	start = offset * BITS_PER_LONG;
+	end = start + number * BITS_PER_LONG - 1;
+	____bm_op(peer_device->device, bm_slot(peer_device->device->bitmap, peer_device->bitmap_index),
+		  start, end, BM_OP_EXTRACT, (__le32 *)buffer);
+}
+
 
 static void drbd_bm_aio_ctx_destroy(struct kref *kref)
 {
@@ -1075,6 +1302,31 @@ static void drbd_bm_aio_ctx_destroy(struct kref *kref)
 	kfree(ctx);
 }
 
+static void bm_translate_endio(struct drbd_bm_aio_ctx *ctx, struct bio *bio)
+{
+	struct drbd_device *device = ctx->device;
+	struct drbd_bitmap *b = device->bitmap;
+	struct page *page = bio->bi_io_vec[0].bv_page;
+	unsigned int idx = bm_page_to_idx(page);
+	unsigned long flags;
+	void *addr;
+
+	if (bio->bi_status) {
+		ctx->error = blk_status_to_errno(bio->bi_status);
+		if (drbd_ratelimit())
+			drbd_err(device, "IO ERROR %d on on-disk bitmap page idx %u\n",
+				 bio->bi_status, idx);
+	} else if (ctx->flags & BM_AIO_READ) {
+		/* neighbouring on-disk pages may or into the same in-core word */
+		spin_lock_irqsave(&b->bm_lock, flags);
+		addr = kmap_atomic(page);
+		bm_translate_page(b, idx, addr, true);
+		kunmap_atomic(addr);
+		spin_unlock_irqrestore(&b->bm_lock, flags);
+	}
+	mempool_free(page, &drbd_md_io_page_pool);
+}
+
 /* bv_page may be a copy, or may be the original */
 static void drbd_bm_endio(struct bio *bio)
 {
@@ -1085,6 +1337,11 @@ static void drbd_bm_endio(struct bio *bio)
 
 	blk_status_t status = bio->bi_status;
 
+	if (ctx->flags & BM_AIO_TRANSLATE) {
+		bm_translate_endio(ctx, bio);
+		goto put;
+	}
+
 	if ((ctx->flags & BM_AIO_COPY_PAGES) == 0 &&
 	    !bm_test_page_unchanged(b->bm_pages[idx]))
 		drbd_warn(device, "bitmap page idx %u changed during IO!\n", idx);
@@ -1109,6 +1366,7 @@ static void drbd_bm_endio(struct bio *bio)
 	if (ctx->flags & BM_AIO_COPY_PAGES)
 		mempool_free(bio->bi_io_vec[0].bv_page, &drbd_md_io_page_pool);
 
+put:
 	bio_put(bio);
 
 	if (atomic_dec_and_test(&ctx->in_flight)) {
@@ -1137,19 +1395,32 @@ static void bm_page_io_async(struct drbd_bm_aio_ctx *ctx, int page_nr) __must_ho
 	len = min_t(unsigned int, PAGE_SIZE,
 		(drbd_md_last_sector(device->ldev) - on_disk_sector + 1)<<9);
 
-	/* serialize IO on this page */
-	bm_page_lock_io(device, page_nr);
-	/* before memcpy and submit,
-	 * so it can be redirtied any time */
-	bm_set_page_unchanged(b->bm_pages[page_nr]);
-
-	if (ctx->flags & BM_AIO_COPY_PAGES) {
+	if (ctx->flags & BM_AIO_TRANSLATE) {
+		/* page_nr is an on-disk page, see bm_rw_translated() */
 		page = mempool_alloc(&drbd_md_io_page_pool,
 				GFP_NOIO | __GFP_HIGHMEM);
-		copy_highpage(page, b->bm_pages[page_nr]);
 		bm_store_page_idx(page, page_nr);
-	} else
-		page = b->bm_pages[page_nr];
+		if (!(ctx->flags & BM_AIO_READ)) {
+			void *addr = kmap_atomic(page);
+
+			bm_translate_page(b, page_nr, addr, false);
+			kunmap_atomic(addr);
+		}
+	} else {
+		/* serialize IO on this page */
+		bm_page_lock_io(device, page_nr);
+		/* before memcpy and submit,
+		 * so it can be redirtied any time */
+		bm_set_page_unchanged(b->bm_pages[page_nr]);
+
+		if (ctx->flags & BM_AIO_COPY_PAGES) {
+			page = mempool_alloc(&drbd_md_io_page_pool,
+					GFP_NOIO | __GFP_HIGHMEM);
+			copy_highpage(page, b->bm_pages[page_nr]);
+			bm_store_page_idx(page, page_nr);
+		} else
+			page = b->bm_pages[page_nr];
+	}
 	bio_set_dev(bio, device->ldev->md_bdev);
 	bio->bi_iter.bi_sector = on_disk_sector;
 	/* bio_add_page of a single page to an empty bio will always succeed,
@@ -1170,6 +1441,97 @@ static void bm_page_io_async(struct drbd_bm_aio_ctx *ctx, int page_nr) __must_ho
 	}
 }
 
+static bool bm_translate_want(struct drbd_bm_aio_ctx *ctx, unsigned int page_nr)
+{
+	struct page *page = ctx->device->bitmap->bm_pages[page_nr];
+
+	if ((ctx->flags & BM_AIO_WRITE_HINTED) &&
+	    !test_and_clear_bit(BM_PAGE_HINT_WRITEOUT, &page_private(page)))
+		return false;
+	if (!(ctx->flags & BM_AIO_WRITE_ALL_PAGES) && bm_test_page_unchanged(page))
+		return false;
+	if ((ctx->flags & BM_AIO_WRITE_LAZY) && !bm_test_page_lazy_writeout(page))
+		return false;
+	/* before the on-disk pages are generated from it,
+	 * so it can be redirtied any time */
+	bm_set_page_unchanged(page);
+	return true;
+}
+
+static int bm_cmp_hint(const void *a, const void *b)
+{
+	unsigned int x = *(const unsigned int *)a, y = *(const unsigned int *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Submit IO for the on-disk pages behind in-core pages @start_page to
+ * @end_page, see struct drbd_bitmap for the two layouts.  Reads go to the
+ * whole on-disk bitmap.  Writes generate each on-disk page behind a changed
+ * in-core page from the current in-core bitmap, once; the caller holds
+ * bm_io_sem exclusively, which orders them against other writes. */
+static unsigned int bm_rw_translated(struct drbd_bm_aio_ctx *ctx,
+				     unsigned int start_page, unsigned int end_page)
+{
+	struct drbd_bitmap *b = ctx->device->bitmap;
+	unsigned long disk_page, first, last, next_first, next_last, next = 0;
+	unsigned int page_nr, hint = 0, count = 0;
+	int want = -1, next_want;
+
+	if (ctx->flags & BM_AIO_READ) {
+		for (page_nr = 0; page_nr < b->bm_number_of_pages; page_nr++)
+			clear_highpage(b->bm_pages[page_nr]);
+		for (disk_page = 0; disk_page < bm_disk_pages(b); disk_page++) {
+			atomic_inc(&ctx->in_flight);
+			bm_page_io_async(ctx, disk_page);
+			++count;
+			cond_resched();
+		}
+		return count;
+	}
+
+	if (ctx->flags & BM_AIO_WRITE_HINTED)
+		sort(b->al_bitmap_hints, b->n_bitmap_hints, sizeof(b->al_bitmap_hints[0]),
+		     bm_cmp_hint, NULL);
+
+	for (page_nr = start_page; ; page_nr++, want = next_want) {
+		if (ctx->flags & BM_AIO_WRITE_HINTED) {
+			while (hint < b->n_bitmap_hints && b->al_bitmap_hints[hint] < page_nr)
+				hint++;
+			if (hint == b->n_bitmap_hints)
+				break;
+			if (b->al_bitmap_hints[hint] != page_nr) {
+				page_nr = b->al_bitmap_hints[hint];
+				want = -1;
+			}
+		}
+		if (page_nr > end_page)
+			break;
+		if (want < 0)
+			want = bm_translate_want(ctx, page_nr);
+		next_want = -1;
+		if (!want)
+			continue;
+
+		bm_disk_page_range(b, page_nr, &first, &last);
+		/* The last on-disk page may hold words of the next in-core
+		 * page as well; decide about that one before copying it. */
+		if (page_nr < end_page) {
+			bm_disk_page_range(b, page_nr + 1, &next_first, &next_last);
+			if (next_first <= last)
+				next_want = bm_translate_want(ctx, page_nr + 1);
+		}
+		for (disk_page = max(first, next); disk_page <= last; disk_page++) {
+			atomic_inc(&ctx->in_flight);
+			bm_page_io_async(ctx, disk_page);
+			++count;
+		}
+		next = last + 1;
+		cond_resched();
+	}
+	return count;
+}
+
 /**
  * bm_rw_range() - read/write the specified range of bitmap pages
  * @device: drbd device this bitmap is associated with
@@ -1193,6 +1555,7 @@ static int bm_rw_range(struct drbd_device *device,
 	struct drbd_bm_aio_ctx *ctx;
 	struct drbd_bitmap *b = device->bitmap;
 	unsigned int i, count = 0;
+	bool exclusive = false;
 	unsigned long now;
 	int err = 0;
 
@@ -1208,15 +1571,26 @@ static int bm_rw_range(struct drbd_device *device,
 	 * the bitmap lock (see drbd_bitmap_io).
 	 * For lazy writeout, we don't care for ongoing changes to the bitmap,
 	 * as we submit copies of pages anyways.
+	 * Against changes of the in-core layout, by bm_io_sem.
 	 */
+	down_read(&b->bm_io_sem);
+	if (b->bm_translate) {
+		up_read(&b->bm_io_sem);
+		down_write(&b->bm_io_sem);
+		exclusive = true;
+	}
 
 	/* if we reach this, we should have at least *some* bitmap pages. */
-	if (!expect(device, b->bm_number_of_pages))
-		return -ENODEV;
+	if (!expect(device, b->bm_number_of_pages)) {
+		err = -ENODEV;
+		goto out_unlock;
+	}
 
 	ctx = kmalloc(sizeof(struct drbd_bm_aio_ctx), GFP_NOIO);
-	if (!ctx)
-		return -ENOMEM;
+	if (!ctx) {
+		err = -ENOMEM;
+		goto out_unlock;
+	}
 
 	*ctx = (struct drbd_bm_aio_ctx) {
 		.device = device,
@@ -1230,7 +1604,8 @@ static int bm_rw_range(struct drbd_device *device,
 
 	if (!expect(device, get_ldev_if_state(device, D_ATTACHING))) {  /* put is in drbd_bm_aio_ctx_destroy() */
 		kfree(ctx);
-		return -ENODEV;
+		err = -ENODEV;
+		goto out_unlock;
 	}
 	/* Here, D_ATTACHING is sufficient because drbd_bm_read() is only
 	 * called from drbd_adm_attach(), after device->ldev has been assigned.
@@ -1241,6 +1616,9 @@ static int bm_rw_range(struct drbd_device *device,
 	if (0 == (ctx->flags & ~BM_AIO_READ))
 		WARN_ON(!(b->bm_flags & BM_LOCK_ALL));
 
+	if (b->bm_translate)
+		ctx->flags |= BM_AIO_TRANSLATE;
+
 	if (end_page >= b->bm_number_of_pages)
 		end_page = b->bm_number_of_pages -1;
 
@@ -1252,7 +1630,9 @@ static int bm_rw_range(struct drbd_device *device,
 
 	/* let the layers below us try to merge these bios... */
 
-	if (flags & BM_AIO_READ) {
+	if (ctx->flags & BM_AIO_TRANSLATE) {
+		count = bm_rw_translated(ctx, start_page, end_page);
+	} else if (flags & BM_AIO_READ) {
 		for (i = start_page; i <= end_page; i++) {
 			atomic_inc(&ctx->in_flight);
 			bm_page_io_async(ctx, i);
@@ -1340,6 +1720,11 @@ static int bm_rw_range(struct drbd_device *device,
 	}
 
 	kref_put(&ctx->kref, &drbd_bm_aio_ctx_destroy);
+out_unlock:
+	if (exclusive)
+		up_write(&b->bm_io_sem);
+	else
+		up_read(&b->bm_io_sem);
 	return err;
 }
 
@@ -1387,7 +1772,7 @@ void drbd_bm_mark_range_for_writeout(struct drbd_device *device, unsigned long s
 		end = bitmap->bm_bits - 1;
 
 	page_nr = bit_to_page_interleaved(bitmap, 0, start);
-	last_page = bit_to_page_interleaved(bitmap, bitmap->bm_max_peers - 1, end);
+	last_page = bit_to_page_interleaved(bitmap, bitmap->bm_slots - 1, end);
 	for (; page_nr <= last_page; page_nr++)
 		push_al_bitmap_hint(device, page_nr);
 }
@@ -1467,16 +1852,18 @@ unsigned long _drbd_bm_find_next(struct drbd_peer_device *peer_device, unsigned
 /* kmap compat: KM_USER0 */
 {
 	/* WARN_ON(!(device->b->bm_flags & BM_LOCK_SET)); */
-	return ____bm_op(peer_device->device, peer_device->bitmap_index, start, -1UL,
-		    BM_OP_FIND_BIT, NULL);
+	return ____bm_op(peer_device->device,
+			 bm_slot(peer_device->device->bitmap, peer_device->bitmap_index),
+			 start, -1UL, BM_OP_FIND_BIT, NULL);
 }
 
 unsigned long _drbd_bm_find_next_zero(struct drbd_peer_device *peer_device, unsigned long start)
 /* kmap compat: KM_USER0 */
 {
 	/* WARN_ON(!(device->b->bm_flags & BM_LOCK_SET)); */
-	return ____bm_op(peer_device->device, peer_device->bitmap_index, start, -1UL,
-		    BM_OP_FIND_ZERO_BIT, NULL);
+	return ____bm_op(peer_device->device,
+			 bm_slot(peer_device->device->bitmap, peer_device->bitmap_index),
+			 start, -1UL, BM_OP_FIND_ZERO_BIT, NULL);
 }
 
 unsigned int drbd_bm_set_bits(struct drbd_device *device, unsigned int bitmap_index,
@@ -1498,7 +1885,7 @@ __bm_many_bits_op(struct drbd_device *device, unsigned int bitmap_index, unsigne
 		end = bitmap->bm_bits - 1;
 
 	while (bit <= end) {
-		unsigned long last_bit = last_bit_on_page(bitmap, bitmap_index, bit);
+		unsigned long last_bit = last_bit_on_page(bitmap, bm_slot(bitmap, bitmap_index), bit);
 
 		if (end < last_bit)
 			last_bit = end;
@@ -1540,6 +1927,17 @@ _drbd_bm_set_many_bits(struct drbd_device *device, int bitmap_index, unsigned lo
 	__bm_many_bits_op(device, bitmap_index, start, end, BM_OP_SET);
 }
 
+/* true if a lower bitmap index already covered this one's slot */
+static bool bm_slot_seen(struct drbd_bitmap *bitmap, unsigned int bitmap_index)
+{
+	unsigned int i;
+
+	for (i = 0; i < bitmap_index; i++)
+		if (bitmap->bm_slot[i] == bitmap->bm_slot[bitmap_index])
+			return true;
+	return false;
+}
+
 /* set all bits in the bitmap */
 void drbd_bm_set_all(struct drbd_device *device)
 {
@@ -1547,7 +1945,8 @@ void drbd_bm_set_all(struct drbd_device *device)
        unsigned int bitmap_index;
 
        for (bitmap_index = 0; bitmap_index < bitmap->bm_max_peers; bitmap_index++)
-	       __bm_many_bits_op(device, bitmap_index, 0, -1, BM_OP_SET);
+	       if (!bm_slot_seen(bitmap, bitmap_index))
+		       __bm_many_bits_op(device, bitmap_index, 0, -1, BM_OP_SET);
 }
 
 /* clear all bits in the bitmap */
@@ -1557,7 +1956,8 @@ void drbd_bm_clear_all(struct drbd_device *device)
 	unsigned int bitmap_index;
 
 	for (bitmap_index = 0; bitmap_index < bitmap->bm_max_peers; bitmap_index++)
-		__bm_many_bits_op(device, bitmap_index, 0, -1, BM_OP_CLEAR);
+		if (!bm_slot_seen(bitmap, bitmap_index))
+			__bm_many_bits_op(device, bitmap_index, 0, -1, BM_OP_CLEAR);
 }
 
 unsigned int drbd_bm_clear_bits(struct drbd_device *device, unsigned int bitmap_index,
@@ -1595,24 +1995,71 @@ int drbd_bm_count_bits(struct drbd_device *device, unsigned int bitmap_index, un
 	return bm_op(device, bitmap_index, s, e, BM_OP_COUNT, NULL);
 }
 
+/**
+ * drbd_bm_count_union_bits() - Bits in [s, e] out of sync with any peer
+ * @device:	DRBD device.
+ * @s:		first bit.
+ * @e:		last bit.
+ *
+ * Only counts bits, in the slots of all bitmap indices assigned to a peer,
+ * if the out-of-sync summary says there are some nearby.  A bit set in more
+ * than one of them is counted more than once.
+ * Returns -1 if there is no bitmap index assigned to a peer.
+ */
+int drbd_bm_count_union_bits(struct drbd_device *device, unsigned long s, unsigned long e)
+{
+	struct drbd_bitmap *bitmap = device->bitmap;
+	unsigned long irq_flags, chunk;
+	unsigned int slot;
+	int count = 0;
+
+	spin_lock_irqsave(&bitmap->bm_lock, irq_flags);
+	if (!bitmap->bm_union_peers) {
+		count = -1;
+		goto out;
+	}
+	if (!bitmap->bm_union || s >= bitmap->bm_bits)
+		goto out;
+	if (e >= bitmap->bm_bits)
+		e = bitmap->bm_bits - 1;
+
+	for (chunk = s >> BM_UNION_SHIFT; chunk <= e >> BM_UNION_SHIFT; chunk++) {
+		/* not counted yet, count exactly */
+		if (chunk < bitmap->bm_union_valid && !bitmap->bm_union[chunk])
+			continue;
+		for_each_set_bit(slot, &bitmap->bm_union_slots, bitmap->bm_slots)
+			count += ___bm_op(device, slot, s, e, BM_OP_COUNT, NULL);
+		break;
+	}
+out:
+	spin_unlock_irqrestore(&bitmap->bm_lock, irq_flags);
+	return count;
+}
+
 void drbd_bm_copy_slot(struct drbd_device *device, unsigned int from_index, unsigned int to_index)
 /* kmap compat: KM_IRQ1 */
 {
 	struct drbd_bitmap *bitmap = device->bitmap;
-	unsigned long word_nr, from_word_nr, to_word_nr, words32_total;
+	unsigned long word_nr, from_word_nr, to_word_nr, words32_total, chunk;
 	unsigned int from_page_nr, to_page_nr, current_page_nr;
+	unsigned int from_slot, to_slot;
 	u32 data_word, *addr;
 
 	words32_total = bitmap->bm_words * sizeof(unsigned long) / sizeof(u32);
 	spin_lock_irq(&bitmap->bm_lock);
 
-	bitmap->bm_set[to_index] = 0;
+	from_slot = bm_slot(bitmap, from_index);
+	to_slot = bm_slot(bitmap, to_index);
+	if (from_slot == to_slot)
+		goto out;
+
+	bitmap->bm_set[to_slot] = 0;
 	current_page_nr = 0;
 	addr = bm_map(bitmap, current_page_nr);
-	for (word_nr = 0; word_nr < words32_total; word_nr += bitmap->bm_max_peers) {
-		from_word_nr = word_nr + from_index;
+	for (word_nr = 0; word_nr < words32_total; word_nr += bitmap->bm_slots) {
+		from_word_nr = word_nr + from_slot;
 		from_page_nr = word32_to_page(from_word_nr);
-		to_word_nr = word_nr + to_index;
+		to_word_nr = word_nr + to_slot;
 		to_page_nr = word32_to_page(to_word_nr);
 
 		if (current_page_nr != from_page_nr) {
@@ -1627,8 +2074,8 @@ void drbd_bm_copy_slot(struct drbd_device *device, unsigned int from_index, unsi
 		}
 		data_word = addr[word32_in_page(from_word_nr)];
 
-		if (word_nr == words32_total - bitmap->bm_max_peers) {
-			unsigned long lw = word_nr / bitmap->bm_max_peers;
+		if (word_nr == words32_total - bitmap->bm_slots) {
+			unsigned long lw = word_nr / bitmap->bm_slots;
 			if (bitmap->bm_bits < (lw + 1) * 32)
 			    data_word &= cpu_to_le32((1 << (bitmap->bm_bits - lw * 32)) - 1);
 		}
@@ -1641,10 +2088,322 @@ void drbd_bm_copy_slot(struct drbd_device *device, unsigned int from_index, unsi
 
 		if (addr[word32_in_page(to_word_nr)] != data_word)
 			bm_set_page_need_writeout(bitmap, current_page_nr);
+		chunk = (word_nr / bitmap->bm_slots) >> (BM_UNION_SHIFT - 5);
+		if (bitmap->bm_union_slots & (1UL << to_slot) && chunk < bitmap->bm_union_valid)
+			bitmap->bm_union[chunk] +=
+				hweight32(data_word) - hweight32(addr[word32_in_page(to_word_nr)]);
 		addr[word32_in_page(to_word_nr)] = data_word;
-		bitmap->bm_set[to_index] += hweight32(data_word);
+		bitmap->bm_set[to_slot] += hweight32(data_word);
 	}
 	bm_unmap(bitmap, addr);
-
+out:
 	spin_unlock_irq(&bitmap->bm_lock);
 }
+
+/* One slot for each bitmap index not in @vacant, in index order, and one
+ * shared by all in @vacant.  @from[slot] is the current slot a new one takes
+ * its bits from; the shared one from the slot of @day0.  */
+static unsigned int bm_plan_slots(struct drbd_bitmap *b, unsigned long vacant,
+				  unsigned int day0, u8 *slot_of, u8 *from)
+{
+	unsigned int bitmap_index, slots = 0;
+	int shared = -1;
+
+	for (bitmap_index = 0; bitmap_index < b->bm_max_peers; bitmap_index++) {
+		if (!(vacant & (1UL << bitmap_index))) {
+			slot_of[bitmap_index] = slots;
+			from[slots++] = bm_slot(b, bitmap_index);
+			continue;
+		}
+		if (shared == -1) {
+			shared = slots++;
+			from[shared] = bm_slot(b, day0);
+		}
+		slot_of[bitmap_index] = shared;
+	}
+	return slots;
+}
+
+static void bm_set_union(struct drbd_bitmap *b, unsigned long peers)
+{
+	unsigned int bitmap_index;
+
+	b->bm_union_peers = peers;
+	b->bm_union_slots = 0;
+	for_each_set_bit(bitmap_index, &peers, b->bm_max_peers)
+		b->bm_union_slots |= 1UL << bm_slot(b, bitmap_index);
+}
+
+static void bm_set_slots(struct drbd_bitmap *b, unsigned int slots, const u8 *slot_of,
+			 unsigned long vacant)
+{
+	memcpy(b->bm_slot, slot_of, b->bm_max_peers);
+	b->bm_slots = slots;
+	b->bm_vacant = vacant;
+	/* else it is the identity, see bm_plan_slots() */
+	b->bm_translate = slots != b->bm_max_peers;
+	bm_set_union(b, b->bm_union_peers);
+}
+
+/* Copy the words of groups @first to @last from the current pages into
+ * @npages, laid out for @slots slots.  */
+static void bm_copy_groups(struct drbd_bitmap *b, struct page **npages, unsigned int slots,
+			   const u8 *from, unsigned long first, unsigned long last)
+{
+	unsigned long word = first * slots, end = (last + 1) * slots;
+	unsigned int dst_nr = -1U, src_nr = -1U;
+	__le32 *dst = NULL, *src = NULL;
+
+	for (; word < end; word++) {
+		unsigned long old = word / slots * b->bm_slots + from[word % slots];
+
+		if (word32_to_page(word) != dst_nr) {
+			if (src) {
+				kunmap_atomic(src);
+				src = NULL;
+				src_nr = -1U;
+			}
+			if (dst)
+				kunmap_atomic(dst);
+			dst_nr = word32_to_page(word);
+			dst = kmap_atomic(npages[dst_nr]);
+		}
+		if (word32_to_page(old) != src_nr) {
+			if (src)
+				kunmap_atomic(src);
+			src_nr = word32_to_page(old);
+			src = kmap_atomic(b->bm_pages[src_nr]);
+		}
+		dst[word32_in_page(word)] = src[word32_in_page(old)];
+	}
+	if (src)
+		kunmap_atomic(src);
+	if (dst)
+		kunmap_atomic(dst);
+}
+
+/* Switch to @slots in-core slots, with slot s starting as a copy of the
+ * current slot @from[s].  The caller holds drbd_bm_lock(BM_LOCK_ALL), has
+ * application IO suspended, and the activity log locked, so that no
+ * al_bitmap_hints point into the old pages.
+ * The bulk is copied without bm_lock.  Old pages changed meanwhile show up
+ * as no longer "unchanged", and get copied once more under the lock. */
+static int bm_relayout(struct drbd_device *device, unsigned int slots, const u8 *slot_of,
+		       const u8 *from, unsigned long vacant)
+{
+	struct drbd_bitmap *b = device->bitmap;
+	unsigned long words, want, groups, group, opages_nr, page_nr;
+	unsigned long bm_set[DRBD_PEERS_MAX];
+	struct page **npages, **opages;
+	unsigned int slot;
+
+	down_write(&b->bm_io_sem);
+	if (!b->bm_pages) {
+		spin_lock_irq(&b->bm_lock);
+		bm_set_slots(b, slots, slot_of, vacant);
+		spin_unlock_irq(&b->bm_lock);
+		goto out;
+	}
+
+	words = ALIGN(b->bm_bits, 64) * slots / BITS_PER_LONG;
+	want = ALIGN(words * sizeof(long), PAGE_SIZE) >> PAGE_SHIFT;
+	if (drbd_insert_fault(device, DRBD_FAULT_BM_ALLOC))
+		npages = NULL;
+	else
+		npages = bm_realloc_pages(NULL, 0, want);
+	if (!npages) {
+		up_write(&b->bm_io_sem);
+		return -ENOMEM;
+	}
+
+	/* The old pages go away, all IO from now on is to the new ones. */
+	for (page_nr = 0; page_nr < b->bm_number_of_pages; page_nr++)
+		bm_set_page_unchanged(b->bm_pages[page_nr]);
+
+	groups = bm_words32_per_slot(b);
+	for (group = 0; group < groups; group += 1024) {
+		bm_copy_groups(b, npages, slots, from, group, min(group + 1024, groups) - 1);
+		cond_resched();
+	}
+
+	spin_lock_irq(&b->bm_lock);
+	for (page_nr = 0; page_nr < b->bm_number_of_pages; page_nr++) {
+		unsigned long word = page_nr << (PAGE_SHIFT - 2);
+
+		if (bm_test_page_unchanged(b->bm_pages[page_nr]))
+			continue;
+		bm_copy_groups(b, npages, slots, from, word / b->bm_slots,
+			       min((word + (1 << (PAGE_SHIFT - 2)) - 1) / b->bm_slots, groups - 1));
+	}
+	for (page_nr = 0; page_nr < want; page_nr++)
+		set_bit(BM_PAGE_NEED_WRITEOUT, &page_private(npages[page_nr]));
+
+	for (slot = 0; slot < slots; slot++)
+		bm_set[slot] = b->bm_set[from[slot]];
+	memcpy(b->bm_set, bm_set, slots * sizeof(bm_set[0]));
+	opages = b->bm_pages;
+	opages_nr = b->bm_number_of_pages;
+	b->bm_pages = npages;
+	b->bm_number_of_pages = want;
+	b->bm_words = words;
+	bm_set_slots(b, slots, slot_of, vacant);
+	spin_unlock_irq(&b->bm_lock);
+
+	bm_free_pages(opages, opages_nr);
+	kvfree(opages);
+	drbd_info(device, "resync bitmap: words=%lu pages=%lu slots=%u\n", words, want, slots);
+out:
+	up_write(&b->bm_io_sem);
+	return 0;
+}
+
+/* bitmap indices of the peers that have a bitmap, see drbd_may_do_local_read() */
+static unsigned long bm_peer_indices(struct drbd_device *device) __must_hold(local)
+{
+	struct drbd_peer_md *peer_md = device->ldev->md.peers;
+	unsigned long peers = 0;
+	int node_id;
+
+	for (node_id = 0; node_id < DRBD_NODE_ID_MAX; node_id++) {
+		int bitmap_index = peer_md[node_id].bitmap_index;
+
+		if (peer_md[node_id].flags & MDF_HAVE_BITMAP &&
+		    bitmap_index >= 0 && bitmap_index < device->bitmap->bm_max_peers)
+			peers |= 1UL << bitmap_index;
+	}
+	return peers;
+}
+
+/**
+ * drbd_bm_init_slots() - Lay out the in-core bitmap for the attaching meta data
+ * @device:	DRBD device.
+ *
+ * Called with the new device->ldev, before the bitmap gets its pages.
+ */
+void drbd_bm_init_slots(struct drbd_device *device) __must_hold(local)
+{
+	struct drbd_bitmap *b = device->bitmap;
+	struct drbd_peer_md *peer_md = device->ldev->md.peers;
+	u8 slot_of[DRBD_PEERS_MAX], from[DRBD_PEERS_MAX];
+	unsigned long vacant = 0;
+	unsigned int bitmap_index;
+	int node_id;
+
+	D_ASSERT(device, b->bm_pages == NULL);
+
+	for (bitmap_index = 0; bitmap_index < b->bm_max_peers; bitmap_index++)
+		vacant |= 1UL << bitmap_index;
+	for (node_id = 0; node_id < DRBD_NODE_ID_MAX; node_id++) {
+		int bitmap_index = peer_md[node_id].bitmap_index;
+
+		if (bitmap_index >= 0 && bitmap_index < b->bm_max_peers)
+			vacant &= ~(1UL << bitmap_index);
+	}
+	/* With DAX, the in-core bitmap is the on-disk one. */
+	if (drbd_md_dax_active(device->ldev))
+		vacant = 0;
+
+	b->bm_union_peers = bm_peer_indices(device);
+	bm_set_slots(b, bm_plan_slots(b, vacant, 0, slot_of, from), slot_of, vacant);
+	if (b->bm_translate)
+		drbd_info(device, "bitmap slots in core: %u of %u\n",
+			  b->bm_slots, b->bm_max_peers);
+}
+
+/**
+ * drbd_bm_add_slot() - Give a newly assigned bitmap index a slot of its own
+ * @device:	DRBD device.
+ * @bitmap_index: bitmap index leaving the vacant ones.
+ *
+ * It starts with what the vacant ones tracked.  If it shares the slot with
+ * other vacant ones, the caller must meet the requirements of bm_relayout().
+ */
+int drbd_bm_add_slot(struct drbd_device *device, unsigned int bitmap_index)
+{
+	struct drbd_bitmap *b = device->bitmap;
+	unsigned long vacant = b->bm_vacant & ~(1UL << bitmap_index);
+	u8 slot_of[DRBD_PEERS_MAX], from[DRBD_PEERS_MAX];
+	unsigned int slots;
+
+	slots = bm_plan_slots(b, vacant, bitmap_index, slot_of, from);
+	if (slots != b->bm_slots)
+		return bm_relayout(device, slots, slot_of, from, vacant);
+
+	/* it was the last vacant one, and keeps the slot */
+	spin_lock_irq(&b->bm_lock);
+	b->bm_vacant = vacant;
+	spin_unlock_irq(&b->bm_lock);
+	return 0;
+}
+
+/**
+ * drbd_bm_free_slot() - Return a bitmap index to the vacant ones
+ * @device:	DRBD device.
+ * @bitmap_index: bitmap index to free.
+ * @from_index: some vacant bitmap index, or -1 if there is none.
+ *
+ * Vacant bitmap indices track all writes since day 0.  The freed one joins
+ * the slot of the others, or gets all bits set if there are none.  It leaves
+ * the out-of-sync summary right away.
+ * Caller holds drbd_bm_lock(BM_LOCK_ALL), and meets the requirements of
+ * bm_relayout().
+ */
+void drbd_bm_free_slot(struct drbd_device *device, unsigned int bitmap_index, int from_index)
+{
+	struct drbd_bitmap *b = device->bitmap;
+	unsigned long vacant = b->bm_vacant | (1UL << bitmap_index);
+	u8 slot_of[DRBD_PEERS_MAX], from[DRBD_PEERS_MAX];
+	unsigned int slots;
+
+	/* Until recounted, drbd_bm_count_union_bits() counts exactly */
+	spin_lock_irq(&b->bm_lock);
+	bm_set_union(b, b->bm_union_peers & ~(1UL << bitmap_index));
+	b->bm_union_valid = 0;
+	spin_unlock_irq(&b->bm_lock);
+
+	if (b->bm_flags & BM_ON_DAX_PMEM) {
+		if (from_index != -1)
+			drbd_bm_copy_slot(device, from_index, bitmap_index);
+		else
+			_drbd_bm_set_many_bits(device, bitmap_index, 0, -1UL);
+		goto out;
+	}
+
+	if (from_index == -1) {
+		_drbd_bm_set_many_bits(device, bitmap_index, 0, -1UL);
+		spin_lock_irq(&b->bm_lock);
+		b->bm_vacant = vacant;
+		spin_unlock_irq(&b->bm_lock);
+		goto out;
+	}
+
+	slots = bm_plan_slots(b, vacant, from_index, slot_of, from);
+	if (bm_relayout(device, slots, slot_of, from, vacant)) {
+		/* keep a slot of its own, with a copy */
+		drbd_warn(device, "Could not shrink the in-core bitmap\n");
+		drbd_bm_copy_slot(device, from_index, bitmap_index);
+	}
+out:
+	bm_count_union(device);
+}
+
+/**
+ * drbd_bm_update_union() - Follow which bitmap indices are assigned to peers
+ * @device:	DRBD device.
+ *
+ * Call after setting or clearing MDF_HAVE_BITMAP of an attached device.
+ */
+void drbd_bm_update_union(struct drbd_device *device) __must_hold(local)
+{
+	struct drbd_bitmap *b = device->bitmap;
+	unsigned long peers = bm_peer_indices(device);
+
+	if (peers == b->bm_union_peers)
+		return;
+
+	spin_lock_irq(&b->bm_lock);
+	bm_set_union(b, peers);
+	b->bm_union_valid = 0;
+	spin_unlock_irq(&b->bm_lock);
+	bm_count_union(device);
+}
@@ -12,6 +12,8 @@
 #include "drbd_debugfs.h"
 #include "drbd_transport.h"
 #include "drbd_dax_pmem.h"
+#include "drbd_journal.h"
+#include "drbd_intent.h"
 
 
 /**********************************************************************
@@ -24,6 +26,7 @@ static struct dentry *drbd_debugfs_refcounts;
 static struct dentry *drbd_debugfs_resources;
 static struct dentry *drbd_debugfs_minors;
 static struct dentry *drbd_debugfs_compat;
+static struct dentry *drbd_debugfs_rates;
 
 #ifdef CONFIG_DRBD_TIMING_STATS
 static void seq_print_age_or_dash(struct seq_file *m, bool valid, ktime_t dt)
@@ -579,6 +582,93 @@ static int resource_state_twopc_show(struct seq_file *m, void *pos)
 	return 0;
 }
 
+static void seq_print_thread_placement(struct seq_file *m, struct drbd_thread *thi)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&thi->t_lock, flags);
+	if (!thi->task) {
+		seq_printf(m, "%-9s %-9s    - -\n", thi->name, "-");
+	} else {
+		seq_printf(m, "%-9s %-9s ", thi->name, drbd_cpu_policy_name(thi->placement));
+		if (thi->numa_node != NUMA_NO_NODE)
+			seq_printf(m, "%4d", thi->numa_node);
+		else
+			seq_puts(m, "   -");
+		seq_printf(m, " %*pbl\n", cpumask_pr_args(thi->task->cpus_ptr));
+	}
+	spin_unlock_irqrestore(&thi->t_lock, flags);
+}
+
+static int resource_cpu_placement_show(struct seq_file *m, void *pos)
+{
+	struct drbd_resource *resource = m->private;
+
+	seq_printf(m, "v: %u\n\n", 1);
+	seq_printf(m, "cpu_mask: %*pbl (%s)\n\n", cpumask_pr_args(resource->cpu_mask),
+		   resource->res_opts.cpu_mask[0] ? "configured" : "calculated");
+	seq_puts(m, "thread    placement node cpus\n");
+	seq_print_thread_placement(m, &resource->worker);
+	return 0;
+}
+
+static void seq_print_thread_overhead(struct seq_file *m, struct drbd_thread *thi,
+				      const char *peer, unsigned int *threads)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&thi->t_lock, flags);
+	if (!thi->task) {
+		seq_printf(m, "%-12s %-16s      -           -        -\n", thi->name, peer);
+	} else {
+		seq_printf(m, "%-12s %-16s %6d %11llu %8lu\n", thi->name, peer,
+			   task_pid_nr(thi->task),
+			   div_u64(thi->task->se.sum_exec_runtime, NSEC_PER_USEC),
+			   thi->task->nvcsw + thi->task->nivcsw);
+		(*threads)++;
+	}
+	spin_unlock_irqrestore(&thi->t_lock, flags);
+}
+
+/* What the resource costs while idle: its kernel threads with the CPU time
+ * and context switches they used up to now, and the rescuer threads of its
+ * own workqueues.  Read it twice, some time apart, for the rates. */
+static int resource_overhead_show(struct seq_file *m, void *pos)
+{
+	struct drbd_resource *resource = m->private;
+	struct drbd_connection *connection;
+	struct drbd_device *device;
+	unsigned int threads = 0, rescuers = 0;
+	int vnr;
+
+	seq_printf(m, "v: %u\n\n", 1);
+	seq_puts(m, "thread       peer                pid   cpu_usecs switches\n");
+	seq_print_thread_overhead(m, &resource->worker, "-", &threads);
+	rcu_read_lock();
+	for_each_connection_rcu(connection, resource) {
+		struct net_conf *nc = rcu_dereference(connection->transport.net_conf);
+		const char *peer = nc ? nc->name : "-";
+
+		seq_print_thread_overhead(m, &connection->receiver, peer, &threads);
+		seq_print_thread_overhead(m, &connection->ack_receiver, peer, &threads);
+		seq_print_thread_overhead(m, &connection->sender, peer, &threads);
+		if (connection->ack_sender && connection->ack_sender != drbd_ack_sender_wq)
+			rescuers++;
+	}
+	idr_for_each_entry(&resource->devices, device, vnr) {
+		if (device->submit.wq)
+			rescuers++;
+	}
+	rcu_read_unlock();
+
+	seq_printf(m, "\nthreads: %u\n", threads);
+	seq_printf(m, "workqueue_rescuers: %u\n", rescuers);
+	/* stacks and task structs, page tables and slab overhead not included */
+	seq_printf(m, "thread_kib: %zu\n",
+		   (threads + rescuers) * (THREAD_SIZE + sizeof(struct task_struct)) >> 10);
+	return 0;
+}
+
 /* make sure at *open* time that the respective object won't go away. */
 static int drbd_single_open(struct file *file, int (*show)(struct seq_file *, void *),
 		                void *data, struct kref *kref,
@@ -633,6 +723,8 @@ static const struct file_operations resource_ ## name ## _fops = {	\
 
 drbd_debugfs_resource_attr(in_flight_summary)
 drbd_debugfs_resource_attr(state_twopc)
+drbd_debugfs_resource_attr(cpu_placement)
+drbd_debugfs_resource_attr(overhead)
 
 #define drbd_dcf(top, obj, attr, perm) do {			\
 	dentry = debugfs_create_file(#attr, perm,		\
@@ -668,6 +760,8 @@ void drbd_debugfs_resource_add(struct drbd_resource *resource)
 	/* debugfs create file */
 	res_dcf(in_flight_summary);
 	res_dcf(state_twopc);
+	res_dcf(cpu_placement);
+	res_dcf(overhead);
 }
 
 static void drbd_debugfs_remove(struct dentry **dp)
@@ -686,6 +780,8 @@ void drbd_debugfs_resource_cleanup(struct drbd_resource *resource)
 	 * and call debugfs_remove on all of them separately.
 	 */
 	/* it is ok to call debugfs_remove(NULL) */
+	drbd_debugfs_remove(&resource->debugfs_res_overhead);
+	drbd_debugfs_remove(&resource->debugfs_res_cpu_placement);
 	drbd_debugfs_remove(&resource->debugfs_res_state_twopc);
 	drbd_debugfs_remove(&resource->debugfs_res_in_flight_summary);
 	drbd_debugfs_remove(&resource->debugfs_res_connections);
@@ -857,9 +953,66 @@ static int connection_debug_show(struct seq_file *m, void *ignored)
 		atomic_read(&connection->done_ee_cnt),
 		atomic_read(&connection->active_ee_cnt));
 	seq_printf(m, "      agreed_pro_version: %d\n", connection->agreed_pro_version);
+	seq_printf(m, "       send.batched_cmds: %lu\n", connection->send.batched_cmds);
+	seq_printf(m, "      send.batch_flushes: %lu\n", connection->send.batch_flushes);
+	seq_printf(m, "              ack_sender: %s\n",
+		   !connection->ack_sender ? "-" :
+		   connection->ack_sender == drbd_ack_sender_wq ? "shared" : "own");
 	return 0;
 }
 
+static int connection_cpu_placement_show(struct seq_file *m, void *ignored)
+{
+	struct drbd_connection *connection = m->private;
+
+	seq_printf(m, "v: %u\n\n", 1);
+	spin_lock_irq(&connection->resource->req_lock);
+	if (cpumask_empty(connection->cpu_mask))
+		seq_puts(m, "explicit: -\n\n");
+	else
+		seq_printf(m, "explicit: %*pbl\n\n", cpumask_pr_args(connection->cpu_mask));
+	spin_unlock_irq(&connection->resource->req_lock);
+	seq_puts(m, "thread    placement node cpus\n");
+	seq_print_thread_placement(m, &connection->receiver);
+	seq_print_thread_placement(m, &connection->ack_receiver);
+	seq_print_thread_placement(m, &connection->sender);
+	return 0;
+}
+
+/* Takes a cpu list, e.g. "8-11,24"; an empty one removes the explicit mask */
+static ssize_t connection_cpu_placement_write(struct file *file, const char __user *ubuf,
+					      size_t cnt, loff_t *ppos)
+{
+	struct drbd_connection *connection = file_inode(file)->i_private;
+	cpumask_var_t new_cpu_mask;
+	char *buffer;
+	int err;
+
+	if (cnt >= PAGE_SIZE)
+		return -EINVAL;
+	buffer = memdup_user_nul(ubuf, cnt);
+	if (IS_ERR(buffer))
+		return PTR_ERR(buffer);
+
+	err = -ENOMEM;
+	if (zalloc_cpumask_var(&new_cpu_mask, GFP_KERNEL)) {
+		err = cpulist_parse(strim(buffer), new_cpu_mask);
+		if (!err) {
+			spin_lock_irq(&connection->resource->req_lock);
+			cpumask_copy(connection->cpu_mask, new_cpu_mask);
+			spin_unlock_irq(&connection->resource->req_lock);
+			conn_reset_cpu_masks(connection);
+		}
+		free_cpumask_var(new_cpu_mask);
+	}
+	kfree(buffer);
+	if (err)
+		return err;
+
+	*ppos += cnt;
+	return cnt;
+}
+
 static int connection_attr_release(struct inode *inode, struct file *file)
 {
 	struct drbd_connection *connection = inode->i_private;
@@ -867,7 +1020,7 @@ static int connection_attr_release(struct inode *inode, struct file *file)
 	return single_release(inode, file);
 }
 
-#define drbd_debugfs_connection_attr(name)				\
+#define __drbd_debugfs_connection_attr(name, write_fn)			\
 static int connection_ ## name ## _open(struct inode *inode, struct file *file) \
 {									\
 	struct drbd_connection *connection = inode->i_private;		\
@@ -878,15 +1031,18 @@ static int connection_ ## name ## _open(struct inode *inode, struct file *file)
 static const struct file_operations connection_ ## name ## _fops = {	\
 	.owner		= THIS_MODULE,				      	\
 	.open		= connection_ ## name ##_open,			\
+	.write		= write_fn,					\
 	.read		= seq_read,					\
 	.llseek		= seq_lseek,					\
 	.release	= connection_attr_release,			\
 };
+#define drbd_debugfs_connection_attr(name) __drbd_debugfs_connection_attr(name, NULL)
 
 drbd_debugfs_connection_attr(oldest_requests)
 drbd_debugfs_connection_attr(callback_history)
 drbd_debugfs_connection_attr(transport)
 drbd_debugfs_connection_attr(debug)
+__drbd_debugfs_connection_attr(cpu_placement, connection_cpu_placement_write)
 
 void drbd_debugfs_connection_add(struct drbd_connection *connection)
 {
@@ -908,6 +1064,7 @@ void drbd_debugfs_connection_add(struct drbd_connection *connection)
 	conn_dcf(oldest_requests);
 	conn_dcf(transport);
 	conn_dcf(debug);
+	drbd_dcf(connection->debugfs_conn, connection, cpu_placement, 0600);
 
 	idr_for_each_entry(&connection->peer_devices, peer_device, vnr) {
 		if (!peer_device->debugfs_peer_dev)
@@ -917,6 +1074,7 @@ void drbd_debugfs_connection_add(struct drbd_connection *connection)
 
 void drbd_debugfs_connection_cleanup(struct drbd_connection *connection)
 {
+	drbd_debugfs_remove(&connection->debugfs_conn_cpu_placement);
 	drbd_debugfs_remove(&connection->debugfs_conn_debug);
 	drbd_debugfs_remove(&connection->debugfs_conn_transport);
 	drbd_debugfs_remove(&connection->debugfs_conn_callback_history);
@@ -971,9 +1129,10 @@ static int device_act_log_extents_show(struct seq_file *m, void *ignored)
 	struct drbd_device *device = m->private;
 
 	/* BUMP me if you change the file format/content/presentation */
-	seq_printf(m, "v: %u\n\n", 0);
+	seq_printf(m, "v: %u\n\n", 1);
 
 	if (get_ldev_if_state(device, D_FAILED)) {
+		seq_printf(m, "transactions: %u\n\n", device->al_writ_cnt);
 		lc_seq_printf_stats(m, device->act_log);
 		lc_seq_dump_details(m, device->act_log, "", NULL);
 		put_ldev(device);
@@ -1038,6 +1197,61 @@ static int device_md_io_show(struct seq_file *m, void *ignored)
 	return 0;
 }
 
+static int device_flush_show(struct seq_file *m, void *ignored)
+{
+	struct drbd_device *device = m->private;
+	struct drbd_flusher *flusher;
+	u64 requests, issued;
+
+	if (!get_ldev_if_state(device, D_FAILED))
+		return -ENODEV;
+
+	flusher = device->ldev->flusher;
+	spin_lock_irq(&flusher->lock);
+	requests = flusher->requests;
+	issued = flusher->issued;
+	spin_unlock_irq(&flusher->lock);
+
+	/* counters are per backing disk, shared with all volumes on it */
+	seq_printf(m, "disk: %s\n", flusher->disk->disk_name);
+	seq_printf(m, "requests: %llu\nissued: %llu\ncoalesced: %llu\n",
+		   requests, issued, requests - issued);
+	if (issued) {
+		u64 rem, q = div64_u64_rem(requests, issued, &rem);
+
+		seq_printf(m, "ratio: %llu.%02llu\n", q, div64_u64(rem * 100, issued));
+	}
+	put_ldev(device);
+
+	return 0;
+}
+
+static int device_journal_show(struct seq_file *m, void *ignored)
+{
+	struct drbd_device *device = m->private;
+
+	if (!get_ldev_if_state(device, D_FAILED))
+		return -ENODEV;
+	if (device->ldev->journal)
+		drbd_journal_seq_show(m, device->ldev->journal);
+	put_ldev(device);
+
+	return 0;
+}
+
+static int device_write_intent_show(struct seq_file *m, void *ignored)
+{
+	struct drbd_device *device = m->private;
+
+	if (!get_ldev_if_state(device, D_FAILED))
+		return -ENODEV;
+	if (device->ldev->intent)
+		drbd_intent_seq_show(m, device->ldev->intent);
+	put_ldev(device);
+
+	return 0;
+}
+
 static int device_data_gen_id_show(struct seq_file *m, void *ignored)
 {
 	struct drbd_device *device = m->private;
@@ -1214,6 +1428,9 @@ drbd_debugfs_device_attr(io_frozen)
 drbd_debugfs_device_attr(ed_gen_id)
 drbd_debugfs_device_attr(openers)
 drbd_debugfs_device_attr(md_io)
+drbd_debugfs_device_attr(flush)
+drbd_debugfs_device_attr(journal)
+drbd_debugfs_device_attr(write_intent)
 #ifdef CONFIG_DRBD_TIMING_STATS
 __drbd_debugfs_device_attr(req_timing, device_req_timing_write)
 #endif
@@ -1253,6 +1470,9 @@ void drbd_debugfs_device_add(struct drbd_device *device)
 	vol_dcf(ed_gen_id);
 	vol_dcf(openers);
 	vol_dcf(md_io);
+	vol_dcf(flush);
+	vol_dcf(journal);
+	vol_dcf(write_intent);
 #ifdef CONFIG_DRBD_TIMING_STATS
 	drbd_dcf(device->debugfs_vol, device, req_timing, 0600);
 #endif
@@ -1281,6 +1501,9 @@ void drbd_debugfs_device_cleanup(struct drbd_device *device)
 	drbd_debugfs_remove(&device->debugfs_vol_ed_gen_id);
 	drbd_debugfs_remove(&device->debugfs_vol_openers);
 	drbd_debugfs_remove(&device->debugfs_vol_md_io);
+	drbd_debugfs_remove(&device->debugfs_vol_flush);
+	drbd_debugfs_remove(&device->debugfs_vol_journal);
+	drbd_debugfs_remove(&device->debugfs_vol_write_intent);
 #ifdef CONFIG_DRBD_TIMING_STATS
 	drbd_debugfs_remove(&device->debugfs_vol_req_timing);
 #endif
@@ -1331,11 +1554,28 @@ static void resync_dump_detail(struct seq_file *m, struct lc_element *e)
 {
        struct bm_extent *bme = lc_entry(e, struct bm_extent, lce);
 
-       seq_printf(m, "%5d %s %s %s", bme->rs_left,
-		  test_bit(BME_NO_WRITES, &bme->flags) ? "NO_WRITES" : "---------",
-		  test_bit(BME_LOCKED, &bme->flags) ? "LOCKED" : "------",
-		  test_bit(BME_PRIORITY, &bme->flags) ? "PRIORITY" : "--------"
-		  );
+       seq_printf(m, "%5d %5d", bme->rs_left, bme->rs_failed);
+}
+
+static void resync_requests_dump(struct seq_file *m, struct drbd_peer_device *peer_device)
+{
+	struct drbd_device *device = peer_device->device;
+	struct rb_node *node;
+
+	seq_puts(m, "\nresync requests\n\tsector\tsize\tflags\n");
+	spin_lock_irq(&device->al_lock);
+	for (node = rb_first(&device->resync_requests); node; node = rb_next(node)) {
+		struct drbd_rs_interval *rsi = rb_entry(node, struct drbd_rs_interval, i.rb);
+
+		if (rsi->peer_device != peer_device)
+			continue;
+		seq_printf(m, "\t%llu\t%u\t%s %s\n",
+			   (unsigned long long)rsi->i.sector, rsi->i.size,
+			   test_bit(RSI_LOCKED, &rsi->flags) ? "LOCKED" :
+			   rsi == peer_device->resync_waiting ? "WAITING" : "------",
+			   test_bit(RSI_PRIORITY, &rsi->flags) ? "PRIORITY" : "--------");
+	}
+	spin_unlock_irq(&device->al_lock);
 }
 
 static int peer_device_resync_extents_show(struct seq_file *m, void *ignored)
@@ -1344,13 +1584,14 @@ static int peer_device_resync_extents_show(struct seq_file *m, void *ignored)
 	struct drbd_device *device = peer_device->device;
 
 	/* BUMP me if you change the file format/content/presentation */
-	seq_printf(m, "v: %u\n\n", 0);
+	seq_printf(m, "v: %u\n\n", 1);
 
 	if (get_ldev_if_state(device, D_FAILED)) {
 		lc_seq_printf_stats(m, peer_device->resync_lru);
-		lc_seq_dump_details(m, peer_device->resync_lru, "rs_left flags", resync_dump_detail);
+		lc_seq_dump_details(m, peer_device->resync_lru, "rs_left rs_failed", resync_dump_detail);
 		put_ldev(device);
 	}
+	resync_requests_dump(m, peer_device);
 	return 0;
 }
 
@@ -1645,8 +1886,23 @@ static const struct file_operations peer_device_ ## name ## _fops = {		\
 	.release	= peer_device_ ## name ## _release,			\
 };
 
+static int peer_device_resync_zero_show(struct seq_file *m, void *ignored)
+{
+	struct drbd_peer_device *peer_device = m->private;
+
+	/* BUMP me if you change the file format/content/presentation */
+	seq_printf(m, "v: %u\n\n", 0);
+
+	seq_printf(m, "deallocated_replies: %llu\n",
+		   (unsigned long long)peer_device->rs_zero_replies_total);
+	seq_printf(m, "bytes_saved: %llu\n",
+		   (unsigned long long)peer_device->rs_zero_sectors_total << 9);
+	return 0;
+}
+
 drbd_debugfs_peer_device_attr(resync_extents)
 drbd_debugfs_peer_device_attr(proc_drbd)
+drbd_debugfs_peer_device_attr(resync_zero)
 
 void drbd_debugfs_peer_device_add(struct drbd_peer_device *peer_device)
 {
@@ -1661,10 +1917,12 @@ void drbd_debugfs_peer_device_add(struct drbd_peer_device *peer_device)
 	/* debugfs create file */
 	peer_dev_dcf(resync_extents);
 	peer_dev_dcf(proc_drbd);
+	peer_dev_dcf(resync_zero);
 }
 
 void drbd_debugfs_peer_device_cleanup(struct drbd_peer_device *peer_device)
 {
+	drbd_debugfs_remove(&peer_device->debugfs_peer_dev_resync_zero);
 	drbd_debugfs_remove(&peer_device->debugfs_peer_dev_proc_drbd);
 	drbd_debugfs_remove(&peer_device->debugfs_peer_dev_resync_extents);
 	drbd_debugfs_remove(&peer_device->debugfs_peer_dev);
@@ -1714,6 +1972,89 @@ static const struct file_operations drbd_refcounts_fops = {
 	.release = single_release,
 };
 
+static const char * const device_rate_names[DRBD_RATE_COUNTERS] = {
+	[DEV_RATE_READ_IOS] = "read_ios",
+	[DEV_RATE_READ_SECT] = "read_kib",
+	[DEV_RATE_WRITE_IOS] = "write_ios",
+	[DEV_RATE_WRITE_SECT] = "write_kib",
+	[DEV_RATE_AL_WRITES] = "al_writes",
+};
+
+static const char * const peer_device_rate_names[DRBD_RATE_COUNTERS] = {
+	[PEER_RATE_SEND_SECT] = "send_kib",
+	[PEER_RATE_RECV_SECT] = "recv_kib",
+	[PEER_RATE_ACKS] = "acks",
+	[PEER_RATE_RS_IN_SECT] = "resync_in_kib",
+	[PEER_RATE_RS_OUT_SECT] = "resync_out_kib",
+};
+
+/* Newest sample first, the counters in @sectors (a bit mask) in KiB */
+static void seq_print_rate_ring(struct seq_file *m, struct drbd_rate_ring *ring,
+				const char * const names[DRBD_RATE_COUNTERS], unsigned int sectors)
+{
+	unsigned int i, n, nr1, nr10, ticks;
+
+	spin_lock_bh(&ring->lock);
+	ticks = ring->ticks;
+	nr1 = min_t(unsigned int, ticks, DRBD_RATE_SLOTS);
+	nr10 = min_t(unsigned int, ticks / 10, DRBD_RATE_SLOTS);
+	seq_printf(m, " age: %ums\n", jiffies_to_msecs(jiffies - ring->stamp));
+	for (i = 0; i < DRBD_RATE_COUNTERS; i++) {
+		unsigned int shift = sectors & (1 << i) ? 1 : 0;
+
+		seq_printf(m, " 1s %s:", names[i]);
+		for (n = 0; n < nr1; n++)
+			seq_printf(m, " %u", ring->s1[(ticks - 1 - n) % DRBD_RATE_SLOTS][i] >> shift);
+		seq_printf(m, "\n 10s %s:", names[i]);
+		for (n = 0; n < nr10; n++)
+			seq_printf(m, " %u", ring->s10[(ticks / 10 - 1 - n) % DRBD_RATE_SLOTS][i] >> shift);
+		seq_putc(m, '\n');
+	}
+	spin_unlock_bh(&ring->lock);
+}
+
+static int drbd_rates_show(struct seq_file *m, void *ignored)
+{
+	struct drbd_resource *resource;
+	struct drbd_peer_device *peer_device;
+	struct drbd_device *device;
+	int vnr;
+
+	/* BUMP me if you change the file format/content/presentation */
+	seq_printf(m, "v: %u\n\n", 0);
+
+	rcu_read_lock();
+	for_each_resource_rcu(resource, &drbd_resources) {
+		idr_for_each_entry(&resource->devices, device, vnr) {
+			seq_printf(m, "%s/%d minor %u\n", resource->name, vnr, device->minor);
+			seq_print_rate_ring(m, &device->rates, device_rate_names,
+					    1 << DEV_RATE_READ_SECT | 1 << DEV_RATE_WRITE_SECT);
+			for_each_peer_device_rcu(peer_device, device) {
+				seq_printf(m, "%s/%d peer %d\n", resource->name, vnr,
+					   peer_device->node_id);
+				seq_print_rate_ring(m, &peer_device->rates, peer_device_rate_names,
+						    1 << PEER_RATE_SEND_SECT | 1 << PEER_RATE_RECV_SECT |
+						    1 << PEER_RATE_RS_IN_SECT | 1 << PEER_RATE_RS_OUT_SECT);
+			}
+		}
+	}
+	rcu_read_unlock();
+	return 0;
+}
+
+static int drbd_rates_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, drbd_rates_show, NULL);
+}
+
+static const struct file_operations drbd_rates_fops = {
+	.owner = THIS_MODULE,
+	.open = drbd_rates_open,
+	.llseek = seq_lseek,
+	.read = seq_read,
+	.release = single_release,
+};
+
 static int drbd_compat_show(struct seq_file *m, void *ignored)
 {
 	return 0;
@@ -1736,6 +2077,7 @@ static const struct file_operations drbd_compat_fops = {
  * from the module-load-failure path as well. */
 void drbd_debugfs_cleanup(void)
 {
+	drbd_debugfs_remove(&drbd_debugfs_rates);
 	drbd_debugfs_remove(&drbd_debugfs_compat);
 	drbd_debugfs_remove(&drbd_debugfs_resources);
 	drbd_debugfs_remove(&drbd_debugfs_minors);
@@ -1765,4 +2107,7 @@ void __init drbd_debugfs_init(void)
 
 	dentry = debugfs_create_file("compat", 0444, drbd_debugfs_root, NULL, &drbd_compat_fops);
 	drbd_debugfs_compat = dentry;
+
+	dentry = debugfs_create_file("rates", 0444, drbd_debugfs_root, NULL, &drbd_rates_fops);
+	drbd_debugfs_rates = dentry;
 }
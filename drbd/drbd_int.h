@@ -21,6 +21,7 @@
 #include <linux/list.h>
 #include <linux/sched.h>
 #include <linux/sched/signal.h>
+#include <linux/hrtimer.h>
 #include <linux/bitops.h>
 #include <linux/slab.h>
 #include <linux/ratelimit.h>
@@ -60,6 +61,12 @@
 /* module parameter, defined in drbd_main.c */
 extern unsigned int drbd_minor_count;
 extern unsigned int drbd_protocol_version_min;
+extern bool drbd_resync_zero_detect;
+extern bool drbd_shared_ack_sender;
+extern bool drbd_async_integrity;
+extern bool drbd_buffered_control_recv;
+extern bool drbd_buffered_data_recv;
+extern unsigned int drbd_send_batch_usecs;
 
 #ifdef CONFIG_DRBD_FAULT_INJECTION
 extern int drbd_enable_faults;
@@ -93,6 +100,10 @@ enum {
 
 struct drbd_device;
 struct drbd_connection;
+struct drbd_journal;
+struct drbd_journal_entry;
+struct drbd_intent;
+struct peer_req_verify;
 
 /* I want to be able to grep for "drbd $resource_name"
  * and get all relevant log lines. */
@@ -162,6 +173,18 @@ struct bm_xfer_ctx {
 
 extern void INFO_bm_xfer_stats(struct drbd_peer_device *, const char *, struct bm_xfer_ctx *);
 
+/* While RLE encoding or decoding the bitmap, runs are looked for (or
+ * assembled) a few 64 bit words at a time in a copy of the bitmap slot,
+ * instead of going through the bitmap accessors once per run.  */
+#define BM_RLE_WINDOW_WORDS	16
+#define BM_RLE_WINDOW_BITS	(BM_RLE_WINDOW_WORDS * 64)
+
+struct bm_rle_window {
+	unsigned long start;	/* first bit covered, 64 bit aligned */
+	unsigned long end;	/* first bit no longer covered */
+	__le64 words[BM_RLE_WINDOW_WORDS];
+};
+
 static inline void bm_xfer_ctx_bit_to_word_offset(struct bm_xfer_ctx *c)
 {
 	/* word_offset counts "native long words" (32 or 64 bit),
@@ -191,6 +214,14 @@ enum drbd_thread_state {
 	RESTARTING
 };
 
+/* How drbd_thread_current_set_cpu() places a thread */
+enum drbd_cpu_policy {
+	CPU_POLICY_RESOURCE,	/* resource->cpu_mask, shared by all threads of a resource */
+	CPU_POLICY_SPREAD,	/* the least used CPU, chosen per thread */
+	CPU_POLICY_NUMA,	/* the CPUs of the NIC's or the backing device's node */
+	CPU_POLICY_EXPLICIT,	/* connection->cpu_mask */
+};
+
 struct drbd_thread {
 	spinlock_t t_lock;
 	struct task_struct *task;
@@ -200,6 +231,9 @@ struct drbd_thread {
 	struct drbd_resource *resource;
 	struct drbd_connection *connection;
 	int reset_cpu_mask;
+	enum drbd_cpu_policy placement;	/* how the current cpu mask was chosen */
+	int numa_node;			/* node followed, or NUMA_NO_NODE */
+	int cpu;			/* CPU picked for CPU_POLICY_SPREAD, or -1 */
 	const char *name;
 };
 
@@ -262,6 +296,7 @@ struct drbd_request {
 	struct bio *private_bio;
 
 	struct drbd_interval i;
+	struct drbd_interval active_write;	/* in device->active_writes */
 
 	/* epoch: used to check on "completion" whether this req was in
 	 * the current epoch, and we therefore have to close it,
@@ -393,7 +428,10 @@ struct drbd_peer_request {
 	unsigned int opf; /* to be used as bi_opf */
 	atomic_t pending_bios;
 	struct drbd_interval i;
+	struct drbd_interval active_write;	/* in device->active_writes */
 	unsigned long flags;	/* see comments on ee flag bits below */
+	struct drbd_journal_entry *journal; /* writes only, see drbd_journal.c */
+	struct peer_req_verify *verify;	/* integrity check still pending */
 	union {
 		struct { /* regular peer_request */
 			struct drbd_epoch *epoch; /* for writes */
@@ -419,7 +457,7 @@ struct drbd_peer_request {
 
 /* ee flag bits.
  * While corresponding bios are in flight, the only modification will be
- * set_bit WAS_ERROR, which has to be atomic.
+ * set_bit WAS_ERROR or JOURNAL_ACKED, which has to be atomic.
  * If no bios are in flight yet, or all have been completed,
  * non-atomic modification to ee->flags is ok.
  */
@@ -484,6 +522,9 @@ enum {
 
 	/* Hold reference in activity log */
 	__EE_IN_ACTLOG,
+
+	/* P_WRITE_ACK was sent once the write was durable in the journal */
+	__EE_JOURNAL_ACKED,
 };
 #define EE_MAY_SET_IN_SYNC     (1<<__EE_MAY_SET_IN_SYNC)
 #define EE_SET_OUT_OF_SYNC     (1<<__EE_SET_OUT_OF_SYNC)
@@ -502,6 +543,7 @@ enum {
 #define EE_APPLICATION		(1<<__EE_APPLICATION)
 #define EE_RS_THIN_REQ		(1<<__EE_RS_THIN_REQ)
 #define EE_IN_ACTLOG		(1<<__EE_IN_ACTLOG)
+#define EE_JOURNAL_ACKED	(1<<__EE_JOURNAL_ACKED)
 
 /* flag bits per device */
 enum device_flag {
@@ -580,6 +622,10 @@ enum peer_device_flag {
 #define AL_UPDATES_PER_TRANSACTION	 64	// arbitrary
 #define AL_CONTEXT_PER_TRANSACTION	919	// (4096 - 36 - 6*64)/4
 
+/* One activity log extent represents 4M of storage */
+#define AL_EXTENT_SHIFT 22
+#define AL_EXTENT_SIZE (1<<AL_EXTENT_SHIFT)
+
 /* definition of bits in bm_flags to be used in drbd_bm_lock
  * and drbd_bitmap_io and friends. */
 enum bm_flag {
@@ -611,7 +657,7 @@ struct drbd_bitmap {
 	};
 	spinlock_t bm_lock;
 
-	unsigned long bm_set[DRBD_PEERS_MAX]; /* number of bits set */
+	unsigned long bm_set[DRBD_PEERS_MAX]; /* number of bits set, per slot */
 	unsigned long bm_bits;  /* bits per peer */
 	size_t   bm_words; /* platform specitif word size; not 32bit!! */
 	size_t   bm_number_of_pages;
@@ -623,10 +669,32 @@ struct drbd_bitmap {
 	enum bm_flag bm_flags;
 	unsigned int bm_max_peers;
 
+	/* In core, only bitmap indices that are assigned in the meta data get
+	 * a slot of their own.  The vacant ones all track the same writes
+	 * since day 0, and share a single slot.  The in-core bitmap is
+	 * interleaved by bm_slots; on disk it is always interleaved by
+	 * bm_max_peers, and bm_rw() translates if the two differ. */
+	unsigned int bm_slots;
+	u8 bm_slot[DRBD_PEERS_MAX];	/* bitmap index -> in-core slot */
+	unsigned long bm_vacant;	/* bitmap indices sharing a slot */
+	bool bm_translate;
+	struct rw_semaphore bm_io_sem;	/* bitmap IO vs. changing the slots */
+
+	/* Summary for drbd_bm_count_union_bits(): per 4 MiB of storage, the
+	 * number of bits set in the slots of the bitmap indices that are
+	 * assigned to a peer (MDF_HAVE_BITMAP).  Kept up to date by every
+	 * set and clear operation.  It may transiently be too high, never
+	 * too low.  Only chunks below bm_union_valid are counted; the others
+	 * are being recounted, after bm_union_slots changed. */
+	u16 *bm_union;
+	unsigned long bm_union_peers;	/* bitmap indices */
+	unsigned long bm_union_slots;	/* their in-core slots */
+	unsigned long bm_union_valid;	/* chunks */
+
 	/* exclusively to be used by __al_write_transaction(),
 	 * and drbd_bm_write_hinted() -> bm_rw() called from there.
-	 * One activity log extent represents 4MB of storage, which are 1024
-	 * bits (at 4k per bit), times at most DRBD_PEERS_MAX (currently 32).
+	 * One activity log extent of 4MB of storage are 1024 bits (at 4k per
+	 * bit), times at most DRBD_PEERS_MAX (currently 32).
 	 * The bitmap is created interleaved, with a potentially odd number
 	 * of peer slots determined at create-md time.  Which means that one
 	 * AL-extent may be associated with one or two bitmap pages.
@@ -680,9 +748,33 @@ struct drbd_md {
 	u32 al_size_4k; /* cached product of the above */
 };
 
+/* One per backing disk, shared by all drbd volumes (of any resource)
+ * that sit on that disk, see drbd_flush_after_epoch().
+ * Flushes are numbered; "issued" is the sequence number of the last flush
+ * submitted, "done" the one of the last flush completed.  There is at most
+ * one flush in flight, so flushes complete in order. */
+struct drbd_flusher {
+	struct list_head list;		/* drbd_flushers, under drbd_flushers_mutex */
+	struct kref kref;
+	struct gendisk *disk;
+
+	spinlock_t lock;
+	wait_queue_head_t wait;
+	bool in_flight;
+	u64 issued;
+	u64 done;
+	u64 error_seq;			/* last flush that failed */
+	struct drbd_device *issuer;	/* of the flush in flight */
+
+	u64 requests;			/* flush requests, coalesced or not */
+};
+
 struct drbd_backing_dev {
 	struct block_device *backing_bdev;
 	struct block_device *md_bdev;
+	struct drbd_flusher *flusher;
+	struct drbd_journal *journal;	/* optional, see drbd_journal.c */
+	struct drbd_intent *intent;	/* optional, see drbd_intent.c */
 	struct drbd_md md;
 	struct disk_conf *disk_conf; /* RCU, for updates: resource->conf_update */
 	sector_t known_size; /* last known size of that backing device */
@@ -808,6 +900,37 @@ struct drbd_thread_timing_details
 };
 #define DRBD_THREAD_DETAILS_HIST	16
 
+/* Per second and per 10 second deltas of a few monotonic counters of a
+ * device or peer device.  Sampled by the rate_timer of the resource. */
+#define DRBD_RATE_COUNTERS	5
+#define DRBD_RATE_SLOTS		60
+
+enum drbd_device_rate {
+	DEV_RATE_READ_IOS,
+	DEV_RATE_READ_SECT,
+	DEV_RATE_WRITE_IOS,
+	DEV_RATE_WRITE_SECT,
+	DEV_RATE_AL_WRITES,
+};
+
+enum drbd_peer_device_rate {
+	PEER_RATE_SEND_SECT,
+	PEER_RATE_RECV_SECT,
+	PEER_RATE_ACKS,
+	PEER_RATE_RS_IN_SECT,
+	PEER_RATE_RS_OUT_SECT,
+};
+
+struct drbd_rate_ring {
+	spinlock_t lock;
+	unsigned long stamp;	/* jiffies of the newest sample */
+	unsigned int ticks;	/* number of 1s samples taken */
+	unsigned int last[DRBD_RATE_COUNTERS];
+	unsigned int acc[DRBD_RATE_COUNTERS];	/* sum of the current 10s period */
+	unsigned int s1[DRBD_RATE_SLOTS][DRBD_RATE_COUNTERS];
+	unsigned int s10[DRBD_RATE_SLOTS][DRBD_RATE_COUNTERS];
+};
+
 struct drbd_send_buffer {
 	struct page *page;  /* current buffer page for sending data */
 	char *unsent;  /* start of unsent area != pos if corked... */
@@ -825,6 +948,8 @@ struct drbd_resource {
 	struct dentry *debugfs_res_connections;
 	struct dentry *debugfs_res_in_flight_summary;
 	struct dentry *debugfs_res_state_twopc;
+	struct dentry *debugfs_res_cpu_placement;
+	struct dentry *debugfs_res_overhead;
 #endif
 	struct kref kref;
 	struct kref_debug_info kref_debug;
@@ -895,6 +1020,7 @@ struct drbd_resource {
 
 	struct timer_list peer_ack_timer; /* send a P_PEER_ACK after last completion */
 	struct timer_list repost_up_to_date_timer;
+	struct timer_list rate_timer; /* samples the rate rings once per second */
 
 	unsigned int w_cb_nr; /* keeps counting up */
 	struct drbd_thread_timing_details w_timing_details[DRBD_THREAD_DETAILS_HIST];
@@ -902,6 +1028,12 @@ struct drbd_resource {
 	struct rcu_head rcu;
 };
 
+/* An ahash request kept for the next digest, see drbd_csum_pages() */
+struct drbd_ahash_req {
+	struct ahash_request *req;
+	unsigned int size;	/* allocated, with the context of the tfm */
+};
+
 struct drbd_connection {
 	struct list_head connections;
 	struct drbd_resource *resource;
@@ -911,6 +1043,7 @@ struct drbd_connection {
 	struct dentry *debugfs_conn_oldest_requests;
 	struct dentry *debugfs_conn_transport;
 	struct dentry *debugfs_conn_debug;
+	struct dentry *debugfs_conn_cpu_placement;
 #endif
 	struct kref kref;
 	struct kref_debug_info kref_debug;
@@ -945,13 +1078,17 @@ struct drbd_connection {
 	struct timer_list connect_timer;
 
 	struct crypto_shash *cram_hmac_tfm;
-	struct crypto_shash *integrity_tfm;  /* checksums we compute, updates protected by connection->mutex[DATA_STREAM] */
-	struct crypto_shash *peer_integrity_tfm;  /* checksums we verify, only accessed from receiver thread  */
-	struct crypto_shash *csums_tfm;
-	struct crypto_shash *verify_tfm;
+	struct crypto_ahash *integrity_tfm;  /* checksums we compute, updates protected by connection->mutex[DATA_STREAM] */
+	struct crypto_ahash *peer_integrity_tfm;  /* checksums we verify, set by the receiver thread; used on drbd_verify_wq */
+	struct crypto_ahash *csums_tfm;
+	struct crypto_ahash *verify_tfm;
 
 	void *int_dig_in;
 	void *int_dig_vv;
+	atomic_t verify_cnt;	/* integrity checks queued on drbd_verify_wq */
+	struct drbd_ahash_req integrity_req;	/* under mutex[DATA_STREAM] */
+	struct drbd_ahash_req receiver_req;	/* peer_integrity_tfm, on the receiver */
+	struct drbd_ahash_req sender_req;	/* csums_tfm and verify_tfm, on the sender */
 
 	/* receiver side */
 	struct drbd_epoch *current_epoch;
@@ -964,7 +1101,12 @@ struct drbd_connection {
 	struct drbd_thread receiver;
 	struct drbd_thread sender;
 	struct drbd_thread ack_receiver;
-	struct workqueue_struct *ack_sender;
+	cpumask_var_t cpu_mask;	/* explicit placement of the threads above, empty if none;
+				 * under resource->req_lock */
+	struct drbd_ack_batch *ack_batch; /* only accessed from ack_receiver thread */
+	struct drbd_recv_buf *recv_buf[2]; /* per stream, only accessed by the thread reading it */
+	struct workqueue_struct *ack_sender;	/* own, or drbd_ack_sender_wq */
+	struct mutex ack_sender_mutex;	/* serializes peer_ack_work and send_acks_work */
 	struct work_struct peer_ack_work;
 
 	struct list_head peer_requests; /* All peer requests in the order we received them.. */
@@ -976,6 +1118,7 @@ struct drbd_connection {
 	struct list_head read_ee;   /* [RS]P_DATA_REQUEST being read */
 	struct list_head net_ee;    /* zero-copy network send in progress */
 	struct list_head done_ee;   /* need to send P_WRITE_ACK */
+	struct list_head journal_acks; /* P_WRITE_ACK to send early, see drbd_journal.c */
 	atomic_t done_ee_cnt;
 	struct work_struct send_acks_work;
 	wait_queue_head_t ee_wait;
@@ -1056,6 +1199,15 @@ struct drbd_connection {
 
 		/* position in change stream */
 		u64 current_dagtag_sector;
+
+		/* while the sender has more to do, its small packets on the
+		 * data stream are collected in the send buffer, see
+		 * drbd_send_batch_begin().  0 if not batching. */
+		u64 batch_start_ns;
+		struct hrtimer batch_timer;	/* ends a batch the sender is stuck in */
+		struct work_struct batch_flush_work;
+		unsigned long batched_cmds;
+		unsigned long batch_flushes;
 	} send;
 
 	unsigned int peer_node_id;
@@ -1087,6 +1239,10 @@ struct drbd_peer_device {
 	enum drbd_repl_state negotiation_result; /* To find disk state after attach */
 	unsigned int send_cnt;
 	unsigned int recv_cnt;
+	unsigned int ack_cnt;		/* block acks received */
+	atomic_t rs_recv_cnt;		/* resync sectors received */
+	unsigned int rs_send_cnt;	/* resync sectors sent */
+	struct drbd_rate_ring rates;
 	atomic_t packet_seq;
 	unsigned int peer_seq;
 	spinlock_t peer_seq_lock;
@@ -1107,12 +1263,11 @@ struct drbd_peer_device {
 	struct timer_list resync_timer;
 	struct drbd_work propagate_uuids_work;
 
-	/* Used to track operations of resync... */
+	/* Caches the out-of-sync bit count of 128MiB bitmap extents... */
 	struct lru_cache *resync_lru;
-	/* Number of locked elements in resync LRU */
-	unsigned int resync_locked;
-	/* resync extent number waiting for application requests */
-	unsigned int resync_wenr;
+	/* resync request reserved in device->resync_requests,
+	 * waiting for application writes to drain */
+	struct drbd_rs_interval *resync_waiting;
 	enum drbd_disk_state resync_finished_pdsk; /* Finished while starting resync */
 	int resync_again; /* decided to resync again while resync running */
 	unsigned long resync_next_bit; /* bitmap bit to search from for next resync request */
@@ -1134,6 +1289,11 @@ struct drbd_peer_device {
 	unsigned long rs_paused;
 	/* skipped because csum was equal [unit BM_BLOCK_SIZE] */
 	unsigned long rs_same_csum;
+	/* answered with P_RS_DEALLOCATED, data was all zero [unit sectors] */
+	unsigned long rs_zero_sectors;
+	/* same, but never reset; for debugfs [unit sectors] */
+	u64 rs_zero_sectors_total;
+	u64 rs_zero_replies_total;
 #define DRBD_SYNC_MARKS 8
 #define DRBD_SYNC_MARK_STEP (3*HZ)
 	/* block not up-to-date at mark [unit BM_BLOCK_SIZE] */
@@ -1185,6 +1345,7 @@ struct drbd_peer_device {
 	struct dentry *debugfs_peer_dev;
 	struct dentry *debugfs_peer_dev_resync_extents;
 	struct dentry *debugfs_peer_dev_proc_drbd;
+	struct dentry *debugfs_peer_dev_resync_zero;
 #endif
 	ktime_t pre_send_kt;
 	ktime_t acked_kt;
@@ -1233,6 +1394,9 @@ struct drbd_device {
 	struct dentry *debugfs_vol_ed_gen_id;
 	struct dentry *debugfs_vol_openers;
 	struct dentry *debugfs_vol_md_io;
+	struct dentry *debugfs_vol_flush;
+	struct dentry *debugfs_vol_journal;
+	struct dentry *debugfs_vol_write_intent;
 #ifdef CONFIG_DRBD_TIMING_STATS
 	struct dentry *debugfs_vol_req_timing;
 #endif
@@ -1268,8 +1432,11 @@ struct drbd_device {
 	wait_queue_head_t misc_wait;
 	unsigned int read_cnt;
 	unsigned int writ_cnt;
+	unsigned int read_ios;
+	unsigned int writ_ios;
 	unsigned int al_writ_cnt;
 	unsigned int bm_writ_cnt;
+	struct drbd_rate_ring rates;
 	atomic_t ap_bio_cnt[2];	 /* Requests we need to complete. [READ] and [WRITE] */
 	atomic_t local_cnt;	 /* Waiting for local completion */
 	atomic_t ap_actlog_cnt;  /* Requests waiting for activity log */
@@ -1283,6 +1450,8 @@ struct drbd_device {
 	/* Interval trees of pending local requests */
 	struct rb_root read_requests;
 	struct rb_root write_requests;
+	/* Resync requests in flight, protected by al_lock */
+	struct rb_root resync_requests;
 
 	/* for statistics and timeouts */
 	/* [0] read, [1] write */
@@ -1300,6 +1469,10 @@ struct drbd_device {
 	spinlock_t al_lock;
 	wait_queue_head_t al_wait;
 	struct lru_cache *act_log;	/* activity log */
+	/* application writes holding activity log references, by range;
+	 * resync requests wait for those overlapping their own range only */
+	struct rb_root active_writes;
+	atomic_t active_writes_rcu;	/* the ones from the lockless fast path */
 	unsigned al_histogram[AL_UPDATES_PER_TRANSACTION+1];
 	unsigned int al_tr_number;
 	int al_tr_cycle;
@@ -1352,6 +1525,7 @@ struct drbd_bm_aio_ctx {
 #define BM_AIO_WRITE_ALL_PAGES	4
 #define BM_AIO_READ	        8
 #define BM_AIO_WRITE_LAZY      16
+#define BM_AIO_TRANSLATE       32
 	int error;
 	struct kref kref;
 };
@@ -1474,6 +1648,10 @@ extern void drbd_thread_current_set_cpu(struct drbd_thread *thi);
 #else
 #define drbd_thread_current_set_cpu(A) ({})
 #endif
+extern void conn_reset_cpu_masks(struct drbd_connection *connection);
+extern void drbd_reset_cpu_masks(struct drbd_resource *resource);
+extern const char *drbd_cpu_policy_name(enum drbd_cpu_policy policy);
+extern void drbd_rate_ring_init(struct drbd_rate_ring *ring);
 extern void tl_release(struct drbd_connection *,
 			uint64_t o_block_id,
 			uint64_t y_block_id,
@@ -1569,6 +1747,8 @@ extern bool drbd_device_stable(struct drbd_device *device, u64 *authoritative);
 extern void drbd_flush_peer_acks(struct drbd_resource *resource);
 extern void drbd_cork(struct drbd_connection *connection, enum drbd_stream stream);
 extern void drbd_uncork(struct drbd_connection *connection, enum drbd_stream stream);
+extern void drbd_send_batch_begin(struct drbd_connection *connection);
+extern void drbd_send_batch_end(struct drbd_connection *connection);
 extern void drbd_open_counts(struct drbd_resource *resource, int *rw_count_ptr, int *ro_count_ptr);
 
 extern struct drbd_connection *
@@ -1612,10 +1792,6 @@ extern sector_t drbd_get_max_capacity(
  *  but is about to become configurable.
  */
 
-/* One activity log extent represents 4M of storage */
-#define AL_EXTENT_SHIFT 22
-#define AL_EXTENT_SIZE (1<<AL_EXTENT_SHIFT)
-
 /* drbd_bitmap.c */
 /*
  * We need to store one bit for a block.
@@ -1663,10 +1839,6 @@ extern sector_t drbd_get_max_capacity(
 
 #define BM_BLOCKS_PER_BM_EXT_MASK  (BM_BITS_PER_EXT - 1)
 
-
-/* in one sector of the bitmap, we have this many activity_log extents. */
-#define AL_EXT_PER_BM_SECT  (1 << (BM_EXT_SHIFT - AL_EXTENT_SHIFT))
-
 /* Indexed external meta data has a fixed on-disk size of 128MiB, of which
  * 4KiB are our "superblock", and 32KiB are the fixed size activity
  * log, leaving this many sectors for the bitmap.
@@ -1708,11 +1880,22 @@ extern sector_t drbd_get_max_capacity(
 #define DRBD_MAX_BATCH_BIO_SIZE	 (AL_UPDATES_PER_TRANSACTION/2*AL_EXTENT_SIZE)
 #define DRBD_MAX_BBIO_SECTORS    (DRBD_MAX_BATCH_BIO_SIZE >> 9)
 
+/* first and last activity log extent touched by this interval */
+static inline void interval_to_al_range(struct drbd_interval *i,
+					unsigned int *first, unsigned int *last)
+{
+	const unsigned int shift = AL_EXTENT_SHIFT - 9;
+
+	*first = i->sector >> shift;
+	*last = i->size == 0 ? *first : (i->sector + (i->size >> 9) - 1) >> shift;
+}
+
 /* how many activity log extents are touched by this interval? */
 static inline int interval_to_al_extents(struct drbd_interval *i)
 {
-	unsigned int first = i->sector >> (AL_EXTENT_SHIFT-9);
-	unsigned int last = i->size == 0 ? first : (i->sector + (i->size >> 9) - 1) >> (AL_EXTENT_SHIFT-9);
+	unsigned int first, last;
+
+	interval_to_al_range(i, &first, &last);
 	return 1 + last - first; /* worst case: all touched extends are cold. */
 }
 
@@ -1725,6 +1908,7 @@ extern void drbd_bm_clear_all(struct drbd_device *device);
 extern unsigned int drbd_bm_set_bits(struct drbd_device *, unsigned int, unsigned long, unsigned long);
 extern unsigned int drbd_bm_clear_bits(struct drbd_device *, unsigned int, unsigned long, unsigned long);
 extern int drbd_bm_count_bits(struct drbd_device *, unsigned int, unsigned long, unsigned long);
+extern int drbd_bm_count_union_bits(struct drbd_device *, unsigned long, unsigned long);
 /* bm_set_bits variant for use while holding drbd_bm_lock,
  * may process the whole bitmap in one go */
 extern void drbd_bm_set_many_bits(struct drbd_peer_device *, unsigned long, unsigned long);
@@ -1757,12 +1941,19 @@ extern void drbd_bm_merge_lel(struct drbd_peer_device *peer_device, size_t offse
 /* for _drbd_send_bitmap */
 extern void drbd_bm_get_lel(struct drbd_peer_device *peer_device, size_t offset,
 		size_t number, unsigned long *buffer);
+/* drbd_bm_get_lel variant for use while you hold drbd_bm_lock() */
+extern void _drbd_bm_get_lel(struct drbd_peer_device *peer_device, size_t offset,
+		size_t number, unsigned long *buffer);
 
 extern void drbd_bm_lock(struct drbd_device *device, char *why, enum bm_flag flags);
 extern void drbd_bm_unlock(struct drbd_device *device);
 extern void drbd_bm_slot_lock(struct drbd_peer_device *peer_device, char *why, enum bm_flag flags);
 extern void drbd_bm_slot_unlock(struct drbd_peer_device *peer_device);
 extern void drbd_bm_copy_slot(struct drbd_device *device, unsigned int from_index, unsigned int to_index);
+extern void drbd_bm_init_slots(struct drbd_device *device) __must_hold(local);
+extern int drbd_bm_add_slot(struct drbd_device *device, unsigned int bitmap_index);
+extern void drbd_bm_free_slot(struct drbd_device *device, unsigned int bitmap_index, int from_index);
+extern void drbd_bm_update_union(struct drbd_device *device) __must_hold(local);
 /* drbd_main.c */
 
 extern struct kmem_cache *drbd_request_cache;
@@ -1771,6 +1962,8 @@ extern struct kmem_cache *drbd_bm_ext_cache;	/* bitmap extents */
 extern struct kmem_cache *drbd_al_ext_cache;	/* activity log extents */
 extern mempool_t drbd_request_mempool;
 extern mempool_t drbd_ee_mempool;
+extern struct workqueue_struct *drbd_ack_sender_wq; /* shared by all connections */
+extern struct workqueue_struct *drbd_verify_wq; /* integrity checks of received data */
 
 /* drbd's page pool, used to buffer data received from the peer,
  * or data requested by the peer.
@@ -1920,8 +2113,11 @@ static inline void ov_skipped_print(struct drbd_peer_device *peer_device)
 	peer_device->ov_last_skipped_size = 0;
 }
 
-extern void drbd_csum_bio(struct crypto_shash *, struct bio *, void *);
-extern void drbd_csum_pages(struct crypto_shash *, struct page *, void *);
+extern void drbd_csum_bio(struct crypto_ahash *, struct drbd_ahash_req *, struct bio *, void *);
+extern void drbd_csum_pages(struct crypto_ahash *, struct drbd_ahash_req *, struct page *, void *);
+extern void drbd_ahash_req_free(struct drbd_ahash_req *);
+extern unsigned int drbd_page_chain_nents(struct page *);
+extern unsigned int drbd_page_chain_to_sg(struct page *, struct scatterlist *);
 /* worker callbacks */
 extern int w_e_end_data_req(struct drbd_work *, int);
 extern int w_e_end_rsdata_req(struct drbd_work *, int);
@@ -2001,6 +2197,8 @@ extern int drbd_send_ack(struct drbd_peer_device *, enum drbd_packet,
 			 struct drbd_peer_request *);
 extern int drbd_send_ack_ex(struct drbd_peer_device *, enum drbd_packet,
 			    sector_t sector, int blksize, u64 block_id);
+extern struct drbd_flusher *drbd_flusher_get(struct block_device *bdev);
+extern void drbd_flusher_put(struct drbd_flusher *flusher);
 extern int drbd_receiver(struct drbd_thread *thi);
 extern int drbd_ack_receiver(struct drbd_thread *thi);
 extern void drbd_send_ping_wf(struct work_struct *ws);
@@ -2010,6 +2208,8 @@ extern bool drbd_rs_c_min_rate_throttle(struct drbd_peer_device *);
 extern bool drbd_rs_should_slow_down(struct drbd_peer_device *, sector_t,
 				     bool throttle_if_app_is_waiting);
 extern int drbd_submit_peer_request(struct drbd_peer_request *);
+extern void drbd_submit_peer_discard(struct drbd_peer_request *);
+extern void drbd_wait_verify_done(struct drbd_connection *connection);
 extern void drbd_cleanup_after_failed_submit_peer_request(struct drbd_peer_request *peer_req);
 extern void drbd_cleanup_peer_requests_wfa(struct drbd_device *device, struct list_head *cleanup);
 extern int drbd_free_peer_reqs(struct drbd_resource *, struct list_head *, bool is_net_ee);
@@ -2082,8 +2282,10 @@ extern bool drbd_al_begin_io_fastpath(struct drbd_device *device, struct drbd_in
 extern int drbd_al_begin_io_for_peer(struct drbd_peer_device *peer_device, struct drbd_interval *i);
 extern bool drbd_al_complete_io(struct drbd_device *device, struct drbd_interval *i);
 extern void drbd_rs_complete_io(struct drbd_peer_device *, sector_t);
-extern int drbd_rs_begin_io(struct drbd_peer_device *, sector_t);
-extern int drbd_try_rs_begin_io(struct drbd_peer_device *, sector_t, bool);
+extern int drbd_rs_begin_io(struct drbd_peer_device *, sector_t, unsigned int);
+extern int drbd_try_rs_begin_io(struct drbd_peer_device *, sector_t, unsigned int, bool);
+extern void __drbd_rs_drop_intervals(struct drbd_peer_device *);
+extern void drbd_active_writes_reset(struct drbd_device *);
 extern void drbd_rs_cancel_all(struct drbd_peer_device *);
 extern int drbd_rs_del_all(struct drbd_peer_device *);
 extern void drbd_rs_failed_io(struct drbd_peer_device *, sector_t, int);
@@ -2140,6 +2342,27 @@ extern int drbd_open_ro_count(struct drbd_resource *resource);
  * inline helper functions
  *************************/
 
+/* Returns the last page of the physically contiguous run starting at @page,
+ * which can be accessed through the linear mapping in one go, and the number
+ * of bytes in that run in @len. Highmem pages are runs of their own. */
+static inline struct page *page_chain_run(struct page *page, unsigned int *len)
+{
+	struct page *next;
+
+	*len = page_chain_size(page);
+	if (PageHighMem(page))
+		return page;
+	while ((next = page_chain_next(page)) &&
+	       page_chain_offset(page) + page_chain_size(page) == PAGE_SIZE &&
+	       page_chain_offset(next) == 0 &&
+	       page_to_pfn(next) == page_to_pfn(page) + 1 &&
+	       !PageHighMem(next)) {
+		*len += page_chain_size(next);
+		page = next;
+	}
+	return page;
+}
+
 static inline int drbd_peer_req_has_active_page(struct drbd_peer_request *peer_req)
 {
 	struct page *page = peer_req->page_chain.head;
@@ -2677,17 +2900,23 @@ static inline int drbd_queue_order_type(struct drbd_device *device)
 }
 
 /* resync bitmap */
-/* 128MB sized 'bitmap extent' to track syncer usage */
+/* 128MB sized 'bitmap extent' to track syncer progress */
 struct bm_extent {
 	int rs_left; /* number of bits set (out of sync) in this extent. */
 	int rs_failed; /* number of failed resync requests in this extent. */
-	unsigned long flags;
 	struct lc_element lce;
 };
 
-#define BME_NO_WRITES  0  /* bm_extent.flags: no more requests on this one! */
-#define BME_LOCKED     1  /* bm_extent.flags: syncer active on this one. */
-#define BME_PRIORITY   2  /* finish resync IO on this extent ASAP! App IO waiting! */
+/* resync (or online verify) request in device->resync_requests.
+ * Application writes overlapping it wait until it completes. */
+struct drbd_rs_interval {
+	struct drbd_interval i;
+	struct drbd_peer_device *peer_device;
+	unsigned long flags;
+};
+
+#define RSI_LOCKED     0  /* drbd_rs_interval.flags: no overlapping application writes left */
+#define RSI_PRIORITY   1  /* finish resync IO on this range ASAP! App IO waiting! */
 
 static inline struct drbd_connection *first_connection(struct drbd_resource *resource)
 {
@@ -0,0 +1,633 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+   drbd_intent.c
+
+   This file is part of DRBD.
+
+ */
+
+/*
+   Optional sub-extent write intent table, on a small local device.
+
+   After a crash of a primary, all extents of the activity log are marked out
+   of sync, 4MiB each by default.  Few of them usually had writes in flight.
+   If a write intent device is configured for a minor (module parameter
+   write_intent), each activity log slot gets a mask of the 32 sub-extents
+   (128KiB each for 4MiB extents) written to since its extent became active.
+   A write to a sub-extent not yet in the mask of its slot does not take the
+   fast path, but goes through drbd_al_begin_io_commit(), which writes the
+   changed table blocks with FUA before the write is submitted.  A sub-extent
+   is recorded once per activation of its extent, so the number of table
+   writes stays close to the number of activity log transactions.  The fast
+   path looks at a copy of the table as it is on disk, not at what is
+   recorded already but still being written.
+
+   The table is a superblock followed by one {extent, mask} slot per
+   activity log slot.  A slot takes the number of a new extent only in the
+   table write that follows the activity log transaction for that change,
+   so the bitmap of the previous extent is already on disk by then.
+
+   On attach with unclean meta data, the table takes the place of drbdmeta
+   apply-al: only the recorded sub-extents are marked out of sync, the bitmap
+   is written, and the activity log is initialized.  drbdadm runs apply-al
+   before every attach; to make use of the table, attach with drbdsetup, or
+   skip apply-al.  As for the write journal, the table must stay configured
+   for as long as the meta data is in use.
+*/
+
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/blkdev.h>
+#include <linux/crc32c.h>
+#include <linux/seq_file.h>
+#include <linux/drbd_limits.h>
+#include "drbd_int.h"
+#include "drbd_intent.h"
+#include "drbd_meta_data.h"
+#include "drbd_dax_pmem.h"
+
+/* minor:path[,minor:path...], looked at on attach */
+static char drbd_write_intent[256];
+MODULE_PARM_DESC(write_intent, "Sub-extent write intent devices, as minor:path[,minor:path...]");
+module_param_string(write_intent, drbd_write_intent, sizeof(drbd_write_intent), 0644);
+
+#define INTENT_MAGIC		0x83a4d1f0
+#define INTENT_VERSION		1
+#define INTENT_BLOCK_SHIFT	12
+#define INTENT_BLOCK_SIZE	(1U << INTENT_BLOCK_SHIFT)
+#define INTENT_SUB_BITS		5	/* 32 sub-extents per extent */
+#define INTENT_SLOTS		DRBD_AL_EXTENTS_MAX
+#define INTENT_SLOTS_PER_BLOCK	(INTENT_BLOCK_SIZE / sizeof(struct intent_slot))
+#define INTENT_BLOCKS		DIV_ROUND_UP(INTENT_SLOTS, INTENT_SLOTS_PER_BLOCK)
+#define INTENT_FMODE		(FMODE_READ | FMODE_WRITE | FMODE_EXCL)
+
+#define IF_FAILED		1
+
+struct intent_super {
+	__be32 magic;
+	__be32 version;
+	__be64 device_uuid;	/* of the drbd volume this table belongs to */
+	__be32 nr_slots;
+	__be32 sub_shift;
+	__be32 flags;
+	__be32 crc;		/* crc32c of the above */
+} __packed;
+
+struct intent_slot {
+	__be32 extent;
+	__be32 mask;		/* sub-extents written to since the extent became active */
+} __packed;
+
+struct drbd_intent {
+	struct block_device *bdev;
+	struct drbd_device *device;
+	u64 device_uuid;
+
+	struct page *sb_page;
+	struct intent_slot *table;	/* recorded, under al_lock */
+	struct intent_slot *shadow;	/* blocks being written, by the holder of the AL lock */
+	struct intent_slot *durable;	/* as on disk, see intent_publish() */
+	DECLARE_BITMAP(dirty, INTENT_BLOCKS);	/* under al_lock */
+	DECLARE_BITMAP(writing, INTENT_BLOCKS);	/* by the holder of the AL lock */
+	bool busy;			/* writing blocks, under al_lock */
+	bool failed;
+	bool recover;			/* table of before a crash, not yet applied */
+
+	/* statistics, under al_lock */
+	u64 misses;		/* fast path requests to a sub-extent not yet recorded */
+	u64 recorded;
+	u64 commits;
+	u64 blocks_written;
+	u64 recovered_kib;	/* marked out of sync on the last recovery */
+	u64 extent_kib;		/* what whole extents would have been */
+};
+
+/* Synchronous I/O of (part of) a page aligned kmalloc or vmalloc buffer. */
+static int intent_sync_io(struct block_device *bdev, unsigned int opf,
+			  sector_t sector, void *buf, unsigned int size)
+{
+	struct bio *bio;
+	int err;
+
+	bio = bio_alloc(GFP_NOIO, DIV_ROUND_UP(size, PAGE_SIZE));
+	if (!bio)
+		return -ENOMEM;
+	bio_set_dev(bio, bdev);
+	bio->bi_iter.bi_sector = sector;
+	bio->bi_opf = opf;
+	while (size) {
+		unsigned int len = min_t(unsigned int, size, PAGE_SIZE);
+		struct page *page = is_vmalloc_addr(buf) ?
+			vmalloc_to_page(buf) : virt_to_page(buf);
+
+		if (bio_add_page(bio, page, len, 0) != len) {
+			bio_put(bio);
+			return -EIO;
+		}
+		buf += len;
+		size -= len;
+	}
+	err = submit_bio_wait(bio);
+	bio_put(bio);
+	return err;
+}
+
+static u32 intent_crc(const void *p, size_t crc_offset)
+{
+	return crc32c(0, p, crc_offset);
+}
+
+static int intent_write_super(struct drbd_intent *intent, u32 flags)
+{
+	struct intent_super *sb = page_address(intent->sb_page);
+
+	memset(sb, 0, INTENT_BLOCK_SIZE);
+	sb->magic = cpu_to_be32(INTENT_MAGIC);
+	sb->version = cpu_to_be32(INTENT_VERSION);
+	sb->device_uuid = cpu_to_be64(intent->device_uuid);
+	sb->nr_slots = cpu_to_be32(INTENT_SLOTS);
+	sb->sub_shift = cpu_to_be32(AL_EXTENT_SHIFT - INTENT_SUB_BITS);
+	sb->flags = cpu_to_be32(flags);
+	sb->crc = cpu_to_be32(intent_crc(sb, offsetof(struct intent_super, crc)));
+	return intent_sync_io(intent->bdev, REQ_OP_WRITE | REQ_PREFLUSH | REQ_FUA,
+			      0, sb, INTENT_BLOCK_SIZE);
+}
+
+static int intent_write_blocks(struct drbd_intent *intent, struct intent_slot *table,
+			       unsigned int first, unsigned int end)
+{
+	return intent_sync_io(intent->bdev, REQ_OP_WRITE | REQ_FUA | REQ_SYNC,
+			      (sector_t)(1 + first) << (INTENT_BLOCK_SHIFT - 9),
+			      (void *)table + ((size_t)first << INTENT_BLOCK_SHIFT),
+			      (end - first) << INTENT_BLOCK_SHIFT);
+}
+
+/* Update a slot of the durable copy, for readers without al_lock.  A reader
+ * that sees the new extent sees its mask, too; one of a new extent does not
+ * start with the mask of the previous one. */
+static void intent_publish(struct intent_slot *d, const struct intent_slot *s)
+{
+	if (d->extent != s->extent) {
+		WRITE_ONCE(d->extent, cpu_to_be32(LC_FREE));
+		smp_wmb();
+	} else if (d->mask == s->mask) {
+		return;
+	}
+	WRITE_ONCE(d->mask, s->mask);
+	smp_wmb();
+	WRITE_ONCE(d->extent, s->extent);
+}
+
+/* The sub-extents of extent enr that i touches */
+static u32 intent_bits(struct drbd_intent *intent, struct drbd_interval *i, unsigned int enr)
+{
+	const int shift = AL_EXTENT_SHIFT - INTENT_SUB_BITS - 9;
+	sector_t ext = (sector_t)enr << (AL_EXTENT_SHIFT - 9);
+	sector_t first, last;
+
+	last = i->size == 0 ? i->sector : i->sector + (i->size >> 9) - 1;
+	first = max_t(sector_t, i->sector, ext);
+	last = min_t(sector_t, last, ext + (1ULL << (AL_EXTENT_SHIFT - 9)) - 1);
+	return GENMASK((unsigned int)((last - ext) >> shift),
+		       (unsigned int)((first - ext) >> shift));
+}
+
+/**
+ * drbd_intent_get() - Check or record the sub-extents an interval writes to
+ * @device:	DRBD device.
+ * @e:		The activity log element for one extent of @i, referenced.
+ * @i:		The interval about to be written.
+ * @record:	Record sub-extents not yet in the table.
+ *
+ * Returns false if some sub-extent of @i in @e is not yet on disk, and
+ * @record is false.  Recorded sub-extents are written to the table by the
+ * next drbd_intent_commit(); see drbd_intent_pending().
+ * Must hold al_lock.
+ */
+bool drbd_intent_get(struct drbd_device *device, struct lc_element *e,
+		     struct drbd_interval *i, bool record)
+{
+	struct drbd_intent *intent = device->ldev->intent;
+	unsigned int enr = e->lc_new_number;
+	struct intent_slot *slot;
+	u32 bits, mask;
+
+	if (!intent || intent->failed)
+		return true;
+
+	bits = intent_bits(intent, i, enr);
+	if (!record) {
+		slot = &intent->durable[e->lc_index];
+		mask = be32_to_cpu(slot->extent) == enr ? be32_to_cpu(slot->mask) : 0;
+		if ((mask & bits) == bits)
+			return true;
+		intent->misses++;
+		return false;
+	}
+
+	slot = &intent->table[e->lc_index];
+	mask = be32_to_cpu(slot->extent) == enr ? be32_to_cpu(slot->mask) : 0;
+	if ((mask & bits) == bits)
+		return true;
+
+	/* A slot still naming the previous extent starts over; the table
+	 * block is only written after the AL transaction for the change. */
+	slot->mask = cpu_to_be32(mask | bits);
+	slot->extent = cpu_to_be32(enr);
+	__set_bit(e->lc_index / INTENT_SLOTS_PER_BLOCK, intent->dirty);
+	intent->recorded++;
+	return true;
+}
+
+/* drbd_intent_get() without recording and without al_lock, for
+ * al_get_rcu().  A durable mask only grows while its slot names the same
+ * extent, so a stale read at worst sends the caller to take the lock. */
+bool drbd_intent_recorded(struct drbd_device *device, struct lc_element *e,
+			  struct drbd_interval *i)
+{
+	struct drbd_intent *intent = device->ldev->intent;
+	unsigned int enr = e->lc_number;
+	struct intent_slot *slot;
+	u32 bits, mask;
+
+	if (!intent || READ_ONCE(intent->failed))
+		return true;
+
+	slot = &intent->durable[e->lc_index];
+	bits = intent_bits(intent, i, enr);
+	if (be32_to_cpu(READ_ONCE(slot->extent)) != enr)
+		return false;
+	smp_rmb();
+	mask = be32_to_cpu(READ_ONCE(slot->mask));
+	return (mask & bits) == bits;
+}
+
+/* Are recorded sub-extents not yet on disk? */
+bool drbd_intent_pending(struct drbd_device *device)
+{
+	struct drbd_intent *intent = device->ldev->intent;
+	bool pending;
+
+	if (!intent)
+		return false;
+
+	spin_lock_irq(&device->al_lock);
+	pending = intent->busy || !bitmap_empty(intent->dirty, INTENT_BLOCKS);
+	spin_unlock_irq(&device->al_lock);
+	return pending;
+}
+
+/**
+ * drbd_intent_commit() - Write the table blocks with recorded sub-extents
+ * @device:	DRBD device.
+ *
+ * Caller holds the activity log locked for a transaction, and already wrote
+ * that, so extents leaving their slot have their bitmap on disk.
+ */
+void drbd_intent_commit(struct drbd_device *device)
+{
+	struct drbd_intent *intent = device->ldev->intent;
+	unsigned int first, end, blocks = 0, s;
+	int err = 0;
+
+	if (!intent)
+		return;
+
+	spin_lock_irq(&device->al_lock);
+	if (bitmap_empty(intent->dirty, INTENT_BLOCKS)) {
+		spin_unlock_irq(&device->al_lock);
+		return;
+	}
+	bitmap_copy(intent->writing, intent->dirty, INTENT_BLOCKS);
+	bitmap_zero(intent->dirty, INTENT_BLOCKS);
+	/* Slots may change while we write them.  Those changes dirty their
+	 * block again, and their requests wait for the next commit. */
+	for_each_set_bit(first, intent->writing, INTENT_BLOCKS)
+		memcpy(intent->shadow + first * INTENT_SLOTS_PER_BLOCK,
+		       intent->table + first * INTENT_SLOTS_PER_BLOCK, INTENT_BLOCK_SIZE);
+	intent->busy = true;
+	spin_unlock_irq(&device->al_lock);
+
+	first = find_first_bit(intent->writing, INTENT_BLOCKS);
+	while (first < INTENT_BLOCKS && !err) {
+		end = find_next_zero_bit(intent->writing, INTENT_BLOCKS, first);
+		err = intent_write_blocks(intent, intent->shadow, first, end);
+		blocks += end - first;
+		first = find_next_bit(intent->writing, INTENT_BLOCKS, end);
+	}
+
+	spin_lock_irq(&device->al_lock);
+	if (!err) {
+		for_each_set_bit(first, intent->writing, INTENT_BLOCKS) {
+			for (s = first * INTENT_SLOTS_PER_BLOCK;
+			     s < (first + 1) * INTENT_SLOTS_PER_BLOCK; s++)
+				intent_publish(&intent->durable[s], &intent->shadow[s]);
+		}
+	}
+	intent->busy = false;
+	intent->commits++;
+	intent->blocks_written += blocks;
+	if (err)
+		intent->failed = true;
+	spin_unlock_irq(&device->al_lock);
+
+	if (err) {
+		drbd_err(device, "writing the write intent table failed: %d\n", err);
+		/* Do not let a later attach trust what is on disk now. */
+		intent_write_super(intent, IF_FAILED);
+		drbd_chk_io_error(device, 1, DRBD_META_IO_ERROR);
+	}
+}
+
+/* Mark the recorded sub-extents out of sync, in all bitmap slots */
+static void intent_apply(struct drbd_intent *intent)
+{
+	struct drbd_device *device = intent->device;
+	const unsigned int sub_bits = 1U << (AL_EXTENT_SHIFT - INTENT_SUB_BITS - BM_BLOCK_SHIFT);
+	unsigned long bm_bits = drbd_bm_bits(device);
+	unsigned long set = 0, whole = 0;
+	unsigned int s, extents = 0;
+
+	for (s = 0; s < INTENT_SLOTS; s++) {
+		unsigned int enr = be32_to_cpu(intent->table[s].extent);
+		u32 mask = be32_to_cpu(intent->table[s].mask);
+		unsigned long ext_start, ext_end;
+		int b;
+
+		if (enr == LC_FREE)
+			continue;
+		ext_start = (unsigned long)enr << (AL_EXTENT_SHIFT - BM_BLOCK_SHIFT);
+		if (ext_start >= bm_bits)
+			continue;
+		ext_end = min(ext_start + (1UL << (AL_EXTENT_SHIFT - BM_BLOCK_SHIFT)), bm_bits);
+		whole += ext_end - ext_start;
+		extents++;
+
+		for (b = 0; b < 32; b++) {
+			unsigned long start = ext_start + b * sub_bits, end;
+			unsigned int bitmap_index;
+
+			if (!(mask & (1U << b)))
+				continue;
+			if (start >= ext_end)
+				break;
+			end = min(start + sub_bits, ext_end) - 1;
+			for (bitmap_index = 0; bitmap_index < device->bitmap->bm_max_peers; bitmap_index++)
+				_drbd_bm_set_many_bits(device, bitmap_index, start, end);
+			set += end + 1 - start;
+		}
+	}
+
+	intent->recovered_kib = (u64)set << (BM_BLOCK_SHIFT - 10);
+	intent->extent_kib = (u64)whole << (BM_BLOCK_SHIFT - 10);
+	drbd_info(device, "write intent table: %llu KiB out of sync in %u extents, "
+		  "instead of %llu KiB\n", intent->recovered_kib, extents, intent->extent_kib);
+}
+
+static int intent_reset(struct drbd_intent *intent)
+{
+	unsigned int s;
+	int err;
+
+	for (s = 0; s < INTENT_BLOCKS * INTENT_SLOTS_PER_BLOCK; s++) {
+		intent->table[s].extent = cpu_to_be32(LC_FREE);
+		intent->table[s].mask = 0;
+	}
+	err = intent_write_blocks(intent, intent->table, 0, INTENT_BLOCKS);
+	if (!err)
+		err = intent_write_super(intent, 0);
+	if (!err)
+		memcpy(intent->durable, intent->table, INTENT_BLOCKS << INTENT_BLOCK_SHIFT);
+	return err;
+}
+
+/**
+ * drbd_intent_recover() - Apply the table after a crash, then start it over
+ * @device:	DRBD device, attaching, with its bitmap read.
+ *
+ * Does what drbdmeta apply-al would, but marks only the recorded sub-extents
+ * out of sync.  The meta data is clean on disk before the table is reset.
+ */
+int drbd_intent_recover(struct drbd_device *device)
+{
+	struct drbd_intent *intent = device->ldev->intent;
+	void *buffer;
+	int err;
+
+	if (!intent)
+		return NO_ERROR;
+
+	if (intent->recover) {
+		intent_apply(intent);
+		err = drbd_bitmap_io(device, &drbd_bm_write,
+				     "write from intent recovery", BM_LOCK_ALL, NULL);
+		if (err)
+			return ERR_IO_MD_DISK;
+
+		buffer = drbd_md_get_buffer(device, __func__);
+		if (!buffer)
+			return ERR_NOMEM;
+		err = drbd_al_initialize(device, buffer);
+		if (!err) {
+			device->ldev->md.flags |= MDF_AL_CLEAN;
+			err = drbd_md_write(device, buffer);
+		}
+		drbd_md_put_buffer(device);
+		if (err)
+			return ERR_IO_MD_DISK;
+		intent->recover = false;
+	}
+
+	err = intent_reset(intent);
+	if (err) {
+		drbd_err(device, "resetting the write intent table failed: %d\n", err);
+		return ERR_IO_MD_DISK;
+	}
+	return NO_ERROR;
+}
+
+/* Returns the write intent path configured for @minor in @buf, or false. */
+static bool intent_path(unsigned int minor, char *buf, size_t size)
+{
+	char *params, *p, *tok, *path;
+	unsigned int m;
+	bool found = false;
+
+	params = kstrdup(drbd_write_intent, GFP_KERNEL);
+	if (!params)
+		return false;
+	p = params;
+	while ((tok = strsep(&p, ",")) != NULL) {
+		path = strchr(tok, ':');
+		if (!path)
+			continue;
+		*path++ = 0;
+		if (kstrtouint(strim(tok), 10, &m) || m != minor)
+			continue;
+		strscpy(buf, strim(path), size);
+		found = buf[0] != 0;
+		break;
+	}
+	kfree(params);
+	return found;
+}
+
+bool drbd_intent_configured(unsigned int minor)
+{
+	char path[128];
+
+	return intent_path(minor, path, sizeof(path));
+}
+
+static void intent_free(struct drbd_intent *intent)
+{
+	if (intent->bdev)
+		blkdev_put(intent->bdev, INTENT_FMODE);
+	if (intent->sb_page)
+		__free_page(intent->sb_page);
+	vfree(intent->table);
+	vfree(intent->shadow);
+	vfree(intent->durable);
+	kfree(intent);
+}
+
+/**
+ * drbd_intent_attach() - Open the write intent table configured for a device, if any
+ * @device:	DRBD device.
+ * @nbc:	The backing device about to be attached, meta data already read.
+ *
+ * With unclean meta data, the table has to be valid for this device; it is
+ * applied later by drbd_intent_recover().
+ */
+int drbd_intent_attach(struct drbd_device *device, struct drbd_backing_dev *nbc)
+{
+	bool md_clean = nbc->md.flags & MDF_AL_CLEAN;
+	struct drbd_intent *intent;
+	struct intent_super *sb;
+	struct block_device *bdev;
+	char path[128];
+	int retcode;
+	int err;
+
+	if (!intent_path(device->minor, path, sizeof(path)))
+		return NO_ERROR;
+
+	if (drbd_md_dax_active(nbc)) {
+		drbd_warn(device, "no write intent table with dax-pmem meta data\n");
+		retcode = NO_ERROR;
+		goto unclean;
+	}
+
+	intent = kzalloc(sizeof(*intent), GFP_KERNEL);
+	if (!intent)
+		return ERR_NOMEM;
+	intent->device = device;
+	intent->device_uuid = nbc->md.device_uuid;
+	intent->sb_page = alloc_page(GFP_KERNEL);
+	intent->table = vmalloc(INTENT_BLOCKS << INTENT_BLOCK_SHIFT);
+	intent->shadow = vmalloc(INTENT_BLOCKS << INTENT_BLOCK_SHIFT);
+	intent->durable = vmalloc(INTENT_BLOCKS << INTENT_BLOCK_SHIFT);
+	if (!intent->sb_page || !intent->table || !intent->shadow || !intent->durable) {
+		retcode = ERR_NOMEM;
+		goto fail;
+	}
+
+	bdev = blkdev_get_by_path(path, INTENT_FMODE, intent);
+	if (IS_ERR(bdev)) {
+		drbd_err(device, "open(\"%s\") for the write intent table failed with %ld\n",
+			 path, PTR_ERR(bdev));
+		retcode = ERR_OPEN_DISK;
+		goto fail;
+	}
+	intent->bdev = bdev;
+
+	if (drbd_get_capacity(bdev) < (1 + INTENT_BLOCKS) << (INTENT_BLOCK_SHIFT - 9)) {
+		drbd_err(device, "write intent device %s is smaller than %u KiB\n",
+			 path, (1 + INTENT_BLOCKS) << (INTENT_BLOCK_SHIFT - 10));
+		retcode = ERR_DISK_TOO_SMALL;
+		goto fail;
+	}
+
+	if (!md_clean) {
+		sb = page_address(intent->sb_page);
+		err = intent_sync_io(bdev, REQ_OP_READ, 0, sb, INTENT_BLOCK_SIZE);
+		if (!err)
+			err = intent_sync_io(bdev, REQ_OP_READ, INTENT_BLOCK_SIZE >> 9,
+					     intent->table, INTENT_BLOCKS << INTENT_BLOCK_SHIFT);
+		if (err) {
+			retcode = ERR_IO_MD_DISK;
+			goto fail;
+		}
+		if (be32_to_cpu(sb->magic) != INTENT_MAGIC ||
+		    be32_to_cpu(sb->version) != INTENT_VERSION ||
+		    be32_to_cpu(sb->crc) != intent_crc(sb, offsetof(struct intent_super, crc)) ||
+		    be64_to_cpu(sb->device_uuid) != intent->device_uuid ||
+		    be32_to_cpu(sb->nr_slots) != INTENT_SLOTS ||
+		    be32_to_cpu(sb->sub_shift) != AL_EXTENT_SHIFT - INTENT_SUB_BITS ||
+		    be32_to_cpu(sb->flags) & IF_FAILED) {
+			drbd_err(device, "write intent table %s does not cover this device\n", path);
+			retcode = NO_ERROR;
+			intent_free(intent);
+			goto unclean;
+		}
+		intent->recover = true;
+	}
+	nbc->intent = intent;
+
+	drbd_info(device, "using %s as write intent table\n", path);
+	return NO_ERROR;
+
+fail:
+	intent_free(intent);
+	return retcode;
+
+unclean:
+	if (!md_clean) {
+		drbd_err(device, "Found unclean meta data. Did you \"drbdadm apply-al\"?\n");
+		retcode = ERR_MD_UNCLEAN;
+	}
+	return retcode;
+}
+
+void drbd_intent_close(struct drbd_backing_dev *ldev)
+{
+	struct drbd_intent *intent = ldev->intent;
+
+	if (!intent)
+		return;
+
+	ldev->intent = NULL;
+	intent_free(intent);
+}
+
+void drbd_intent_seq_show(struct seq_file *m, struct drbd_intent *intent)
+{
+	struct drbd_device *device = intent->device;
+	u64 kib = 0, extent_kib = 0;
+	unsigned int s;
+
+	/* What a crash right now would leave to resync.  Not under al_lock;
+	 * a slot changing meanwhile is counted either way. */
+	for (s = 0; s < INTENT_SLOTS; s++) {
+		if (be32_to_cpu(READ_ONCE(intent->durable[s].extent)) == LC_FREE)
+			continue;
+		kib += (u64)hweight32(be32_to_cpu(READ_ONCE(intent->durable[s].mask))) <<
+			(AL_EXTENT_SHIFT - INTENT_SUB_BITS - 10);
+		extent_kib += 1U << (AL_EXTENT_SHIFT - 10);
+	}
+
+	spin_lock_irq(&device->al_lock);
+	seq_printf(m, "device: %pg\n", intent->bdev);
+	seq_printf(m, "state: %s\n", intent->failed ? "failed" : "active");
+	seq_printf(m, "sub_extent_kib: %u\n", 1U << (AL_EXTENT_SHIFT - INTENT_SUB_BITS - 10));
+	seq_printf(m, "resync_kib: %llu\n", kib);
+	seq_printf(m, "extent_kib: %llu\n", extent_kib);
+	seq_printf(m, "misses: %llu\n", intent->misses);
+	seq_printf(m, "recorded: %llu\n", intent->recorded);
+	seq_printf(m, "commits: %llu\n", intent->commits);
+	seq_printf(m, "blocks_written: %llu\n", intent->blocks_written);
+	seq_printf(m, "recovered_kib: %llu\n", intent->recovered_kib);
+	seq_printf(m, "recovered_extent_kib: %llu\n", intent->extent_kib);
+	spin_unlock_irq(&device->al_lock);
+}
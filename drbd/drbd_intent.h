@@ -0,0 +1,19 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+#ifndef DRBD_INTENT_H
+#define DRBD_INTENT_H
+
+struct drbd_intent;
+
+extern bool drbd_intent_configured(unsigned int minor);
+extern int drbd_intent_attach(struct drbd_device *device, struct drbd_backing_dev *nbc);
+extern int drbd_intent_recover(struct drbd_device *device);
+extern void drbd_intent_close(struct drbd_backing_dev *ldev);
+extern bool drbd_intent_get(struct drbd_device *device, struct lc_element *e,
+			    struct drbd_interval *i, bool record);
+extern bool drbd_intent_recorded(struct drbd_device *device, struct lc_element *e,
+				 struct drbd_interval *i);
+extern bool drbd_intent_pending(struct drbd_device *device);
+extern void drbd_intent_commit(struct drbd_device *device);
+extern void drbd_intent_seq_show(struct seq_file *m, struct drbd_intent *intent);
+
+#endif /* DRBD_INTENT_H */
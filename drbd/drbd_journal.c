@@ -0,0 +1,1053 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+   drbd_journal.c
+
+   This file is part of DRBD.
+
+ */
+
+/*
+   Optional write journal for peer writes, on a fast local device.
+
+   With protocol C a secondary sends the P_WRITE_ACK only once the backing
+   device completed the write.  If a journal device is configured for a minor
+   (module parameter write_journal), every peer write is in addition appended
+   to the journal with FUA, and the P_WRITE_ACK is sent as soon as that
+   completed.  The write to the backing device is submitted in parallel, as
+   before; once it completed, the journal record may be reclaimed.
+   Until then, a peer read of the same blocks waits for that write: the
+   peer may already have completed the write, and would otherwise read
+   stale data from the backing device.
+
+   The journal is a ring of 4KiB blocks behind a superblock.  A record is a
+   header block followed by the data, padded to full blocks; records do not
+   wrap.  The superblock holds the sequence number of the oldest record that
+   may not yet be stable on the backing device.  It is advanced only after
+   a flush of the backing device, and ring space is only reused once the
+   superblock was advanced past it.
+
+   On attach after a crash, all valid records from that sequence number on
+   are written to the backing device again, in sequence order.  Only onto
+   the data generation they were written to: the superblock also holds the
+   current UUID of the meta data, updated before the meta data gets a new
+   one.  A volume that was attached without the journal in between, and
+   got a new current UUID that way, does not get stale data replayed over
+   newer data.
+
+   Only writes the peer waits for with a P_WRITE_ACK are journaled: not
+   resync writes, and not writes with protocol A or B.  The journal is used
+   while the resource is secondary, and drained on promotion.  Discards and
+   write-same requests are not journaled either; they wait until no older
+   record can be replayed over them anymore, on the submit workqueue.
+*/
+
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/blkdev.h>
+#include <linux/crc32c.h>
+#include <linux/random.h>
+#include <linux/sort.h>
+#include <linux/seq_file.h>
+#include "drbd_int.h"
+#include "drbd_journal.h"
+
+/* minor:path[,minor:path...], looked at on attach */
+static char drbd_write_journal[256];
+MODULE_PARM_DESC(write_journal, "Journal devices for peer writes, as minor:path[,minor:path...]");
+module_param_string(write_journal, drbd_write_journal, sizeof(drbd_write_journal), 0644);
+
+#define JOURNAL_MAGIC		0x83a4d1e7
+#define JOURNAL_RECORD_MAGIC	0x83a4d1e8
+#define JOURNAL_VERSION		2
+#define JOURNAL_BLOCK_SHIFT	12
+#define JOURNAL_BLOCK_SIZE	(1U << JOURNAL_BLOCK_SHIFT)
+#define JOURNAL_MIN_SIZE	(8U << 20)
+#define JOURNAL_FMODE		(FMODE_READ | FMODE_WRITE | FMODE_EXCL)
+
+#define JF_CLEAN		1
+
+struct journal_super {
+	__be32 magic;
+	__be32 version;
+	__be64 device_uuid;	/* of the drbd volume this journal belongs to */
+	__be64 data_uuid;	/* its current UUID, without UUID_PRIMARY */
+	__be64 prev_data_uuid;	/* the one before, in case the meta data has that */
+	__be64 nonce;		/* random per attach, in every record, too */
+	__be64 nr_blocks;
+	__be64 tail_seq;
+	__be32 flags;
+	__be32 crc;		/* crc32c of the above */
+} __packed;
+
+struct journal_record {
+	__be32 magic;
+	__be32 size;		/* of the data, in bytes */
+	__be64 nonce;
+	__be64 seq;
+	__be64 sector;
+	__be32 data_crc;
+	__be32 crc;		/* crc32c of the above */
+} __packed;
+
+struct drbd_journal {
+	struct block_device *bdev;
+	struct block_device *backing;
+	struct drbd_device *device;
+
+	u64 device_uuid;
+	u64 data_uuid, prev_data_uuid;
+	u64 nonce;
+	u64 nr_blocks;		/* ring size, without the superblock */
+
+	spinlock_t lock;
+	wait_queue_head_t wait;
+	struct list_head entries;
+	u64 next_seq;
+	u64 head;		/* absolute block number for the next record */
+	u64 tail;		/* of the oldest record not yet written back */
+	u64 tail_seq;
+	u64 sb_tail;		/* tail as last written to the superblock */
+	u64 sb_tail_seq;
+	bool failed;		/* the journal device failed */
+	bool stopped;		/* a write to the backing device failed */
+	unsigned int read_waiters;	/* in drbd_journal_wait_read() */
+
+	struct mutex sb_mutex;
+	struct page *sb_page;
+
+	struct list_head discards;	/* struct journal_discard, in order */
+	struct work_struct discard_work;
+
+	/* statistics, under lock */
+	u64 appended;
+	u64 early_acks;
+	u64 waited;		/* appends that had to wait for ring space */
+	u64 sb_writes;
+	u64 replayed;
+	u64 deferred;		/* discards that waited for the superblock */
+	u64 waited_reads;	/* peer reads that waited for a write-back */
+};
+
+struct journal_discard {
+	struct list_head list;
+	struct drbd_peer_request *peer_req;
+	u64 seq;		/* no record before this one may be replayed */
+};
+
+static sector_t journal_sector(struct drbd_journal *journal, u64 block)
+{
+	u64 pos;
+
+	div64_u64_rem(block, journal->nr_blocks, &pos);
+	return (1 + pos) << (JOURNAL_BLOCK_SHIFT - 9);
+}
+
+static u32 journal_crc(const void *p, size_t crc_offset)
+{
+	return crc32c(0, p, crc_offset);
+}
+
+/* Synchronous I/O of a page aligned kmalloc or vmalloc buffer.
+ * With size 0, this is an empty flush. */
+static int journal_sync_io(struct block_device *bdev, unsigned int opf,
+			   sector_t sector, void *buf, unsigned int size)
+{
+	struct bio *bio;
+	int err;
+
+	bio = bio_alloc(GFP_NOIO, DIV_ROUND_UP(size, PAGE_SIZE));
+	if (!bio)
+		return -ENOMEM;
+	bio_set_dev(bio, bdev);
+	bio->bi_iter.bi_sector = sector;
+	bio->bi_opf = opf;
+	while (size) {
+		unsigned int len = min_t(unsigned int, size, PAGE_SIZE);
+		struct page *page = is_vmalloc_addr(buf) ?
+			vmalloc_to_page(buf) : virt_to_page(buf);
+
+		if (bio_add_page(bio, page, len, 0) != len) {
+			bio_put(bio);
+			return -EIO;
+		}
+		buf += len;
+		size -= len;
+	}
+	err = submit_bio_wait(bio);
+	bio_put(bio);
+	return err;
+}
+
+static int journal_write_super(struct drbd_journal *journal, bool clean)
+{
+	struct journal_super *sb = page_address(journal->sb_page);
+	u64 tail, tail_seq, data_uuid, prev_data_uuid;
+	int err;
+
+	mutex_lock(&journal->sb_mutex);
+	spin_lock_irq(&journal->lock);
+	tail = journal->tail;
+	tail_seq = journal->tail_seq;
+	data_uuid = journal->data_uuid;
+	prev_data_uuid = journal->prev_data_uuid;
+	spin_unlock_irq(&journal->lock);
+
+	/* Whatever got written back before tail has to be stable first. */
+	err = journal_sync_io(journal->backing, REQ_OP_FLUSH | REQ_PREFLUSH, 0, NULL, 0);
+	if (!err) {
+		memset(sb, 0, JOURNAL_BLOCK_SIZE);
+		sb->magic = cpu_to_be32(JOURNAL_MAGIC);
+		sb->version = cpu_to_be32(JOURNAL_VERSION);
+		sb->device_uuid = cpu_to_be64(journal->device_uuid);
+		sb->data_uuid = cpu_to_be64(data_uuid);
+		sb->prev_data_uuid = cpu_to_be64(prev_data_uuid);
+		sb->nonce = cpu_to_be64(journal->nonce);
+		sb->nr_blocks = cpu_to_be64(journal->nr_blocks);
+		sb->tail_seq = cpu_to_be64(tail_seq);
+		sb->flags = cpu_to_be32(clean ? JF_CLEAN : 0);
+		sb->crc = cpu_to_be32(journal_crc(sb, offsetof(struct journal_super, crc)));
+		err = journal_sync_io(journal->bdev, REQ_OP_WRITE | REQ_PREFLUSH | REQ_FUA,
+				      0, sb, JOURNAL_BLOCK_SIZE);
+	}
+
+	spin_lock_irq(&journal->lock);
+	if (err) {
+		journal->failed = true;
+	} else {
+		journal->sb_tail = tail;
+		journal->sb_tail_seq = tail_seq;
+		journal->sb_writes++;
+	}
+	spin_unlock_irq(&journal->lock);
+	wake_up_all(&journal->wait);
+	mutex_unlock(&journal->sb_mutex);
+
+	if (err)
+		drbd_err(journal->device, "writing the journal superblock failed: %d\n", err);
+	return err;
+}
+
+/* Find room for a record of @blocks blocks.  Returns false if there is none,
+ * and sets @need_super if there would be after writing the superblock. */
+static bool journal_reserve(struct drbd_journal *journal, unsigned int blocks,
+			    u64 *start, bool *need_super)
+{
+	u64 s = journal->head, pos;
+
+	div64_u64_rem(s, journal->nr_blocks, &pos);
+	if (pos + blocks > journal->nr_blocks)
+		s += journal->nr_blocks - pos;
+	if (s + blocks - journal->tail > journal->nr_blocks)
+		return false;
+	if (s + blocks > journal->sb_tail + journal->nr_blocks) {
+		*need_super = true;
+		return false;
+	}
+	*start = s;
+	return true;
+}
+
+static bool journal_has_room(struct drbd_journal *journal, unsigned int blocks)
+{
+	bool need_super = false, rv;
+	u64 start;
+
+	spin_lock_irq(&journal->lock);
+	rv = journal->failed || journal->stopped || journal_reserve(journal, blocks, &start, &need_super) || need_super;
+	spin_unlock_irq(&journal->lock);
+	return rv;
+}
+
+static void journal_entry_release(struct kref *kref)
+{
+	struct drbd_journal_entry *entry = container_of(kref, struct drbd_journal_entry, kref);
+
+	__free_page(entry->header);
+	kfree(entry);
+}
+
+void drbd_journal_put_entry(struct drbd_journal_entry *entry)
+{
+	kref_put(&entry->kref, journal_entry_release);
+}
+
+/* The write to the backing device completed.  May be called from
+ * interrupt context. */
+void drbd_journal_written_back(struct drbd_journal_entry *entry)
+{
+	struct drbd_journal *journal = entry->journal;
+	struct drbd_journal_entry *e, *t;
+	LIST_HEAD(reclaimed);
+	unsigned long flags;
+	bool wake;
+
+	spin_lock_irqsave(&journal->lock, flags);
+	entry->written_back = true;
+	entry->peer_req = NULL;
+	list_for_each_entry_safe(e, t, &journal->entries, list) {
+		if (!e->written_back)
+			break;
+		list_move_tail(&e->list, &reclaimed);
+	}
+	if (list_empty(&journal->entries)) {
+		journal->tail = journal->head;
+		journal->tail_seq = journal->next_seq;
+	} else {
+		e = list_first_entry(&journal->entries, struct drbd_journal_entry, list);
+		journal->tail = e->start;
+		journal->tail_seq = e->seq;
+	}
+	wake = !list_empty(&reclaimed) || journal->read_waiters;
+	spin_unlock_irqrestore(&journal->lock, flags);
+
+	if (!wake)
+		return;
+	wake_up_all(&journal->wait);
+	list_for_each_entry_safe(e, t, &reclaimed, list)
+		drbd_journal_put_entry(e);
+}
+
+/**
+ * drbd_journal_write_error() - The write to the backing device failed
+ * @peer_req:	journaled peer write, all its bios completed
+ *
+ * The record is reclaimed as usual; the caller marks the block out of sync.
+ * The peer has to learn about it as well: if the early P_WRITE_ACK is not
+ * sent yet, it never will be, and e_end_block() sends the P_NEG_ACK.  If it
+ * is, e_end_block() sends a P_OUT_OF_SYNC.  No more writes get journaled,
+ * their acks wait for the backing device again.
+ */
+void drbd_journal_write_error(struct drbd_peer_request *peer_req)
+{
+	struct drbd_journal_entry *entry = peer_req->journal;
+	struct drbd_journal *journal = entry->journal;
+	unsigned long flags;
+	bool was_stopped;
+
+	if (peer_req->flags & EE_JOURNAL_ACKED &&
+	    !test_and_set_bit(JE_ACK_CLAIMED, &entry->flags))
+		peer_req->flags &= ~EE_JOURNAL_ACKED;
+
+	spin_lock_irqsave(&journal->lock, flags);
+	was_stopped = journal->stopped;
+	journal->stopped = true;
+	spin_unlock_irqrestore(&journal->lock, flags);
+
+	if (!was_stopped)
+		drbd_err(journal->device, "write to the backing device failed, no longer using the journal\n");
+}
+
+static void journal_queue_ack(struct drbd_journal_entry *entry)
+{
+	struct drbd_connection *connection = entry->peer_device->connection;
+	struct drbd_resource *resource = connection->resource;
+	unsigned long flags;
+
+	/* dropped by the ack sender, see drbd_finish_peer_reqs() */
+	kref_get(&entry->kref);
+	set_bit(__EE_JOURNAL_ACKED, &entry->peer_req->flags);
+
+	spin_lock_irqsave(&resource->req_lock, flags);
+	list_add_tail(&entry->ack_list, &connection->journal_acks);
+	if (connection->cstate[NOW] == C_CONNECTED)
+		queue_work(connection->ack_sender, &connection->send_acks_work);
+	spin_unlock_irqrestore(&resource->req_lock, flags);
+}
+
+static void drbd_journal_endio(struct bio *bio)
+{
+	struct drbd_journal_entry *entry = bio->bi_private;
+	struct drbd_peer_request *peer_req = entry->peer_req;
+	struct drbd_journal *journal = entry->journal;
+	blk_status_t status = bio->bi_status;
+	unsigned long flags;
+	bool was_failed;
+
+	bio_put(bio);
+
+	spin_lock_irqsave(&journal->lock, flags);
+	was_failed = journal->failed;
+	if (status)
+		journal->failed = true;
+	else
+		journal->early_acks++;
+	spin_unlock_irqrestore(&journal->lock, flags);
+
+	if (status) {
+		/* The peer write gets acked once on the backing device, as usual. */
+		if (!was_failed)
+			drbd_err(journal->device, "journal write failed with status %d, no longer using the journal\n",
+				 status);
+		wake_up_all(&journal->wait);
+	} else {
+		journal_queue_ack(entry);
+	}
+
+	if (atomic_dec_and_test(&peer_req->pending_bios))
+		drbd_endio_write_sec_final(peer_req);
+}
+
+/**
+ * drbd_journal_data_generation() - The meta data is about to get written
+ * @ldev:	backing device of a volume, attached.
+ * @uuid:	the current UUID in the meta data superblock to be written.
+ *
+ * A new data generation goes to the journal superblock first, along with the
+ * previous one, so that a crash before the meta data write still matches.
+ */
+void drbd_journal_data_generation(struct drbd_backing_dev *ldev, u64 uuid)
+{
+	struct drbd_journal *journal = ldev->journal;
+	bool changed;
+
+	if (!journal)
+		return;
+
+	uuid &= ~UUID_PRIMARY;
+	spin_lock_irq(&journal->lock);
+	changed = uuid != journal->data_uuid;
+	if (changed) {
+		journal->prev_data_uuid = journal->data_uuid;
+		journal->data_uuid = uuid;
+	}
+	spin_unlock_irq(&journal->lock);
+
+	if (changed && !journal->failed)
+		journal_write_super(journal, false);
+}
+
+static struct bio *journal_bio_alloc(struct drbd_journal *journal, sector_t sector,
+				     unsigned int nr_pages)
+{
+	struct bio *bio = bio_alloc(GFP_NOIO, min_t(unsigned int, nr_pages, BIO_MAX_PAGES));
+
+	if (!bio)
+		return NULL;
+	bio_set_dev(bio, journal->bdev);
+	bio->bi_iter.bi_sector = sector;
+	bio->bi_opf = REQ_OP_WRITE | REQ_FUA;
+	return bio;
+}
+
+/* Adds a page to the last bio of the list at @bios, chaining another bio to it
+ * if it is full.  The last bio is the parent of all others. */
+static int journal_add_page(struct drbd_journal *journal, struct bio **bios,
+			    struct page *page, unsigned int len, unsigned int off,
+			    unsigned int nr_pages)
+{
+	struct bio *bio = *bios, *new;
+
+	if (bio_add_page(bio, page, len, off) == len)
+		return 0;
+	new = journal_bio_alloc(journal, bio_end_sector(bio), nr_pages);
+	if (!new)
+		return -ENOMEM;
+	bio_chain(bio, new);
+	new->bi_next = bio;
+	*bios = new;
+	return bio_add_page(new, page, len, off) == len ? 0 : -EIO;
+}
+
+/**
+ * drbd_journal_prepare() - Append a peer write to the journal
+ * @peer_req:	peer write request, about to be submitted
+ *
+ * Reserves room for the record and builds the bios writing it.  Returns NULL
+ * if the write is not to be journaled.  Otherwise, the caller accounts for one
+ * more pending bio in @peer_req, and calls drbd_journal_submit() on the result.
+ * May sleep while the ring is full.
+ */
+struct bio *drbd_journal_prepare(struct drbd_peer_request *peer_req)
+{
+	struct drbd_device *device = peer_req->peer_device->device;
+	struct drbd_journal *journal = device->ldev->journal;
+	struct drbd_journal_entry *entry;
+	struct journal_record *rec;
+	unsigned int size = peer_req->i.size;
+	unsigned int nr_pages = peer_req->page_chain.nr_pages + 2;
+	unsigned int blocks, pad;
+	struct bio *bios;
+	struct page *page;
+	u32 data_crc = 0;
+	u64 start;
+
+	if (!journal || peer_req->journal || !(peer_req->flags & EE_SEND_WRITE_ACK) ||
+	    device->resource->role[NOW] != R_SECONDARY)
+		return NULL;
+
+	entry = kzalloc(sizeof(*entry), GFP_NOIO);
+	if (!entry)
+		return NULL;
+	entry->header = alloc_page(GFP_NOIO);
+	if (!entry->header) {
+		kfree(entry);
+		return NULL;
+	}
+	kref_init(&entry->kref);
+	entry->journal = journal;
+	entry->peer_req = peer_req;
+	entry->peer_device = peer_req->peer_device;
+	entry->sector = peer_req->i.sector;
+	entry->size = size;
+	entry->block_id = peer_req->block_id;
+	entry->may_set_in_sync = !!(peer_req->flags & EE_MAY_SET_IN_SYNC);
+
+	page = peer_req->page_chain.head;
+	page_chain_for_each(page) {
+		void *addr = kmap_atomic(page);
+
+		data_crc = crc32c(data_crc, addr + page_chain_offset(page), page_chain_size(page));
+		kunmap_atomic(addr);
+	}
+
+	blocks = 1 + DIV_ROUND_UP(size, JOURNAL_BLOCK_SIZE);
+	for (;;) {
+		bool need_super = false;
+
+		spin_lock_irq(&journal->lock);
+		if (journal->failed || journal->stopped)
+			goto fail_unlock;
+		if (journal_reserve(journal, blocks, &start, &need_super))
+			break;
+		if (!need_super)
+			journal->waited++;
+		spin_unlock_irq(&journal->lock);
+
+		if (need_super) {
+			if (journal_write_super(journal, false))
+				goto fail;
+			continue;
+		}
+		wait_event(journal->wait, journal_has_room(journal, blocks));
+	}
+	if (list_empty(&journal->entries)) {
+		journal->tail = start;
+		journal->tail_seq = journal->next_seq;
+	}
+	entry->seq = journal->next_seq++;
+	entry->start = start;
+	entry->end = start + blocks;
+	journal->head = entry->end;
+	journal->appended++;
+	list_add_tail(&entry->list, &journal->entries);
+	spin_unlock_irq(&journal->lock);
+
+	rec = page_address(entry->header);
+	memset(rec, 0, JOURNAL_BLOCK_SIZE);
+	rec->magic = cpu_to_be32(JOURNAL_RECORD_MAGIC);
+	rec->size = cpu_to_be32(size);
+	rec->nonce = cpu_to_be64(journal->nonce);
+	rec->seq = cpu_to_be64(entry->seq);
+	rec->sector = cpu_to_be64(entry->sector);
+	rec->data_crc = cpu_to_be32(data_crc);
+	rec->crc = cpu_to_be32(journal_crc(rec, offsetof(struct journal_record, crc)));
+
+	bios = journal_bio_alloc(journal, journal_sector(journal, start), nr_pages);
+	if (!bios)
+		goto fail_reserved;
+	if (journal_add_page(journal, &bios, entry->header, JOURNAL_BLOCK_SIZE, 0, nr_pages))
+		goto fail_bios;
+	page = peer_req->page_chain.head;
+	page_chain_for_each(page) {
+		if (journal_add_page(journal, &bios, page, page_chain_size(page),
+				     page_chain_offset(page), nr_pages))
+			goto fail_bios;
+	}
+	pad = (blocks - 1) * JOURNAL_BLOCK_SIZE - size;
+	while (pad) {
+		unsigned int len = min_t(unsigned int, pad, PAGE_SIZE);
+
+		if (journal_add_page(journal, &bios, ZERO_PAGE(0), len, 0, nr_pages))
+			goto fail_bios;
+		pad -= len;
+	}
+
+	bios->bi_private = entry;
+	bios->bi_end_io = drbd_journal_endio;
+	peer_req->journal = entry;
+	return bios;
+
+fail_bios:
+	while (bios) {
+		struct bio *bio = bios;
+
+		bios = bio->bi_next;
+		bio_put(bio);
+	}
+fail_reserved:
+	/* gives back the ring space, and drops the only reference */
+	drbd_journal_written_back(entry);
+	return NULL;
+
+fail_unlock:
+	spin_unlock_irq(&journal->lock);
+fail:
+	journal_entry_release(&entry->kref);
+	return NULL;
+}
+
+void drbd_journal_submit(struct bio *bios)
+{
+	while (bios) {
+		struct bio *bio = bios;
+
+		bios = bio->bi_next;
+		bio->bi_next = NULL;
+		submit_bio(bio);
+	}
+}
+
+static bool journal_empty(struct drbd_journal *journal)
+{
+	bool rv;
+
+	spin_lock_irq(&journal->lock);
+	rv = list_empty(&journal->entries);
+	spin_unlock_irq(&journal->lock);
+	return rv;
+}
+
+/* Wait until all journaled writes are written back, and make the journal
+ * forget them.  Caller holds a reference on device->ldev. */
+void drbd_journal_drain(struct drbd_device *device)
+{
+	struct drbd_journal *journal = device->ldev->journal;
+
+	if (!journal)
+		return;
+	wait_event(journal->wait, journal_empty(journal));
+	if (!journal->failed)
+		journal_write_super(journal, false);
+}
+
+static bool __journal_overlaps(struct drbd_journal *journal, sector_t sector, unsigned int size)
+{
+	struct drbd_journal_entry *e;
+
+	list_for_each_entry(e, &journal->entries, list) {
+		if (!e->written_back &&
+		    e->sector < sector + (size >> 9) && sector < e->sector + (e->size >> 9))
+			return true;
+	}
+	return false;
+}
+
+static bool journal_overlaps(struct drbd_journal *journal, sector_t sector, unsigned int size)
+{
+	bool rv;
+
+	spin_lock_irq(&journal->lock);
+	rv = __journal_overlaps(journal, sector, size);
+	spin_unlock_irq(&journal->lock);
+	return rv;
+}
+
+/**
+ * drbd_journal_wait_read() - Wait for journaled writes a peer read overlaps
+ * @device:	DRBD device, caller holds a reference on device->ldev
+ * @sector:	start of the peer read
+ * @size:	its size in bytes
+ *
+ * A journaled write got its P_WRITE_ACK before the backing device has the
+ * data.  Reading the backing device before that write completed would
+ * return what was there before.
+ */
+void drbd_journal_wait_read(struct drbd_device *device, sector_t sector, unsigned int size)
+{
+	struct drbd_journal *journal = device->ldev->journal;
+
+	if (!journal)
+		return;
+
+	spin_lock_irq(&journal->lock);
+	if (!__journal_overlaps(journal, sector, size)) {
+		spin_unlock_irq(&journal->lock);
+		return;
+	}
+	journal->read_waiters++;
+	journal->waited_reads++;
+	spin_unlock_irq(&journal->lock);
+
+	wait_event(journal->wait, !journal_overlaps(journal, sector, size));
+
+	spin_lock_irq(&journal->lock);
+	journal->read_waiters--;
+	spin_unlock_irq(&journal->lock);
+}
+
+static bool journal_written_back_before(struct drbd_journal *journal, u64 seq)
+{
+	bool rv;
+
+	spin_lock_irq(&journal->lock);
+	rv = journal->failed || journal->tail_seq >= seq;
+	spin_unlock_irq(&journal->lock);
+	return rv;
+}
+
+static void journal_discard_work(struct work_struct *ws)
+{
+	struct drbd_journal *journal = container_of(ws, struct drbd_journal, discard_work);
+	struct journal_discard *d;
+	bool need_super;
+
+	for (;;) {
+		spin_lock_irq(&journal->lock);
+		d = list_first_entry_or_null(&journal->discards, struct journal_discard, list);
+		spin_unlock_irq(&journal->lock);
+		if (!d)
+			break;
+
+		wait_event(journal->wait, journal_written_back_before(journal, d->seq));
+		spin_lock_irq(&journal->lock);
+		need_super = !journal->failed && journal->sb_tail_seq < d->seq;
+		spin_unlock_irq(&journal->lock);
+		/* one superblock write for all discards queued up meanwhile */
+		if (need_super)
+			journal_write_super(journal, false);
+
+		spin_lock_irq(&journal->lock);
+		list_del(&d->list);
+		spin_unlock_irq(&journal->lock);
+		drbd_submit_peer_discard(d->peer_req);
+		kfree(d);
+	}
+}
+
+/**
+ * drbd_journal_defer_discard() - Keep older records from being replayed over a discard
+ * @peer_req:	discard, zero-out or write-same peer request, not journaled
+ *
+ * Returns false if no record before @peer_req can be replayed, and the caller
+ * submits it right away.  Otherwise, it gets submitted from the submit
+ * workqueue once these records are written back, and the superblock says so.
+ * The receiver does not wait for that.
+ */
+bool drbd_journal_defer_discard(struct drbd_peer_request *peer_req)
+{
+	struct drbd_device *device = peer_req->peer_device->device;
+	struct drbd_journal *journal = device->ldev->journal;
+	struct journal_discard *d;
+	bool replayable;
+
+	if (!journal)
+		return false;
+
+	spin_lock_irq(&journal->lock);
+	replayable = !journal->failed &&
+		(!list_empty(&journal->discards) || journal->sb_tail_seq < journal->next_seq);
+	spin_unlock_irq(&journal->lock);
+	if (!replayable)
+		return false;
+
+	d = kmalloc(sizeof(*d), GFP_NOIO);
+	if (!d) {
+		drbd_journal_drain(device);
+		return false;
+	}
+	d->peer_req = peer_req;
+
+	spin_lock_irq(&journal->lock);
+	d->seq = journal->next_seq;
+	list_add_tail(&d->list, &journal->discards);
+	journal->deferred++;
+	spin_unlock_irq(&journal->lock);
+
+	queue_work(device->submit.wq, &journal->discard_work);
+	return true;
+}
+
+struct journal_replay_rec {
+	u64 seq;
+	u64 block;
+	u64 sector;
+	u32 size;
+	u32 data_crc;
+};
+
+static int replay_rec_cmp(const void *a, const void *b)
+{
+	const struct journal_replay_rec *ra = a, *rb = b;
+
+	return ra->seq < rb->seq ? -1 : ra->seq > rb->seq;
+}
+
+static bool journal_record_valid(struct drbd_journal *journal, struct journal_record *rec,
+				 u64 nonce, u64 block)
+{
+	u32 size = be32_to_cpu(rec->size);
+
+	return be32_to_cpu(rec->magic) == JOURNAL_RECORD_MAGIC &&
+		be64_to_cpu(rec->nonce) == nonce &&
+		be32_to_cpu(rec->crc) == journal_crc(rec, offsetof(struct journal_record, crc)) &&
+		size && size <= DRBD_MAX_BIO_SIZE && IS_ALIGNED(size, 512) &&
+		block + 1 + DIV_ROUND_UP(size, JOURNAL_BLOCK_SIZE) <= journal->nr_blocks;
+}
+
+/* Write all records from @sb's tail on to the backing device, in sequence
+ * order.  Records that were torn by the crash were not acked; skip them. */
+static int journal_replay(struct drbd_journal *journal, struct journal_super *sb)
+{
+	const unsigned int chunk_blocks = DRBD_MAX_BIO_SIZE >> JOURNAL_BLOCK_SHIFT;
+	u64 nonce = be64_to_cpu(sb->nonce), tail_seq = be64_to_cpu(sb->tail_seq);
+	struct journal_replay_rec *recs = NULL, *tmp;
+	unsigned int nr = 0, max = 0, i, replayed = 0;
+	u64 block = 0, chunk = 0, chunk_end = 0;
+	void *buf;
+	int err = 0;
+
+	buf = vmalloc(DRBD_MAX_BIO_SIZE);
+	if (!buf)
+		return -ENOMEM;
+
+	while (block < journal->nr_blocks) {
+		struct journal_record *rec;
+
+		if (block >= chunk_end) {
+			chunk = block;
+			chunk_end = min_t(u64, chunk + chunk_blocks, journal->nr_blocks);
+			err = journal_sync_io(journal->bdev, REQ_OP_READ, journal_sector(journal, chunk),
+					      buf, (chunk_end - chunk) << JOURNAL_BLOCK_SHIFT);
+			if (err)
+				goto out;
+		}
+		rec = buf + ((block - chunk) << JOURNAL_BLOCK_SHIFT);
+		if (!journal_record_valid(journal, rec, nonce, block) ||
+		    be64_to_cpu(rec->seq) < tail_seq) {
+			block++;
+			continue;
+		}
+
+		if (nr == max) {
+			max = max ? 2 * max : 1024;
+			tmp = kvmalloc_array(max, sizeof(*recs), GFP_KERNEL);
+			if (!tmp) {
+				err = -ENOMEM;
+				goto out;
+			}
+			if (recs)
+				memcpy(tmp, recs, nr * sizeof(*recs));
+			kvfree(recs);
+			recs = tmp;
+		}
+		recs[nr].seq = be64_to_cpu(rec->seq);
+		recs[nr].block = block;
+		recs[nr].sector = be64_to_cpu(rec->sector);
+		recs[nr].size = be32_to_cpu(rec->size);
+		recs[nr].data_crc = be32_to_cpu(rec->data_crc);
+		block += 1 + DIV_ROUND_UP(recs[nr].size, JOURNAL_BLOCK_SIZE);
+		nr++;
+	}
+
+	sort(recs, nr, sizeof(*recs), replay_rec_cmp, NULL);
+
+	for (i = 0; i < nr; i++) {
+		struct journal_replay_rec *r = &recs[i];
+
+		err = journal_sync_io(journal->bdev, REQ_OP_READ, journal_sector(journal, r->block + 1),
+				      buf, round_up(r->size, JOURNAL_BLOCK_SIZE));
+		if (err)
+			goto out;
+		if (crc32c(0, buf, r->size) != r->data_crc) {
+			drbd_warn(journal->device, "journal: skipping torn record %llu\n", r->seq);
+			continue;
+		}
+		err = journal_sync_io(journal->backing, REQ_OP_WRITE, r->sector, buf, r->size);
+		if (err)
+			goto out;
+		replayed++;
+		journal->next_seq = r->seq + 1;
+	}
+	if (replayed)
+		err = journal_sync_io(journal->backing, REQ_OP_FLUSH | REQ_PREFLUSH, 0, NULL, 0);
+
+	journal->replayed = replayed;
+	drbd_info(journal->device, "journal: replayed %u of %u records\n", replayed, nr);
+out:
+	kvfree(recs);
+	vfree(buf);
+	return err;
+}
+
+/* Returns the journal path configured for @minor in @buf, or false. */
+static bool journal_configured(unsigned int minor, char *buf, size_t size)
+{
+	char *params, *p, *tok, *path;
+	unsigned int m;
+	bool found = false;
+
+	params = kstrdup(drbd_write_journal, GFP_KERNEL);
+	if (!params)
+		return false;
+	p = params;
+	while ((tok = strsep(&p, ",")) != NULL) {
+		path = strchr(tok, ':');
+		if (!path)
+			continue;
+		*path++ = 0;
+		if (kstrtouint(strim(tok), 10, &m) || m != minor)
+			continue;
+		strscpy(buf, strim(path), size);
+		found = buf[0] != 0;
+		break;
+	}
+	kfree(params);
+	return found;
+}
+
+static void journal_free(struct drbd_journal *journal)
+{
+	if (journal->bdev)
+		blkdev_put(journal->bdev, JOURNAL_FMODE);
+	if (journal->sb_page)
+		__free_page(journal->sb_page);
+	kfree(journal);
+}
+
+/**
+ * drbd_journal_attach() - Open the journal configured for a device, if any
+ * @device:	DRBD device.
+ * @nbc:	The backing device about to be attached, meta data already read.
+ *
+ * Replays the journal if it was not closed cleanly.
+ */
+int drbd_journal_attach(struct drbd_device *device, struct drbd_backing_dev *nbc)
+{
+	struct drbd_journal *journal;
+	struct journal_super *sb;
+	struct block_device *bdev;
+	char path[128];
+	int retcode;
+	int err;
+
+	if (!journal_configured(device->minor, path, sizeof(path)))
+		return NO_ERROR;
+
+	journal = kzalloc(sizeof(*journal), GFP_KERNEL);
+	if (!journal)
+		return ERR_NOMEM;
+	spin_lock_init(&journal->lock);
+	init_waitqueue_head(&journal->wait);
+	INIT_LIST_HEAD(&journal->entries);
+	INIT_LIST_HEAD(&journal->discards);
+	INIT_WORK(&journal->discard_work, journal_discard_work);
+	mutex_init(&journal->sb_mutex);
+	journal->device = device;
+	journal->backing = nbc->backing_bdev;
+	journal->device_uuid = nbc->md.device_uuid;
+	journal->data_uuid = nbc->md.current_uuid & ~UUID_PRIMARY;
+	journal->prev_data_uuid = journal->data_uuid;
+	journal->sb_page = alloc_page(GFP_KERNEL);
+	if (!journal->sb_page) {
+		retcode = ERR_NOMEM;
+		goto fail;
+	}
+
+	bdev = blkdev_get_by_path(path, JOURNAL_FMODE, journal);
+	if (IS_ERR(bdev)) {
+		drbd_err(device, "open(\"%s\") for the journal failed with %ld\n",
+			 path, PTR_ERR(bdev));
+		retcode = ERR_OPEN_DISK;
+		goto fail;
+	}
+	journal->bdev = bdev;
+
+	if (drbd_get_capacity(bdev) < JOURNAL_MIN_SIZE >> 9) {
+		drbd_err(device, "journal %s is smaller than %u MiB\n", path, JOURNAL_MIN_SIZE >> 20);
+		retcode = ERR_DISK_TOO_SMALL;
+		goto fail;
+	}
+	journal->nr_blocks = (drbd_get_capacity(bdev) >> (JOURNAL_BLOCK_SHIFT - 9)) - 1;
+
+	sb = page_address(journal->sb_page);
+	err = journal_sync_io(bdev, REQ_OP_READ, 0, sb, JOURNAL_BLOCK_SIZE);
+	if (err) {
+		retcode = ERR_IO_MD_DISK;
+		goto fail;
+	}
+
+	journal->next_seq = 1;
+	if (be32_to_cpu(sb->magic) == JOURNAL_MAGIC &&
+	    be32_to_cpu(sb->version) == JOURNAL_VERSION &&
+	    be32_to_cpu(sb->crc) == journal_crc(sb, offsetof(struct journal_super, crc))) {
+		journal->next_seq = be64_to_cpu(sb->tail_seq);
+
+		if (!(be32_to_cpu(sb->flags) & JF_CLEAN)) {
+			if (be64_to_cpu(sb->device_uuid) != journal->device_uuid ||
+			    be64_to_cpu(sb->nr_blocks) != journal->nr_blocks) {
+				drbd_err(device, "journal %s holds unreplayed writes of another device\n",
+					 path);
+				retcode = ERR_OPEN_DISK;
+				goto fail;
+			}
+			if (be64_to_cpu(sb->data_uuid) != journal->data_uuid &&
+			    be64_to_cpu(sb->prev_data_uuid) != journal->data_uuid) {
+				drbd_warn(device, "journal %s is of data generation %016llX, not replaying it onto %016llX\n",
+					  path, (unsigned long long)be64_to_cpu(sb->data_uuid),
+					  (unsigned long long)journal->data_uuid);
+			} else {
+				err = journal_replay(journal, sb);
+				if (err) {
+					drbd_err(device, "journal replay failed: %d\n", err);
+					retcode = ERR_IO_MD_DISK;
+					goto fail;
+				}
+			}
+		}
+	}
+
+	/* A new nonce invalidates all records written before. */
+	get_random_bytes(&journal->nonce, sizeof(journal->nonce));
+	journal->tail_seq = journal->next_seq;
+
+	err = journal_write_super(journal, false);
+	if (err) {
+		retcode = ERR_IO_MD_DISK;
+		goto fail;
+	}
+	nbc->journal = journal;
+
+	drbd_info(device, "using %s as write journal, %llu MiB\n", path,
+		  journal->nr_blocks >> (20 - JOURNAL_BLOCK_SHIFT));
+	return NO_ERROR;
+
+fail:
+	journal_free(journal);
+	return retcode;
+}
+
+void drbd_journal_close(struct drbd_backing_dev *ldev)
+{
+	struct drbd_journal *journal = ldev->journal;
+
+	if (!journal)
+		return;
+
+	flush_work(&journal->discard_work);
+	D_ASSERT(journal->device, list_empty(&journal->entries));
+	if (!journal->failed)
+		journal_write_super(journal, true);
+	ldev->journal = NULL;
+	journal_free(journal);
+}
+
+void drbd_journal_seq_show(struct seq_file *m, struct drbd_journal *journal)
+{
+	spin_lock_irq(&journal->lock);
+	seq_printf(m, "device: %pg\n", journal->bdev);
+	seq_printf(m, "state: %s\n", journal->failed ? "failed" :
+		   journal->stopped ? "stopped" : "active");
+	seq_printf(m, "blocks: %llu\n", journal->nr_blocks);
+	seq_printf(m, "in_use: %llu\n", journal->head - journal->tail);
+	seq_printf(m, "next_seq: %llu\n", journal->next_seq);
+	seq_printf(m, "tail_seq: %llu\n", journal->tail_seq);
+	seq_printf(m, "appended: %llu\n", journal->appended);
+	seq_printf(m, "early_acks: %llu\n", journal->early_acks);
+	seq_printf(m, "waited: %llu\n", journal->waited);
+	seq_printf(m, "superblock_writes: %llu\n", journal->sb_writes);
+	seq_printf(m, "deferred_discards: %llu\n", journal->deferred);
+	seq_printf(m, "waited_reads: %llu\n", journal->waited_reads);
+	seq_printf(m, "replayed: %llu\n", journal->replayed);
+	spin_unlock_irq(&journal->lock);
+}
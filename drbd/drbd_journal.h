@@ -0,0 +1,49 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+#ifndef DRBD_JOURNAL_H
+#define DRBD_JOURNAL_H
+
+struct drbd_journal;
+
+/* Whoever sets it first answers the peer write: the ack sender with the
+ * early P_WRITE_ACK, or drbd_journal_write_error() leaving it to
+ * e_end_block(). */
+#define JE_ACK_CLAIMED		0
+
+/* One record in the write journal, for one peer write.
+ * Referenced by the journal until the peer write reached the backing device
+ * and the tail moved past it, and by connection->journal_acks until the
+ * early P_WRITE_ACK was sent. */
+struct drbd_journal_entry {
+	struct list_head list;		/* journal->entries, in seq order */
+	struct list_head ack_list;	/* connection->journal_acks */
+	struct kref kref;
+	unsigned long flags;		/* JE_ACK_CLAIMED */
+	struct drbd_journal *journal;
+	struct drbd_peer_request *peer_req;	/* until written back */
+	struct page *header;
+	u64 seq;
+	u64 start, end;			/* absolute ring block numbers */
+	bool written_back;
+
+	/* for the early P_WRITE_ACK, copied from the peer request */
+	struct drbd_peer_device *peer_device;
+	sector_t sector;
+	unsigned int size;
+	u64 block_id;
+	bool may_set_in_sync;
+};
+
+extern int drbd_journal_attach(struct drbd_device *device, struct drbd_backing_dev *nbc);
+extern void drbd_journal_close(struct drbd_backing_dev *ldev);
+extern struct bio *drbd_journal_prepare(struct drbd_peer_request *peer_req);
+extern void drbd_journal_submit(struct bio *bios);
+extern void drbd_journal_data_generation(struct drbd_backing_dev *ldev, u64 uuid);
+extern void drbd_journal_written_back(struct drbd_journal_entry *entry);
+extern void drbd_journal_write_error(struct drbd_peer_request *peer_req);
+extern void drbd_journal_put_entry(struct drbd_journal_entry *entry);
+extern void drbd_journal_drain(struct drbd_device *device);
+extern void drbd_journal_wait_read(struct drbd_device *device, sector_t sector, unsigned int size);
+extern bool drbd_journal_defer_discard(struct drbd_peer_request *peer_req);
+extern void drbd_journal_seq_show(struct seq_file *m, struct drbd_journal *journal);
+
+#endif /* DRBD_JOURNAL_H */
@@ -22,6 +22,7 @@
 #include <linux/uaccess.h>
 #include <asm/types.h>
 #include <net/sock.h>
+#include <linux/inetdevice.h>
 #include <linux/ctype.h>
 #include <linux/fs.h>
 #include <linux/file.h>
@@ -52,6 +53,8 @@
 #include "drbd_debugfs.h"
 #include "drbd_meta_data.h"
 #include "drbd_dax_pmem.h"
+#include "drbd_journal.h"
+#include "drbd_intent.h"
 
 static int drbd_open(struct block_device *bdev, fmode_t mode);
 static void drbd_release(struct gendisk *gd, fmode_t mode);
@@ -103,6 +106,43 @@ char drbd_usermode_helper[80] = "/sbin/drbdadm";
 module_param_named(minor_count, drbd_minor_count, uint, 0444);
 module_param_string(usermode_helper, drbd_usermode_helper, sizeof(drbd_usermode_helper), 0644);
 
+/* Reply to any resync request for an all zero block with P_RS_DEALLOCATED,
+ * if the peer understands it; not only to P_RS_THIN_REQ. */
+bool drbd_resync_zero_detect = true;
+MODULE_PARM_DESC(resync_zero_detect, "Send all zero resync blocks as deallocated ranges");
+module_param_named(resync_zero_detect, drbd_resync_zero_detect, bool, 0644);
+
+/* Run the ack_sender work of all connections on one per-CPU workqueue instead
+ * of an ordered workqueue (and its rescuer thread) per connection. Taken into
+ * account when a connection gets established. */
+bool drbd_shared_ack_sender;
+MODULE_PARM_DESC(shared_ack_sender, "Use one shared workqueue for the ack_sender of all connections");
+module_param_named(shared_ack_sender, drbd_shared_ack_sender, bool, 0644);
+
+/* Check the data-integrity-alg digest of received writes on drbd_verify_wq,
+ * while the receiver goes on reading; the write is submitted once it passed.
+ * Writes that get a P_RECV_ACK (protocol B) are still checked before that. */
+bool drbd_async_integrity = true;
+MODULE_PARM_DESC(async_integrity, "Verify data integrity digests of received writes in parallel");
+module_param_named(async_integrity, drbd_async_integrity, bool, 0644);
+
+/* Read the control stream (and optionally the data stream) in large chunks
+ * into a buffer and parse as many packets from it as are complete, instead of
+ * one receive call per header and per payload. Taken into account when the
+ * receiving thread starts on a connection. */
+bool drbd_buffered_control_recv = true;
+MODULE_PARM_DESC(buffered_control_recv, "Read ahead on the control stream");
+module_param_named(buffered_control_recv, drbd_buffered_control_recv, bool, 0644);
+bool drbd_buffered_data_recv;
+MODULE_PARM_DESC(buffered_data_recv, "Read ahead on the data stream");
+module_param_named(buffered_data_recv, drbd_buffered_data_recv, bool, 0644);
+
+/* How long the sender may hold back small packets on the data stream, to send
+ * them with the next ones in one go, while it has more work queued. */
+unsigned int drbd_send_batch_usecs = 50;
+MODULE_PARM_DESC(send_batch_usecs, "Latency budget for batching packets in the sender (0 = off)");
+module_param_named(send_batch_usecs, drbd_send_batch_usecs, uint, 0644);
+
 static int param_set_drbd_protocol_version(const char *s, const struct kernel_param *kp)
 {
 	unsigned long long tmp;
@@ -129,12 +169,73 @@ const struct kernel_param_ops param_ops_drbd_protocol_version = {
 unsigned int drbd_protocol_version_min = PRO_VERSION_MIN;
 module_param_named(protocol_version_min, drbd_protocol_version_min, drbd_protocol_version, 0644);
 
+static const char * const drbd_cpu_policy_names[] = {
+	[CPU_POLICY_RESOURCE] = "resource",
+	[CPU_POLICY_SPREAD] = "spread",
+	[CPU_POLICY_NUMA] = "numa",
+	[CPU_POLICY_EXPLICIT] = "explicit",
+};
+
+const char *drbd_cpu_policy_name(enum drbd_cpu_policy policy)
+{
+	return drbd_cpu_policy_names[policy];
+}
+
+static int param_set_drbd_cpu_policy(const char *s, const struct kernel_param *kp)
+{
+	enum drbd_cpu_policy *res = kp->arg;
+	struct drbd_resource *resource;
+	int policy;
+
+	/* explicit masks are per connection, not a default for a thread class */
+	policy = __sysfs_match_string(drbd_cpu_policy_names, CPU_POLICY_EXPLICIT, s);
+	if (policy < 0)
+		return policy;
+	*res = policy;
+
+	/* drbd_resources is statically initialized, this also works at load time */
+	rcu_read_lock();
+	for_each_resource_rcu(resource, &drbd_resources)
+		drbd_reset_cpu_masks(resource);
+	rcu_read_unlock();
+	return 0;
+}
+
+static int param_get_drbd_cpu_policy(char *buffer, const struct kernel_param *kp)
+{
+	enum drbd_cpu_policy *policy = kp->arg;
+
+	return sprintf(buffer, "%s\n", drbd_cpu_policy_names[*policy]);
+}
+
+#define param_check_drbd_cpu_policy(name, p) __param_check(name, p, enum drbd_cpu_policy)
+
+static const struct kernel_param_ops param_ops_drbd_cpu_policy = {
+	.set = param_set_drbd_cpu_policy,
+	.get = param_get_drbd_cpu_policy,
+};
+
+/* Placement of the threads of each class, unless the resource has a cpu-mask
+ * configured or the connection an explicit one (debugfs cpu_placement). */
+static enum drbd_cpu_policy drbd_cpu_policy_worker = CPU_POLICY_RESOURCE;
+static enum drbd_cpu_policy drbd_cpu_policy_receiver = CPU_POLICY_RESOURCE;
+static enum drbd_cpu_policy drbd_cpu_policy_ack_receiver = CPU_POLICY_RESOURCE;
+static enum drbd_cpu_policy drbd_cpu_policy_sender = CPU_POLICY_RESOURCE;
+MODULE_PARM_DESC(cpu_policy_worker, "CPU placement of worker threads: resource, spread or numa");
+MODULE_PARM_DESC(cpu_policy_receiver, "CPU placement of receiver threads: resource, spread or numa");
+MODULE_PARM_DESC(cpu_policy_ack_receiver, "CPU placement of ack_receiver threads: resource, spread or numa");
+MODULE_PARM_DESC(cpu_policy_sender, "CPU placement of sender threads: resource, spread or numa");
+module_param_named(cpu_policy_worker, drbd_cpu_policy_worker, drbd_cpu_policy, 0644);
+module_param_named(cpu_policy_receiver, drbd_cpu_policy_receiver, drbd_cpu_policy, 0644);
+module_param_named(cpu_policy_ack_receiver, drbd_cpu_policy_ack_receiver, drbd_cpu_policy, 0644);
+module_param_named(cpu_policy_sender, drbd_cpu_policy_sender, drbd_cpu_policy, 0644);
+
 
 /* in 2.6.x, our device mapping and config info contains our virtual gendisks
  * as member "struct gendisk *vdisk;"
  */
 struct idr drbd_devices;
-struct list_head drbd_resources;
+LIST_HEAD(drbd_resources);
 
 struct kmem_cache *drbd_request_cache;
 struct kmem_cache *drbd_ee_cache;	/* peer requests */
@@ -142,6 +243,8 @@ struct kmem_cache *drbd_bm_ext_cache;	/* bitmap extents */
 struct kmem_cache *drbd_al_ext_cache;	/* activity log extents */
 mempool_t drbd_request_mempool;
 mempool_t drbd_ee_mempool;
+struct workqueue_struct *drbd_ack_sender_wq;
+struct workqueue_struct *drbd_verify_wq;
 mempool_t drbd_md_io_page_pool;
 struct bio_set drbd_md_io_bio_set;
 struct bio_set drbd_io_bio_set;
@@ -624,6 +727,7 @@ restart:
 
 	thi->task = NULL;
 	thi->t_state = NONE;
+	thi->cpu = -1;
 	smp_mb();
 
 	if (connection)
@@ -651,6 +755,9 @@ static void drbd_thread_init(struct drbd_resource *resource, struct drbd_thread
 	thi->function = func;
 	thi->resource = resource;
 	thi->connection = NULL;
+	thi->placement = CPU_POLICY_RESOURCE;
+	thi->numa_node = NUMA_NO_NODE;
+	thi->cpu = -1;
 	thi->name = name;
 }
 
@@ -759,6 +866,51 @@ void _drbd_thread_stop(struct drbd_thread *thi, int restart, int wait)
 }
 
 #ifdef CONFIG_SMP
+static void count_spread_thread(unsigned int *threads_per_cpu, struct drbd_thread *thi,
+				struct drbd_thread *self)
+{
+	int cpu = READ_ONCE(thi->cpu);
+
+	if (thi != self && cpu >= 0)
+		threads_per_cpu[cpu]++;
+}
+
+/* Returns the least used online CPU, or -1. A CPU counts as used once for each
+ * resource cpu_mask containing it, and for each thread placed on it by
+ * CPU_POLICY_SPREAD (except @self). */
+static int drbd_least_used_cpu(struct drbd_thread *self)
+{
+	unsigned int *threads_per_cpu, cpu, min = ~0;
+	struct drbd_resource *resource;
+	struct drbd_connection *connection;
+	int min_index = -1;
+
+	threads_per_cpu = kcalloc(nr_cpu_ids, sizeof(*threads_per_cpu), GFP_KERNEL);
+	if (!threads_per_cpu)
+		return -1;
+
+	rcu_read_lock();
+	for_each_resource_rcu(resource, &drbd_resources) {
+		for_each_cpu(cpu, resource->cpu_mask)
+			threads_per_cpu[cpu]++;
+		count_spread_thread(threads_per_cpu, &resource->worker, self);
+		for_each_connection_rcu(connection, resource) {
+			count_spread_thread(threads_per_cpu, &connection->receiver, self);
+			count_spread_thread(threads_per_cpu, &connection->ack_receiver, self);
+			count_spread_thread(threads_per_cpu, &connection->sender, self);
+		}
+	}
+	rcu_read_unlock();
+	for_each_online_cpu(cpu) {
+		if (threads_per_cpu[cpu] < min) {
+			min = threads_per_cpu[cpu];
+			min_index = cpu;
+		}
+	}
+	kfree(threads_per_cpu);
+	return min_index;
+}
+
 /**
  * drbd_calc_cpu_mask() - Generate CPU masks, spread over all CPUs
  *
@@ -767,56 +919,176 @@ void _drbd_thread_stop(struct drbd_thread *thi, int restart, int wait)
  */
 static void drbd_calc_cpu_mask(cpumask_var_t *cpu_mask)
 {
-	unsigned int *resources_per_cpu, min_index = ~0;
+	int cpu = drbd_least_used_cpu(NULL);
 
-	resources_per_cpu = kzalloc(nr_cpu_ids * sizeof(*resources_per_cpu), GFP_KERNEL);
-	if (resources_per_cpu) {
-		struct drbd_resource *resource;
-		unsigned int cpu, min = ~0;
+	if (cpu < 0) {
+		cpumask_setall(*cpu_mask);
+		return;
+	}
+	cpumask_set_cpu(cpu, *cpu_mask);
+}
 
-		rcu_read_lock();
-		for_each_resource_rcu(resource, &drbd_resources) {
-			for_each_cpu(cpu, resource->cpu_mask)
-				resources_per_cpu[cpu]++;
-		}
-		rcu_read_unlock();
-		for_each_online_cpu(cpu) {
-			if (resources_per_cpu[cpu] < min) {
-				min = resources_per_cpu[cpu];
-				min_index = cpu;
-			}
+/* Node of the NIC carrying the established path, if it has a local address.
+ * IPv6 would need ipv6_dev_find(), i.e. a hard dependency on ipv6.ko. */
+static int connection_nic_node(struct drbd_connection *connection)
+{
+	struct sockaddr_storage addr = { .ss_family = AF_UNSPEC };
+	struct drbd_path *path;
+	struct net_device *dev;
+	int node = NUMA_NO_NODE;
+
+	rcu_read_lock();
+	list_for_each_entry_rcu(path, &connection->transport.paths, list) {
+		if (path->established) {
+			addr = path->my_addr;
+			break;
 		}
-		kfree(resources_per_cpu);
 	}
-	if (min_index == ~0) {
-		cpumask_setall(*cpu_mask);
-		return;
+	rcu_read_unlock();
+
+	if (addr.ss_family != AF_INET)
+		return NUMA_NO_NODE;
+
+	dev = ip_dev_find(&init_net, ((struct sockaddr_in *)&addr)->sin_addr.s_addr);
+	if (dev) {
+		node = dev_to_node(&dev->dev);
+		dev_put(dev);
+	}
+	return node;
+}
+
+static int resource_backing_dev_node(struct drbd_resource *resource)
+{
+	struct drbd_device *device;
+	int vnr, node = NUMA_NO_NODE;
+
+	rcu_read_lock();
+	idr_for_each_entry(&resource->devices, device, vnr) {
+		if (!get_ldev(device))
+			continue;
+		node = device->ldev->backing_bdev->bd_disk->node_id;
+		put_ldev(device);
+		if (node != NUMA_NO_NODE)
+			break;
 	}
-	cpumask_set_cpu(min_index, *cpu_mask);
+	rcu_read_unlock();
+	return node;
+}
+
+static enum drbd_cpu_policy thread_cpu_policy(struct drbd_thread *thi)
+{
+	struct drbd_connection *connection = thi->connection;
+
+	if (!connection)
+		return drbd_cpu_policy_worker;
+	if (thi == &connection->receiver)
+		return drbd_cpu_policy_receiver;
+	if (thi == &connection->ack_receiver)
+		return drbd_cpu_policy_ack_receiver;
+	return drbd_cpu_policy_sender;
 }
 
 /**
  * drbd_thread_current_set_cpu() - modifies the cpu mask of the _current_ thread
- * @device:	DRBD device.
  * @thi:	drbd_thread object
  *
  * call in the "main loop" of _all_ threads, no need for any mutex, current won't die
  * prematurely.
+ *
+ * An explicit connection->cpu_mask wins over a configured resource cpu-mask,
+ * which wins over the policy of the thread's class. Whatever can not be
+ * resolved (no CPU of that node online, no NIC known yet) falls back to
+ * resource->cpu_mask.
  */
 void drbd_thread_current_set_cpu(struct drbd_thread *thi)
 {
 	struct drbd_resource *resource = thi->resource;
+	struct drbd_connection *connection = thi->connection;
 	struct task_struct *p = current;
+	enum drbd_cpu_policy policy;
+	int node = NUMA_NO_NODE, cpu = -1;
+	cpumask_var_t cpu_mask;
 
 	if (!thi->reset_cpu_mask)
 		return;
 	thi->reset_cpu_mask = 0;
-	set_cpus_allowed_ptr(p, resource->cpu_mask);
+
+	if (!zalloc_cpumask_var(&cpu_mask, GFP_KERNEL)) {
+		thi->placement = CPU_POLICY_RESOURCE;
+		set_cpus_allowed_ptr(p, resource->cpu_mask);
+		return;
+	}
+
+	/* debugfs may change it any time */
+	if (connection) {
+		spin_lock_irq(&resource->req_lock);
+		cpumask_and(cpu_mask, connection->cpu_mask, cpu_online_mask);
+		spin_unlock_irq(&resource->req_lock);
+	}
+
+	if (!cpumask_empty(cpu_mask))
+		policy = CPU_POLICY_EXPLICIT;
+	else if (resource->res_opts.cpu_mask[0] != 0)
+		policy = CPU_POLICY_RESOURCE;
+	else
+		policy = thread_cpu_policy(thi);
+
+	switch (policy) {
+	case CPU_POLICY_EXPLICIT:
+		break;
+	case CPU_POLICY_NUMA:
+		if (connection)
+			node = connection_nic_node(connection);
+		if (node == NUMA_NO_NODE)
+			node = resource_backing_dev_node(resource);
+		if (node != NUMA_NO_NODE)
+			cpumask_and(cpu_mask, cpumask_of_node(node), cpu_online_mask);
+		break;
+	case CPU_POLICY_SPREAD:
+		cpu = drbd_least_used_cpu(thi);
+		if (cpu >= 0)
+			cpumask_set_cpu(cpu, cpu_mask);
+		break;
+	case CPU_POLICY_RESOURCE:
+		break;
+	}
+
+	if (cpumask_empty(cpu_mask)) {
+		policy = CPU_POLICY_RESOURCE;
+		node = NUMA_NO_NODE;
+		cpu = -1;
+		cpumask_copy(cpu_mask, resource->cpu_mask);
+	}
+
+	thi->placement = policy;
+	thi->numa_node = node;
+	WRITE_ONCE(thi->cpu, cpu);
+	set_cpus_allowed_ptr(p, cpu_mask);
+	free_cpumask_var(cpu_mask);
 }
 #else
 #define drbd_calc_cpu_mask(A) ({})
 #endif
 
+/* Have the threads of a connection recalculate their placement */
+void conn_reset_cpu_masks(struct drbd_connection *connection)
+{
+	connection->receiver.reset_cpu_mask = 1;
+	connection->ack_receiver.reset_cpu_mask = 1;
+	connection->sender.reset_cpu_mask = 1;
+}
+
+void drbd_reset_cpu_masks(struct drbd_resource *resource)
+{
+	struct drbd_connection *connection;
+
+	resource->worker.reset_cpu_mask = 1;
+	rcu_read_lock();
+	for_each_connection_rcu(connection, resource)
+		conn_reset_cpu_masks(connection);
+	rcu_read_unlock();
+}
+
 static bool drbd_all_neighbor_secondary(struct drbd_device *device, u64 *authoritative_ptr)
 {
 	struct drbd_peer_device *peer_device;
@@ -1065,6 +1337,32 @@ static int flush_send_buffer(struct drbd_connection *connection, enum drbd_strea
 	return err;
 }
 
+/* Whether to leave the command in the send buffer, for the sender to send it
+ * together with the following ones. */
+static bool send_batched(struct drbd_connection *connection, enum drbd_stream drbd_stream)
+{
+	u64 now, budget;
+
+	if (drbd_stream != DATA_STREAM || !connection->send.batch_start_ns ||
+	    current != connection->sender.task)
+		return false;
+
+	now = ktime_get_ns();
+	budget = (u64)drbd_send_batch_usecs * NSEC_PER_USEC;
+	if (now - connection->send.batch_start_ns < budget) {
+		if (!hrtimer_active(&connection->send.batch_timer))
+			hrtimer_start(&connection->send.batch_timer,
+				      ns_to_ktime(connection->send.batch_start_ns + budget - now),
+				      HRTIMER_MODE_REL);
+		return true;
+	}
+
+	/* over budget, this one goes out with the ones before it */
+	connection->send.batch_start_ns = now;
+	connection->send.batch_flushes++;
+	return false;
+}
+
 int __send_command(struct drbd_connection *connection, int vnr,
 			  enum drbd_packet cmd, enum drbd_stream drbd_stream)
 {
@@ -1087,6 +1385,13 @@ int __send_command(struct drbd_connection *connection, int vnr,
 	prepare_header(connection, vnr, sbuf->pos, cmd,
 		       sbuf->allocated_size + sbuf->additional_size);
 
+	/* P_BARRIER closes an epoch, it is not held back for batching either.
+	   Unlike the ones above, it still respects corking. */
+	if (!flush && !corked && cmd != P_BARRIER && send_batched(connection, drbd_stream)) {
+		connection->send.batched_cmds++;
+		corked = true;
+	}
+
 	if (corked && !flush) {
 		sbuf->pos += sbuf->allocated_size;
 		sbuf->allocated_size = 0;
@@ -1133,6 +1438,59 @@ void drbd_uncork(struct drbd_connection *connection, enum drbd_stream stream)
 	mutex_unlock(&connection->mutex[stream]);
 }
 
+/* Called by the sender when it has work queued: until drbd_send_batch_end(),
+ * or for at most send_batch_usecs, its small packets on the data stream stay
+ * in the send buffer, and go out in one transport call together with the next
+ * packet's header, or before the next payload. */
+void drbd_send_batch_begin(struct drbd_connection *connection)
+{
+	if (drbd_send_batch_usecs && !connection->send.batch_start_ns)
+		connection->send.batch_start_ns = ktime_get_ns() ?: 1;
+}
+
+/* The sender may block with packets collected, in a work callback or on
+ * memory.  send_batched() arms a timer, so that they do not wait for longer
+ * than send_batch_usecs. */
+static enum hrtimer_restart send_batch_timer_fn(struct hrtimer *timer)
+{
+	struct drbd_connection *connection =
+		container_of(timer, struct drbd_connection, send.batch_timer);
+
+	queue_work(system_highpri_wq, &connection->send.batch_flush_work);
+	return HRTIMER_NORESTART;
+}
+
+static void send_batch_flush_wf(struct work_struct *ws)
+{
+	struct drbd_connection *connection =
+		container_of(ws, struct drbd_connection, send.batch_flush_work);
+
+	mutex_lock(&connection->mutex[DATA_STREAM]);
+	if (connection->send.batch_start_ns &&
+	    !test_bit(CORKED + DATA_STREAM, &connection->flags)) {
+		/* the batch goes on, with a new budget */
+		connection->send.batch_start_ns = ktime_get_ns() ?: 1;
+		connection->send.batch_flushes++;
+		flush_send_buffer(connection, DATA_STREAM);
+	}
+	mutex_unlock(&connection->mutex[DATA_STREAM]);
+}
+
+void drbd_send_batch_end(struct drbd_connection *connection)
+{
+	if (!connection->send.batch_start_ns)
+		return;
+
+	hrtimer_try_to_cancel(&connection->send.batch_timer);
+	mutex_lock(&connection->mutex[DATA_STREAM]);
+	connection->send.batch_start_ns = 0;
+	if (!test_bit(CORKED + DATA_STREAM, &connection->flags)) {
+		connection->send.batch_flushes++;
+		flush_send_buffer(connection, DATA_STREAM);
+	}
+	mutex_unlock(&connection->mutex[DATA_STREAM]);
+}
+
 int send_command(struct drbd_connection *connection, int vnr,
 		 enum drbd_packet cmd, enum drbd_stream drbd_stream)
 {
@@ -1794,11 +2152,63 @@ static void dcbp_set_pad_bits(struct p_compressed_bm *p, int n)
 	p->encoding = (p->encoding & (~0x7 << 4)) | (n << 4);
 }
 
+static void bm_rle_window_fill(struct drbd_peer_device *peer_device, struct bm_rle_window *w,
+			       unsigned long bit, struct bm_xfer_ctx *c)
+{
+	unsigned long offset, number;
+
+	w->start = bit & ~63UL;
+	w->end = w->start + BM_RLE_WINDOW_BITS;
+	offset = w->start / BITS_PER_LONG;
+	number = min_t(unsigned long, BM_RLE_WINDOW_BITS / BITS_PER_LONG, c->bm_words - offset);
+	if (number < BM_RLE_WINDOW_BITS / BITS_PER_LONG)
+		memset(w->words, 0, sizeof(w->words));
+	_drbd_bm_get_lel(peer_device, offset, number, (unsigned long *)w->words);
+}
+
+/* Find the end of the run of set (or clear) bits starting at @bit.
+ * Runs are followed word by word through the window; once a run covers a
+ * whole window it is a long one, and the bitmap's own find functions skip
+ * the rest of it more cheaply. */
+static unsigned long bm_rle_run_end(struct drbd_peer_device *peer_device, struct bm_rle_window *w,
+				    unsigned long bit, bool set, struct bm_xfer_ctx *c)
+{
+	while (bit < c->bm_bits) {
+		unsigned int i;
+		bool whole_window;
+
+		if (bit < w->start || bit >= w->end)
+			bm_rle_window_fill(peer_device, w, bit, c);
+
+		i = (bit - w->start) / 64;
+		whole_window = i == 0 && !(bit & 63);
+		for (; i < BM_RLE_WINDOW_WORDS; i++, bit = (bit | 63) + 1) {
+			u64 word = le64_to_cpu(w->words[i]);
+
+			if (set)
+				word = ~word;
+			word &= ~0ULL << (bit & 63);
+			if (word)
+				return min_t(unsigned long, (bit & ~63UL) + __ffs64(word), c->bm_bits);
+		}
+
+		if (whole_window && bit < c->bm_bits) {
+			bit = set ? _drbd_bm_find_next_zero(peer_device, bit)
+				  : _drbd_bm_find_next(peer_device, bit);
+			if (bit == DRBD_END_OF_BITMAP)
+				bit = c->bm_bits;
+			return bit;
+		}
+	}
+	return c->bm_bits;
+}
+
 static int fill_bitmap_rle_bits(struct drbd_peer_device *peer_device,
 				struct p_compressed_bm *p,
 				unsigned int size,
 				struct bm_xfer_ctx *c)
 {
+	struct bm_rle_window w = { };
 	struct bitstream bs;
 	unsigned long plain_bits;
 	unsigned long tmp;
@@ -1831,10 +2241,7 @@ static int fill_bitmap_rle_bits(struct drbd_peer_device *peer_device,
 	/* see how much plain bits we can stuff into one packet
 	 * using RLE and VLI. */
 	do {
-		tmp = (toggle == 0) ? _drbd_bm_find_next_zero(peer_device, c->bit_offset)
-				    : _drbd_bm_find_next(peer_device, c->bit_offset);
-		if (tmp == -1UL)
-			tmp = c->bm_bits;
+		tmp = bm_rle_run_end(peer_device, &w, c->bit_offset, toggle == 0, c);
 		rl = tmp - c->bit_offset;
 
 		if (toggle == 2) { /* first iteration */
@@ -1868,6 +2275,13 @@ static int fill_bitmap_rle_bits(struct drbd_peer_device *peer_device,
 		toggle = !toggle;
 		plain_bits += rl;
 		c->bit_offset = tmp;
+
+		/* Do not fill the whole buffer to find out that an area is
+		 * incompressible: once an eighth of it is used, the code must
+		 * stay shorter than the plain bits it covers. */
+		if (bs.cur.b - p->code > size / 8 &&
+		    plain_bits < ((unsigned long)(bs.cur.b - p->code) << 3))
+			break;
 	} while (c->bit_offset < c->bm_bits);
 
 	len = bs.cur.b - p->code + !!bs.cur.bit;
@@ -2275,7 +2689,7 @@ int drbd_send_dblock(struct drbd_peer_device *peer_device, struct drbd_request *
 		trim->size = cpu_to_be32(req->i.size);
 	} else {
 		if (peer_device->connection->integrity_tfm)
-			digest_size = crypto_shash_digestsize(peer_device->connection->integrity_tfm);
+			digest_size = crypto_ahash_digestsize(peer_device->connection->integrity_tfm);
 
 		if (op == REQ_OP_WRITE_SAME) {
 			wsame = drbd_prepare_command(peer_device, sizeof(*wsame) + digest_size, DATA_STREAM);
@@ -2314,7 +2728,8 @@ int drbd_send_dblock(struct drbd_peer_device *peer_device, struct drbd_request *
 
 	if (digest_size && digest_out) {
 		BUG_ON(digest_size > sizeof(peer_device->connection->scratch_buffer.d.before));
-		drbd_csum_bio(peer_device->connection->integrity_tfm, req->master_bio, before);
+		drbd_csum_bio(peer_device->connection->integrity_tfm,
+			      &peer_device->connection->integrity_req, req->master_bio, before);
 		memcpy(digest_out, before, digest_size);
 	}
 
@@ -2345,7 +2760,8 @@ int drbd_send_dblock(struct drbd_peer_device *peer_device, struct drbd_request *
 
 		/* double check digest, sometimes buffers have been modified in flight. */
 		if (digest_size > 0) {
-			drbd_csum_bio(peer_device->connection->integrity_tfm, req->master_bio, after);
+			drbd_csum_bio(peer_device->connection->integrity_tfm,
+				      &peer_device->connection->integrity_req, req->master_bio, after);
 			if (memcmp(before, after, digest_size)) {
 				drbd_warn(device,
 					"Digest mismatch, buffer modified by upper layers during write: %llus +%u\n",
@@ -2371,7 +2787,7 @@ int drbd_send_block(struct drbd_peer_device *peer_device, enum drbd_packet cmd,
 	int digest_size;
 
 	digest_size = peer_device->connection->integrity_tfm ?
-		      crypto_shash_digestsize(peer_device->connection->integrity_tfm) : 0;
+		      crypto_ahash_digestsize(peer_device->connection->integrity_tfm) : 0;
 
 	p = drbd_prepare_command(peer_device, sizeof(*p) + digest_size, DATA_STREAM);
 
@@ -2382,12 +2798,15 @@ int drbd_send_block(struct drbd_peer_device *peer_device, enum drbd_packet cmd,
 	p->seq_num = 0;  /* unused */
 	p->dp_flags = 0;
 	if (digest_size)
-		drbd_csum_pages(peer_device->connection->integrity_tfm, peer_req->page_chain.head, p + 1);
+		drbd_csum_pages(peer_device->connection->integrity_tfm,
+				&peer_device->connection->integrity_req, peer_req->page_chain.head, p + 1);
 	additional_size_command(peer_device->connection, DATA_STREAM, peer_req->i.size);
 	err = __send_command(peer_device->connection,
 			     peer_device->device->vnr, cmd, DATA_STREAM);
 	if (!err)
 		err = _drbd_send_zc_ee(peer_device, peer_req);
+	if (!err && cmd == P_RS_DATA_REPLY)
+		peer_device->rs_send_cnt += peer_req->i.size >> 9;
 	mutex_unlock(&peer_device->connection->mutex[DATA_STREAM]);
 
 	return err;
@@ -2751,6 +3170,8 @@ void drbd_cleanup_device(struct drbd_device *device)
 	device->bm_writ_cnt = 0;
 	device->read_cnt = 0;
 	device->writ_cnt = 0;
+	device->read_ios = 0;
+	device->writ_ios = 0;
 
 	if (device->bitmap) {
 		/* maybe never allocated. */
@@ -3067,6 +3488,10 @@ static void drbd_cleanup(void)
 
 	if (retry.wq)
 		destroy_workqueue(retry.wq);
+	if (drbd_ack_sender_wq)
+		destroy_workqueue(drbd_ack_sender_wq);
+	if (drbd_verify_wq)
+		destroy_workqueue(drbd_verify_wq);
 
 	drbd_genl_unregister();
 	drbd_debugfs_cleanup();
@@ -3247,15 +3672,92 @@ static void peer_ack_timer_fn(struct timer_list *t)
 	drbd_flush_peer_acks(resource);
 }
 
+void drbd_rate_ring_init(struct drbd_rate_ring *ring)
+{
+	spin_lock_init(&ring->lock);
+	ring->stamp = jiffies;
+}
+
+/* Counters are only reset by an administrator, but the sector counters
+ * wrap every 2TiB.  A delta too large for one second is a reset. */
+static unsigned int rate_delta(unsigned int now, unsigned int last)
+{
+	unsigned int delta = now - last;
+
+	return delta < 1U << 30 ? delta : now;
+}
+
+static void drbd_rate_sample(struct drbd_rate_ring *ring, const unsigned int now[DRBD_RATE_COUNTERS])
+{
+	unsigned int slot, i;
+
+	spin_lock(&ring->lock);
+	slot = ring->ticks % DRBD_RATE_SLOTS;
+	for (i = 0; i < DRBD_RATE_COUNTERS; i++) {
+		unsigned int delta = rate_delta(now[i], ring->last[i]);
+
+		ring->last[i] = now[i];
+		ring->s1[slot][i] = delta;
+		ring->acc[i] += delta;
+	}
+	ring->ticks++;
+	if (ring->ticks % 10 == 0) {
+		slot = (ring->ticks / 10 - 1) % DRBD_RATE_SLOTS;
+		memcpy(ring->s10[slot], ring->acc, sizeof(ring->acc));
+		memset(ring->acc, 0, sizeof(ring->acc));
+	}
+	ring->stamp = jiffies;
+	spin_unlock(&ring->lock);
+}
+
+static void rate_timer_fn(struct timer_list *t)
+{
+	struct drbd_resource *resource = from_timer(resource, t, rate_timer);
+	struct drbd_peer_device *peer_device;
+	struct drbd_device *device;
+	int vnr;
+
+	rcu_read_lock();
+	idr_for_each_entry(&resource->devices, device, vnr) {
+		unsigned int dev_now[DRBD_RATE_COUNTERS] = {
+			[DEV_RATE_READ_IOS] = READ_ONCE(device->read_ios),
+			[DEV_RATE_READ_SECT] = READ_ONCE(device->read_cnt),
+			[DEV_RATE_WRITE_IOS] = READ_ONCE(device->writ_ios),
+			[DEV_RATE_WRITE_SECT] = READ_ONCE(device->writ_cnt),
+			[DEV_RATE_AL_WRITES] = READ_ONCE(device->al_writ_cnt),
+		};
+
+		drbd_rate_sample(&device->rates, dev_now);
+		for_each_peer_device_rcu(peer_device, device) {
+			unsigned int peer_now[DRBD_RATE_COUNTERS] = {
+				[PEER_RATE_SEND_SECT] = READ_ONCE(peer_device->send_cnt),
+				[PEER_RATE_RECV_SECT] = READ_ONCE(peer_device->recv_cnt),
+				[PEER_RATE_ACKS] = READ_ONCE(peer_device->ack_cnt),
+				[PEER_RATE_RS_IN_SECT] = atomic_read(&peer_device->rs_recv_cnt),
+				[PEER_RATE_RS_OUT_SECT] = READ_ONCE(peer_device->rs_send_cnt),
+			};
+
+			drbd_rate_sample(&peer_device->rates, peer_now);
+		}
+	}
+	rcu_read_unlock();
+
+	mod_timer(&resource->rate_timer, jiffies + HZ);
+}
+
 void conn_free_crypto(struct drbd_connection *connection)
 {
-	crypto_free_shash(connection->csums_tfm);
-	crypto_free_shash(connection->verify_tfm);
+	drbd_wait_verify_done(connection);
+	crypto_free_ahash(connection->csums_tfm);
+	crypto_free_ahash(connection->verify_tfm);
 	crypto_free_shash(connection->cram_hmac_tfm);
-	crypto_free_shash(connection->integrity_tfm);
-	crypto_free_shash(connection->peer_integrity_tfm);
+	crypto_free_ahash(connection->integrity_tfm);
+	crypto_free_ahash(connection->peer_integrity_tfm);
 	kfree(connection->int_dig_in);
 	kfree(connection->int_dig_vv);
+	drbd_ahash_req_free(&connection->integrity_req);
+	drbd_ahash_req_free(&connection->receiver_req);
+	drbd_ahash_req_free(&connection->sender_req);
 
 	connection->csums_tfm = NULL;
 	connection->verify_tfm = NULL;
@@ -3336,13 +3838,7 @@ int set_resource_options(struct drbd_resource *resource, struct res_opts *res_op
 		drbd_calc_cpu_mask(&new_cpu_mask);
 	if (!cpumask_equal(resource->cpu_mask, new_cpu_mask)) {
 		cpumask_copy(resource->cpu_mask, new_cpu_mask);
-		rcu_read_lock();
-		for_each_connection_rcu(connection, resource) {
-			connection->receiver.reset_cpu_mask = 1;
-			connection->ack_receiver.reset_cpu_mask = 1;
-			connection->sender.reset_cpu_mask = 1;
-		}
-		rcu_read_unlock();
+		drbd_reset_cpu_masks(resource);
 	}
 	err = 0;
 
@@ -3381,6 +3877,7 @@ struct drbd_resource *drbd_create_resource(const char *name,
 	INIT_LIST_HEAD(&resource->peer_ack_list);
 	timer_setup(&resource->peer_ack_timer, peer_ack_timer_fn, 0);
 	timer_setup(&resource->repost_up_to_date_timer, repost_up_to_date_fn, 0);
+	timer_setup(&resource->rate_timer, rate_timer_fn, 0);
 	sema_init(&resource->state_sem, 1);
 	resource->role[NOW] = R_SECONDARY;
 	if (set_resource_options(resource, res_opts))
@@ -3407,6 +3904,7 @@ struct drbd_resource *drbd_create_resource(const char *name,
 	drbd_thread_start(&resource->worker);
 	drbd_debugfs_resource_add(resource);
 	resource->cached_min_aggreed_protocol_version = drbd_protocol_version_min;
+	mod_timer(&resource->rate_timer, jiffies + HZ);
 
 	list_add_tail_rcu(&resource->resources, &drbd_resources);
 
@@ -3439,6 +3937,9 @@ struct drbd_connection *drbd_create_connection(struct drbd_resource *resource,
 	if (!connection->current_epoch)
 		goto fail;
 
+	if (!zalloc_cpumask_var(&connection->cpu_mask, GFP_KERNEL))
+		goto fail;
+
 	INIT_LIST_HEAD(&connection->current_epoch->list);
 	connection->epochs = 1;
 	spin_lock_init(&connection->epoch_lock);
@@ -3460,6 +3961,9 @@ struct drbd_connection *drbd_create_connection(struct drbd_resource *resource,
 	drbd_init_workqueue(&connection->sender_work);
 	mutex_init(&connection->mutex[DATA_STREAM]);
 	mutex_init(&connection->mutex[CONTROL_STREAM]);
+	hrtimer_init(&connection->send.batch_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	connection->send.batch_timer.function = send_batch_timer_fn;
+	INIT_WORK(&connection->send.batch_flush_work, send_batch_flush_wf);
 
 	INIT_LIST_HEAD(&connection->connect_timer_work.list);
 	timer_setup(&connection->connect_timer, connect_timer_fn, 0);
@@ -3477,11 +3981,14 @@ struct drbd_connection *drbd_create_connection(struct drbd_resource *resource,
 	INIT_LIST_HEAD(&connection->read_ee);
 	INIT_LIST_HEAD(&connection->net_ee);
 	INIT_LIST_HEAD(&connection->done_ee);
+	INIT_LIST_HEAD(&connection->journal_acks);
 	init_waitqueue_head(&connection->ee_wait);
+	atomic_set(&connection->verify_cnt, 0);
 
 	kref_init(&connection->kref);
 	kref_debug_init(&connection->kref_debug, &connection->kref, &kref_class_connection);
 
+	mutex_init(&connection->ack_sender_mutex);
 	INIT_WORK(&connection->peer_ack_work, drbd_send_peer_ack_wf);
 	INIT_WORK(&connection->send_acks_work, drbd_send_acks_wf);
 
@@ -3498,6 +4005,7 @@ struct drbd_connection *drbd_create_connection(struct drbd_resource *resource,
 
 fail:
 	drbd_put_send_buffers(connection);
+	free_cpumask_var(connection->cpu_mask);
 	kfree(connection->current_epoch);
 	kfree(connection);
 
@@ -3547,6 +4055,7 @@ void drbd_destroy_connection(struct kref *kref)
 	idr_destroy(&connection->peer_devices);
 
 	kfree(connection->transport.net_conf);
+	free_cpumask_var(connection->cpu_mask);
 	kref_debug_destroy(&connection->kref_debug);
 	kfree(connection);
 	kref_debug_put(&resource->kref_debug, 3);
@@ -3567,6 +4076,7 @@ struct drbd_peer_device *create_peer_device(struct drbd_device *device, struct d
 	peer_device->disk_state[NOW] = D_UNKNOWN;
 	peer_device->repl_state[NOW] = L_OFF;
 	spin_lock_init(&peer_device->peer_seq_lock);
+	drbd_rate_ring_init(&peer_device->rates);
 
 	err = drbd_create_peer_device_default_config(peer_device);
 	if (err) {
@@ -3591,7 +4101,6 @@ struct drbd_peer_device *create_peer_device(struct drbd_device *device, struct d
 	atomic_set(&peer_device->rs_sect_in, 0);
 
 	peer_device->bitmap_index = -1;
-	peer_device->resync_wenr = LC_FREE;
 	peer_device->resync_finished_pdsk = D_UNKNOWN;
 
 	return peer_device;
@@ -3664,6 +4173,7 @@ enum drbd_ret_code drbd_create_device(struct drbd_config_context *adm_ctx, unsig
 	spin_lock_init(&device->timing_lock);
 #endif
 	spin_lock_init(&device->al_lock);
+	drbd_rate_ring_init(&device->rates);
 
 	INIT_LIST_HEAD(&device->pending_master_completion[0]);
 	INIT_LIST_HEAD(&device->pending_master_completion[1]);
@@ -3718,6 +4228,8 @@ enum drbd_ret_code drbd_create_device(struct drbd_config_context *adm_ctx, unsig
 		goto out_no_bitmap;
 	device->read_requests = RB_ROOT;
 	device->write_requests = RB_ROOT;
+	device->resync_requests = RB_ROOT;
+	device->active_writes = RB_ROOT;
 
 	BUG_ON(!mutex_is_locked(&resource->conf_update));
 	for_each_connection(connection, resource) {
@@ -3926,6 +4438,14 @@ void drbd_unregister_connection(struct drbd_connection *connection)
 	if (rr)
 		drbd_err(connection, "%d EEs in done list found!\n", rr);
 
+	while (!list_empty(&connection->journal_acks)) {
+		struct drbd_journal_entry *entry =
+			list_first_entry(&connection->journal_acks, struct drbd_journal_entry, ack_list);
+
+		list_del(&entry->ack_list);
+		drbd_journal_put_entry(entry);
+	}
+
 	rr = drbd_free_peer_reqs(connection->resource, &connection->net_ee, true);
 	if (rr)
 		drbd_err(connection, "%d EEs in net list found!\n", rr);
@@ -4048,6 +4568,20 @@ static int __init drbd_init(void)
 	spin_lock_init(&retry.lock);
 	INIT_LIST_HEAD(&retry.writes);
 
+	/* per-CPU, so the ack_sender runs where the completion was */
+	drbd_ack_sender_wq = alloc_workqueue("drbd_ack_sender", WQ_MEM_RECLAIM, 0);
+	if (!drbd_ack_sender_wq) {
+		pr_err("unable to create ack_sender workqueue\n");
+		goto fail;
+	}
+
+	/* unbound, so the integrity checks of one connection spread over all CPUs */
+	drbd_verify_wq = alloc_workqueue("drbd_verify", WQ_UNBOUND | WQ_MEM_RECLAIM, 0);
+	if (!drbd_verify_wq) {
+		pr_err("unable to create verify workqueue\n");
+		goto fail;
+	}
+
 	drbd_debugfs_init();
 
 	pr_info("initialized. "
@@ -4110,6 +4644,7 @@ int drbd_md_write(struct drbd_device *device, struct meta_data_on_disk_9 *buffer
 	int err;
 
 	if (drbd_md_dax_active(device->ldev)) {
+		drbd_journal_data_generation(device->ldev, device->ldev->md.current_uuid);
 		drbd_md_encode(device, drbd_dax_md_addr(device->ldev));
 		arch_wb_cache_pmem(drbd_dax_md_addr(device->ldev),
 				   sizeof(struct meta_data_on_disk_9));
@@ -4119,6 +4654,7 @@ int drbd_md_write(struct drbd_device *device, struct meta_data_on_disk_9 *buffer
 	memset(buffer, 0, sizeof(*buffer));
 
 	drbd_md_encode(device, buffer);
+	drbd_journal_data_generation(device->ldev, be64_to_cpu(buffer->current_uuid));
 
 	D_ASSERT(device, drbd_md_ss(device->ldev) == device->ldev->md.md_offset);
 	sector = device->ldev->md.md_offset;
@@ -4330,7 +4866,9 @@ int drbd_md_decode(struct drbd_device *device,
 
 	magic = be32_to_cpu(buffer->magic);
 	flags = be32_to_cpu(buffer->flags);
-	if (magic == DRBD_MD_MAGIC_09 && !(flags & MDF_AL_CLEAN)) {
+	/* drbd_intent_attach() checks whether the write intent table covers it */
+	if (magic == DRBD_MD_MAGIC_09 && !(flags & MDF_AL_CLEAN) &&
+	    !drbd_intent_configured(device->minor)) {
 			/* btw: that's Activity Log clean, not "all" clean. */
 		drbd_err(device, "Found unclean meta data. Did you \"drbdadm apply-al\"?\n");
 		rv = ERR_MD_UNCLEAN;
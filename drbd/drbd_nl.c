@@ -29,6 +29,8 @@
 #include "drbd_debugfs.h"
 #include "drbd_transport.h"
 #include "drbd_dax_pmem.h"
+#include "drbd_journal.h"
+#include "drbd_intent.h"
 #include <asm/unaligned.h>
 #include <linux/drbd_limits.h>
 #include <linux/kthread.h>
@@ -1195,6 +1197,11 @@ retry:
 				drbd_uuid_new_current(device, true);
 				clear_bit(NEW_CUR_UUID, &device->flags);
 			}
+			/* Local writes are not journaled. */
+			if (get_ldev(device)) {
+				drbd_journal_drain(device);
+				put_ldev(device);
+			}
 		}
 	}
 
@@ -1875,10 +1882,10 @@ static int drbd_check_al_size(struct drbd_device *device, struct disk_conf *dc)
 	if (t) {
 		for (i = 0; i < t->nr_elements; i++) {
 			e = lc_element_by_index(t, i);
-			if (e->refcnt)
+			if (atomic_read(&e->refcnt))
 				drbd_err(device, "refcnt(%d)==%d\n",
-				    e->lc_number, e->refcnt);
-			in_use += e->refcnt;
+				    e->lc_number, atomic_read(&e->refcnt));
+			in_use += atomic_read(&e->refcnt);
 		}
 	}
 	if (!in_use)
@@ -1889,6 +1896,9 @@ static int drbd_check_al_size(struct drbd_device *device, struct disk_conf *dc)
 		lc_destroy(n);
 		return -EBUSY;
 	} else {
+		/* lc_try_get_rcu() may still be looking at it */
+		if (t)
+			synchronize_rcu();
 		lc_destroy(t);
 		device->al_writ_cnt = 0;
 		memset(device->al_histogram, 0, sizeof(device->al_histogram));
@@ -2111,9 +2121,16 @@ void drbd_reconsider_queue_parameters(struct drbd_device *device, struct drbd_ba
 			queue_max_hw_sectors(bdev->backing_bdev->bd_disk->queue) << 9);
 	}
 
+	/* Peers since protocol 94 split a request that exceeds the limits of
+	 * their backing device into several bios (drbd_submit_peer_request()),
+	 * and receive_sizes() made sure that device_conf.max_bio_size fits into
+	 * a data packet for every peer.  Only older peers have to restrict what
+	 * upper layers may submit to us; the others should not reduce it for
+	 * the local disk and all other peers. */
 	spin_lock_irq(&device->resource->req_lock);
 	for_each_peer_device(peer_device, device) {
-		if (peer_device->repl_state[NOW] >= L_ESTABLISHED)
+		if (peer_device->repl_state[NOW] >= L_ESTABLISHED &&
+		    peer_device->connection->agreed_pro_version < 94)
 			max_bio_size = min(max_bio_size, peer_device->max_bio_size);
 	}
 	spin_unlock_irq(&device->resource->req_lock);
@@ -2475,10 +2492,30 @@ allocate_bitmap_index(struct drbd_peer_device *peer_device,
 		return -ENOSPC;
 	}
 
+	/* While attaching, drbd_bm_init_slots() takes care of the in-core bitmap */
+	if (nbc == device->ldev) {
+		int err;
+
+		drbd_suspend_io(device, WRITE_ONLY);
+		wait_event(device->al_wait, drbd_al_try_lock_for_transaction(device));
+		drbd_bm_lock(device, "add_slot()", BM_LOCK_ALL);
+		err = drbd_bm_add_slot(device, bitmap_index);
+		drbd_bm_unlock(device);
+		lc_unlock(device->act_log);
+		wake_up(&device->al_wait);
+		drbd_resume_io(device);
+		if (err) {
+			drbd_err(peer_device, "No memory for bitmap slot %d\n", bitmap_index);
+			return err;
+		}
+	}
+
 	peer_md->bitmap_index = bitmap_index;
 	peer_device->bitmap_index = bitmap_index;
 	peer_md->flags &= ~MDF_NODE_EXISTS; /* it is a peer now */
 	peer_md->flags |= MDF_HAVE_BITMAP;
+	if (nbc == device->ldev)
+		drbd_bm_update_union(device);
 
 	return 0;
 }
@@ -2521,15 +2558,15 @@ static int free_bitmap_index(struct drbd_device *device, int peer_node_id, u32 m
 	   to this one, or set it to all out-of-sync */
 
 	drbd_suspend_io(device, WRITE_ONLY);
+	wait_event(device->al_wait, drbd_al_try_lock_for_transaction(device));
 	drbd_bm_lock(device, "copy_bitmap()", BM_LOCK_ALL);
 
-	if (from_index != -1)
-		drbd_bm_copy_slot(device, from_index, freed_index);
-	else
-		_drbd_bm_set_many_bits(device, freed_index, 0, -1UL);
+	drbd_bm_free_slot(device, freed_index, from_index);
 
 	drbd_bm_write(device, NULL);
 	drbd_bm_unlock(device);
+	lc_unlock(device->act_log);
+	wake_up(&device->al_wait);
 
 	day0_md = day0_peer_md(device);
 	if (day0_md) {
@@ -2601,6 +2638,10 @@ static int open_backing_devices(struct drbd_device *device,
 		return ERR_OPEN_DISK;
 	nbc->backing_bdev = bdev;
 
+	nbc->flusher = drbd_flusher_get(bdev);
+	if (!nbc->flusher)
+		return ERR_NOMEM;
+
 	/*
 	 * meta_dev_idx >= 0: external fixed size, possibly multiple
 	 * drbd sharing one meta device.  TODO in that case, paranoia
@@ -2639,6 +2680,9 @@ void drbd_backing_dev_free(struct drbd_device *device, struct drbd_backing_dev *
 		return;
 
 	drbd_dax_close(ldev);
+	drbd_journal_close(ldev);
+	drbd_intent_close(ldev);
+	drbd_flusher_put(ldev->flusher);
 
 	close_backing_dev(device, ldev->md_bdev, ldev->md_bdev != ldev->backing_bdev);
 	close_backing_dev(device, ldev->backing_bdev, true);
@@ -2765,6 +2809,16 @@ int drbd_adm_attach(struct sk_buff *skb, struct genl_info *info)
 	if (retcode != NO_ERROR)
 		goto fail;
 
+	/* Replays the write journal, if there is one and it is dirty. */
+	retcode = drbd_journal_attach(device, nbc);
+	if (retcode != NO_ERROR)
+		goto fail;
+
+	/* With unclean meta data, the write intent table has to cover it. */
+	retcode = drbd_intent_attach(device, nbc);
+	if (retcode != NO_ERROR)
+		goto fail;
+
 	discard_not_wanted_bitmap_uuids(device, nbc);
 	sanitize_disk_conf(device, new_disk_conf, nbc);
 
@@ -2929,6 +2983,7 @@ int drbd_adm_attach(struct sk_buff *skb, struct genl_info *info)
 	 * clean it up somewhere.  */
 	D_ASSERT(device, device->ldev == NULL);
 	device->ldev = nbc;
+	drbd_bm_init_slots(device);
 	nbc = NULL;
 	new_disk_conf = NULL;
 
@@ -3005,6 +3060,8 @@ int drbd_adm_attach(struct sk_buff *skb, struct genl_info *info)
 
 	device->read_cnt = 0;
 	device->writ_cnt = 0;
+	device->read_ios = 0;
+	device->writ_ios = 0;
 
 	drbd_reconsider_queue_parameters(device, device->ldev, NULL);
 
@@ -3047,6 +3104,10 @@ int drbd_adm_attach(struct sk_buff *skb, struct genl_info *info)
 		goto force_diskless_dec;
 	}
 
+	retcode = drbd_intent_recover(device);
+	if (retcode != NO_ERROR)
+		goto force_diskless_dec;
+
 	for_each_peer_device(peer_device, device) {
 		if ((test_bit(CRASHED_PRIMARY, &device->flags) &&
 		     drbd_md_test_flag(device->ldev, MDF_AL_DISABLED)) ||
@@ -3302,10 +3363,10 @@ check_net_options(struct drbd_connection *connection, struct net_conf *new_net_c
 }
 
 struct crypto {
-	struct crypto_shash *verify_tfm;
-	struct crypto_shash *csums_tfm;
+	struct crypto_ahash *verify_tfm;
+	struct crypto_ahash *csums_tfm;
 	struct crypto_shash *cram_hmac_tfm;
-	struct crypto_shash *integrity_tfm;
+	struct crypto_ahash *integrity_tfm;
 };
 
 static int
@@ -3323,6 +3384,21 @@ alloc_shash(struct crypto_shash **tfm, char *tfm_name, int err_alg)
 	return NO_ERROR;
 }
 
+static int
+alloc_ahash(struct crypto_ahash **tfm, char *tfm_name, int err_alg)
+{
+	if (!tfm_name[0])
+		return NO_ERROR;
+
+	*tfm = crypto_alloc_ahash(tfm_name, 0, 0);
+	if (IS_ERR(*tfm)) {
+		*tfm = NULL;
+		return err_alg;
+	}
+
+	return NO_ERROR;
+}
+
 static enum drbd_ret_code
 alloc_crypto(struct crypto *crypto, struct net_conf *new_net_conf)
 {
@@ -3330,21 +3406,21 @@ alloc_crypto(struct crypto *crypto, struct net_conf *new_net_conf)
 	int digest_size = 0;
 	enum drbd_ret_code rv;
 
-	rv = alloc_shash(&crypto->csums_tfm, new_net_conf->csums_alg,
+	rv = alloc_ahash(&crypto->csums_tfm, new_net_conf->csums_alg,
 			 ERR_CSUMS_ALG);
 	if (rv != NO_ERROR)
 		return rv;
-	rv = alloc_shash(&crypto->verify_tfm, new_net_conf->verify_alg,
+	rv = alloc_ahash(&crypto->verify_tfm, new_net_conf->verify_alg,
 			 ERR_VERIFY_ALG);
 	if (rv != NO_ERROR)
 		return rv;
-	rv = alloc_shash(&crypto->integrity_tfm, new_net_conf->integrity_alg,
+	rv = alloc_ahash(&crypto->integrity_tfm, new_net_conf->integrity_alg,
 			 ERR_INTEGRITY_ALG);
 	if (rv != NO_ERROR)
 		return rv;
 	if (crypto->integrity_tfm) {
 		const int max_digest_size = sizeof(((struct drbd_connection*)0)->scratch_buffer.d.before);
-		digest_size = crypto_shash_digestsize(crypto->integrity_tfm);
+		digest_size = crypto_ahash_digestsize(crypto->integrity_tfm);
 		if (digest_size > max_digest_size) {
 			pr_notice("we currently support only digest sizes <= %d bits, but digest size of %s is %d bits\n",
 				max_digest_size * 8, new_net_conf->integrity_alg, digest_size * 8);
@@ -3365,9 +3441,9 @@ alloc_crypto(struct crypto *crypto, struct net_conf *new_net_conf)
 static void free_crypto(struct crypto *crypto)
 {
 	crypto_free_shash(crypto->cram_hmac_tfm);
-	crypto_free_shash(crypto->integrity_tfm);
-	crypto_free_shash(crypto->csums_tfm);
-	crypto_free_shash(crypto->verify_tfm);
+	crypto_free_ahash(crypto->integrity_tfm);
+	crypto_free_ahash(crypto->csums_tfm);
+	crypto_free_ahash(crypto->verify_tfm);
 }
 
 int drbd_adm_net_opts(struct sk_buff *skb, struct genl_info *info)
@@ -3443,17 +3519,17 @@ int drbd_adm_net_opts(struct sk_buff *skb, struct genl_info *info)
 	connection->fencing_policy = new_net_conf->fencing_policy;
 
 	if (!rsr) {
-		crypto_free_shash(connection->csums_tfm);
+		crypto_free_ahash(connection->csums_tfm);
 		connection->csums_tfm = crypto.csums_tfm;
 		crypto.csums_tfm = NULL;
 	}
 	if (!ovr) {
-		crypto_free_shash(connection->verify_tfm);
+		crypto_free_ahash(connection->verify_tfm);
 		connection->verify_tfm = crypto.verify_tfm;
 		crypto.verify_tfm = NULL;
 	}
 
-	crypto_free_shash(connection->integrity_tfm);
+	crypto_free_ahash(connection->integrity_tfm);
 	connection->integrity_tfm = crypto.integrity_tfm;
 	if (connection->cstate[NOW] >= C_CONNECTED && connection->agreed_pro_version >= 100)
 		/* Do this without trying to take connection->data.mutex again.  */
@@ -3754,8 +3830,10 @@ static int adm_new_connection(struct drbd_connection **ret_conn,
 		if (bitmap_index != -1) {
 			if (want_bitmap(peer_device))
 				peer_device->bitmap_index = bitmap_index;
-			else
+			else {
 				device->ldev->md.peers[adm_ctx->peer_node_id].flags &= ~MDF_HAVE_BITMAP;
+				drbd_bm_update_union(device);
+			}
 		}
 		put_ldev(device);
 	}
@@ -4240,6 +4318,8 @@ static void del_connection(struct drbd_connection *connection)
 	 * handling only does drbd_thread_stop_nowait().
 	 */
 	drbd_thread_stop(&connection->sender);
+	hrtimer_cancel(&connection->send.batch_timer);
+	cancel_work_sync(&connection->send.batch_flush_work);
 
 	drbd_unregister_connection(connection);
 
@@ -5973,6 +6053,7 @@ static int adm_del_resource(struct drbd_resource *resource)
 	del_timer_sync(&resource->twopc_timer);
 	del_timer_sync(&resource->peer_ack_timer);
 	del_timer_sync(&resource->repost_up_to_date_timer);
+	del_timer_sync(&resource->rate_timer);
 	call_rcu(&resource->rcu, drbd_reclaim_resource);
 
 	mutex_lock(&notification_mutex);
@@ -35,6 +35,7 @@
 #include "drbd_protocol.h"
 #include "drbd_req.h"
 #include "drbd_vli.h"
+#include "drbd_journal.h"
 #include <linux/scatterlist.h>
 
 #define PRO_FEATURES (DRBD_FF_TRIM|DRBD_FF_THIN_RESYNC|DRBD_FF_WSAME|DRBD_FF_WZEROES)
@@ -167,6 +168,8 @@ void conn_disconnect(struct drbd_connection *connection);
 
 static enum finish_epoch drbd_may_finish_epoch(struct drbd_connection *, struct drbd_epoch *, enum epoch_event);
 static int e_end_block(struct drbd_work *, int);
+static int e_end_resync_block(struct drbd_work *, int);
+static int _drbd_send_ack(struct drbd_peer_device *, enum drbd_packet, u64, u32, u64);
 static void cleanup_unacked_peer_requests(struct drbd_connection *connection);
 static void cleanup_peer_ack_list(struct drbd_connection *connection);
 static u64 node_ids_to_bitmap(struct drbd_device *device, u64 node_ids);
@@ -284,6 +287,26 @@ static void page_chain_add(struct page **head,
 	*head = chain_first;
 }
 
+/* Largest block __drbd_alloc_pages() tries to get in one go: a whole
+ * DRBD_MAX_BIO_SIZE request */
+#define DRBD_PP_MAX_ORDER get_order(DRBD_MAX_BIO_SIZE)
+
+/* Prepends the pages of a split 2^order block to the chain at @head, in
+ * ascending address order, so that they stay physically contiguous in the
+ * chain. bio_add_page() merges them into one bvec, drbd_csum_pages() and
+ * all_zero() access them as one run (see page_chain_run()). */
+static struct page *page_chain_add_block(struct page *head, struct page *block,
+					 unsigned int order)
+{
+	int j;
+
+	for (j = (1 << order) - 1; j >= 0; j--) {
+		set_page_chain_next_offset_size(block + j, head, 0, 0);
+		head = block + j;
+	}
+	return head;
+}
+
 static struct page *__drbd_alloc_pages(unsigned int number, gfp_t gfp_mask)
 {
 	struct page *page = NULL;
@@ -302,12 +325,26 @@ static struct page *__drbd_alloc_pages(unsigned int number, gfp_t gfp_mask)
 			return page;
 	}
 
-	for (i = 0; i < number; i++) {
-		tmp = alloc_page(gfp_mask);
-		if (!tmp)
-			break;
-		set_page_chain_next_offset_size(tmp, page, 0, 0);
-		page = tmp;
+	while (i < number) {
+		unsigned int order = min_t(unsigned int, ilog2(number - i), DRBD_PP_MAX_ORDER);
+
+		/* Higher order blocks only if they are readily available; they
+		 * are split, the chain still consists of order-0 pages. */
+		tmp = NULL;
+		if (order) {
+			tmp = alloc_pages((gfp_mask & ~__GFP_RECLAIM) | __GFP_NOWARN | __GFP_NORETRY,
+					  order);
+			if (tmp)
+				split_page(tmp, order);
+		}
+		if (!tmp) {
+			order = 0;
+			tmp = alloc_page(gfp_mask);
+			if (!tmp)
+				break;
+		}
+		page = page_chain_add_block(page, tmp, order);
+		i += 1 << order;
 	}
 
 	if (i == number)
@@ -330,6 +367,8 @@ static void rs_sectors_came_in(struct drbd_peer_device *peer_device, int size)
 {
 	int rs_sect_in = atomic_add_return(size >> 9, &peer_device->rs_sect_in);
 
+	atomic_add(size >> 9, &peer_device->rs_recv_cnt);
+
 	/* In case resync runs faster than anticipated, run the resync_work early */
 	if (rs_sect_in >= peer_device->rs_in_flight)
 		drbd_queue_work_if_unqueued(
@@ -505,6 +544,7 @@ drbd_alloc_peer_req(struct drbd_peer_device *peer_device, gfp_t gfp_mask) __must
 	memset(peer_req, 0, sizeof(*peer_req));
 	INIT_LIST_HEAD(&peer_req->w.list);
 	drbd_clear_interval(&peer_req->i);
+	drbd_clear_interval(&peer_req->active_write);
 	INIT_LIST_HEAD(&peer_req->recv_order);
 	INIT_LIST_HEAD(&peer_req->wait_for_actlog);
 	peer_req->submit_jif = jiffies;
@@ -513,11 +553,46 @@ drbd_alloc_peer_req(struct drbd_peer_device *peer_device, gfp_t gfp_mask) __must
 	return peer_req;
 }
 
+/* Received data is checked on drbd_verify_wq, see read_in_block().  Before
+ * the pages of a peer request that was never submitted may go away, that
+ * check has to be finished. */
+struct peer_req_verify {
+	struct work_struct work;
+	struct drbd_peer_request *peer_req;
+	struct ahash_request *req;	/* allocated behind the digests */
+	atomic_t gate;		/* the check, and drbd_submit_peer_request() */
+	int err;		/* of the digest */
+	bool digested;		/* the digest was issued, verify_work_fn() finishes */
+	bool failed;
+	unsigned int digest_size;
+	u8 digest[];		/* as received, then as computed */
+};
+
+static void peer_req_wait_verify(struct drbd_peer_request *peer_req)
+{
+	struct drbd_connection *connection = peer_req->peer_device->connection;
+	struct peer_req_verify *v = peer_req->verify;
+
+	if (!v)
+		return;
+	/* Not submitted, so the check gives up its part of the gate once it
+	 * is done with the pages. */
+	wait_event(connection->ee_wait, atomic_read(&v->gate) < 2);
+	peer_req->verify = NULL;
+	kfree(v);
+}
+
+void drbd_wait_verify_done(struct drbd_connection *connection)
+{
+	wait_event(connection->ee_wait, !atomic_read(&connection->verify_cnt));
+}
+
 void __drbd_free_peer_req(struct drbd_peer_request *peer_req, int is_net)
 {
 	struct drbd_peer_device *peer_device = peer_req->peer_device;
 
 	might_sleep();
+	peer_req_wait_verify(peer_req);
 	if (peer_req->flags & EE_HAS_DIGEST)
 		kfree(peer_req->digest);
 	D_ASSERT(peer_device, atomic_read(&peer_req->pending_bios) == 0);
@@ -543,6 +618,19 @@ int drbd_free_peer_reqs(struct drbd_resource *resource, struct list_head *list,
 	return count;
 }
 
+/* The ack for a peer write that made it to stable storage.  During resync,
+ * it sets the block in sync on both sides, if the peer allows that. */
+static enum drbd_packet write_ack_cmd(struct drbd_peer_device *peer_device,
+				      sector_t sector, unsigned int size, bool may_set_in_sync)
+{
+	if (peer_device->repl_state[NOW] >= L_SYNC_SOURCE &&
+	    peer_device->repl_state[NOW] <= L_PAUSED_SYNC_T && may_set_in_sync) {
+		drbd_set_in_sync(peer_device, sector, size);
+		return P_RS_WRITE_ACK;
+	}
+	return P_WRITE_ACK;
+}
+
 /*
  * See also comments in _req_mod(,BARRIER_ACKED) and receive_Barrier.
  */
@@ -550,18 +638,40 @@ static int drbd_finish_peer_reqs(struct drbd_connection *connection)
 {
 	LIST_HEAD(work_list);
 	LIST_HEAD(reclaimed);
+	LIST_HEAD(journal_acks);
 	struct drbd_peer_request *peer_req, *t;
+	struct drbd_journal_entry *entry, *te;
 	int err = 0;
 	int n = 0;
 
 	spin_lock_irq(&connection->resource->req_lock);
 	reclaim_finished_net_peer_reqs(connection, &reclaimed);
+	list_splice_init(&connection->journal_acks, &journal_acks);
 	list_splice_init(&connection->done_ee, &work_list);
 	spin_unlock_irq(&connection->resource->req_lock);
 
 	list_for_each_entry_safe(peer_req, t, &reclaimed, w.list)
 		drbd_free_net_peer_req(peer_req);
 
+	/* Writes that are durable in the journal.  Their peer requests may be
+	 * on work_list already; e_end_block() does not ack them again, unless
+	 * the backing device failed them first, see drbd_journal_write_error(). */
+	list_for_each_entry_safe(entry, te, &journal_acks, ack_list) {
+		if (!test_and_set_bit(JE_ACK_CLAIMED, &entry->flags)) {
+			enum drbd_packet cmd = write_ack_cmd(entry->peer_device, entry->sector,
+							     entry->size, entry->may_set_in_sync);
+
+			if (!err)
+				err = _drbd_send_ack(entry->peer_device, cmd,
+						     cpu_to_be64(entry->sector),
+						     cpu_to_be32(entry->size),
+						     entry->block_id);
+			dec_unacked(entry->peer_device);
+		}
+		list_del(&entry->ack_list);
+		drbd_journal_put_entry(entry);
+	}
+
 	/* possible callbacks here:
 	 * e_end_block, and e_end_resync_block, e_send_discard_write.
 	 * all ignore the last argument.
@@ -575,6 +685,7 @@ static int drbd_finish_peer_reqs(struct drbd_connection *connection)
 		if (!err)
 			err = err2;
 		if (!list_empty(&peer_req->recv_order)) {
+			peer_req_wait_verify(peer_req);
 			drbd_free_page_chain(&connection->transport, &peer_req->page_chain, 0);
 		} else
 			drbd_free_peer_req(peer_req);
@@ -585,12 +696,120 @@ static int drbd_finish_peer_reqs(struct drbd_connection *connection)
 	return err;
 }
 
+/* Read-ahead buffer of a stream, see drbd_buffered_control_recv.
+ * [start, pos) is what was handed out of the current packet so far,
+ * [pos, end) was read ahead. */
+#define DRBD_RECV_BUF_SIZE (4 * PAGE_SIZE)
+
+struct drbd_recv_buf {
+	unsigned int start, pos, end;
+	char data[DRBD_RECV_BUF_SIZE];
+};
+
+static void drbd_recv_buf_alloc(struct drbd_connection *connection, enum drbd_stream stream)
+{
+	struct drbd_recv_buf *rb;
+
+	/* without it, we read exactly what is asked for */
+	rb = kvmalloc(sizeof(*rb), GFP_KERNEL);
+	if (rb)
+		rb->start = rb->pos = rb->end = 0;
+	connection->recv_buf[stream] = rb;
+}
+
+static void drbd_recv_buf_free(struct drbd_connection *connection, enum drbd_stream stream)
+{
+	kvfree(connection->recv_buf[stream]);
+	connection->recv_buf[stream] = NULL;
+}
+
+/* Reads as much as there is, and then blocks for the rest of @want bytes,
+ * unless @flags has MSG_DONTWAIT. */
+static int recv_buf_fill(struct drbd_transport *transport, enum drbd_stream stream,
+			 struct drbd_recv_buf *rb, unsigned int want, int flags)
+{
+	struct drbd_transport_ops *tr_ops = transport->ops;
+	unsigned int got = 0;
+	void *p;
+	int rv;
+
+	/* The packet we are in is less than a page, so after moving it to
+	 * the front there is room for the rest of it. */
+	if (rb->start == rb->end) {
+		rb->start = rb->pos = rb->end = 0;
+	} else if (rb->end + want > DRBD_RECV_BUF_SIZE) {
+		memmove(rb->data, rb->data + rb->start, rb->end - rb->start);
+		rb->pos -= rb->start;
+		rb->end -= rb->start;
+		rb->start = 0;
+	}
+
+	p = rb->data + rb->end;
+	rv = tr_ops->recv(transport, stream, &p, DRBD_RECV_BUF_SIZE - rb->end,
+			  CALLER_BUFFER | MSG_DONTWAIT | MSG_NOSIGNAL);
+	if (rv > 0) {
+		rb->end += rv;
+		got = rv;
+	}
+	if ((rv == -EAGAIN || (rv > 0 && got < want)) && !(flags & MSG_DONTWAIT)) {
+		p = rb->data + rb->end;
+		rv = tr_ops->recv(transport, stream, &p, want - got, CALLER_BUFFER);
+		if (rv > 0) {
+			rb->end += rv;
+			got += rv;
+		}
+	}
+
+	return got ?: rv;
+}
+
+/* Like tr_ops->recv(), but served from the read-ahead buffer of the stream,
+ * if it has one. */
+static int drbd_recv_buffered(struct drbd_connection *connection, enum drbd_stream stream,
+			      void **buf, size_t size, int flags)
+{
+	struct drbd_transport *transport = &connection->transport;
+	struct drbd_recv_buf *rb = connection->recv_buf[stream];
+	unsigned int n;
+	int rv;
+
+	if (!rb)
+		return transport->ops->recv(transport, stream, buf, size, flags);
+
+	if (flags & CALLER_BUFFER) {
+		void *p = *buf;
+
+		/* What was read ahead first, the rest goes straight to the caller. */
+		n = min_t(unsigned int, size, rb->end - rb->pos);
+		memcpy(p, rb->data + rb->pos, n);
+		rb->pos += n;
+		rb->start = rb->pos;
+		if (n == size)
+			return n;
+
+		p += n;
+		rv = transport->ops->recv(transport, stream, &p, size - n, flags);
+		return rv > 0 ? n + rv : (n ?: rv);
+	}
+
+	if (!(flags & GROW_BUFFER))
+		rb->start = rb->pos;
+	if (rb->end - rb->pos < size) {
+		rv = recv_buf_fill(transport, stream, rb, size - (rb->end - rb->pos), flags);
+		if (rv <= 0)
+			return rv;
+	}
+	n = min_t(unsigned int, size, rb->end - rb->pos);
+	rb->pos += n;
+	*buf = rb->data + rb->start;
+	return n;
+}
+
 static int drbd_recv(struct drbd_connection *connection, void **buf, size_t size, int flags)
 {
-	struct drbd_transport_ops *tr_ops = connection->transport.ops;
 	int rv;
 
-	rv = tr_ops->recv(&connection->transport, DATA_STREAM, buf, size, flags);
+	rv = drbd_recv_buffered(connection, DATA_STREAM, buf, size, flags);
 
 	if (rv < 0) {
 		if (rv == -ECONNRESET)
@@ -634,6 +853,41 @@ static int drbd_recv_into(struct drbd_connection *connection, void *buf, size_t
 	return err;
 }
 
+/* Like tr_ops->recv_pages(). Once part of the payload was read ahead, it
+ * cannot be received into the pages directly. */
+static int drbd_recv_pages(struct drbd_connection *connection,
+			   struct drbd_page_chain_head *chain, size_t size)
+{
+	struct drbd_transport *transport = &connection->transport;
+	struct drbd_recv_buf *rb = connection->recv_buf[DATA_STREAM];
+	struct page *page;
+	int err = 0;
+
+	if (!rb || rb->pos == rb->end)
+		return transport->ops->recv_pages(transport, chain, size);
+
+	drbd_alloc_page_chain(transport, chain, DIV_ROUND_UP(size, PAGE_SIZE), GFP_TRY);
+	page = chain->head;
+	if (!page)
+		return -ENOMEM;
+
+	page_chain_for_each(page) {
+		size_t len = min_t(size_t, size, PAGE_SIZE);
+		void *data = kmap(page);
+
+		err = drbd_recv_into(connection, data, len);
+		kunmap(page);
+		set_page_chain_offset(page, 0);
+		set_page_chain_size(page, len);
+		if (err)
+			break;
+		size -= len;
+	}
+	if (err)
+		drbd_free_page_chain(transport, chain, 0);
+	return err;
+}
+
 static int drbd_recv_all(struct drbd_connection *connection, void **buf, size_t size)
 {
 	int err;
@@ -881,9 +1135,14 @@ start:
 	mutex_unlock(&connection->mutex[DATA_STREAM]);
 	have_mutex = false;
 
+	/* now that a path is established, CPU_POLICY_NUMA can follow its NIC */
+	conn_reset_cpu_masks(connection);
 	drbd_thread_start(&connection->ack_receiver);
-	connection->ack_sender =
-		alloc_ordered_workqueue("drbd_as_%s", WQ_MEM_RECLAIM, connection->resource->name);
+	if (drbd_shared_ack_sender)
+		connection->ack_sender = drbd_ack_sender_wq;
+	else
+		connection->ack_sender = alloc_ordered_workqueue("drbd_as_%s", WQ_MEM_RECLAIM,
+								 connection->resource->name);
 	if (!connection->ack_sender) {
 		drbd_err(connection, "Failed to create workqueue ack_sender\n");
 		schedule_timeout_uninterruptible(HZ);
@@ -994,8 +1253,8 @@ static int drbd_recv_header_maybe_unplug(struct drbd_connection *connection, str
 	void *buffer;
 	int err;
 
-	err = tr_ops->recv(&connection->transport, DATA_STREAM, &buffer,
-			   size, MSG_NOSIGNAL | MSG_DONTWAIT);
+	err = drbd_recv_buffered(connection, DATA_STREAM, &buffer,
+				 size, MSG_NOSIGNAL | MSG_DONTWAIT);
 	if (err != size) {
 		int rflags = 0;
 
@@ -1028,110 +1287,224 @@ static int drbd_recv_header_maybe_unplug(struct drbd_connection *connection, str
 	return err;
 }
 
-/* This is blkdev_issue_flush, but asynchronous.
- * We want to submit to all component volumes in parallel,
- * then wait for all completions.
+/* Flushes are coalesced per backing disk.
+ * Several volumes (of this or other resources) may share a backing disk,
+ * and with several connections and small epochs we would otherwise send
+ * a storm of back-to-back flushes to the same disk.
+ *
+ * Anyone who wants a flush takes a "ticket": the sequence number of the
+ * next flush to be issued on that disk.  Any flush submitted after the
+ * ticket was taken covers all writes that completed before, so the waiter
+ * is done as soon as the flush with that number completed, no matter who
+ * submitted it.  At most one flush is in flight per disk; whoever finds
+ * the disk idle and its own ticket not yet served submits the next one.
  */
-struct issue_flush_context {
-	atomic_t pending;
-	int error;
-	struct completion done;
-};
-struct one_flush_context {
-	struct drbd_device *device;
-	struct issue_flush_context *ctx;
-};
+static LIST_HEAD(drbd_flushers);
+static DEFINE_MUTEX(drbd_flushers_mutex);
 
-static void one_flush_endio(struct bio *bio)
+struct drbd_flusher *drbd_flusher_get(struct block_device *bdev)
 {
-	struct one_flush_context *octx = bio->bi_private;
-	struct drbd_device *device = octx->device;
-	struct issue_flush_context *ctx = octx->ctx;
+	struct drbd_flusher *flusher;
 
-	blk_status_t status = bio->bi_status;
-
-	if (status) {
-		ctx->error = blk_status_to_errno(status);
-		drbd_info(device, "local disk FLUSH FAILED with status %d\n", status);
+	mutex_lock(&drbd_flushers_mutex);
+	list_for_each_entry(flusher, &drbd_flushers, list) {
+		if (flusher->disk == bdev->bd_disk) {
+			kref_get(&flusher->kref);
+			goto out;
+		}
 	}
-	kfree(octx);
-	bio_put(bio);
+	flusher = kzalloc(sizeof(*flusher), GFP_KERNEL);
+	if (flusher) {
+		kref_init(&flusher->kref);
+		flusher->disk = bdev->bd_disk;
+		spin_lock_init(&flusher->lock);
+		init_waitqueue_head(&flusher->wait);
+		list_add(&flusher->list, &drbd_flushers);
+	}
+out:
+	mutex_unlock(&drbd_flushers_mutex);
+	return flusher;
+}
+
+static void drbd_flusher_release(struct kref *kref)
+{
+	struct drbd_flusher *flusher = container_of(kref, struct drbd_flusher, kref);
 
+	list_del(&flusher->list);
+	mutex_unlock(&drbd_flushers_mutex);
+	kfree(flusher);
+}
+
+void drbd_flusher_put(struct drbd_flusher *flusher)
+{
+	if (flusher)
+		kref_put_mutex(&flusher->kref, drbd_flusher_release, &drbd_flushers_mutex);
+}
+
+struct flush_ticket {
+	struct drbd_device *device;
+	struct drbd_flusher *flusher;
+	u64 seq;
+};
+
+static void flusher_complete(struct drbd_flusher *flusher, int error)
+{
+	struct drbd_device *device;
+	unsigned long flags;
+
+	/* Wake up under the lock: once a waiter sees its ticket served, it
+	 * may drop the last reference to the flusher. */
+	spin_lock_irqsave(&flusher->lock, flags);
+	device = flusher->issuer;
+	flusher->issuer = NULL;
+	flusher->done = flusher->issued;
+	if (error)
+		flusher->error_seq = flusher->issued;
+	flusher->in_flight = false;
 	clear_bit(FLUSH_PENDING, &device->flags);
-	put_ldev(device);
+	wake_up_all(&flusher->wait);
+	spin_unlock_irqrestore(&flusher->lock, flags);
+
 	kref_debug_put(&device->kref_debug, 7);
 	kref_put(&device->kref, drbd_destroy_device);
+}
+
+static void one_flush_endio(struct bio *bio)
+{
+	struct drbd_flusher *flusher = bio->bi_private;
+	blk_status_t status = bio->bi_status;
+
+	if (status)
+		drbd_info(flusher->issuer, "local disk FLUSH FAILED with status %d\n", status);
+	bio_put(bio);
 
-	if (atomic_dec_and_test(&ctx->pending))
-		complete(&ctx->done);
+	flusher_complete(flusher, status ? blk_status_to_errno(status) : 0);
 }
 
-static void submit_one_flush(struct drbd_device *device, struct issue_flush_context *ctx)
+/* Submits the next flush on behalf of ticket t, unless it is served
+ * already or some other flush is in flight. */
+static void flusher_kick(struct flush_ticket *t)
 {
-	struct bio *bio = bio_alloc(GFP_NOIO, 0);
-	struct one_flush_context *octx = kmalloc(sizeof(*octx), GFP_NOIO);
-	if (!bio || !octx) {
+	struct drbd_flusher *flusher = t->flusher;
+	struct drbd_device *device = t->device;
+	struct bio *bio;
+
+	spin_lock_irq(&flusher->lock);
+	if (flusher->in_flight || flusher->done >= t->seq) {
+		spin_unlock_irq(&flusher->lock);
+		return;
+	}
+	flusher->in_flight = true;
+	flusher->issued++;
+	flusher->issuer = device;
+	spin_unlock_irq(&flusher->lock);
+
+	/* The issuer waits for this flush, and holds a reference on the
+	 * flusher through its ldev.  The device reference is dropped in
+	 * flusher_complete(). */
+	kref_get(&device->kref);
+	kref_debug_get(&device->kref_debug, 7);
+	device->flush_jif = jiffies;
+	set_bit(FLUSH_PENDING, &device->flags);
+
+	bio = bio_alloc(GFP_NOIO, 0);
+	if (!bio) {
 		drbd_warn(device, "Could not allocate a bio, CANNOT ISSUE FLUSH\n");
 		/* FIXME: what else can I do now?  disconnecting or detaching
 		 * really does not help to improve the state of the world, either.
 		 */
-		kfree(octx);
-		if (bio)
-			bio_put(bio);
-
-		ctx->error = -ENOMEM;
-		put_ldev(device);
-		kref_debug_put(&device->kref_debug, 7);
-		kref_put(&device->kref, drbd_destroy_device);
+		flusher_complete(flusher, -ENOMEM);
 		return;
 	}
 
-	octx->device = device;
-	octx->ctx = ctx;
 	bio_set_dev(bio, device->ldev->backing_bdev);
-	bio->bi_private = octx;
+	bio->bi_private = flusher;
 	bio->bi_end_io = one_flush_endio;
-
-	device->flush_jif = jiffies;
-	set_bit(FLUSH_PENDING, &device->flags);
-	atomic_inc(&ctx->pending);
 	bio->bi_opf = REQ_OP_FLUSH | REQ_PREFLUSH;
 	submit_bio(bio);
 }
 
+static bool flusher_idle_or_served(struct drbd_flusher *flusher, u64 seq)
+{
+	bool rv;
+
+	spin_lock_irq(&flusher->lock);
+	rv = !flusher->in_flight || flusher->done >= seq;
+	spin_unlock_irq(&flusher->lock);
+	return rv;
+}
+
+/* Returns 0, or -EIO if the flush serving this ticket (or a later one) failed. */
+static int flusher_wait(struct flush_ticket *t)
+{
+	struct drbd_flusher *flusher = t->flusher;
+	bool served;
+	int err;
+
+	for (;;) {
+		wait_event(flusher->wait, flusher_idle_or_served(flusher, t->seq));
+		spin_lock_irq(&flusher->lock);
+		served = flusher->done >= t->seq;
+		err = flusher->error_seq >= t->seq ? -EIO : 0;
+		spin_unlock_irq(&flusher->lock);
+		if (served)
+			return err;
+		flusher_kick(t);
+	}
+}
+
+#define FLUSH_TICKETS_PER_ROUND 8
+
 static enum finish_epoch drbd_flush_after_epoch(struct drbd_connection *connection, struct drbd_epoch *epoch)
 {
 	struct drbd_resource *resource = connection->resource;
 
 	if (resource->write_ordering >= WO_BDEV_FLUSH) {
+		struct flush_ticket tickets[FLUSH_TICKETS_PER_ROUND];
 		struct drbd_device *device;
-		struct issue_flush_context ctx;
-		int vnr;
-
-		atomic_set(&ctx.pending, 1);
-		ctx.error = 0;
-		init_completion(&ctx.done);
+		int vnr = 0, n, i, err = 0;
 
-		rcu_read_lock();
-		idr_for_each_entry(&resource->devices, device, vnr) {
-			if (!get_ldev(device))
-				continue;
-			kref_get(&device->kref);
-			kref_debug_get(&device->kref_debug, 7);
+		/* Take tickets and kick all volumes of a round in parallel,
+		 * then wait for all of them. */
+		do {
+			n = 0;
+			rcu_read_lock();
+			while (n < FLUSH_TICKETS_PER_ROUND &&
+			       (device = idr_get_next(&resource->devices, &vnr))) {
+				vnr++;
+				if (!get_ldev(device))
+					continue;
+				kref_get(&device->kref);
+				kref_debug_get(&device->kref_debug, 7);
+				tickets[n].device = device;
+				tickets[n].flusher = device->ldev->flusher;
+				n++;
+			}
 			rcu_read_unlock();
 
-			submit_one_flush(device, &ctx);
+			for (i = 0; i < n; i++) {
+				struct drbd_flusher *flusher = tickets[i].flusher;
 
-			rcu_read_lock();
-		}
-		rcu_read_unlock();
+				spin_lock_irq(&flusher->lock);
+				tickets[i].seq = flusher->issued + 1;
+				flusher->requests++;
+				spin_unlock_irq(&flusher->lock);
+				flusher_kick(&tickets[i]);
+			}
 
-		/* Do we want to add a timeout,
-		 * if disk-timeout is set? */
-		if (!atomic_dec_and_test(&ctx.pending))
-			wait_for_completion(&ctx.done);
+			/* Do we want to add a timeout,
+			 * if disk-timeout is set? */
+			for (i = 0; i < n; i++) {
+				device = tickets[i].device;
+				if (flusher_wait(&tickets[i]))
+					err = -EIO;
+				put_ldev(device);
+				kref_debug_put(&device->kref_debug, 7);
+				kref_put(&device->kref, drbd_destroy_device);
+			}
+		} while (n == FLUSH_TICKETS_PER_ROUND);
 
-		if (ctx.error) {
+		if (err) {
 			/* would rather check on EOPNOTSUPP, but that is not reliable.
 			 * don't try again for ANY return value != 0
 			 * if (rv == -EOPNOTSUPP) */
@@ -1535,6 +1908,17 @@ static void drbd_issue_peer_wsame(struct drbd_device *device,
 	drbd_endio_write_sec_final(peer_req);
 }
 
+/* Synchronous, see drbd_submit_peer_request() */
+void drbd_submit_peer_discard(struct drbd_peer_request *peer_req)
+{
+	struct drbd_device *device = peer_req->peer_device->device;
+
+	if (peer_req->flags & (EE_TRIM|EE_ZEROOUT))
+		drbd_issue_peer_discard_or_zero_out(device, peer_req);
+	else /* EE_WRITE_SAME */
+		drbd_issue_peer_wsame(device, peer_req);
+}
+
 static bool conn_wait_ee_cond(struct drbd_connection *connection, struct list_head *head)
 {
 	struct drbd_resource *resource = connection->resource;
@@ -1588,6 +1972,7 @@ int drbd_submit_peer_request(struct drbd_peer_request *peer_req)
 {
 	struct drbd_device *device = peer_req->peer_device->device;
 	struct bio *bios = NULL;
+	struct bio *journal_bios = NULL;
 	struct bio *bio;
 	struct page *page = peer_req->page_chain.head;
 	sector_t sector = peer_req->i.sector;
@@ -1596,6 +1981,20 @@ int drbd_submit_peer_request(struct drbd_peer_request *peer_req)
 	unsigned nr_pages = peer_req->page_chain.nr_pages;
 	int err = -ENOMEM;
 
+	if (peer_req->verify) {
+		struct peer_req_verify *v = peer_req->verify;
+		bool failed;
+
+		/* still being checked, verify_work_fn() submits it */
+		if (!atomic_dec_and_test(&v->gate))
+			return 0;
+		failed = v->failed;
+		peer_req->verify = NULL;
+		kfree(v);
+		if (failed)
+			return -EINVAL;
+	}
+
 	if (peer_req->flags & EE_SET_OUT_OF_SYNC)
 		drbd_set_out_of_sync(peer_req->peer_device,
 				peer_req->i.sector, peer_req->i.size);
@@ -1610,10 +2009,9 @@ int drbd_submit_peer_request(struct drbd_peer_request *peer_req)
 		peer_req->submit_jif = jiffies;
 		peer_req->flags |= EE_SUBMITTED;
 
-		if (peer_req->flags & (EE_TRIM|EE_ZEROOUT))
-			drbd_issue_peer_discard_or_zero_out(device, peer_req);
-		else /* EE_WRITE_SAME */
-			drbd_issue_peer_wsame(device, peer_req);
+		/* not journaled, must not be overwritten by a replay */
+		if (!drbd_journal_defer_discard(peer_req))
+			drbd_submit_peer_discard(peer_req);
 		return 0;
 	}
 
@@ -1696,7 +2094,10 @@ next_bio:
 	D_ASSERT(device, data_size == 0);
 	D_ASSERT(device, page == NULL);
 
-	atomic_set(&peer_req->pending_bios, n_bios);
+	if (peer_req_op(peer_req) == REQ_OP_WRITE)
+		journal_bios = drbd_journal_prepare(peer_req);
+
+	atomic_set(&peer_req->pending_bios, n_bios + !!journal_bios);
 	/* for debugfs: update timestamp, mark as submitted */
 	peer_req->submit_jif = jiffies;
 	peer_req->flags |= EE_SUBMITTED;
@@ -1712,6 +2113,7 @@ next_bio:
 		if (bios && bios->bi_next)
 			bios->bi_opf &= ~REQ_PREFLUSH;
 	} while (bios);
+	drbd_journal_submit(journal_bios);
 	return 0;
 
 fail:
@@ -1902,7 +2304,7 @@ static void p_req_detail_from_pi(struct drbd_connection *connection,
 	bool is_trim_or_wsame = pi->cmd == P_TRIM || pi->cmd == P_WSAME || pi->cmd == P_ZEROES;
 	unsigned int digest_size =
 		pi->cmd != P_TRIM && connection->peer_integrity_tfm ?
-		crypto_shash_digestsize(connection->peer_integrity_tfm) : 0;
+		crypto_ahash_digestsize(connection->peer_integrity_tfm) : 0;
 
 	d->sector = be64_to_cpu(p->p_data.sector);
 	d->block_id = p->p_data.block_id;
@@ -1913,6 +2315,121 @@ static void p_req_detail_from_pi(struct drbd_connection *connection,
 	d->digest_size = digest_size;
 }
 
+static void cleanup_after_failed_verify(struct drbd_peer_request *peer_req)
+{
+	struct drbd_peer_device *peer_device = peer_req->peer_device;
+	struct drbd_device *device = peer_device->device;
+
+	if (peer_req->w.cb != e_end_resync_block) {
+		drbd_cleanup_after_failed_submit_peer_request(peer_req);
+		return;
+	}
+
+	/* what recv_resync_read() and receive_RSDataReply() do on errors */
+	spin_lock_irq(&device->resource->req_lock);
+	list_del(&peer_req->w.list);
+	spin_unlock_irq(&device->resource->req_lock);
+	drbd_free_peer_req(peer_req);
+	put_ldev(device);
+	change_cstate(peer_device->connection, C_PROTOCOL_ERROR, CS_HARD);
+}
+
+static void verify_digest_done(struct crypto_async_request *areq, int err)
+{
+	struct peer_req_verify *v = areq->data;
+
+	/* taken off the backlog, the completion follows */
+	if (err == -EINPROGRESS)
+		return;
+	v->err = err;
+	queue_work(drbd_verify_wq, &v->work);
+}
+
+/* Runs twice if the digest completes asynchronously: once to issue it, once
+ * from verify_digest_done() to compare. */
+static void verify_work_fn(struct work_struct *ws)
+{
+	struct peer_req_verify *v = container_of(ws, struct peer_req_verify, work);
+	struct drbd_peer_request *peer_req = v->peer_req;
+	struct drbd_peer_device *peer_device = peer_req->peer_device;
+	struct drbd_connection *connection = peer_device->connection;
+
+	if (!v->digested) {
+		v->digested = true;
+		v->err = crypto_ahash_digest(v->req);
+		if (v->err == -EINPROGRESS || v->err == -EBUSY)
+			return;
+	}
+
+	if (v->err || memcmp(v->digest, v->digest + v->digest_size, v->digest_size)) {
+		drbd_err(peer_device->device, "Digest integrity check FAILED: %llus +%u\n",
+			 (unsigned long long)peer_req->i.sector, peer_req->i.size);
+		v->failed = true;
+		change_cstate(connection, C_PROTOCOL_ERROR, CS_HARD);
+	}
+
+	/* Do not touch v after this, unless we are the last one. */
+	if (atomic_dec_and_test(&v->gate)) {
+		bool failed = v->failed;
+
+		peer_req->verify = NULL;
+		kfree(v);
+		if (failed || drbd_submit_peer_request(peer_req))
+			cleanup_after_failed_verify(peer_req);
+	}
+
+	/* peer_req_wait_verify() waits for the gate, too */
+	atomic_dec(&connection->verify_cnt);
+	wake_up(&connection->ee_wait);
+}
+
+/* Check the digest of the received data on drbd_verify_wq, while the receiver
+ * goes on.  drbd_submit_peer_request() on this peer request only submits
+ * once the check passed.  The ahash request and its scatterlist come with
+ * the same allocation; the digest completes asynchronously if the
+ * implementation does, without blocking a worker. */
+static bool queue_verify(struct drbd_peer_request *peer_req, void *dig_in, unsigned int digest_size)
+{
+	struct drbd_connection *connection = peer_req->peer_device->connection;
+	struct crypto_ahash *tfm = connection->peer_integrity_tfm;
+	struct page *page = peer_req->page_chain.head;
+	unsigned int nents = max(drbd_page_chain_nents(page), 1U);
+	size_t req_off, sg_off;
+	struct scatterlist *sg;
+	struct peer_req_verify *v;
+	unsigned int nbytes;
+
+	req_off = ALIGN(sizeof(*v) + 2 * digest_size, CRYPTO_MINALIGN);
+	sg_off = ALIGN(req_off + sizeof(struct ahash_request) + crypto_ahash_reqsize(tfm),
+		       __alignof__(struct scatterlist));
+	v = kmalloc(sg_off + nents * sizeof(*sg), GFP_NOIO);
+	if (!v)
+		return false;
+	INIT_WORK(&v->work, verify_work_fn);
+	v->peer_req = peer_req;
+	atomic_set(&v->gate, 2);
+	v->err = 0;
+	v->digested = false;
+	v->failed = false;
+	v->digest_size = digest_size;
+	memcpy(v->digest, dig_in, digest_size);
+
+	sg = (void *)v + sg_off;
+	sg_init_table(sg, nents);
+	nbytes = drbd_page_chain_to_sg(page, sg);
+	v->req = (void *)v + req_off;
+	ahash_request_set_tfm(v->req, tfm);
+	ahash_request_set_callback(v->req,
+		CRYPTO_TFM_REQ_MAY_BACKLOG | CRYPTO_TFM_REQ_MAY_SLEEP,
+		verify_digest_done, v);
+	ahash_request_set_crypt(v->req, sg, v->digest + digest_size, nbytes);
+	peer_req->verify = v;
+
+	atomic_inc(&connection->verify_cnt);
+	queue_work(drbd_verify_wq, &v->work);
+	return true;
+}
+
 /* used from receive_RSDataReply (recv_resync_read)
  * and from receive_Data.
  * data_size: actual payload ("data in")
@@ -1931,8 +2448,6 @@ read_in_block(struct drbd_peer_device *peer_device, struct drbd_peer_request_det
 	int err;
 	void *dig_in = peer_device->connection->int_dig_in;
 	void *dig_vv = peer_device->connection->int_dig_vv;
-	struct drbd_transport *transport = &peer_device->connection->transport;
-	struct drbd_transport_ops *tr_ops = transport->ops;
 
 	if (d->digest_size) {
 		err = drbd_recv_into(peer_device->connection, dig_in, d->digest_size);
@@ -1968,7 +2483,7 @@ read_in_block(struct drbd_peer_device *peer_device, struct drbd_peer_request_det
 	if (d->length == 0)
 		return peer_req;
 
-	err = tr_ops->recv_pages(transport, &peer_req->page_chain, d->length - d->digest_size);
+	err = drbd_recv_pages(peer_device->connection, &peer_req->page_chain, d->length - d->digest_size);
 	if (err)
 		goto fail;
 
@@ -1983,8 +2498,13 @@ read_in_block(struct drbd_peer_device *peer_device, struct drbd_peer_request_det
 		kunmap(page);
 	}
 
-	if (d->digest_size) {
-		drbd_csum_pages(peer_device->connection->peer_integrity_tfm, peer_req->page_chain.head, dig_vv);
+	/* receive_Data() sends the P_RECV_ACK before submitting, so data
+	 * that gets one is checked here, before that. */
+	if (d->digest_size &&
+	    !(drbd_async_integrity && !(d->dp_flags & DP_SEND_RECEIVE_ACK) &&
+	      queue_verify(peer_req, dig_in, d->digest_size))) {
+		drbd_csum_pages(peer_device->connection->peer_integrity_tfm,
+				&peer_device->connection->receiver_req, peer_req->page_chain.head, dig_vv);
 		if (memcmp(dig_in, dig_vv, d->digest_size)) {
 			drbd_err(device, "Digest integrity check FAILED: %llus +%u\n",
 				d->sector, d->bi_size);
@@ -2027,7 +2547,7 @@ static int recv_dless_read(struct drbd_peer_device *peer_device, struct drbd_req
 
 	digest_size = 0;
 	if (peer_device->connection->peer_integrity_tfm) {
-		digest_size = crypto_shash_digestsize(peer_device->connection->peer_integrity_tfm);
+		digest_size = crypto_ahash_digestsize(peer_device->connection->peer_integrity_tfm);
 		err = drbd_recv_into(peer_device->connection, dig_in, digest_size);
 		if (err)
 			return err;
@@ -2052,7 +2572,8 @@ static int recv_dless_read(struct drbd_peer_device *peer_device, struct drbd_req
 	}
 
 	if (digest_size) {
-		drbd_csum_bio(peer_device->connection->peer_integrity_tfm, bio, dig_vv);
+		drbd_csum_bio(peer_device->connection->peer_integrity_tfm,
+			      &peer_device->connection->receiver_req, bio, dig_vv);
 		if (memcmp(dig_in, dig_vv, digest_size)) {
 			drbd_err(peer_device, "Digest integrity check FAILED. Broken NICs?\n");
 			return -EINVAL;
@@ -2340,18 +2861,20 @@ static int e_end_block(struct drbd_work *w, int cancel)
 			drbd_may_finish_epoch(peer_device->connection, epoch, EV_BARRIER_DONE + (cancel ? EV_CLEANUP : 0));
 	}
 
-	if (peer_req->flags & EE_SEND_WRITE_ACK) {
+	/* Not if acked already once it was in the journal.  Should the write
+	 * to the backing device have failed after that, it is marked out of
+	 * sync here, and the peer has to know. */
+	if ((peer_req->flags & (EE_JOURNAL_ACKED | EE_WAS_ERROR)) ==
+	    (EE_JOURNAL_ACKED | EE_WAS_ERROR)) {
+		err = drbd_send_out_of_sync(peer_device, &peer_req->i);
+	} else if ((peer_req->flags & (EE_SEND_WRITE_ACK | EE_JOURNAL_ACKED)) == EE_SEND_WRITE_ACK) {
 		if (unlikely(peer_req->flags & EE_WAS_ERROR)) {
 			pcmd = P_NEG_ACK;
 			/* we expect it to be marked out of sync anyways...
 			 * maybe assert this?  */
-		} else if (peer_device->repl_state[NOW] >= L_SYNC_SOURCE &&
-			   peer_device->repl_state[NOW] <= L_PAUSED_SYNC_T &&
-			   peer_req->flags & EE_MAY_SET_IN_SYNC) {
-			pcmd = P_RS_WRITE_ACK;
-			drbd_set_in_sync(peer_device, sector, peer_req->i.size);
 		} else
-			pcmd = P_WRITE_ACK;
+			pcmd = write_ack_cmd(peer_device, sector, peer_req->i.size,
+					     peer_req->flags & EE_MAY_SET_IN_SYNC);
 		err = drbd_send_ack(peer_device, pcmd, peer_req);
 		dec_unacked(peer_device);
 	}
@@ -2450,7 +2973,7 @@ static bool overlapping_resync_write(struct drbd_connection *connection, struct
 	 * iterate over all connections.
 	 * Fortunately we don't have to, because we have now mutually excluded
 	 * resync and application activity on a particular region using
-	 * device->act_log and peer_device->resync_lru.
+	 * device->act_log and device->resync_requests.
 	 */
 	spin_lock_irq(&connection->resource->req_lock);
 	list_for_each_entry(rs_req, &connection->sync_ee, w.list) {
@@ -2822,6 +3345,21 @@ static int receive_Data(struct drbd_connection *connection, struct packet_info *
 	 * end of this function.
 	 */
 
+	/* read_in_block() needs to know whether the data gets a P_RECV_ACK */
+	if (connection->agreed_pro_version < 100) {
+		rcu_read_lock();
+		nc = rcu_dereference(connection->transport.net_conf);
+		switch (nc->wire_protocol) {
+		case DRBD_PROT_C:
+			d.dp_flags |= DP_SEND_WRITE_ACK;
+			break;
+		case DRBD_PROT_B:
+			d.dp_flags |= DP_SEND_RECEIVE_ACK;
+			break;
+		}
+		rcu_read_unlock();
+	}
+
 	peer_req = read_in_block(peer_device, &d);
 	if (!peer_req) {
 		put_ldev(device);
@@ -2913,16 +3451,6 @@ static int receive_Data(struct drbd_connection *connection, struct packet_info *
 	rcu_read_lock();
 	nc = rcu_dereference(connection->transport.net_conf);
 	tp = nc->two_primaries;
-	if (connection->agreed_pro_version < 100) {
-		switch (nc->wire_protocol) {
-		case DRBD_PROT_C:
-			d.dp_flags |= DP_SEND_WRITE_ACK;
-			break;
-		case DRBD_PROT_B:
-			d.dp_flags |= DP_SEND_RECEIVE_ACK;
-			break;
-		}
-	}
 	rcu_read_unlock();
 
 	if (d.dp_flags & DP_SEND_WRITE_ACK) {
@@ -3361,7 +3889,7 @@ static int receive_DataRequest(struct drbd_connection *connection, struct packet
 	 * introduces a bunch of new code for synchronization between threads.
 	 *
 	 * Unlimited throttling before drbd_rs_begin_io may stall the resync
-	 * "forever", throttling after drbd_rs_begin_io will lock that extent
+	 * "forever", throttling after drbd_rs_begin_io will lock that range
 	 * for application writes for the same time.  For now, just throttle
 	 * here, where the rest of the code expects the receiver to sleep for
 	 * a while, anyways.
@@ -3393,7 +3921,7 @@ static int receive_DataRequest(struct drbd_connection *connection, struct packet
 	if (connection->agreed_pro_version >= 110) {
 		/* In DRBD9 we may not sleep here in order to avoid deadlocks.
 		   Instruct the SyncSource to retry */
-		err = drbd_try_rs_begin_io(peer_device, sector, false);
+		err = drbd_try_rs_begin_io(peer_device, sector, size, false);
 		if (err) {
 			if (pi->cmd == P_OV_REQUEST)
 				verify_skipped_block(peer_device, sector, size);
@@ -3403,7 +3931,7 @@ static int receive_DataRequest(struct drbd_connection *connection, struct packet
 		}
 	} else {
 		update_receiver_timing_details(connection, drbd_rs_begin_io);
-		if (drbd_rs_begin_io(peer_device, sector)) {
+		if (drbd_rs_begin_io(peer_device, sector, size)) {
 			err = -EIO;
 			goto fail3;
 		}
@@ -3413,6 +3941,10 @@ submit_for_resync:
 	atomic_add(size >> 9, &device->rs_sect_ev);
 
 submit:
+	/* not before a journaled write of these blocks reached the disk */
+	update_receiver_timing_details(connection, drbd_journal_wait_read);
+	drbd_journal_wait_read(device, sector, size);
+
 	update_receiver_timing_details(connection, drbd_submit_peer_request);
 	inc_unacked(peer_device);
 	if (drbd_submit_peer_request(peer_req) == 0)
@@ -4346,7 +4878,7 @@ static int receive_protocol(struct drbd_connection *connection, struct packet_in
 	int p_proto, p_discard_my_data, p_two_primaries, cf;
 	struct net_conf *nc, *old_net_conf, *new_net_conf = NULL;
 	char integrity_alg[SHARED_SECRET_MAX] = "";
-	struct crypto_shash *peer_integrity_tfm = NULL;
+	struct crypto_ahash *peer_integrity_tfm = NULL;
 	void *int_dig_in = NULL, *int_dig_vv = NULL;
 
 	p_proto		= be32_to_cpu(p->protocol);
@@ -4425,7 +4957,7 @@ static int receive_protocol(struct drbd_connection *connection, struct packet_in
 		 * change.
 		 */
 
-		peer_integrity_tfm = crypto_alloc_shash(integrity_alg, 0, 0);
+		peer_integrity_tfm = crypto_alloc_ahash(integrity_alg, 0, 0);
 		if (IS_ERR(peer_integrity_tfm)) {
 			peer_integrity_tfm = NULL;
 			drbd_err(connection, "peer data-integrity-alg %s not supported\n",
@@ -4433,7 +4965,7 @@ static int receive_protocol(struct drbd_connection *connection, struct packet_in
 			goto disconnect;
 		}
 
-		hash_size = crypto_shash_digestsize(peer_integrity_tfm);
+		hash_size = crypto_ahash_digestsize(peer_integrity_tfm);
 		int_dig_in = kmalloc(hash_size, GFP_KERNEL);
 		int_dig_vv = kmalloc(hash_size, GFP_KERNEL);
 		if (!(int_dig_in && int_dig_vv)) {
@@ -4467,7 +4999,8 @@ static int receive_protocol(struct drbd_connection *connection, struct packet_in
 	mutex_unlock(&connection->mutex[DATA_STREAM]);
 	mutex_unlock(&connection->resource->conf_update);
 
-	crypto_free_shash(connection->peer_integrity_tfm);
+	drbd_wait_verify_done(connection);
+	crypto_free_ahash(connection->peer_integrity_tfm);
 	kfree(connection->int_dig_in);
 	kfree(connection->int_dig_vv);
 	connection->peer_integrity_tfm = peer_integrity_tfm;
@@ -4485,7 +5018,7 @@ static int receive_protocol(struct drbd_connection *connection, struct packet_in
 disconnect_rcu_unlock:
 	rcu_read_unlock();
 disconnect:
-	crypto_free_shash(peer_integrity_tfm);
+	crypto_free_ahash(peer_integrity_tfm);
 	kfree(int_dig_in);
 	kfree(int_dig_vv);
 	change_cstate(connection, C_DISCONNECTING, CS_HARD);
@@ -4497,15 +5030,15 @@ disconnect:
  * return: NULL (alg name was "")
  *         ERR_PTR(error) if something goes wrong
  *         or the crypto hash ptr, if it worked out ok. */
-static struct crypto_shash *drbd_crypto_alloc_digest_safe(const struct drbd_device *device,
+static struct crypto_ahash *drbd_crypto_alloc_digest_safe(const struct drbd_device *device,
 		const char *alg, const char *name)
 {
-	struct crypto_shash *tfm;
+	struct crypto_ahash *tfm;
 
 	if (!alg[0])
 		return NULL;
 
-	tfm = crypto_alloc_shash(alg, 0, 0);
+	tfm = crypto_alloc_ahash(alg, 0, 0);
 	if (IS_ERR(tfm)) {
 		drbd_err(device, "Can not allocate \"%s\" as %s (reason: %ld)\n",
 			alg, name, PTR_ERR(tfm));
@@ -4538,8 +5071,8 @@ static int receive_SyncParam(struct drbd_connection *connection, struct packet_i
 	struct drbd_device *device;
 	struct p_rs_param_95 *p;
 	unsigned int header_size, data_size, exp_max_sz;
-	struct crypto_shash *verify_tfm = NULL;
-	struct crypto_shash *csums_tfm = NULL;
+	struct crypto_ahash *verify_tfm = NULL;
+	struct crypto_ahash *csums_tfm = NULL;
 	struct net_conf *old_net_conf, *new_net_conf = NULL;
 	struct peer_device_conf *old_peer_device_conf = NULL, *new_peer_device_conf = NULL;
 	const int apv = connection->agreed_pro_version;
@@ -4681,14 +5214,14 @@ static int receive_SyncParam(struct drbd_connection *connection, struct packet_i
 			if (verify_tfm) {
 				strcpy(new_net_conf->verify_alg, p->verify_alg);
 				new_net_conf->verify_alg_len = strlen(p->verify_alg) + 1;
-				crypto_free_shash(connection->verify_tfm);
+				crypto_free_ahash(connection->verify_tfm);
 				connection->verify_tfm = verify_tfm;
 				drbd_info(device, "using verify-alg: \"%s\"\n", p->verify_alg);
 			}
 			if (csums_tfm) {
 				strcpy(new_net_conf->csums_alg, p->csums_alg);
 				new_net_conf->csums_alg_len = strlen(p->csums_alg) + 1;
-				crypto_free_shash(connection->csums_tfm);
+				crypto_free_ahash(connection->csums_tfm);
 				connection->csums_tfm = csums_tfm;
 				drbd_info(device, "using csums-alg: \"%s\"\n", p->csums_alg);
 			}
@@ -4731,9 +5264,9 @@ disconnect:
 	mutex_unlock(&resource->conf_update);
 	/* just for completeness: actually not needed,
 	 * as this is not reached if csums_tfm was ok. */
-	crypto_free_shash(csums_tfm);
+	crypto_free_ahash(csums_tfm);
 	/* but free the verify_tfm again, if csums_tfm did not work out */
-	crypto_free_shash(verify_tfm);
+	crypto_free_ahash(verify_tfm);
 	change_cstate(connection, C_DISCONNECTING, CS_HARD);
 	return -EIO;
 }
@@ -7064,6 +7597,48 @@ static int dcbp_get_pad_bits(struct p_compressed_bm *p)
 	return (p->encoding >> 4) & 0x7;
 }
 
+static void bm_rle_window_flush(struct drbd_peer_device *peer_device, struct bm_rle_window *w,
+				struct bm_xfer_ctx *c)
+{
+	unsigned long offset, number;
+
+	if (w->start == w->end || peer_device->bitmap_index == -1)
+		return;
+	offset = w->start / BITS_PER_LONG;
+	number = min_t(unsigned long, BM_RLE_WINDOW_BITS / BITS_PER_LONG, c->bm_words - offset);
+	drbd_bm_merge_lel(peer_device, offset, number, (unsigned long *)w->words);
+	w->start = w->end = 0;
+}
+
+/* Collect decoded runs of set bits in a window and merge that into the
+ * bitmap in one go, rather than taking the bitmap lock once per run.
+ * Runs too long for the window go to the bitmap directly. */
+static void bm_rle_window_set_bits(struct drbd_peer_device *peer_device, struct bm_rle_window *w,
+				   unsigned long s, unsigned long e, struct bm_xfer_ctx *c)
+{
+	if (e - s + 1 >= BM_RLE_WINDOW_BITS) {
+		bm_rle_window_flush(peer_device, w, c);
+		drbd_bm_set_many_bits(peer_device, s, e);
+		return;
+	}
+
+	while (s <= e) {
+		unsigned long last;
+		u64 mask;
+
+		if (s < w->start || s >= w->end) {
+			bm_rle_window_flush(peer_device, w, c);
+			w->start = s & ~63UL;
+			w->end = w->start + BM_RLE_WINDOW_BITS;
+			memset(w->words, 0, sizeof(w->words));
+		}
+		last = min(e, s | 63);
+		mask = (~0ULL << (s & 63)) & (~0ULL >> (63 - (last & 63)));
+		w->words[(s - w->start) / 64] |= cpu_to_le64(mask);
+		s = last + 1;
+	}
+}
+
 /**
  * recv_bm_rle_bits
  *
@@ -7076,6 +7651,7 @@ recv_bm_rle_bits(struct drbd_peer_device *peer_device,
 		 struct bm_xfer_ctx *c,
 		 unsigned int len)
 {
+	struct bm_rle_window w = { };
 	struct bitstream bs;
 	u64 look_ahead;
 	u64 rl;
@@ -7103,7 +7679,7 @@ recv_bm_rle_bits(struct drbd_peer_device *peer_device,
 				drbd_err(peer_device, "bitmap overflow (e:%lu) while decoding bm RLE packet\n", e);
 				return -EIO;
 			}
-			drbd_bm_set_many_bits(peer_device, s, e);
+			bm_rle_window_set_bits(peer_device, &w, s, e, c);
 		}
 
 		if (have < bits) {
@@ -7126,6 +7702,7 @@ recv_bm_rle_bits(struct drbd_peer_device *peer_device,
 		look_ahead |= tmp << have;
 		have += bits;
 	}
+	bm_rle_window_flush(peer_device, &w, c);
 
 	c->bit_offset = s;
 	bm_xfer_ctx_bit_to_word_offset(c);
@@ -7592,7 +8169,7 @@ static int receive_rs_deallocated(struct drbd_connection *connection, struct pac
 		list_add_tail(&peer_req->w.list, &connection->sync_ee);
 		spin_unlock_irq(&device->resource->req_lock);
 
-		atomic_add(pi->size >> 9, &device->rs_sect_ev);
+		atomic_add(size >> 9, &device->rs_sect_ev);
 		err = drbd_submit_peer_request(peer_req);
 
 		if (err) {
@@ -7875,7 +8452,11 @@ void conn_disconnect(struct drbd_connection *connection)
 
 	/* ack_receiver does not clean up anything. it must not interfere, either */
 	drbd_thread_stop(&connection->ack_receiver);
-	if (connection->ack_sender) {
+	if (connection->ack_sender == drbd_ack_sender_wq) {
+		flush_work(&connection->send_acks_work);
+		flush_work(&connection->peer_ack_work);
+		connection->ack_sender = NULL;
+	} else if (connection->ack_sender) {
 		destroy_workqueue(connection->ack_sender);
 		connection->ack_sender = NULL;
 	}
@@ -8305,9 +8886,12 @@ int drbd_receiver(struct drbd_thread *thi)
 	struct drbd_connection *connection = thi->connection;
 
 	if (conn_connect(connection)) {
+		if (drbd_buffered_data_recv)
+			drbd_recv_buf_alloc(connection, DATA_STREAM);
 		blk_start_plug(&connection->receiver_plug);
 		drbdd(connection);
 		blk_finish_plug(&connection->receiver_plug);
+		drbd_recv_buf_free(connection, DATA_STREAM);
 	}
 
 	conn_disconnect(connection);
@@ -8560,6 +9144,75 @@ validate_req_change_req_state(struct drbd_peer_device *peer_device, u64 id, sect
 	return 0;
 }
 
+/* Positive write acks are collected while more packets are readily
+ * available on the control stream, and then applied under a single
+ * req_lock.  They are applied before any other packet is processed, and
+ * before the ack receiver would block waiting for more. */
+#define ACK_BATCH_MAX 32
+
+struct drbd_ack_batch {
+	unsigned int nr;
+	struct {
+		struct drbd_peer_device *peer_device;
+		u64 id;
+		sector_t sector;
+		enum drbd_req_event what;
+		struct bio_and_error m;
+	} acks[ACK_BATCH_MAX];
+};
+
+static int drbd_ack_batch_flush(struct drbd_connection *connection)
+{
+	struct drbd_ack_batch *batch = connection->ack_batch;
+	unsigned int i, nr;
+	int err = 0;
+
+	if (!batch || !batch->nr)
+		return 0;
+
+	spin_lock_irq(&connection->resource->req_lock);
+	for (nr = 0; nr < batch->nr; nr++) {
+		struct drbd_peer_device *peer_device = batch->acks[nr].peer_device;
+		struct drbd_device *device = peer_device->device;
+		struct drbd_request *req;
+
+		req = find_request(device, &device->write_requests, batch->acks[nr].id,
+				   batch->acks[nr].sector, false, "got_BlockAck");
+		if (unlikely(!req)) {
+			err = -EIO;
+			break;
+		}
+		__req_mod(req, batch->acks[nr].what, peer_device, &batch->acks[nr].m);
+	}
+	spin_unlock_irq(&connection->resource->req_lock);
+
+	for (i = 0; i < nr; i++) {
+		if (batch->acks[i].m.bio)
+			complete_master_bio(batch->acks[i].peer_device->device, &batch->acks[i].m);
+	}
+	batch->nr = 0;
+
+	return err;
+}
+
+static int drbd_ack_batch_add(struct drbd_connection *connection,
+			      struct drbd_peer_device *peer_device, u64 id, sector_t sector,
+			      enum drbd_req_event what)
+{
+	struct drbd_ack_batch *batch = connection->ack_batch;
+	unsigned int nr = batch->nr++;
+
+	batch->acks[nr].peer_device = peer_device;
+	batch->acks[nr].id = id;
+	batch->acks[nr].sector = sector;
+	batch->acks[nr].what = what;
+	batch->acks[nr].m.bio = NULL;
+
+	if (batch->nr == ACK_BATCH_MAX)
+		return drbd_ack_batch_flush(connection);
+	return 0;
+}
+
 static int got_BlockAck(struct drbd_connection *connection, struct packet_info *pi)
 {
 	struct drbd_peer_device *peer_device;
@@ -8573,6 +9226,7 @@ static int got_BlockAck(struct drbd_connection *connection, struct packet_info *
 	if (!peer_device)
 		return -EIO;
 	device = peer_device->device;
+	peer_device->ack_cnt++;
 
 	update_peer_seq(peer_device, be32_to_cpu(p->seq_num));
 
@@ -8602,6 +9256,13 @@ static int got_BlockAck(struct drbd_connection *connection, struct packet_info *
 		BUG();
 	}
 
+	if (connection->ack_batch && what != DISCARD_WRITE && what != POSTPONE_WRITE)
+		return drbd_ack_batch_add(connection, peer_device, p->block_id, sector, what);
+
+	/* not after the acks batched before it */
+	if (drbd_ack_batch_flush(connection))
+		return -EIO;
+
 	return validate_req_change_req_state(peer_device, p->block_id, sector,
 					     &device->write_requests, __func__,
 					     what, false);
@@ -9052,13 +9713,18 @@ int drbd_ack_receiver(struct drbd_thread *thi)
 	int expect   = header_size;
 	bool ping_timeout_active = false;
 	struct sched_param param = { .sched_priority = 2 };
-	struct drbd_transport *transport = &connection->transport;
-	struct drbd_transport_ops *tr_ops = transport->ops;
 
 	rv = sched_setscheduler(current, SCHED_RR, &param);
 	if (rv < 0)
 		drbd_err(connection, "drbd_ack_receiver: ERROR set priority, ret=%d\n", rv);
 
+	/* without it, acks are simply applied one by one */
+	connection->ack_batch = kmalloc(sizeof(struct drbd_ack_batch), GFP_KERNEL);
+	if (connection->ack_batch)
+		connection->ack_batch->nr = 0;
+	if (drbd_buffered_control_recv)
+		drbd_recv_buf_alloc(connection, CONTROL_STREAM);
+
 	while (get_t_state(thi) == RUNNING) {
 		drbd_thread_current_set_cpu(thi);
 
@@ -9075,7 +9741,19 @@ int drbd_ack_receiver(struct drbd_thread *thi)
 		}
 
 		pre_recv_jif = jiffies;
-		rv = tr_ops->recv(transport, CONTROL_STREAM, &buffer, expect - received, rflags);
+		if (connection->ack_batch && connection->ack_batch->nr) {
+			/* apply collected acks before blocking for more */
+			rv = drbd_recv_buffered(connection, CONTROL_STREAM, &buffer, expect - received,
+						rflags | MSG_DONTWAIT);
+			if (rv == -EAGAIN) {
+				if (drbd_ack_batch_flush(connection))
+					goto reconnect;
+				continue;
+			}
+		} else {
+			rv = drbd_recv_buffered(connection, CONTROL_STREAM, &buffer, expect - received,
+						rflags);
+		}
 
 		/* Note:
 		 * -EINTR	 (on meta) we got a signal
@@ -9152,6 +9830,9 @@ int drbd_ack_receiver(struct drbd_thread *thi)
 		if (received == expect) {
 			bool err;
 
+			if (cmd->fn != got_BlockAck && drbd_ack_batch_flush(connection))
+				goto reconnect;
+
 			pi.data = buffer;
 			err = cmd->fn(connection, &pi);
 			if (err) {
@@ -9175,12 +9856,18 @@ int drbd_ack_receiver(struct drbd_thread *thi)
 
 	if (0) {
 reconnect:
+		drbd_ack_batch_flush(connection);
 		change_cstate(connection, C_NETWORK_FAILURE, CS_HARD);
 	}
 	if (0) {
 disconnect:
+		drbd_ack_batch_flush(connection);
 		change_cstate(connection, C_DISCONNECTING, CS_HARD);
 	}
+	drbd_ack_batch_flush(connection);
+	kfree(connection->ack_batch);
+	connection->ack_batch = NULL;
+	drbd_recv_buf_free(connection, CONTROL_STREAM);
 
 	drbd_info(connection, "ack_receiver terminated\n");
 
@@ -9200,8 +9887,13 @@ void drbd_send_acks_wf(struct work_struct *ws)
 	tcp_cork = nc->tcp_cork;
 	rcu_read_unlock();
 
-	/* TODO: conditionally cork; it may hurt latency if we cork without
-	   much to send */
+	/* Corking only pays off if there is more than one ack to send.  While
+	 * corked, the acks accumulate in the send buffer and go out in a
+	 * single send on uncork; more completions arriving meanwhile get
+	 * picked up by the next run of this work. */
+	if (atomic_read(&connection->done_ee_cnt) <= 1)
+		tcp_cork = false;
+	mutex_lock(&connection->ack_sender_mutex);
 	if (tcp_cork)
 		drbd_cork(connection, CONTROL_STREAM);
 	err = drbd_finish_peer_reqs(connection);
@@ -9209,6 +9901,7 @@ void drbd_send_acks_wf(struct work_struct *ws)
 	/* but unconditionally uncork unless disabled */
 	if (tcp_cork)
 		drbd_uncork(connection, CONTROL_STREAM);
+	mutex_unlock(&connection->ack_sender_mutex);
 
 	if (err)
 		change_cstate(connection, C_NETWORK_FAILURE, CS_HARD);
@@ -9218,8 +9911,13 @@ void drbd_send_peer_ack_wf(struct work_struct *ws)
 {
 	struct drbd_connection *connection =
 		container_of(ws, struct drbd_connection, peer_ack_work);
+	int err;
 
-	if (process_peer_ack_list(connection))
+	/* on the shared drbd_ack_sender_wq both works may run at the same time */
+	mutex_lock(&connection->ack_sender_mutex);
+	err = process_peer_ack_list(connection);
+	mutex_unlock(&connection->ack_sender_mutex);
+	if (err)
 		change_cstate(connection, C_NETWORK_FAILURE, CS_HARD);
 }
 
@@ -55,6 +55,7 @@ static struct drbd_request *drbd_req_new(struct drbd_device *device, struct bio
 	req->epoch = 0;
 
 	drbd_clear_interval(&req->i);
+	drbd_clear_interval(&req->active_write);
 	req->i.sector = bio_src->bi_iter.bi_sector;
 	req->i.size = bio_src->bi_iter.bi_size;
 	req->i.local = true;
@@ -841,10 +842,13 @@ void __req_mod(struct drbd_request *req, enum drbd_req_event what,
 		break;
 
 	case COMPLETED_OK:
-		if (req->local_rq_state & RQ_WRITE)
+		if (req->local_rq_state & RQ_WRITE) {
 			device->writ_cnt += req->i.size >> 9;
-		else
+			device->writ_ios++;
+		} else {
 			device->read_cnt += req->i.size >> 9;
+			device->read_ios++;
+		}
 
 		mod_rq_state(req, m, peer_device, RQ_LOCAL_PENDING,
 				RQ_LOCAL_COMPLETED|RQ_LOCAL_OK);
@@ -1116,12 +1120,9 @@ void __req_mod(struct drbd_request *req, enum drbd_req_event what,
  */
 static bool drbd_may_do_local_read(struct drbd_device *device, sector_t sector, int size)
 {
-	struct drbd_md *md = &device->ldev->md;
-	unsigned int node_id;
-	unsigned int n_checked = 0;
-
 	unsigned long sbnr, ebnr;
 	sector_t esector, nr_sectors;
+	int count;
 
 	if (device->disk_state[NOW] == D_UP_TO_DATE)
 		return true;
@@ -1135,24 +1136,15 @@ static bool drbd_may_do_local_read(struct drbd_device *device, sector_t sector,
 	sbnr = BM_SECT_TO_BIT(sector);
 	ebnr = BM_SECT_TO_BIT(esector);
 
-	for (node_id = 0; node_id < DRBD_NODE_ID_MAX; node_id++) {
-		struct drbd_peer_md *peer_md = &md->peers[node_id];
-
-		/* Skip bitmap indexes which are not assigned to a peer. */
-		if (!(peer_md->flags & MDF_HAVE_BITMAP))
-			continue;
-
-		if (drbd_bm_count_bits(device, peer_md->bitmap_index, sbnr, ebnr))
-			return false;
-		++n_checked;
-	}
-	if (n_checked == 0) {
+	/* Out of sync with any of the peers that have a bitmap? */
+	count = drbd_bm_count_union_bits(device, sbnr, ebnr);
+	if (count < 0) {
 		if (drbd_ratelimit()) {
 			drbd_err(device, "No valid bitmap slots found to check!\n");
 		}
 		return false;
 	}
-	return true;
+	return count == 0;
 }
 
 /* TODO improve for more than one peer.
@@ -26,6 +26,7 @@
 #include "drbd_int.h"
 #include "drbd_protocol.h"
 #include "drbd_req.h"
+#include "drbd_journal.h"
 
 void drbd_panic_after_delayed_completion_of_aborted_request(struct drbd_device *device);
 
@@ -95,6 +96,7 @@ static void drbd_endio_read_sec_final(struct drbd_peer_request *peer_req) __rele
 
 	spin_lock_irqsave(&device->resource->req_lock, flags);
 	device->read_cnt += peer_req->i.size >> 9;
+	device->read_ios++;
 	list_del(&peer_req->w.list);
 	if (list_empty(&connection->read_ee))
 		wake_up(&connection->ee_wait);
@@ -141,6 +143,13 @@ void drbd_endio_write_sec_final(struct drbd_peer_request *peer_req) __releases(l
 		return;
 	}
 
+	if (peer_req->journal) {
+		if (peer_req->flags & EE_WAS_ERROR)
+			drbd_journal_write_error(peer_req);
+		drbd_journal_written_back(peer_req->journal);
+		peer_req->journal = NULL;
+	}
+
 	/* after we moved peer_req to done_ee,
 	 * we may no longer access it,
 	 * it may be freed/reused already!
@@ -158,6 +167,7 @@ void drbd_endio_write_sec_final(struct drbd_peer_request *peer_req) __releases(l
 
 	spin_lock_irqsave(&device->resource->req_lock, flags);
 	device->writ_cnt += peer_req->i.size >> 9;
+	device->writ_ios++;
 	atomic_inc(&connection->done_ee_cnt);
 	list_move_tail(&peer_req->w.list, &connection->done_ee);
 
@@ -312,50 +322,145 @@ void drbd_request_endio(struct bio *bio)
 		complete_master_bio(device, &m);
 }
 
-void drbd_csum_pages(struct crypto_shash *tfm, struct page *page, void *digest)
-/* kmap compat: KM_USER1 */
+/* Digests go through the ahash API, so that offload engines and asynchronous
+ * implementations (e.g. cryptd) can be used.  The data is handed over as one
+ * scatterlist; we sleep until the digest is done.  Contexts that compute one
+ * digest at a time keep their request in a struct drbd_ahash_req; the checks
+ * on drbd_verify_wq do not wait, see verify_work_fn(). */
+#define DRBD_CSUM_INLINE_SG 8
+
+/* The request of @cache, grown to what @tfm needs, or NULL */
+static struct ahash_request *drbd_ahash_req_get(struct drbd_ahash_req *cache,
+						struct crypto_ahash *tfm)
+{
+	unsigned int size = sizeof(struct ahash_request) + crypto_ahash_reqsize(tfm);
+
+	if (cache->size < size) {
+		drbd_ahash_req_free(cache);
+		cache->req = kmalloc(size, GFP_NOIO);
+		if (!cache->req)
+			return NULL;
+		cache->size = size;
+	}
+	ahash_request_set_tfm(cache->req, tfm);
+	return cache->req;
+}
+
+void drbd_ahash_req_free(struct drbd_ahash_req *cache)
+{
+	if (cache->req)
+		ahash_request_free(cache->req);
+	cache->req = NULL;
+	cache->size = 0;
+}
+
+static void drbd_csum_sg(struct crypto_ahash *tfm, struct drbd_ahash_req *cache,
+			 struct scatterlist *sg, unsigned int nbytes, void *digest)
+{
+	struct ahash_request *req;
+	DECLARE_CRYPTO_WAIT(wait);
+	int err = -ENOMEM;
+
+	req = sg ? drbd_ahash_req_get(cache, tfm) : NULL;
+	if (req) {
+		ahash_request_set_callback(req,
+			CRYPTO_TFM_REQ_MAY_BACKLOG | CRYPTO_TFM_REQ_MAY_SLEEP,
+			crypto_req_done, &wait);
+		ahash_request_set_crypt(req, sg, digest, nbytes);
+		err = crypto_wait_req(crypto_ahash_digest(req), &wait);
+	}
+	if (err) {
+		/* Make a mismatch out of it on the other end. */
+		pr_err_ratelimited("drbd: %s digest failed: %d\n",
+				   crypto_ahash_alg_name(tfm), err);
+		memset(digest, 0, crypto_ahash_digestsize(tfm));
+	}
+}
+
+static struct scatterlist *drbd_csum_alloc_sg(struct scatterlist *inline_sg, unsigned int nents)
+{
+	struct scatterlist *sg = inline_sg;
+
+	if (nents > DRBD_CSUM_INLINE_SG)
+		sg = kmalloc_array(nents, sizeof(*sg), GFP_NOIO);
+	if (sg)
+		sg_init_table(sg, nents);
+	return sg;
+}
+
+static void drbd_csum_free_sg(struct scatterlist *inline_sg, struct scatterlist *sg)
 {
-	SHASH_DESC_ON_STACK(desc, tfm);
+	if (sg != inline_sg)
+		kfree(sg);
+}
 
-	desc->tfm = tfm;
+/* The number of scatterlist entries drbd_page_chain_to_sg() fills in */
+unsigned int drbd_page_chain_nents(struct page *page)
+{
+	unsigned int nents = 0;
 
-	crypto_shash_init(desc);
+	page_chain_for_each(page) {
+		unsigned len;
+
+		page = page_chain_run(page, &len);
+		nents++;
+	}
+	return nents;
+}
+
+/* Returns the number of bytes */
+unsigned int drbd_page_chain_to_sg(struct page *page, struct scatterlist *sg)
+{
+	unsigned int nbytes = 0, i = 0;
 
 	page_chain_for_each(page) {
 		unsigned off = page_chain_offset(page);
-		unsigned len = page_chain_size(page);
-		u8 *src;
-		src = kmap_atomic(page);
-		crypto_shash_update(desc, src + off, len);
-		kunmap_atomic(src);
+		unsigned len;
+		struct page *last = page_chain_run(page, &len);
+
+		sg_set_page(&sg[i++], page, len, off);
+		nbytes += len;
+		page = last;
 	}
-	crypto_shash_final(desc, digest);
-	shash_desc_zero(desc);
+	return nbytes;
 }
 
-void drbd_csum_bio(struct crypto_shash *tfm, struct bio *bio, void *digest)
-/* kmap compat: KM_USER1 */
+void drbd_csum_pages(struct crypto_ahash *tfm, struct drbd_ahash_req *cache,
+		     struct page *page, void *digest)
 {
-	struct bio_vec bvec;
-	struct bvec_iter iter;
-	SHASH_DESC_ON_STACK(desc, tfm);
+	struct scatterlist inline_sg[DRBD_CSUM_INLINE_SG], *sg;
+	unsigned int nbytes = 0;
 
-	desc->tfm = tfm;
-
-	crypto_shash_init(desc);
+	sg = drbd_csum_alloc_sg(inline_sg, max(drbd_page_chain_nents(page), 1U));
+	if (sg)
+		nbytes = drbd_page_chain_to_sg(page, sg);
+	drbd_csum_sg(tfm, cache, sg, nbytes, digest);
+	drbd_csum_free_sg(inline_sg, sg);
+}
 
-	bio_for_each_segment(bvec, bio, iter) {
-		u8 *src;
-		src = kmap_atomic(bvec.bv_page);
-		crypto_shash_update(desc, src + bvec.bv_offset, bvec.bv_len);
-		kunmap_atomic(src);
-		/* WRITE_SAME has only one segment,
-		 * checksum the payload only once. */
-		if (bio_op(bio) == REQ_OP_WRITE_SAME)
-			break;
+void drbd_csum_bio(struct crypto_ahash *tfm, struct drbd_ahash_req *cache,
+		   struct bio *bio, void *digest)
+{
+	struct scatterlist inline_sg[DRBD_CSUM_INLINE_SG], *sg;
+	struct bio_vec bvec;
+	struct bvec_iter iter;
+	/* WRITE_SAME has only one segment,
+	 * checksum the payload only once. */
+	bool once = bio_op(bio) == REQ_OP_WRITE_SAME;
+	unsigned int nents = once ? 1 : bio_segments(bio);
+	unsigned int nbytes = 0, i = 0;
+
+	sg = drbd_csum_alloc_sg(inline_sg, max(nents, 1U));
+	if (sg) {
+		bio_for_each_segment(bvec, bio, iter) {
+			sg_set_page(&sg[i++], bvec.bv_page, bvec.bv_len, bvec.bv_offset);
+			nbytes += bvec.bv_len;
+			if (once)
+				break;
+		}
 	}
-	crypto_shash_final(desc, digest);
-	shash_desc_zero(desc);
+	drbd_csum_sg(tfm, cache, sg, nbytes, digest);
+	drbd_csum_free_sg(inline_sg, sg);
 }
 
 /* MAYBE merge common code with w_e_end_ov_req */
@@ -373,10 +478,11 @@ static int w_e_send_csum(struct drbd_work *w, int cancel)
 	if (unlikely((peer_req->flags & EE_WAS_ERROR) != 0))
 		goto out;
 
-	digest_size = crypto_shash_digestsize(peer_device->connection->csums_tfm);
+	digest_size = crypto_ahash_digestsize(peer_device->connection->csums_tfm);
 	digest = drbd_prepare_drequest_csum(peer_req, digest_size);
 	if (digest) {
-		drbd_csum_pages(peer_device->connection->csums_tfm, peer_req->page_chain.head, digest);
+		drbd_csum_pages(peer_device->connection->csums_tfm, &peer_device->connection->sender_req,
+				peer_req->page_chain.head, digest);
 		/* Free peer_req and pages before send.
 		 * In case we block on congestion, we could otherwise run into
 		 * some distributed deadlock, if the other side blocks on
@@ -735,17 +841,6 @@ next_sector:
 
 		sector = BM_BIT_TO_SECT(bit);
 
-		if (drbd_try_rs_begin_io(peer_device, sector, true)) {
-			peer_device->resync_next_bit = bit;
-			goto request_done;
-		}
-
-		if (unlikely(drbd_bm_test_bit(peer_device, bit) == 0)) {
-			peer_device->resync_next_bit = bit + 1;
-			drbd_rs_complete_io(peer_device, sector);
-			goto next_sector;
-		}
-
 		/* try to find some adjacent bits.
 		 * we stop if we have already the maximum req size.
 		 *
@@ -781,13 +876,27 @@ next_sector:
 				align++;
 			i++;
 		}
-		/* set the offset to start the next drbd_bm_find_next from */
-		peer_device->resync_next_bit = bit + 1;
-
 		/* adjust very last sectors, in case we are oddly sized */
 		if (sector + (size>>9) > capacity)
 			size = (capacity-sector)<<9;
 
+		/* only application writes to exactly this range lock us out */
+		if (drbd_try_rs_begin_io(peer_device, sector, size, true)) {
+			peer_device->resync_next_bit = BM_SECT_TO_BIT(sector);
+			i = rollback_i;
+			goto request_done;
+		}
+
+		if (unlikely(drbd_bm_test_bit(peer_device, BM_SECT_TO_BIT(sector)) == 0)) {
+			peer_device->resync_next_bit = BM_SECT_TO_BIT(sector) + 1;
+			drbd_rs_complete_io(peer_device, sector);
+			i = rollback_i;
+			goto next_sector;
+		}
+
+		/* set the offset to start the next drbd_bm_find_next from */
+		peer_device->resync_next_bit = bit + 1;
+
 		if (peer_device->use_csums) {
 			switch (read_for_csum(peer_device, sector, size)) {
 			case -EIO: /* Disk failure */
@@ -877,13 +986,12 @@ static int make_ov_request(struct drbd_peer_device *peer_device, int cancel)
 			break;
 
 		size = BM_BLOCK_SIZE;
-
-		if (drbd_try_rs_begin_io(peer_device, sector, true))
-			break;
-
 		if (sector + (size>>9) > capacity)
 			size = (capacity-sector)<<9;
 
+		if (drbd_try_rs_begin_io(peer_device, sector, size, true))
+			break;
+
 		inc_rs_pending(peer_device);
 		if (drbd_send_ov_request(peer_device, sector, size)) {
 			dec_rs_pending(peer_device);
@@ -1153,6 +1261,10 @@ int drbd_resync_finished(struct drbd_peer_device *peer_device,
 			     Bit2KB(peer_device->rs_total - peer_device->rs_same_csum),
 			     Bit2KB(peer_device->rs_total));
 		}
+
+		if (peer_device->rs_zero_sectors)
+			drbd_info(peer_device, "%luK were all zero, sent as deallocated\n",
+				  peer_device->rs_zero_sectors >> 1);
 	}
 
 	if (peer_device->rs_failed) {
@@ -1321,25 +1433,54 @@ static bool all_zero(struct drbd_peer_request *peer_req)
 	struct page *page = peer_req->page_chain.head;
 	unsigned int len = peer_req->i.size;
 
+	/* memchr_inv() compares a machine word (or more) per iteration,
+	 * and is the best the architecture has to offer for this. */
 	page_chain_for_each(page) {
-		unsigned int l = min_t(unsigned int, len, PAGE_SIZE);
-		unsigned int i, words = l / sizeof(long);
-		unsigned long *d;
-
-		d = kmap_atomic(page);
-		for (i = 0; i < words; i++) {
-			if (d[i]) {
-				kunmap_atomic(d);
+		unsigned int l;
+		struct page *last = page_chain_run(page, &l);
+		void *d;
+		bool nonzero;
+
+		l = min(l, len);
+		if (last != page) {
+			if (memchr_inv(page_address(page), 0, l))
+				return false;
+			page = last;
+		} else {
+			d = kmap_atomic(page);
+			nonzero = memchr_inv(d, 0, l) != NULL;
+			kunmap_atomic(d);
+			if (nonzero)
 				return false;
-			}
 		}
-		kunmap_atomic(d);
 		len -= l;
 	}
 
 	return true;
 }
 
+/* Any peer that knows about P_RS_DEALLOCATED gets it as reply for an all
+ * zero resync block, not only those that asked with P_RS_THIN_REQ.  The
+ * receiving side then discards or zeroes out that range, depending on what
+ * its backing device can do reliably, see drbd_issue_peer_discard_or_zero_out().
+ * That makes the initial sync of freshly provisioned, mostly empty volumes
+ * a lot cheaper on the wire. */
+static bool rs_reply_deallocated(struct drbd_peer_device *peer_device,
+				 struct drbd_peer_request *peer_req)
+{
+	if (!(peer_device->connection->agreed_features & DRBD_FF_THIN_RESYNC))
+		return false;
+	if (!(peer_req->flags & EE_RS_THIN_REQ) && !drbd_resync_zero_detect)
+		return false;
+	if (!all_zero(peer_req))
+		return false;
+
+	peer_device->rs_zero_sectors += peer_req->i.size >> 9;
+	peer_device->rs_zero_sectors_total += peer_req->i.size >> 9;
+	peer_device->rs_zero_replies_total++;
+	return true;
+}
+
 /**
  * w_e_end_rsdata_req() - Worker callback to send a P_RS_DATA_REPLY packet in response to a P_RS_DATA_REQUEST
  * @w:		work object.
@@ -1375,7 +1516,7 @@ int w_e_end_rsdata_req(struct drbd_work *w, int cancel)
 			 * the atomic_sub() in got_BlockAck.
 			 * TODO: to fix that, we'd need a protocol bump. */
 			atomic_add(peer_req->i.size >> 9, &connection->rs_in_flight);
-			if (peer_req->flags & EE_RS_THIN_REQ && all_zero(peer_req)) {
+			if (rs_reply_deallocated(peer_device, peer_req)) {
 				err = drbd_send_rs_deallocated(peer_device, peer_req);
 			} else {
 				err = drbd_send_block(peer_device, P_RS_DATA_REPLY, peer_req);
@@ -1434,11 +1575,13 @@ int w_e_end_csum_rs_req(struct drbd_work *w, int cancel)
 		 * a real fix would be much more involved,
 		 * introducing more locking mechanisms */
 		if (peer_device->connection->csums_tfm) {
-			digest_size = crypto_shash_digestsize(peer_device->connection->csums_tfm);
+			digest_size = crypto_ahash_digestsize(peer_device->connection->csums_tfm);
 			D_ASSERT(device, digest_size == di->digest_size);
 			digest = kmalloc(digest_size, GFP_NOIO);
 			if (digest) {
-				drbd_csum_pages(peer_device->connection->csums_tfm, peer_req->page_chain.head, digest);
+				drbd_csum_pages(peer_device->connection->csums_tfm,
+						&peer_device->connection->sender_req,
+						peer_req->page_chain.head, digest);
 				eq = !memcmp(digest, di->digest, digest_size);
 				kfree(digest);
 			}
@@ -1482,7 +1625,7 @@ int w_e_end_ov_req(struct drbd_work *w, int cancel)
 	if (unlikely(cancel))
 		goto out;
 
-	digest_size = crypto_shash_digestsize(peer_device->connection->verify_tfm);
+	digest_size = crypto_ahash_digestsize(peer_device->connection->verify_tfm);
 	/* FIXME if this allocation fails, online verify will not terminate! */
 	digest = drbd_prepare_drequest_csum(peer_req, digest_size);
 	if (!digest) {
@@ -1491,7 +1634,8 @@ int w_e_end_ov_req(struct drbd_work *w, int cancel)
 	}
 
 	if (!(peer_req->flags & EE_WAS_ERROR))
-		drbd_csum_pages(peer_device->connection->verify_tfm, peer_req->page_chain.head, digest);
+		drbd_csum_pages(peer_device->connection->verify_tfm, &peer_device->connection->sender_req,
+				peer_req->page_chain.head, digest);
 	else
 		memset(digest, 0, digest_size);
 
@@ -1573,10 +1717,12 @@ int w_e_end_ov_reply(struct drbd_work *w, int cancel)
 	di = peer_req->digest;
 
 	if (likely((peer_req->flags & EE_WAS_ERROR) == 0)) {
-		digest_size = crypto_shash_digestsize(peer_device->connection->verify_tfm);
+		digest_size = crypto_ahash_digestsize(peer_device->connection->verify_tfm);
 		digest = kmalloc(digest_size, GFP_NOIO);
 		if (digest) {
-			drbd_csum_pages(peer_device->connection->verify_tfm, peer_req->page_chain.head, digest);
+			drbd_csum_pages(peer_device->connection->verify_tfm,
+					&peer_device->connection->sender_req,
+					peer_req->page_chain.head, digest);
 
 			D_ASSERT(device, digest_size == di->digest_size);
 			eq = !memcmp(digest, di->digest, digest_size);
@@ -2052,8 +2198,7 @@ skip_helper:
 		 * disabled, and know the disk state is ok. */
 		spin_lock(&device->al_lock);
 		lc_reset(peer_device->resync_lru);
-		peer_device->resync_locked = 0;
-		peer_device->resync_wenr = LC_FREE;
+		__drbd_rs_drop_intervals(peer_device);
 		spin_unlock(&device->al_lock);
 	}
 
@@ -2165,6 +2310,10 @@ static void drbd_ldev_destroy(struct drbd_device *device)
         rcu_read_unlock();
         lc_destroy(device->act_log);
         device->act_log = NULL;
+	/* requests completing without a disk do not give these back */
+	spin_lock_irq(&device->al_lock);
+	drbd_active_writes_reset(device);
+	spin_unlock_irq(&device->al_lock);
 	__acquire(local);
 	drbd_backing_dev_free(device, device->ldev);
 	device->ldev = NULL;
@@ -2610,6 +2759,9 @@ static void wait_for_sender_todo(struct drbd_connection *connection)
 	if (got_something)
 		return;
 
+	/* nothing more to batch up */
+	drbd_send_batch_end(connection);
+
 	/* Still nothing to do?
 	 * Maybe we still need to close the current epoch,
 	 * even if no new requests are queued yet.
@@ -2940,10 +3092,14 @@ int drbd_sender(struct drbd_thread *thi)
 		if (get_t_state(thi) != RUNNING)
 			break;
 
+		drbd_send_batch_begin(connection);
 		err = process_sender_todo(connection);
-		if (err)
+		if (err) {
+			drbd_send_batch_end(connection);
 			change_cstate(connection, C_NETWORK_FAILURE, CS_HARD);
+		}
 	}
+	drbd_send_batch_end(connection);
 
 	/* cleanup all currently unprocessed requests */
 	if (!connection->todo.req) {
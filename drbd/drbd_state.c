@@ -2177,6 +2177,7 @@ static void initialize_resync(struct drbd_peer_device *peer_device)
 	peer_device->rs_failed = 0;
 	peer_device->rs_paused = 0;
 	peer_device->rs_same_csum = 0;
+	peer_device->rs_zero_sectors = 0;
 	peer_device->rs_last_sect_ev = 0;
 	peer_device->rs_total = tw;
 	peer_device->rs_start = now;
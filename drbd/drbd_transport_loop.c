@@ -0,0 +1,864 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+   drbd_transport_loop.c
+
+   This file is part of DRBD.
+
+   In-kernel loopback transport. Connects two DRBD resources inside the
+   same kernel through in-memory queues, so that two "nodes" can run on
+   one machine without the network stack dominating every profile.
+
+   Data is handed over by page reference: send_page() takes a reference
+   on the page and queues it, the receiving side copies it out exactly
+   once (into the receive buffer or into its own page chain).  The page
+   chain of a peer request links its pages through page private fields,
+   so foreign pages can not be adopted into it.
+
+   Latency, bandwidth and loss can be injected with module parameters,
+   which allows to reproduce congestion, Ahead/Behind and timeout
+   behavior deterministically on a single machine.
+
+*/
+
+#include <linux/module.h>
+#include <linux/errno.h>
+#include <linux/socket.h>
+#include <linux/sched/signal.h>
+#include <linux/highmem.h>
+#include <linux/wait.h>
+#include <linux/drbd_genl_api.h>
+#include <linux/drbd_config.h>
+#include <drbd_transport.h>
+#include "drbd_wrappers.h"
+
+
+MODULE_AUTHOR("Philipp Reisner <philipp.reisner@linbit.com>");
+MODULE_AUTHOR("Lars Ellenberg <lars.ellenberg@linbit.com>");
+MODULE_DESCRIPTION("In-kernel loopback transport layer for DRBD");
+MODULE_LICENSE("GPL");
+MODULE_VERSION(REL_VERSION);
+
+/* Emulated link properties, shared by all connections of this transport */
+static unsigned int dtl_delay_ms;
+static unsigned int dtl_bandwidth_kbs; /* kByte/s, 0 = unlimited */
+static unsigned int dtl_loss_ppm;      /* per million chunks */
+static unsigned int dtl_rto_ms = 200;  /* delay of a "lost" chunk */
+static unsigned int dtl_buffer_size = 4 << 20; /* per direction and stream */
+
+MODULE_PARM_DESC(delay_ms, "One-way delay added to every chunk");
+module_param_named(delay_ms, dtl_delay_ms, uint, 0644);
+MODULE_PARM_DESC(bandwidth_kbs, "Emulated link bandwidth in kByte/s, 0 for unlimited");
+module_param_named(bandwidth_kbs, dtl_bandwidth_kbs, uint, 0644);
+MODULE_PARM_DESC(loss_ppm, "Chunks per million that get delayed by rto_ms, like a retransmit");
+module_param_named(loss_ppm, dtl_loss_ppm, uint, 0644);
+MODULE_PARM_DESC(rto_ms, "Additional delay of a lost chunk");
+module_param_named(rto_ms, dtl_rto_ms, uint, 0644);
+MODULE_PARM_DESC(buffer_size, "Bytes in flight per direction and stream before senders block");
+module_param_named(buffer_size, dtl_buffer_size, uint, 0644);
+
+struct buffer {
+	void *base;
+	void *pos;
+};
+
+struct dtl_chunk {
+	struct list_head list;
+	struct page *page;
+	unsigned int offset;
+	unsigned int size;
+	unsigned long deliver_at; /* jiffies */
+};
+
+/* One direction of one stream */
+struct dtl_queue {
+	spinlock_t lock;
+	wait_queue_head_t recv_wait; /* woken when data arrives or the pair closes */
+	wait_queue_head_t send_wait; /* woken when the receiver consumed data */
+	struct list_head chunks;
+	unsigned int queued;	     /* bytes not yet consumed by the receiver */
+	unsigned long wire_free;     /* jiffies when the emulated wire is idle again */
+	u64 bytes;		     /* total bytes passed through */
+	u64 lost;		     /* chunks that got delayed by rto_ms */
+};
+
+/* The two sides of a connection.  The side that calls connect() first
+ * creates the pair and waits on dtl_pending for the other side. */
+struct dtl_pair {
+	struct kref kref;
+	struct list_head list;
+	struct sockaddr_storage addr[2]; /* my_addr of side 0 and side 1 */
+	int addr_len[2];
+	bool connected;
+	bool closed;
+	wait_queue_head_t connect_wait;
+	struct dtl_queue queue[2][2];	 /* [receiving side][stream] */
+};
+
+struct drbd_loop_transport {
+	struct drbd_transport transport; /* Must be first! */
+	spinlock_t paths_lock;
+	struct dtl_pair *pair;
+	int side;
+	long rcvtimeo[2];
+	struct buffer rbuf[2];
+};
+
+struct dtl_path {
+	struct drbd_path path;
+};
+
+static DEFINE_MUTEX(dtl_pending_mutex);
+static LIST_HEAD(dtl_pending);
+
+static int dtl_init(struct drbd_transport *transport);
+static void dtl_free(struct drbd_transport *transport, enum drbd_tr_free_op free_op);
+static int dtl_connect(struct drbd_transport *transport);
+static int dtl_recv(struct drbd_transport *transport, enum drbd_stream stream, void **buf, size_t size, int flags);
+static int dtl_recv_pages(struct drbd_transport *transport, struct drbd_page_chain_head *chain, size_t size);
+static void dtl_stats(struct drbd_transport *transport, struct drbd_transport_stats *stats);
+static void dtl_set_rcvtimeo(struct drbd_transport *transport, enum drbd_stream stream, long timeout);
+static long dtl_get_rcvtimeo(struct drbd_transport *transport, enum drbd_stream stream);
+static int dtl_send_page(struct drbd_transport *transport, enum drbd_stream, struct page *page,
+		int offset, size_t size, unsigned msg_flags);
+static int dtl_send_zc_bio(struct drbd_transport *, struct bio *bio);
+static bool dtl_stream_ok(struct drbd_transport *transport, enum drbd_stream stream);
+static bool dtl_hint(struct drbd_transport *transport, enum drbd_stream stream, enum drbd_tr_hints hint);
+static void dtl_debugfs_show(struct drbd_transport *transport, struct seq_file *m);
+static int dtl_add_path(struct drbd_transport *, struct drbd_path *path);
+static int dtl_remove_path(struct drbd_transport *, struct drbd_path *);
+
+static struct drbd_transport_class loop_transport_class = {
+	.name = "loop",
+	.instance_size = sizeof(struct drbd_loop_transport),
+	.path_instance_size = sizeof(struct dtl_path),
+	.listener_instance_size = sizeof(struct drbd_listener),
+	.module = THIS_MODULE,
+	.init = dtl_init,
+	.list = LIST_HEAD_INIT(loop_transport_class.list),
+};
+
+static struct drbd_transport_ops dtl_ops = {
+	.free = dtl_free,
+	.connect = dtl_connect,
+	.recv = dtl_recv,
+	.recv_pages = dtl_recv_pages,
+	.stats = dtl_stats,
+	.set_rcvtimeo = dtl_set_rcvtimeo,
+	.get_rcvtimeo = dtl_get_rcvtimeo,
+	.send_page = dtl_send_page,
+	.send_zc_bio = dtl_send_zc_bio,
+	.stream_ok = dtl_stream_ok,
+	.hint = dtl_hint,
+	.debugfs_show = dtl_debugfs_show,
+	.add_path = dtl_add_path,
+	.remove_path = dtl_remove_path,
+};
+
+/* Might restart iteration, if current element is removed from list!! */
+#define for_each_path_ref(path, transport)			\
+	for (path = __drbd_next_path_ref(NULL, transport);	\
+	     path;						\
+	     path = __drbd_next_path_ref(path, transport))
+
+/* This is save as long you use list_del_init() everytime something is removed
+   from the list. */
+static struct drbd_path *__drbd_next_path_ref(struct drbd_path *drbd_path,
+					      struct drbd_transport *transport)
+{
+	struct drbd_loop_transport *loop_transport =
+		container_of(transport, struct drbd_loop_transport, transport);
+
+	spin_lock(&loop_transport->paths_lock);
+	if (!drbd_path) {
+		drbd_path = list_first_entry_or_null(&transport->paths, struct drbd_path, list);
+	} else {
+		bool in_list = !list_empty(&drbd_path->list);
+		kref_put(&drbd_path->kref, drbd_destroy_path);
+		if (in_list) {
+			/* Element still on the list, ref count can not drop to zero! */
+			if (list_is_last(&drbd_path->list, &transport->paths))
+				drbd_path = NULL;
+			else
+				drbd_path = list_next_entry(drbd_path, list);
+		} else {
+			/* No longer on the list, element might be freed already, restart from the start */
+			drbd_path = list_first_entry_or_null(&transport->paths, struct drbd_path, list);
+		}
+	}
+	if (drbd_path)
+		kref_get(&drbd_path->kref);
+	spin_unlock(&loop_transport->paths_lock);
+
+	return drbd_path;
+}
+
+static int dtl_init(struct drbd_transport *transport)
+{
+	struct drbd_loop_transport *loop_transport =
+		container_of(transport, struct drbd_loop_transport, transport);
+	enum drbd_stream i;
+
+	spin_lock_init(&loop_transport->paths_lock);
+	loop_transport->transport.ops = &dtl_ops;
+	loop_transport->transport.class = &loop_transport_class;
+	for (i = DATA_STREAM; i <= CONTROL_STREAM ; i++) {
+		void *buffer = (void *)__get_free_page(GFP_KERNEL);
+		if (!buffer)
+			goto fail;
+		loop_transport->rbuf[i].base = buffer;
+		loop_transport->rbuf[i].pos = buffer;
+		loop_transport->rcvtimeo[i] = MAX_SCHEDULE_TIMEOUT;
+	}
+
+	return 0;
+fail:
+	free_page((unsigned long)loop_transport->rbuf[0].base);
+	return -ENOMEM;
+}
+
+static struct dtl_pair *dtl_alloc_pair(void)
+{
+	struct dtl_pair *pair;
+	int side, stream;
+
+	pair = kzalloc(sizeof(*pair), GFP_KERNEL);
+	if (!pair)
+		return NULL;
+
+	kref_init(&pair->kref);
+	INIT_LIST_HEAD(&pair->list);
+	init_waitqueue_head(&pair->connect_wait);
+	for (side = 0; side < 2; side++) {
+		for (stream = DATA_STREAM; stream <= CONTROL_STREAM; stream++) {
+			struct dtl_queue *q = &pair->queue[side][stream];
+
+			spin_lock_init(&q->lock);
+			init_waitqueue_head(&q->recv_wait);
+			init_waitqueue_head(&q->send_wait);
+			INIT_LIST_HEAD(&q->chunks);
+		}
+	}
+	return pair;
+}
+
+static void dtl_destroy_pair(struct kref *kref)
+{
+	struct dtl_pair *pair = container_of(kref, struct dtl_pair, kref);
+	struct dtl_chunk *chunk, *tmp;
+	int side, stream;
+
+	for (side = 0; side < 2; side++) {
+		for (stream = DATA_STREAM; stream <= CONTROL_STREAM; stream++) {
+			struct dtl_queue *q = &pair->queue[side][stream];
+
+			list_for_each_entry_safe(chunk, tmp, &q->chunks, list) {
+				put_page(chunk->page);
+				kfree(chunk);
+			}
+		}
+	}
+	kfree(pair);
+}
+
+static void dtl_close_pair(struct dtl_pair *pair)
+{
+	int side, stream;
+
+	for (side = 0; side < 2; side++) {
+		for (stream = DATA_STREAM; stream <= CONTROL_STREAM; stream++) {
+			struct dtl_queue *q = &pair->queue[side][stream];
+
+			spin_lock(&q->lock);
+			pair->closed = true;
+			spin_unlock(&q->lock);
+			wake_up_all(&q->recv_wait);
+			wake_up_all(&q->send_wait);
+		}
+	}
+}
+
+static void dtl_free(struct drbd_transport *transport, enum drbd_tr_free_op free_op)
+{
+	struct drbd_loop_transport *loop_transport =
+		container_of(transport, struct drbd_loop_transport, transport);
+	struct dtl_pair *pair = loop_transport->pair;
+	struct drbd_path *drbd_path;
+	enum drbd_stream i;
+
+	if (pair) {
+		loop_transport->pair = NULL;
+		dtl_close_pair(pair);
+		kref_put(&pair->kref, dtl_destroy_pair);
+	}
+
+	for_each_path_ref(drbd_path, transport) {
+		bool was_established = drbd_path->established;
+		drbd_path->established = false;
+		if (was_established)
+			drbd_path_event(transport, drbd_path);
+	}
+
+	if (free_op == DESTROY_TRANSPORT) {
+		struct drbd_path *tmp;
+
+		for (i = DATA_STREAM; i <= CONTROL_STREAM; i++) {
+			free_page((unsigned long)loop_transport->rbuf[i].base);
+			loop_transport->rbuf[i].base = NULL;
+		}
+		spin_lock(&loop_transport->paths_lock);
+		list_for_each_entry_safe(drbd_path, tmp, &transport->paths, list) {
+			list_del_init(&drbd_path->list);
+			kref_put(&drbd_path->kref, drbd_destroy_path);
+		}
+		spin_unlock(&loop_transport->paths_lock);
+	}
+}
+
+/* Head chunk of the queue, if it already "arrived" */
+static struct dtl_chunk *dtl_ready_chunk(struct dtl_queue *q, unsigned long *deliver_at)
+{
+	struct dtl_chunk *chunk;
+
+	spin_lock(&q->lock);
+	chunk = list_first_entry_or_null(&q->chunks, struct dtl_chunk, list);
+	spin_unlock(&q->lock);
+
+	if (chunk && time_before(jiffies, chunk->deliver_at)) {
+		*deliver_at = chunk->deliver_at;
+		return NULL;
+	}
+	return chunk;
+}
+
+static bool dtl_recv_cond(struct dtl_pair *pair, struct dtl_queue *q)
+{
+	unsigned long deliver_at;
+
+	return dtl_ready_chunk(q, &deliver_at) || READ_ONCE(pair->closed);
+}
+
+/*
+ * Returns like kernel_recvmsg() on a TCP socket: the number of bytes
+ * received, 0 if the peer closed, -EAGAIN if nothing arrived within the
+ * receive timeout (or at once with MSG_DONTWAIT), or -EINTR/-ERESTARTSYS
+ * when interrupted by a signal before anything was received.
+ *
+ * There is exactly one reader per queue, so the head chunk can be copied
+ * from without holding the lock; senders only ever append.
+ */
+static int dtl_recv_short(struct drbd_loop_transport *loop_transport, enum drbd_stream stream,
+			  void *buf, size_t size, int flags)
+{
+	struct dtl_pair *pair = loop_transport->pair;
+	struct dtl_queue *q = &pair->queue[loop_transport->side][stream];
+	long timeo = loop_transport->rcvtimeo[stream];
+	unsigned long deadline = jiffies + timeo;
+	size_t copied = 0;
+	int err = 0;
+
+	if (flags & MSG_DONTWAIT)
+		timeo = 0;
+
+	while (copied < size) {
+		unsigned long deliver_at = 0;
+		struct dtl_chunk *chunk;
+		long t;
+
+		chunk = dtl_ready_chunk(q, &deliver_at);
+		if (chunk) {
+			unsigned int len = min_t(size_t, size - copied, chunk->size);
+			void *data;
+
+			data = kmap_atomic(chunk->page);
+			memcpy(buf + copied, data + chunk->offset, len);
+			kunmap_atomic(data);
+			copied += len;
+
+			spin_lock(&q->lock);
+			chunk->offset += len;
+			chunk->size -= len;
+			q->queued -= len;
+			if (chunk->size == 0)
+				list_del(&chunk->list);
+			else
+				chunk = NULL;
+			spin_unlock(&q->lock);
+			wake_up(&q->send_wait);
+
+			if (chunk) {
+				put_page(chunk->page);
+				kfree(chunk);
+			}
+			continue;
+		}
+
+		if (READ_ONCE(pair->closed))
+			break;
+
+		if (timeo == 0) {
+			err = -EAGAIN;
+			break;
+		}
+		if (timeo == MAX_SCHEDULE_TIMEOUT) {
+			t = MAX_SCHEDULE_TIMEOUT;
+		} else {
+			t = (long)(deadline - jiffies);
+			if (t <= 0) {
+				err = -EAGAIN;
+				break;
+			}
+		}
+		/* Head of queue not yet "arrived", wait for its delivery time */
+		if (deliver_at && (long)(deliver_at - jiffies) < t)
+			t = max_t(long, (long)(deliver_at - jiffies), 1);
+
+		t = wait_event_interruptible_timeout(q->recv_wait, dtl_recv_cond(pair, q), t);
+		if (t < 0) {
+			err = timeo == MAX_SCHEDULE_TIMEOUT ? -ERESTARTSYS : -EINTR;
+			break;
+		}
+	}
+
+	return copied ? copied : err;
+}
+
+static int dtl_recv(struct drbd_transport *transport, enum drbd_stream stream, void **buf, size_t size, int flags)
+{
+	struct drbd_loop_transport *loop_transport =
+		container_of(transport, struct drbd_loop_transport, transport);
+	void *buffer;
+	int rv;
+
+	if (!loop_transport->pair)
+		return -ENOTCONN;
+
+	if (flags & CALLER_BUFFER) {
+		buffer = *buf;
+		rv = dtl_recv_short(loop_transport, stream, buffer, size, flags & ~CALLER_BUFFER);
+	} else if (flags & GROW_BUFFER) {
+		TR_ASSERT(transport, *buf == loop_transport->rbuf[stream].base);
+		buffer = loop_transport->rbuf[stream].pos;
+		TR_ASSERT(transport, (buffer - *buf) + size <= PAGE_SIZE);
+
+		rv = dtl_recv_short(loop_transport, stream, buffer, size, flags & ~GROW_BUFFER);
+	} else {
+		buffer = loop_transport->rbuf[stream].base;
+
+		rv = dtl_recv_short(loop_transport, stream, buffer, size, flags);
+		if (rv > 0)
+			*buf = buffer;
+	}
+
+	if (rv > 0)
+		loop_transport->rbuf[stream].pos = buffer + rv;
+
+	return rv;
+}
+
+static int dtl_recv_pages(struct drbd_transport *transport, struct drbd_page_chain_head *chain, size_t size)
+{
+	struct drbd_loop_transport *loop_transport =
+		container_of(transport, struct drbd_loop_transport, transport);
+	struct page *page;
+	int err;
+
+	if (!loop_transport->pair)
+		return -ENOTCONN;
+
+	drbd_alloc_page_chain(transport, chain, DIV_ROUND_UP(size, PAGE_SIZE), GFP_TRY);
+	page = chain->head;
+	if (!page)
+		return -ENOMEM;
+
+	page_chain_for_each(page) {
+		size_t len = min_t(int, size, PAGE_SIZE);
+		void *data = kmap(page);
+		err = dtl_recv_short(loop_transport, DATA_STREAM, data, len, 0);
+		kunmap(page);
+		set_page_chain_offset(page, 0);
+		set_page_chain_size(page, len);
+		if (err != len) {
+			if (err >= 0)
+				err = -EIO;
+			goto fail;
+		}
+		size -= len;
+	}
+	return 0;
+fail:
+	drbd_free_page_chain(transport, chain, 0);
+	return err;
+}
+
+static void dtl_stats(struct drbd_transport *transport, struct drbd_transport_stats *stats)
+{
+	struct drbd_loop_transport *loop_transport =
+		container_of(transport, struct drbd_loop_transport, transport);
+	struct dtl_pair *pair = loop_transport->pair;
+
+	if (pair) {
+		int side = loop_transport->side;
+		unsigned int in_flight = READ_ONCE(pair->queue[!side][DATA_STREAM].queued);
+
+		stats->unread_received = READ_ONCE(pair->queue[side][DATA_STREAM].queued);
+		stats->unacked_send = in_flight;
+		stats->send_buffer_size = READ_ONCE(dtl_buffer_size);
+		stats->send_buffer_used = in_flight;
+	}
+}
+
+static void dtl_update_congested(struct drbd_loop_transport *loop_transport, struct dtl_queue *q)
+{
+	if (READ_ONCE(q->queued) > READ_ONCE(dtl_buffer_size) / 5 * 4)
+		set_bit(NET_CONGESTED, &loop_transport->transport.flags);
+}
+
+/* When the chunk "arrives" on the other side, with the emulated link properties */
+static unsigned long dtl_deliver_at(struct dtl_queue *q, unsigned int size)
+{
+	unsigned long now = jiffies;
+	unsigned int bandwidth_kbs = READ_ONCE(dtl_bandwidth_kbs);
+	unsigned int loss_ppm = READ_ONCE(dtl_loss_ppm);
+	unsigned long deliver_at;
+
+	if (bandwidth_kbs) {
+		unsigned long start = time_after(q->wire_free, now) ? q->wire_free : now;
+
+		q->wire_free = start + DIV_ROUND_UP((u64)size * HZ, (u64)bandwidth_kbs * 1024);
+		deliver_at = q->wire_free;
+	} else {
+		deliver_at = now;
+	}
+	deliver_at += msecs_to_jiffies(READ_ONCE(dtl_delay_ms));
+	if (loss_ppm && prandom_u32() % 1000000 < loss_ppm) {
+		deliver_at += msecs_to_jiffies(READ_ONCE(dtl_rto_ms));
+		q->lost++;
+	}
+	return deliver_at;
+}
+
+static bool dtl_send_cond(struct dtl_pair *pair, struct dtl_queue *q, unsigned int size)
+{
+	unsigned int queued = READ_ONCE(q->queued);
+
+	return queued == 0 || queued + size <= READ_ONCE(dtl_buffer_size) ||
+		READ_ONCE(pair->closed);
+}
+
+static int dtl_send_one(struct drbd_loop_transport *loop_transport, enum drbd_stream stream,
+			struct page *page, unsigned int offset, unsigned int size)
+{
+	struct drbd_transport *transport = &loop_transport->transport;
+	struct dtl_pair *pair = loop_transport->pair;
+	struct dtl_queue *q = &pair->queue[!loop_transport->side][stream];
+	struct dtl_chunk *chunk;
+	struct net_conf *nc;
+	long timeout;
+
+	rcu_read_lock();
+	nc = rcu_dereference(transport->net_conf);
+	timeout = nc ? nc->timeout * HZ / 10 : MAX_SCHEDULE_TIMEOUT;
+	rcu_read_unlock();
+
+	while (!dtl_send_cond(pair, q, size)) {
+		long t = wait_event_interruptible_timeout(q->send_wait,
+				dtl_send_cond(pair, q, size), timeout);
+		if (t < 0) {
+			flush_signals(current);
+			continue;
+		}
+		if (t == 0 && drbd_stream_send_timed_out(transport, stream))
+			return -EAGAIN;
+	}
+
+	chunk = kmalloc(sizeof(*chunk), GFP_NOIO);
+	if (!chunk)
+		return -ENOMEM;
+
+	get_page(page);
+	chunk->page = page;
+	chunk->offset = offset;
+	chunk->size = size;
+
+	spin_lock(&q->lock);
+	if (pair->closed) {
+		spin_unlock(&q->lock);
+		put_page(page);
+		kfree(chunk);
+		return -ECONNRESET;
+	}
+	chunk->deliver_at = dtl_deliver_at(q, size);
+	list_add_tail(&chunk->list, &q->chunks);
+	q->queued += size;
+	q->bytes += size;
+	spin_unlock(&q->lock);
+	wake_up(&q->recv_wait);
+
+	return 0;
+}
+
+static int dtl_send_page(struct drbd_transport *transport, enum drbd_stream stream,
+			 struct page *page, int offset, size_t size, unsigned msg_flags)
+{
+	struct drbd_loop_transport *loop_transport =
+		container_of(transport, struct drbd_loop_transport, transport);
+	struct dtl_pair *pair = loop_transport->pair;
+	int err = 0;
+
+	if (!pair)
+		return -ENOTCONN;
+
+	dtl_update_congested(loop_transport, &pair->queue[!loop_transport->side][stream]);
+
+	/* Queue at most one page per chunk, so that the receiver can kmap it */
+	page = nth_page(page, offset >> PAGE_SHIFT);
+	offset &= ~PAGE_MASK;
+	while (size) {
+		unsigned int len = min_t(size_t, size, PAGE_SIZE - offset);
+
+		err = dtl_send_one(loop_transport, stream, page, offset, len);
+		if (err)
+			break;
+		size -= len;
+		offset = 0;
+		page = nth_page(page, 1);
+	}
+	clear_bit(NET_CONGESTED, &transport->flags);
+
+	return err;
+}
+
+static int dtl_send_zc_bio(struct drbd_transport *transport, struct bio *bio)
+{
+	struct bio_vec bvec;
+	struct bvec_iter iter;
+
+	bio_for_each_segment(bvec, bio, iter) {
+		int err;
+
+		err = dtl_send_page(transport, DATA_STREAM, bvec.bv_page,
+				      bvec.bv_offset, bvec.bv_len,
+				      bio_iter_last(bvec, iter) ? 0 : MSG_MORE);
+		if (err)
+			return err;
+
+		if (bio_op(bio) == REQ_OP_WRITE_SAME)
+			break;
+	}
+	return 0;
+}
+
+static bool dtl_addr_equal(const struct sockaddr_storage *addr1, int len1,
+			   const struct sockaddr_storage *addr2, int len2)
+{
+	return len1 == len2 && !memcmp(addr1, addr2, len1);
+}
+
+static int dtl_connect(struct drbd_transport *transport)
+{
+	struct drbd_loop_transport *loop_transport =
+		container_of(transport, struct drbd_loop_transport, transport);
+	struct dtl_pair *pair, *new_pair;
+	struct drbd_path *drbd_path;
+	struct net_conf *nc;
+	int connect_int, side = 0, err = 0;
+
+	rcu_read_lock();
+	nc = rcu_dereference(transport->net_conf);
+	if (!nc) {
+		rcu_read_unlock();
+		return -EIO;
+	}
+	connect_int = nc->connect_int;
+	rcu_read_unlock();
+
+	spin_lock(&loop_transport->paths_lock);
+	drbd_path = list_first_entry_or_null(&transport->paths, struct drbd_path, list);
+	if (drbd_path)
+		kref_get(&drbd_path->kref);
+	spin_unlock(&loop_transport->paths_lock);
+	if (!drbd_path)
+		return -EDESTADDRREQ;
+
+	new_pair = dtl_alloc_pair();
+	if (!new_pair) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	mutex_lock(&dtl_pending_mutex);
+	list_for_each_entry(pair, &dtl_pending, list) {
+		if (dtl_addr_equal(&pair->addr[0], pair->addr_len[0],
+				   &drbd_path->peer_addr, drbd_path->peer_addr_len) &&
+		    dtl_addr_equal(&pair->addr[1], pair->addr_len[1],
+				   &drbd_path->my_addr, drbd_path->my_addr_len)) {
+			list_del_init(&pair->list);
+			kref_get(&pair->kref);
+			pair->connected = true;
+			wake_up_all(&pair->connect_wait);
+			side = 1;
+			break;
+		}
+	}
+	if (!side) {
+		pair = new_pair;
+		new_pair = NULL;
+		pair->addr[0] = drbd_path->my_addr;
+		pair->addr_len[0] = drbd_path->my_addr_len;
+		pair->addr[1] = drbd_path->peer_addr;
+		pair->addr_len[1] = drbd_path->peer_addr_len;
+		list_add_tail(&pair->list, &dtl_pending);
+	}
+	mutex_unlock(&dtl_pending_mutex);
+	kfree(new_pair);
+
+	if (!side) {
+		long timeo = connect_int * HZ;
+
+		timeo += (prandom_u32() & 1) ? timeo / 7 : -timeo / 7; /* 28.5% random jitter */
+		wait_event_interruptible_timeout(pair->connect_wait, READ_ONCE(pair->connected), timeo);
+
+		mutex_lock(&dtl_pending_mutex);
+		if (!pair->connected)
+			list_del_init(&pair->list);
+		mutex_unlock(&dtl_pending_mutex);
+
+		if (!pair->connected) {
+			kref_put(&pair->kref, dtl_destroy_pair);
+			/* flushes pending signals, our caller decides about retrying */
+			drbd_should_abort_listening(transport);
+			err = -EAGAIN;
+			goto out;
+		}
+		clear_bit(RESOLVE_CONFLICTS, &transport->flags);
+	} else {
+		set_bit(RESOLVE_CONFLICTS, &transport->flags);
+	}
+
+	loop_transport->pair = pair;
+	loop_transport->side = side;
+	loop_transport->rcvtimeo[DATA_STREAM] = MAX_SCHEDULE_TIMEOUT;
+	loop_transport->rcvtimeo[CONTROL_STREAM] = MAX_SCHEDULE_TIMEOUT;
+
+	drbd_path->established = true;
+	drbd_path_event(transport, drbd_path);
+out:
+	kref_put(&drbd_path->kref, drbd_destroy_path);
+	return err;
+}
+
+static void dtl_set_rcvtimeo(struct drbd_transport *transport, enum drbd_stream stream, long timeout)
+{
+	struct drbd_loop_transport *loop_transport =
+		container_of(transport, struct drbd_loop_transport, transport);
+
+	loop_transport->rcvtimeo[stream] = timeout;
+}
+
+static long dtl_get_rcvtimeo(struct drbd_transport *transport, enum drbd_stream stream)
+{
+	struct drbd_loop_transport *loop_transport =
+		container_of(transport, struct drbd_loop_transport, transport);
+
+	if (!loop_transport->pair)
+		return -ENOTCONN;
+
+	return loop_transport->rcvtimeo[stream];
+}
+
+static bool dtl_stream_ok(struct drbd_transport *transport, enum drbd_stream stream)
+{
+	struct drbd_loop_transport *loop_transport =
+		container_of(transport, struct drbd_loop_transport, transport);
+
+	return loop_transport->pair != NULL;
+}
+
+static bool dtl_hint(struct drbd_transport *transport, enum drbd_stream stream,
+		enum drbd_tr_hints hint)
+{
+	struct drbd_loop_transport *loop_transport =
+		container_of(transport, struct drbd_loop_transport, transport);
+
+	if (!loop_transport->pair)
+		return false;
+
+	/* Nothing is held back, so CORK, UNCORK, NODELAY and QUICKACK
+	 * have nothing to do. */
+	return true;
+}
+
+static void dtl_debugfs_show_queue(struct seq_file *m, const char *what, struct dtl_queue *q)
+{
+	seq_printf(m, "%s: queued: %u Byte total: %llu Byte lost: %llu\n", what,
+		   READ_ONCE(q->queued), (unsigned long long)q->bytes,
+		   (unsigned long long)q->lost);
+}
+
+static void dtl_debugfs_show(struct drbd_transport *transport, struct seq_file *m)
+{
+	struct drbd_loop_transport *loop_transport =
+		container_of(transport, struct drbd_loop_transport, transport);
+	struct dtl_pair *pair = loop_transport->pair;
+	enum drbd_stream i;
+
+	/* BUMP me if you change the file format/content/presentation */
+	seq_printf(m, "v: %u\n\n", 0);
+
+	seq_printf(m, "delay: %u ms bandwidth: %u kB/s loss: %u ppm rto: %u ms buffer: %u Byte\n",
+		   dtl_delay_ms, dtl_bandwidth_kbs, dtl_loss_ppm, dtl_rto_ms, dtl_buffer_size);
+	if (!pair)
+		return;
+
+	for (i = DATA_STREAM; i <= CONTROL_STREAM ; i++) {
+		int side = loop_transport->side;
+
+		seq_printf(m, "%s stream\n", i == DATA_STREAM ? "data" : "control");
+		dtl_debugfs_show_queue(m, "send", &pair->queue[!side][i]);
+		dtl_debugfs_show_queue(m, "receive", &pair->queue[side][i]);
+	}
+}
+
+static int dtl_add_path(struct drbd_transport *transport, struct drbd_path *drbd_path)
+{
+	struct drbd_loop_transport *loop_transport =
+		container_of(transport, struct drbd_loop_transport, transport);
+
+	drbd_path->established = false;
+
+	spin_lock(&loop_transport->paths_lock);
+	list_add(&drbd_path->list, &transport->paths);
+	spin_unlock(&loop_transport->paths_lock);
+
+	return 0;
+}
+
+static int dtl_remove_path(struct drbd_transport *transport, struct drbd_path *drbd_path)
+{
+	struct drbd_loop_transport *loop_transport =
+		container_of(transport, struct drbd_loop_transport, transport);
+
+	if (drbd_path->established)
+		return -EBUSY;
+
+	spin_lock(&loop_transport->paths_lock);
+	list_del_init(&drbd_path->list);
+	spin_unlock(&loop_transport->paths_lock);
+
+	return 0;
+}
+
+static int __init dtl_initialize(void)
+{
+	return drbd_register_transport_class(&loop_transport_class,
+					     DRBD_TRANSPORT_API_VERSION,
+					     sizeof(struct drbd_transport));
+}
+
+static void __exit dtl_cleanup(void)
+{
+	drbd_unregister_transport_class(&loop_transport_class);
+}
+
+module_init(dtl_initialize)
+module_exit(dtl_cleanup)
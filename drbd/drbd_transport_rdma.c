@@ -0,0 +1,1575 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+   drbd_transport_rdma.c
+
+   This file is part of DRBD.
+
+   RDMA transport.  Each DRBD stream is one reliable connected queue pair,
+   set up with the RDMA connection manager, so it runs on InfiniBand, RoCE
+   and on soft-RoCE (rdma_rxe) on top of any Ethernet device:
+
+	rdma link add rxe0 type rxe netdev eth0
+
+   Data moves with two sided SEND/RECV.  Every send_page() becomes one or
+   more SEND work requests straight from the (DMA mapped) page, no copy.
+   The receiver keeps a ring of page sized receive buffers posted.  A
+   message that carries exactly one page of a peer request is not copied:
+   recv_pages() swaps the receive buffer page into the page chain and
+   reposts the ring slot with the chain page it replaced.
+
+   Flow control is credit based.  Both sides announce the number of posted
+   receive buffers in the connection private data, every send consumes one
+   credit, and credits for reposted buffers travel back in the immediate
+   data of the next SEND on the same queue pair.  If nothing goes back for
+   a while, a zero length SEND carries them.  Those do not consume credits;
+   DTR_CREDIT_RESERVE receive buffers are kept outside of the announced
+   credits for them.
+
+   The side with the larger address connects, the other one accepts.  Only
+   the first path of a connection is used.
+
+*/
+
+#include <linux/module.h>
+#include <linux/errno.h>
+#include <linux/socket.h>
+#include <linux/sched/signal.h>
+#include <linux/highmem.h>
+#include <linux/wait.h>
+#include <linux/in.h>
+#include <linux/in6.h>
+#include <rdma/ib_verbs.h>
+#include <rdma/rdma_cm.h>
+#include <linux/drbd_genl_api.h>
+#include <linux/drbd_config.h>
+#include <drbd_transport.h>
+#include "drbd_wrappers.h"
+
+
+MODULE_AUTHOR("Philipp Reisner <philipp.reisner@linbit.com>");
+MODULE_AUTHOR("Lars Ellenberg <lars.ellenberg@linbit.com>");
+MODULE_DESCRIPTION("RDMA transport layer for DRBD");
+MODULE_LICENSE("GPL");
+MODULE_VERSION(REL_VERSION);
+
+#define DTR_MAGIC ((u32)0x5257ab65)
+#define DTR_RESOLVE_TIMEOUT_MS	2000
+#define DTR_CONTROL_RX_BUFFERS	64
+#define DTR_MIN_RX_BUFFERS	32
+#define DTR_MAX_RX_BUFFERS	4096
+/* Receive buffers not announced as credits, for the credit only messages.
+ * Each of those carries at least nr_rx_descs / DTR_CREDIT_RESERVE credits,
+ * so no more than DTR_CREDIT_RESERVE of them can be in flight. */
+#define DTR_CREDIT_RESERVE	8
+
+static unsigned int dtr_rx_buffers = 256;
+
+MODULE_PARM_DESC(rx_buffers, "Page sized receive buffers posted on each data stream");
+module_param_named(rx_buffers, dtr_rx_buffers, uint, 0644);
+
+struct buffer {
+	void *base;
+	void *pos;
+};
+
+/* Exchanged with rdma_connect() and rdma_accept() */
+struct dtr_cm_private_data {
+	__be32 magic;
+	__be16 stream;
+	__be16 rx_credits;
+};
+
+enum dtr_cm_state {
+	DTR_CM_IDLE,
+	DTR_CM_ROUTE_RESOLVED,
+	DTR_CM_CONNECT_REQUEST,
+	DTR_CM_ESTABLISHED,
+	DTR_CM_ERROR,
+	DTR_CM_DISCONNECTED,
+};
+
+struct dtr_stream;
+struct dtr_listener;
+
+/* Context of one rdma_cm_id */
+struct dtr_cm {
+	struct rdma_cm_id *id;
+	struct dtr_listener *listener;	/* set on the listening cm_id only */
+	struct dtr_stream *stream;	/* set once the queue pair carries a stream */
+	struct list_head list;		/* on dtr_path->pending until accepted */
+	enum dtr_cm_state state;
+	wait_queue_head_t wait;
+	enum drbd_stream peer_stream;
+	unsigned int peer_credits;
+};
+
+struct dtr_rx_desc {
+	struct ib_cqe cqe;
+	struct list_head list;		/* on dtr_stream->rx_ready */
+	struct dtr_stream *stream;
+	struct page *page;
+	u64 dma_addr;
+	unsigned int size;		/* bytes received */
+	unsigned int pos;		/* bytes already consumed */
+};
+
+struct dtr_tx_desc {
+	struct ib_cqe cqe;
+	struct dtr_stream *stream;
+	struct page *page;		/* NULL for a credit only message */
+	u64 dma_addr;
+	unsigned int size;
+};
+
+struct dtr_stream {
+	struct dtr_cm *cm;
+	struct ib_device *device;
+	struct ib_pd *pd;
+	struct ib_cq *cq;
+	struct dtr_rx_desc *rx_descs;
+	unsigned int nr_rx_descs;
+	unsigned int max_send_wr;
+
+	spinlock_t lock;		/* rx_ready, rx_ready_bytes */
+	struct list_head rx_ready;
+	unsigned int rx_ready_bytes;
+	wait_queue_head_t recv_wait;
+	wait_queue_head_t send_wait;
+
+	unsigned int peer_credits;	/* receive buffers the peer announced */
+	atomic_t tx_credits;		/* sends the peer has receive buffers for */
+	atomic_t rx_credits_due;	/* reposted receive buffers not yet announced */
+	atomic_t tx_posted;		/* send work requests not yet completed */
+	atomic_t tx_bytes;		/* bytes of those */
+	bool broken;
+
+	long rcvtimeo;
+	struct buffer rbuf;
+
+	u64 bytes_sent;
+	u64 bytes_received;
+	u64 credit_msgs;
+	u64 pages_flipped;
+	u64 pages_copied;
+};
+
+struct drbd_rdma_transport {
+	struct drbd_transport transport; /* Must be first! */
+	spinlock_t paths_lock;
+	bool connected;
+	struct dtr_stream stream[2];
+};
+
+struct dtr_path {
+	struct drbd_path path;
+
+	spinlock_t lock;
+	struct list_head pending; /* connect requests of the peer, not yet accepted */
+};
+
+struct dtr_listener {
+	struct drbd_listener listener;
+	struct dtr_cm cm;
+	wait_queue_head_t wait;
+};
+
+static int dtr_init(struct drbd_transport *transport);
+static void dtr_free(struct drbd_transport *transport, enum drbd_tr_free_op free_op);
+static int dtr_connect(struct drbd_transport *transport);
+static int dtr_recv(struct drbd_transport *transport, enum drbd_stream stream, void **buf, size_t size, int flags);
+static int dtr_recv_pages(struct drbd_transport *transport, struct drbd_page_chain_head *chain, size_t size);
+static void dtr_stats(struct drbd_transport *transport, struct drbd_transport_stats *stats);
+static void dtr_set_rcvtimeo(struct drbd_transport *transport, enum drbd_stream stream, long timeout);
+static long dtr_get_rcvtimeo(struct drbd_transport *transport, enum drbd_stream stream);
+static int dtr_send_page(struct drbd_transport *transport, enum drbd_stream, struct page *page,
+		int offset, size_t size, unsigned msg_flags);
+static int dtr_send_zc_bio(struct drbd_transport *, struct bio *bio);
+static bool dtr_stream_ok(struct drbd_transport *transport, enum drbd_stream stream);
+static bool dtr_hint(struct drbd_transport *transport, enum drbd_stream stream, enum drbd_tr_hints hint);
+static void dtr_debugfs_show(struct drbd_transport *transport, struct seq_file *m);
+static int dtr_add_path(struct drbd_transport *, struct drbd_path *path);
+static int dtr_remove_path(struct drbd_transport *, struct drbd_path *);
+
+static struct drbd_transport_class rdma_transport_class = {
+	.name = "rdma",
+	.instance_size = sizeof(struct drbd_rdma_transport),
+	.path_instance_size = sizeof(struct dtr_path),
+	.listener_instance_size = sizeof(struct dtr_listener),
+	.module = THIS_MODULE,
+	.init = dtr_init,
+	.list = LIST_HEAD_INIT(rdma_transport_class.list),
+};
+
+static struct drbd_transport_ops dtr_ops = {
+	.free = dtr_free,
+	.connect = dtr_connect,
+	.recv = dtr_recv,
+	.recv_pages = dtr_recv_pages,
+	.stats = dtr_stats,
+	.set_rcvtimeo = dtr_set_rcvtimeo,
+	.get_rcvtimeo = dtr_get_rcvtimeo,
+	.send_page = dtr_send_page,
+	.send_zc_bio = dtr_send_zc_bio,
+	.stream_ok = dtr_stream_ok,
+	.hint = dtr_hint,
+	.debugfs_show = dtr_debugfs_show,
+	.add_path = dtr_add_path,
+	.remove_path = dtr_remove_path,
+};
+
+/* Might restart iteration, if current element is removed from list!! */
+#define for_each_path_ref(path, transport)			\
+	for (path = __drbd_next_path_ref(NULL, transport);	\
+	     path;						\
+	     path = __drbd_next_path_ref(path, transport))
+
+/* This is save as long you use list_del_init() everytime something is removed
+   from the list. */
+static struct drbd_path *__drbd_next_path_ref(struct drbd_path *drbd_path,
+					      struct drbd_transport *transport)
+{
+	struct drbd_rdma_transport *rdma_transport =
+		container_of(transport, struct drbd_rdma_transport, transport);
+
+	spin_lock(&rdma_transport->paths_lock);
+	if (!drbd_path) {
+		drbd_path = list_first_entry_or_null(&transport->paths, struct drbd_path, list);
+	} else {
+		bool in_list = !list_empty(&drbd_path->list);
+		kref_put(&drbd_path->kref, drbd_destroy_path);
+		if (in_list) {
+			/* Element still on the list, ref count can not drop to zero! */
+			if (list_is_last(&drbd_path->list, &transport->paths))
+				drbd_path = NULL;
+			else
+				drbd_path = list_next_entry(drbd_path, list);
+		} else {
+			/* No longer on the list, element might be freed already, restart from the start */
+			drbd_path = list_first_entry_or_null(&transport->paths, struct drbd_path, list);
+		}
+	}
+	if (drbd_path)
+		kref_get(&drbd_path->kref);
+	spin_unlock(&rdma_transport->paths_lock);
+
+	return drbd_path;
+}
+
+static int dtr_init(struct drbd_transport *transport)
+{
+	struct drbd_rdma_transport *rdma_transport =
+		container_of(transport, struct drbd_rdma_transport, transport);
+	enum drbd_stream i;
+
+	spin_lock_init(&rdma_transport->paths_lock);
+	rdma_transport->transport.ops = &dtr_ops;
+	rdma_transport->transport.class = &rdma_transport_class;
+	for (i = DATA_STREAM; i <= CONTROL_STREAM ; i++) {
+		struct dtr_stream *s = &rdma_transport->stream[i];
+		void *buffer = (void *)__get_free_page(GFP_KERNEL);
+		if (!buffer)
+			goto fail;
+		s->rbuf.base = buffer;
+		s->rbuf.pos = buffer;
+		s->rcvtimeo = MAX_SCHEDULE_TIMEOUT;
+		spin_lock_init(&s->lock);
+		INIT_LIST_HEAD(&s->rx_ready);
+		init_waitqueue_head(&s->recv_wait);
+		init_waitqueue_head(&s->send_wait);
+	}
+
+	return 0;
+fail:
+	free_page((unsigned long)rdma_transport->stream[0].rbuf.base);
+	return -ENOMEM;
+}
+
+static struct dtr_cm *dtr_alloc_cm(gfp_t gfp_mask)
+{
+	struct dtr_cm *cm;
+
+	cm = kzalloc(sizeof(*cm), gfp_mask);
+	if (!cm)
+		return NULL;
+	INIT_LIST_HEAD(&cm->list);
+	init_waitqueue_head(&cm->wait);
+	return cm;
+}
+
+static void dtr_destroy_cm(struct dtr_cm *cm)
+{
+	/* Waits for a running event handler of this cm_id */
+	rdma_destroy_id(cm->id);
+	kfree(cm);
+}
+
+static void dtr_cm_set_state(struct dtr_cm *cm, enum dtr_cm_state state)
+{
+	WRITE_ONCE(cm->state, state);
+	wake_up_all(&cm->wait);
+}
+
+static void dtr_stream_broken(struct dtr_stream *s)
+{
+	WRITE_ONCE(s->broken, true);
+	wake_up_all(&s->recv_wait);
+	wake_up_all(&s->send_wait);
+}
+
+static bool dtr_private_data_ok(const void *data, u8 len)
+{
+	const struct dtr_cm_private_data *pdata = data;
+
+	return data && len >= sizeof(*pdata) &&
+		pdata->magic == cpu_to_be32(DTR_MAGIC) &&
+		be16_to_cpu(pdata->stream) <= CONTROL_STREAM;
+}
+
+static int dtr_cma_connect_request(struct dtr_listener *listener, struct rdma_cm_id *new_id,
+				   struct rdma_cm_event *event)
+{
+	const struct dtr_cm_private_data *pdata = event->param.conn.private_data;
+	struct drbd_path *drbd_path;
+	struct dtr_cm *cm;
+
+	if (!listener || !dtr_private_data_ok(pdata, event->param.conn.private_data_len))
+		return -EINVAL; /* makes the rdma cm destroy new_id */
+
+	cm = dtr_alloc_cm(GFP_KERNEL);
+	if (!cm)
+		return -ENOMEM;
+	cm->id = new_id;
+	cm->state = DTR_CM_CONNECT_REQUEST;
+	cm->peer_stream = be16_to_cpu(pdata->stream);
+	cm->peer_credits = be16_to_cpu(pdata->rx_credits);
+
+	spin_lock_bh(&listener->listener.waiters_lock);
+	drbd_path = drbd_find_path_by_addr(&listener->listener,
+					   (struct sockaddr_storage *)&new_id->route.addr.dst_addr);
+	if (drbd_path) {
+		struct dtr_path *path = container_of(drbd_path, struct dtr_path, path);
+
+		new_id->context = cm;
+		spin_lock(&path->lock);
+		list_add_tail(&cm->list, &path->pending);
+		spin_unlock(&path->lock);
+	}
+	spin_unlock_bh(&listener->listener.waiters_lock);
+
+	if (!drbd_path) {
+		kfree(cm);
+		return -ENOENT;
+	}
+	wake_up(&listener->wait);
+	return 0;
+}
+
+static int dtr_cma_event_handler(struct rdma_cm_id *cm_id, struct rdma_cm_event *event)
+{
+	struct dtr_cm *cm = cm_id->context;
+	struct dtr_stream *s;
+	int err;
+
+	switch (event->event) {
+	case RDMA_CM_EVENT_CONNECT_REQUEST:
+		/* cm_id is the new one, it still has the context of the listener */
+		return dtr_cma_connect_request(cm->listener, cm_id, event);
+
+	case RDMA_CM_EVENT_ADDR_RESOLVED:
+		err = rdma_resolve_route(cm_id, DTR_RESOLVE_TIMEOUT_MS);
+		if (err)
+			dtr_cm_set_state(cm, DTR_CM_ERROR);
+		break;
+
+	case RDMA_CM_EVENT_ROUTE_RESOLVED:
+		dtr_cm_set_state(cm, DTR_CM_ROUTE_RESOLVED);
+		break;
+
+	case RDMA_CM_EVENT_ESTABLISHED:
+		/* On the active side it carries the private data of rdma_accept() */
+		if (dtr_private_data_ok(event->param.conn.private_data,
+					event->param.conn.private_data_len)) {
+			const struct dtr_cm_private_data *pdata = event->param.conn.private_data;
+
+			cm->peer_stream = be16_to_cpu(pdata->stream);
+			cm->peer_credits = be16_to_cpu(pdata->rx_credits);
+		}
+		dtr_cm_set_state(cm, DTR_CM_ESTABLISHED);
+		break;
+
+	case RDMA_CM_EVENT_ADDR_ERROR:
+	case RDMA_CM_EVENT_ROUTE_ERROR:
+	case RDMA_CM_EVENT_CONNECT_ERROR:
+	case RDMA_CM_EVENT_UNREACHABLE:
+	case RDMA_CM_EVENT_REJECTED:
+		dtr_cm_set_state(cm, DTR_CM_ERROR);
+		break;
+
+	case RDMA_CM_EVENT_DISCONNECTED:
+	case RDMA_CM_EVENT_DEVICE_REMOVAL:
+		dtr_cm_set_state(cm, DTR_CM_DISCONNECTED);
+		s = READ_ONCE(cm->stream);
+		if (s)
+			dtr_stream_broken(s);
+		break;
+
+	default:
+		break;
+	}
+	return 0;
+}
+
+static void dtr_rx_done(struct ib_cq *cq, struct ib_wc *wc);
+static void dtr_tx_done(struct ib_cq *cq, struct ib_wc *wc);
+
+static int dtr_post_recv(struct dtr_stream *s, struct dtr_rx_desc *rx_desc)
+{
+	struct ib_sge sge = {
+		.addr = rx_desc->dma_addr,
+		.length = PAGE_SIZE,
+		.lkey = s->pd->local_dma_lkey,
+	};
+	struct ib_recv_wr wr = {
+		.wr_cqe = &rx_desc->cqe,
+		.sg_list = &sge,
+		.num_sge = 1,
+	};
+	const struct ib_recv_wr *bad_wr;
+
+	rx_desc->cqe.done = dtr_rx_done;
+	rx_desc->size = 0;
+	rx_desc->pos = 0;
+	return ib_post_recv(s->cm->id->qp, &wr, &bad_wr);
+}
+
+static int dtr_post_send(struct dtr_stream *s, struct dtr_tx_desc *tx_desc)
+{
+	struct ib_sge sge = {
+		.addr = tx_desc->dma_addr,
+		.length = tx_desc->size,
+		.lkey = s->pd->local_dma_lkey,
+	};
+	struct ib_send_wr wr = {
+		.wr_cqe = &tx_desc->cqe,
+		.sg_list = tx_desc->size ? &sge : NULL,
+		.num_sge = tx_desc->size ? 1 : 0,
+		.opcode = IB_WR_SEND_WITH_IMM,
+		.send_flags = IB_SEND_SIGNALED,
+	};
+	const struct ib_send_wr *bad_wr;
+	unsigned int credits;
+	int err;
+
+	tx_desc->cqe.done = dtr_tx_done;
+	tx_desc->stream = s;
+
+	credits = atomic_xchg(&s->rx_credits_due, 0);
+	wr.ex.imm_data = cpu_to_be32(credits);
+	atomic_inc(&s->tx_posted);
+	atomic_add(tx_desc->size, &s->tx_bytes);
+	err = ib_post_send(s->cm->id->qp, &wr, &bad_wr);
+	if (err) {
+		atomic_add(credits, &s->rx_credits_due);
+		atomic_sub(tx_desc->size, &s->tx_bytes);
+		atomic_dec(&s->tx_posted);
+	}
+	return err;
+}
+
+/* Announce reposted receive buffers, if no SEND took them along lately */
+static void dtr_maybe_send_credits(struct dtr_stream *s)
+{
+	struct dtr_tx_desc *tx_desc;
+
+	if (atomic_read(&s->rx_credits_due) < s->nr_rx_descs / DTR_CREDIT_RESERVE ||
+	    READ_ONCE(s->broken))
+		return;
+
+	tx_desc = kzalloc(sizeof(*tx_desc), GFP_NOIO);
+	if (!tx_desc)
+		return; /* the next data message takes them along */
+
+	if (dtr_post_send(s, tx_desc))
+		kfree(tx_desc);
+	else
+		s->credit_msgs++;
+}
+
+static void dtr_repost_rx(struct dtr_stream *s, struct dtr_rx_desc *rx_desc, bool credit)
+{
+	ib_dma_sync_single_for_device(s->device, rx_desc->dma_addr, PAGE_SIZE, DMA_FROM_DEVICE);
+	if (dtr_post_recv(s, rx_desc)) {
+		dtr_stream_broken(s);
+		return;
+	}
+	if (credit)
+		atomic_inc(&s->rx_credits_due);
+}
+
+static void dtr_rx_done(struct ib_cq *cq, struct ib_wc *wc)
+{
+	struct dtr_rx_desc *rx_desc = container_of(wc->wr_cqe, struct dtr_rx_desc, cqe);
+	struct dtr_stream *s = rx_desc->stream;
+
+	if (wc->status != IB_WC_SUCCESS) {
+		/* Flushed while tearing down, or the queue pair went into error */
+		dtr_stream_broken(s);
+		return;
+	}
+
+	if (wc->wc_flags & IB_WC_WITH_IMM) {
+		unsigned int credits = be32_to_cpu(wc->ex.imm_data);
+
+		if (credits) {
+			atomic_add(credits, &s->tx_credits);
+			wake_up(&s->send_wait);
+		}
+	}
+
+	if (wc->byte_len == 0) {
+		/* Credit only message; it was sent without a credit, so do not
+		 * grant one for reposting its buffer either */
+		dtr_repost_rx(s, rx_desc, false);
+		return;
+	}
+
+	ib_dma_sync_single_for_cpu(s->device, rx_desc->dma_addr, wc->byte_len, DMA_FROM_DEVICE);
+	rx_desc->size = wc->byte_len;
+	rx_desc->pos = 0;
+
+	spin_lock(&s->lock);
+	list_add_tail(&rx_desc->list, &s->rx_ready);
+	s->rx_ready_bytes += wc->byte_len;
+	s->bytes_received += wc->byte_len;
+	spin_unlock(&s->lock);
+	wake_up(&s->recv_wait);
+}
+
+static void dtr_tx_done(struct ib_cq *cq, struct ib_wc *wc)
+{
+	struct dtr_tx_desc *tx_desc = container_of(wc->wr_cqe, struct dtr_tx_desc, cqe);
+	struct dtr_stream *s = tx_desc->stream;
+
+	if (tx_desc->page) {
+		ib_dma_unmap_page(s->device, tx_desc->dma_addr, tx_desc->size, DMA_TO_DEVICE);
+		put_page(tx_desc->page);
+	}
+	if (wc->status != IB_WC_SUCCESS)
+		dtr_stream_broken(s);
+
+	atomic_sub(tx_desc->size, &s->tx_bytes);
+	atomic_dec(&s->tx_posted);
+	kfree(tx_desc);
+	wake_up(&s->send_wait);
+}
+
+static void dtr_free_stream(struct dtr_stream *s)
+{
+	struct dtr_cm *cm = s->cm;
+	unsigned int i;
+
+	dtr_stream_broken(s);
+
+	if (cm && cm->id->qp) {
+		rdma_disconnect(cm->id);
+		/* All outstanding work requests complete (flushed) before this returns */
+		ib_drain_qp(cm->id->qp);
+		rdma_destroy_qp(cm->id);
+	}
+	if (s->cq) {
+		ib_free_cq(s->cq);
+		s->cq = NULL;
+	}
+	for (i = 0; i < s->nr_rx_descs; i++) {
+		struct dtr_rx_desc *rx_desc = &s->rx_descs[i];
+
+		if (!rx_desc->page)
+			continue;
+		ib_dma_unmap_page(s->device, rx_desc->dma_addr, PAGE_SIZE, DMA_FROM_DEVICE);
+		__free_page(rx_desc->page);
+	}
+	kfree(s->rx_descs);
+	s->rx_descs = NULL;
+	s->nr_rx_descs = 0;
+	INIT_LIST_HEAD(&s->rx_ready);
+	s->rx_ready_bytes = 0;
+	if (s->pd) {
+		ib_dealloc_pd(s->pd);
+		s->pd = NULL;
+	}
+	if (cm) {
+		s->cm = NULL;
+		dtr_destroy_cm(cm);
+	}
+	s->device = NULL;
+}
+
+/* Creates the queue pair on the cm_id and posts the receive buffers */
+static int dtr_setup_stream(struct drbd_rdma_transport *rdma_transport, enum drbd_stream stream,
+			    struct dtr_cm *cm)
+{
+	struct drbd_transport *transport = &rdma_transport->transport;
+	struct dtr_stream *s = &rdma_transport->stream[stream];
+	struct ib_device *device = cm->id->device;
+	struct ib_qp_init_attr qp_attr = {};
+	unsigned int nr_rx, i;
+	const char *what;
+	int err;
+
+	nr_rx = stream == DATA_STREAM ?
+		clamp_t(unsigned int, READ_ONCE(dtr_rx_buffers), DTR_MIN_RX_BUFFERS, DTR_MAX_RX_BUFFERS) :
+		DTR_CONTROL_RX_BUFFERS;
+	nr_rx = min_t(unsigned int, nr_rx, device->attrs.max_qp_wr - DTR_CREDIT_RESERVE);
+
+	s->cm = cm;
+	s->device = device;
+	s->broken = false;
+	s->max_send_wr = nr_rx + DTR_CREDIT_RESERVE;
+	atomic_set(&s->tx_credits, 0);
+	atomic_set(&s->rx_credits_due, 0);
+	atomic_set(&s->tx_posted, 0);
+	atomic_set(&s->tx_bytes, 0);
+	s->bytes_sent = 0;
+	s->bytes_received = 0;
+	s->credit_msgs = 0;
+	s->pages_flipped = 0;
+	s->pages_copied = 0;
+
+	s->pd = ib_alloc_pd(device, 0);
+	if (IS_ERR(s->pd)) {
+		err = PTR_ERR(s->pd);
+		s->pd = NULL;
+		what = "ib_alloc_pd";
+		goto out;
+	}
+
+	s->cq = ib_alloc_cq(device, s, nr_rx + s->max_send_wr,
+			    stream % device->num_comp_vectors, IB_POLL_SOFTIRQ);
+	if (IS_ERR(s->cq)) {
+		err = PTR_ERR(s->cq);
+		s->cq = NULL;
+		what = "ib_alloc_cq";
+		goto out;
+	}
+
+	qp_attr.qp_context = s;
+	qp_attr.send_cq = s->cq;
+	qp_attr.recv_cq = s->cq;
+	qp_attr.cap.max_send_wr = s->max_send_wr;
+	qp_attr.cap.max_recv_wr = nr_rx;
+	qp_attr.cap.max_send_sge = 1;
+	qp_attr.cap.max_recv_sge = 1;
+	qp_attr.sq_sig_type = IB_SIGNAL_ALL_WR;
+	qp_attr.qp_type = IB_QPT_RC;
+	err = rdma_create_qp(cm->id, s->pd, &qp_attr);
+	if (err) {
+		what = "rdma_create_qp";
+		goto out;
+	}
+
+	s->rx_descs = kcalloc(nr_rx, sizeof(*s->rx_descs), GFP_KERNEL);
+	if (!s->rx_descs) {
+		err = -ENOMEM;
+		what = "kcalloc";
+		goto out;
+	}
+	s->nr_rx_descs = nr_rx;
+
+	for (i = 0; i < nr_rx; i++) {
+		struct dtr_rx_desc *rx_desc = &s->rx_descs[i];
+		struct page *page = alloc_page(GFP_KERNEL);
+
+		if (!page) {
+			err = -ENOMEM;
+			what = "alloc_page";
+			goto out;
+		}
+		rx_desc->dma_addr = ib_dma_map_page(device, page, 0, PAGE_SIZE, DMA_FROM_DEVICE);
+		if (ib_dma_mapping_error(device, rx_desc->dma_addr)) {
+			__free_page(page);
+			err = -ENOMEM;
+			what = "ib_dma_map_page";
+			goto out;
+		}
+		rx_desc->page = page;
+		rx_desc->stream = s;
+		err = dtr_post_recv(s, rx_desc);
+		if (err) {
+			what = "ib_post_recv";
+			goto out;
+		}
+	}
+	return 0;
+
+out:
+	tr_err(transport, "%s failed, err = %d\n", what, err);
+	/* the cm_id stays with the caller */
+	s->cm = NULL;
+	if (cm->id->qp) {
+		ib_drain_qp(cm->id->qp);
+		rdma_destroy_qp(cm->id);
+	}
+	dtr_free_stream(s);
+	return err;
+}
+
+static void dtr_fill_conn_param(struct rdma_conn_param *conn_param, struct dtr_cm_private_data *pdata,
+				struct dtr_stream *s, enum drbd_stream stream)
+{
+	pdata->magic = cpu_to_be32(DTR_MAGIC);
+	pdata->stream = cpu_to_be16(stream);
+	pdata->rx_credits = cpu_to_be16(s->nr_rx_descs - DTR_CREDIT_RESERVE);
+
+	memset(conn_param, 0, sizeof(*conn_param));
+	conn_param->private_data = pdata;
+	conn_param->private_data_len = sizeof(*pdata);
+	conn_param->retry_count = 7;
+	conn_param->rnr_retry_count = 7; /* infinite, only a safety net, credits avoid RNR */
+}
+
+static long dtr_wait_cm(struct dtr_cm *cm, enum dtr_cm_state state, long timeo)
+{
+	return wait_event_interruptible_timeout(cm->wait,
+			READ_ONCE(cm->state) == state || READ_ONCE(cm->state) >= DTR_CM_ERROR,
+			timeo);
+}
+
+static void dtr_stream_established(struct dtr_stream *s, struct dtr_cm *cm)
+{
+	s->peer_credits = cm->peer_credits;
+	atomic_set(&s->tx_credits, cm->peer_credits);
+	WRITE_ONCE(cm->stream, s);
+	if (READ_ONCE(cm->state) != DTR_CM_ESTABLISHED)
+		dtr_stream_broken(s);
+}
+
+static int dtr_connect_stream(struct drbd_rdma_transport *rdma_transport, struct drbd_path *drbd_path,
+			      enum drbd_stream stream, long timeo)
+{
+	struct drbd_transport *transport = &rdma_transport->transport;
+	struct dtr_stream *s = &rdma_transport->stream[stream];
+	struct sockaddr_storage my_addr = drbd_path->my_addr;
+	struct dtr_cm_private_data pdata;
+	struct rdma_conn_param conn_param;
+	struct rdma_cm_id *id;
+	struct dtr_cm *cm;
+	int err;
+
+	/* Any source port, the configured one might be a listener */
+	if (my_addr.ss_family == AF_INET6)
+		((struct sockaddr_in6 *)&my_addr)->sin6_port = 0;
+	else
+		((struct sockaddr_in *)&my_addr)->sin_port = 0;
+
+	cm = dtr_alloc_cm(GFP_KERNEL);
+	if (!cm)
+		return -ENOMEM;
+
+	id = rdma_create_id(&init_net, dtr_cma_event_handler, cm, RDMA_PS_TCP, IB_QPT_RC);
+	if (IS_ERR(id)) {
+		kfree(cm);
+		return PTR_ERR(id);
+	}
+	cm->id = id;
+
+	err = rdma_resolve_addr(id, (struct sockaddr *)&my_addr,
+				(struct sockaddr *)&drbd_path->peer_addr, DTR_RESOLVE_TIMEOUT_MS);
+	if (err)
+		goto out;
+	if (dtr_wait_cm(cm, DTR_CM_ROUTE_RESOLVED, timeo) <= 0 ||
+	    READ_ONCE(cm->state) != DTR_CM_ROUTE_RESOLVED) {
+		err = -EAGAIN;
+		goto out;
+	}
+
+	err = dtr_setup_stream(rdma_transport, stream, cm);
+	if (err)
+		goto out;
+
+	dtr_fill_conn_param(&conn_param, &pdata, s, stream);
+	err = rdma_connect(id, &conn_param);
+	if (err) {
+		tr_err(transport, "rdma_connect failed, err = %d\n", err);
+		dtr_free_stream(s); /* also destroys the cm_id */
+		return err;
+	}
+	if (dtr_wait_cm(cm, DTR_CM_ESTABLISHED, timeo) <= 0 ||
+	    READ_ONCE(cm->state) != DTR_CM_ESTABLISHED) {
+		dtr_free_stream(s);
+		return -EAGAIN;
+	}
+	dtr_stream_established(s, cm);
+	return 0;
+
+out:
+	dtr_destroy_cm(cm);
+	return err;
+}
+
+static struct dtr_cm *dtr_next_pending(struct dtr_path *path)
+{
+	struct dtr_cm *cm;
+
+	spin_lock_bh(&path->lock);
+	cm = list_first_entry_or_null(&path->pending, struct dtr_cm, list);
+	if (cm)
+		list_del_init(&cm->list);
+	spin_unlock_bh(&path->lock);
+
+	return cm;
+}
+
+static void dtr_purge_pending(struct dtr_path *path)
+{
+	struct dtr_cm *cm;
+
+	while ((cm = dtr_next_pending(path)))
+		dtr_destroy_cm(cm);
+}
+
+static int dtr_accept_stream(struct drbd_rdma_transport *rdma_transport, struct dtr_cm *cm, long timeo)
+{
+	struct drbd_transport *transport = &rdma_transport->transport;
+	enum drbd_stream stream = cm->peer_stream;
+	struct dtr_stream *s = &rdma_transport->stream[stream];
+	struct dtr_cm_private_data pdata;
+	struct rdma_conn_param conn_param;
+	int err;
+
+	/* A connect request for a stream we accepted already: the peer gave up
+	 * on the first one and retried */
+	if (s->cm)
+		dtr_free_stream(s);
+
+	err = dtr_setup_stream(rdma_transport, stream, cm);
+	if (err) {
+		dtr_destroy_cm(cm);
+		return err;
+	}
+
+	dtr_fill_conn_param(&conn_param, &pdata, s, stream);
+	err = rdma_accept(cm->id, &conn_param);
+	if (err) {
+		tr_err(transport, "rdma_accept failed, err = %d\n", err);
+		dtr_free_stream(s);
+		return err;
+	}
+	if (dtr_wait_cm(cm, DTR_CM_ESTABLISHED, timeo) <= 0 ||
+	    READ_ONCE(cm->state) != DTR_CM_ESTABLISHED) {
+		dtr_free_stream(s);
+		return -EAGAIN;
+	}
+	dtr_stream_established(s, cm);
+	return 0;
+}
+
+static bool dtr_both_established(struct drbd_rdma_transport *rdma_transport)
+{
+	return rdma_transport->stream[DATA_STREAM].cm && rdma_transport->stream[CONTROL_STREAM].cm;
+}
+
+static int dtr_accept_streams(struct drbd_rdma_transport *rdma_transport, struct dtr_path *path,
+			      long timeo)
+{
+	struct dtr_listener *listener =
+		container_of(path->path.listener, struct dtr_listener, listener);
+	unsigned long deadline = jiffies + timeo;
+
+	while (!dtr_both_established(rdma_transport)) {
+		struct dtr_cm *cm = NULL;
+		long t = (long)(deadline - jiffies);
+		int err;
+
+		if (t <= 0)
+			return -EAGAIN;
+		t = wait_event_interruptible_timeout(listener->wait,
+				!list_empty(&path->pending), t);
+		if (t <= 0)
+			return -EAGAIN;
+
+		cm = dtr_next_pending(path);
+		if (!cm)
+			continue;
+		if (READ_ONCE(cm->state) != DTR_CM_CONNECT_REQUEST) {
+			dtr_destroy_cm(cm);
+			continue;
+		}
+		err = dtr_accept_stream(rdma_transport, cm, t);
+		if (err && err != -EAGAIN)
+			return err;
+	}
+	return 0;
+}
+
+static bool dtr_path_cmp_addr(struct drbd_path *drbd_path)
+{
+	int addr_size;
+
+	addr_size = min(drbd_path->my_addr_len, drbd_path->peer_addr_len);
+	return memcmp(&drbd_path->my_addr, &drbd_path->peer_addr, addr_size) > 0;
+}
+
+static void dtr_destroy_listener(struct drbd_listener *generic_listener)
+{
+	struct dtr_listener *listener =
+		container_of(generic_listener, struct dtr_listener, listener);
+
+	rdma_destroy_id(listener->cm.id);
+	kfree(listener);
+}
+
+static int dtr_init_listener(struct drbd_transport *transport,
+			     const struct sockaddr *addr,
+			     struct drbd_listener *drbd_listener)
+{
+	struct dtr_listener *listener = container_of(drbd_listener, struct dtr_listener, listener);
+	struct sockaddr_storage my_addr;
+	struct rdma_cm_id *id;
+	const char *what;
+	int err;
+
+	my_addr = *(struct sockaddr_storage *)addr;
+
+	memset(&listener->cm, 0, sizeof(listener->cm));
+	INIT_LIST_HEAD(&listener->cm.list);
+	init_waitqueue_head(&listener->cm.wait);
+	listener->cm.listener = listener;
+	init_waitqueue_head(&listener->wait);
+
+	id = rdma_create_id(&init_net, dtr_cma_event_handler, &listener->cm, RDMA_PS_TCP, IB_QPT_RC);
+	if (IS_ERR(id)) {
+		err = PTR_ERR(id);
+		what = "rdma_create_id";
+		goto out;
+	}
+	listener->cm.id = id;
+
+	err = rdma_bind_addr(id, (struct sockaddr *)&my_addr);
+	if (err) {
+		what = "rdma_bind_addr";
+		goto out_destroy;
+	}
+
+	err = rdma_listen(id, DRBD_PEERS_MAX * 2);
+	if (err) {
+		what = "rdma_listen";
+		goto out_destroy;
+	}
+
+	listener->listener.listen_addr = my_addr;
+	listener->listener.destroy = dtr_destroy_listener;
+
+	return 0;
+
+out_destroy:
+	rdma_destroy_id(id);
+out:
+	if (err != -EADDRINUSE && err != -EADDRNOTAVAIL)
+		tr_err(transport, "%s failed, err = %d\n", what, err);
+
+	return err;
+}
+
+static int dtr_connect(struct drbd_transport *transport)
+{
+	struct drbd_rdma_transport *rdma_transport =
+		container_of(transport, struct drbd_rdma_transport, transport);
+	struct drbd_path *drbd_path;
+	struct dtr_path *path;
+	struct net_conf *nc;
+	int connect_int, err;
+	bool active;
+	long timeo;
+
+	rcu_read_lock();
+	nc = rcu_dereference(transport->net_conf);
+	if (!nc) {
+		rcu_read_unlock();
+		return -EIO;
+	}
+	connect_int = nc->connect_int;
+	rcu_read_unlock();
+
+	timeo = connect_int * HZ;
+	timeo += (prandom_u32() & 1) ? timeo / 7 : -timeo / 7; /* 28.5% random jitter */
+
+	spin_lock(&rdma_transport->paths_lock);
+	drbd_path = list_first_entry_or_null(&transport->paths, struct drbd_path, list);
+	if (drbd_path)
+		kref_get(&drbd_path->kref);
+	spin_unlock(&rdma_transport->paths_lock);
+	if (!drbd_path)
+		return -EDESTADDRREQ;
+	path = container_of(drbd_path, struct dtr_path, path);
+
+	active = dtr_path_cmp_addr(drbd_path);
+	if (active) {
+		err = dtr_connect_stream(rdma_transport, drbd_path, DATA_STREAM, timeo);
+		if (!err)
+			err = dtr_connect_stream(rdma_transport, drbd_path, CONTROL_STREAM, timeo);
+		if (err && err != -EADDRNOTAVAIL)
+			err = -EAGAIN;
+	} else {
+		err = drbd_get_listener(transport, drbd_path, dtr_init_listener);
+		if (!err) {
+			err = dtr_accept_streams(rdma_transport, path, timeo);
+			drbd_put_listener(drbd_path);
+			dtr_purge_pending(path);
+		}
+	}
+
+	if (err) {
+		dtr_free_stream(&rdma_transport->stream[DATA_STREAM]);
+		dtr_free_stream(&rdma_transport->stream[CONTROL_STREAM]);
+		if (err == -EAGAIN) {
+			/* The peer is probably not listening yet */
+			if (active)
+				schedule_timeout_interruptible(timeo);
+			/* flushes pending signals, our caller decides about retrying */
+			drbd_should_abort_listening(transport);
+		}
+		goto out;
+	}
+
+	if (active)
+		clear_bit(RESOLVE_CONFLICTS, &transport->flags);
+	else
+		set_bit(RESOLVE_CONFLICTS, &transport->flags);
+
+	rdma_transport->stream[DATA_STREAM].rcvtimeo = MAX_SCHEDULE_TIMEOUT;
+	rdma_transport->stream[CONTROL_STREAM].rcvtimeo = MAX_SCHEDULE_TIMEOUT;
+	WRITE_ONCE(rdma_transport->connected, true);
+
+	drbd_path->established = true;
+	drbd_path_event(transport, drbd_path);
+out:
+	kref_put(&drbd_path->kref, drbd_destroy_path);
+	return err;
+}
+
+static void dtr_free(struct drbd_transport *transport, enum drbd_tr_free_op free_op)
+{
+	struct drbd_rdma_transport *rdma_transport =
+		container_of(transport, struct drbd_rdma_transport, transport);
+	struct drbd_path *drbd_path;
+	enum drbd_stream i;
+
+	WRITE_ONCE(rdma_transport->connected, false);
+	for (i = DATA_STREAM; i <= CONTROL_STREAM; i++)
+		dtr_free_stream(&rdma_transport->stream[i]);
+
+	for_each_path_ref(drbd_path, transport) {
+		bool was_established = drbd_path->established;
+		drbd_path->established = false;
+		if (was_established)
+			drbd_path_event(transport, drbd_path);
+	}
+
+	if (free_op == DESTROY_TRANSPORT) {
+		struct drbd_path *tmp;
+
+		for (i = DATA_STREAM; i <= CONTROL_STREAM; i++) {
+			free_page((unsigned long)rdma_transport->stream[i].rbuf.base);
+			rdma_transport->stream[i].rbuf.base = NULL;
+		}
+		spin_lock(&rdma_transport->paths_lock);
+		list_for_each_entry_safe(drbd_path, tmp, &transport->paths, list) {
+			list_del_init(&drbd_path->list);
+			kref_put(&drbd_path->kref, drbd_destroy_path);
+		}
+		spin_unlock(&rdma_transport->paths_lock);
+	}
+}
+
+static struct dtr_rx_desc *dtr_rx_head(struct dtr_stream *s)
+{
+	struct dtr_rx_desc *rx_desc;
+
+	spin_lock_bh(&s->lock);
+	rx_desc = list_first_entry_or_null(&s->rx_ready, struct dtr_rx_desc, list);
+	spin_unlock_bh(&s->lock);
+
+	return rx_desc;
+}
+
+static bool dtr_recv_cond(struct dtr_stream *s)
+{
+	return dtr_rx_head(s) || READ_ONCE(s->broken);
+}
+
+/*
+ * Waits for the next received message.  Returns NULL with *err set to 0 if
+ * the stream is broken, or to -EAGAIN, -EINTR or -ERESTARTSYS like
+ * kernel_recvmsg() on a TCP socket with the receive timeout @timeo.
+ */
+static struct dtr_rx_desc *dtr_next_rx(struct dtr_stream *s, long timeo,
+				       unsigned long deadline, int *err)
+{
+	struct dtr_rx_desc *rx_desc;
+	long t;
+
+	*err = 0;
+	while (!(rx_desc = dtr_rx_head(s))) {
+		if (READ_ONCE(s->broken))
+			return NULL;
+
+		if (timeo == 0) {
+			*err = -EAGAIN;
+			return NULL;
+		}
+		if (timeo == MAX_SCHEDULE_TIMEOUT) {
+			t = MAX_SCHEDULE_TIMEOUT;
+		} else {
+			t = (long)(deadline - jiffies);
+			if (t <= 0) {
+				*err = -EAGAIN;
+				return NULL;
+			}
+		}
+
+		t = wait_event_interruptible_timeout(s->recv_wait, dtr_recv_cond(s), t);
+		if (t < 0) {
+			*err = timeo == MAX_SCHEDULE_TIMEOUT ? -ERESTARTSYS : -EINTR;
+			return NULL;
+		}
+	}
+	return rx_desc;
+}
+
+/* The message of rx_desc is consumed, give its buffer back to the HCA */
+static void dtr_consumed_rx(struct dtr_stream *s, struct dtr_rx_desc *rx_desc)
+{
+	spin_lock_bh(&s->lock);
+	list_del(&rx_desc->list);
+	spin_unlock_bh(&s->lock);
+
+	dtr_repost_rx(s, rx_desc, true);
+	dtr_maybe_send_credits(s);
+}
+
+/*
+ * Returns like kernel_recvmsg() on a TCP socket.  There is exactly one
+ * reader per stream, so the head message can be copied from without
+ * holding the lock; the completion handler only ever appends.
+ */
+static int dtr_recv_short(struct dtr_stream *s, void *buf, size_t size, int flags)
+{
+	long timeo = s->rcvtimeo;
+	unsigned long deadline = jiffies + timeo;
+	size_t copied = 0;
+	int err = 0;
+
+	if (flags & MSG_DONTWAIT)
+		timeo = 0;
+
+	while (copied < size) {
+		struct dtr_rx_desc *rx_desc;
+		unsigned int len;
+		void *data;
+
+		rx_desc = dtr_next_rx(s, timeo, deadline, &err);
+		if (!rx_desc)
+			break;
+
+		len = min_t(size_t, size - copied, rx_desc->size - rx_desc->pos);
+		data = kmap_atomic(rx_desc->page);
+		memcpy(buf + copied, data + rx_desc->pos, len);
+		kunmap_atomic(data);
+		copied += len;
+		rx_desc->pos += len;
+
+		spin_lock_bh(&s->lock);
+		s->rx_ready_bytes -= len;
+		spin_unlock_bh(&s->lock);
+
+		if (rx_desc->pos == rx_desc->size)
+			dtr_consumed_rx(s, rx_desc);
+	}
+
+	return copied ? copied : err;
+}
+
+static int dtr_recv(struct drbd_transport *transport, enum drbd_stream stream, void **buf, size_t size, int flags)
+{
+	struct drbd_rdma_transport *rdma_transport =
+		container_of(transport, struct drbd_rdma_transport, transport);
+	struct dtr_stream *s = &rdma_transport->stream[stream];
+	void *buffer;
+	int rv;
+
+	if (!READ_ONCE(rdma_transport->connected))
+		return -ENOTCONN;
+
+	if (flags & CALLER_BUFFER) {
+		buffer = *buf;
+		rv = dtr_recv_short(s, buffer, size, flags & ~CALLER_BUFFER);
+	} else if (flags & GROW_BUFFER) {
+		TR_ASSERT(transport, *buf == s->rbuf.base);
+		buffer = s->rbuf.pos;
+		TR_ASSERT(transport, (buffer - *buf) + size <= PAGE_SIZE);
+
+		rv = dtr_recv_short(s, buffer, size, flags & ~GROW_BUFFER);
+	} else {
+		buffer = s->rbuf.base;
+
+		rv = dtr_recv_short(s, buffer, size, flags);
+		if (rv > 0)
+			*buf = buffer;
+	}
+
+	if (rv > 0)
+		s->rbuf.pos = buffer + rv;
+
+	return rv;
+}
+
+/*
+ * If the next message is exactly the next @len bytes of payload, it sits
+ * alone in its receive buffer page.  Swap that page with @page and repost
+ * the ring slot with @page.  Returns the received page, or NULL if it has
+ * to be copied.
+ */
+static struct page *dtr_flip_page(struct dtr_stream *s, struct page *page, unsigned int len, int *err)
+{
+	struct dtr_rx_desc *rx_desc;
+	struct page *rx_page;
+	u64 dma_addr;
+
+	rx_desc = dtr_next_rx(s, s->rcvtimeo, jiffies + s->rcvtimeo, err);
+	if (!rx_desc || rx_desc->pos != 0 || rx_desc->size != len)
+		return NULL;
+
+	dma_addr = ib_dma_map_page(s->device, page, 0, PAGE_SIZE, DMA_FROM_DEVICE);
+	if (ib_dma_mapping_error(s->device, dma_addr))
+		return NULL;
+	ib_dma_unmap_page(s->device, rx_desc->dma_addr, PAGE_SIZE, DMA_FROM_DEVICE);
+
+	spin_lock_bh(&s->lock);
+	s->rx_ready_bytes -= len;
+	spin_unlock_bh(&s->lock);
+
+	rx_page = rx_desc->page;
+	rx_desc->page = page;
+	rx_desc->dma_addr = dma_addr;
+	dtr_consumed_rx(s, rx_desc);
+
+	return rx_page;
+}
+
+static int dtr_recv_pages(struct drbd_transport *transport, struct drbd_page_chain_head *chain, size_t size)
+{
+	struct drbd_rdma_transport *rdma_transport =
+		container_of(transport, struct drbd_rdma_transport, transport);
+	struct dtr_stream *s = &rdma_transport->stream[DATA_STREAM];
+	struct page *page, *prev = NULL;
+	int err = 0;
+
+	if (!READ_ONCE(rdma_transport->connected))
+		return -ENOTCONN;
+
+	drbd_alloc_page_chain(transport, chain, DIV_ROUND_UP(size, PAGE_SIZE), GFP_TRY);
+	page = chain->head;
+	if (!page)
+		return -ENOMEM;
+
+	while (page) {
+		size_t len = min_t(size_t, size, PAGE_SIZE);
+		struct page *next = page_chain_next(page);
+		struct page *rx_page;
+
+		rx_page = dtr_flip_page(s, page, len, &err);
+		if (rx_page) {
+			/* page is in the receive ring now, rx_page takes its place */
+			set_page_chain_next_offset_size(page, NULL, 0, 0);
+			set_page_chain_next(rx_page, next);
+			if (prev)
+				set_page_chain_next(prev, rx_page);
+			else
+				chain->head = rx_page;
+			page = rx_page;
+			s->pages_flipped++;
+		} else {
+			void *data;
+
+			if (err)
+				goto fail;
+			data = kmap(page);
+			err = dtr_recv_short(s, data, len, 0);
+			kunmap(page);
+			if (err != len) {
+				if (err >= 0)
+					err = -EIO;
+				goto fail;
+			}
+			s->pages_copied++;
+		}
+		set_page_chain_offset(page, 0);
+		set_page_chain_size(page, len);
+		size -= len;
+		prev = page;
+		page = next;
+	}
+	return 0;
+fail:
+	drbd_free_page_chain(transport, chain, 0);
+	return err;
+}
+
+static void dtr_stats(struct drbd_transport *transport, struct drbd_transport_stats *stats)
+{
+	struct drbd_rdma_transport *rdma_transport =
+		container_of(transport, struct drbd_rdma_transport, transport);
+	struct dtr_stream *s = &rdma_transport->stream[DATA_STREAM];
+
+	if (READ_ONCE(rdma_transport->connected)) {
+		unsigned int in_flight = atomic_read(&s->tx_bytes);
+
+		stats->unread_received = READ_ONCE(s->rx_ready_bytes);
+		stats->unacked_send = in_flight;
+		stats->send_buffer_size = s->peer_credits * PAGE_SIZE;
+		stats->send_buffer_used = in_flight;
+	}
+}
+
+static void dtr_update_congested(struct drbd_rdma_transport *rdma_transport, struct dtr_stream *s)
+{
+	if (atomic_read(&s->tx_credits) < s->peer_credits / 5)
+		set_bit(NET_CONGESTED, &rdma_transport->transport.flags);
+}
+
+static bool dtr_send_cond(struct dtr_stream *s)
+{
+	return (atomic_read(&s->tx_credits) > 0 &&
+		atomic_read(&s->tx_posted) < s->max_send_wr) ||
+		READ_ONCE(s->broken);
+}
+
+static int dtr_send_one(struct drbd_rdma_transport *rdma_transport, enum drbd_stream stream,
+			struct page *page, unsigned int offset, unsigned int size)
+{
+	struct drbd_transport *transport = &rdma_transport->transport;
+	struct dtr_stream *s = &rdma_transport->stream[stream];
+	struct dtr_tx_desc *tx_desc;
+	struct net_conf *nc;
+	long timeout;
+	int err;
+
+	rcu_read_lock();
+	nc = rcu_dereference(transport->net_conf);
+	timeout = nc ? nc->timeout * HZ / 10 : MAX_SCHEDULE_TIMEOUT;
+	rcu_read_unlock();
+
+	while (!dtr_send_cond(s)) {
+		long t = wait_event_interruptible_timeout(s->send_wait, dtr_send_cond(s), timeout);
+		if (t < 0) {
+			flush_signals(current);
+			continue;
+		}
+		if (t == 0 && drbd_stream_send_timed_out(transport, stream))
+			return -EAGAIN;
+	}
+	if (READ_ONCE(s->broken))
+		return -ECONNRESET;
+
+	tx_desc = kmalloc(sizeof(*tx_desc), GFP_NOIO);
+	if (!tx_desc)
+		return -ENOMEM;
+
+	tx_desc->dma_addr = ib_dma_map_page(s->device, page, offset, size, DMA_TO_DEVICE);
+	if (ib_dma_mapping_error(s->device, tx_desc->dma_addr)) {
+		kfree(tx_desc);
+		return -ENOMEM;
+	}
+	get_page(page);
+	tx_desc->page = page;
+	tx_desc->size = size;
+
+	atomic_dec(&s->tx_credits);
+	err = dtr_post_send(s, tx_desc);
+	if (err) {
+		atomic_inc(&s->tx_credits);
+		ib_dma_unmap_page(s->device, tx_desc->dma_addr, size, DMA_TO_DEVICE);
+		put_page(page);
+		kfree(tx_desc);
+		dtr_stream_broken(s);
+		return err;
+	}
+	s->bytes_sent += size;
+
+	return 0;
+}
+
+static int dtr_send_page(struct drbd_transport *transport, enum drbd_stream stream,
+			 struct page *page, int offset, size_t size, unsigned msg_flags)
+{
+	struct drbd_rdma_transport *rdma_transport =
+		container_of(transport, struct drbd_rdma_transport, transport);
+	int err = 0;
+
+	if (!READ_ONCE(rdma_transport->connected))
+		return -ENOTCONN;
+
+	dtr_update_congested(rdma_transport, &rdma_transport->stream[stream]);
+
+	/* At most one page per message, so that the receiver can flip it */
+	page = nth_page(page, offset >> PAGE_SHIFT);
+	offset &= ~PAGE_MASK;
+	while (size) {
+		unsigned int len = min_t(size_t, size, PAGE_SIZE - offset);
+
+		err = dtr_send_one(rdma_transport, stream, page, offset, len);
+		if (err)
+			break;
+		size -= len;
+		offset = 0;
+		page = nth_page(page, 1);
+	}
+	clear_bit(NET_CONGESTED, &transport->flags);
+
+	return err;
+}
+
+static int dtr_send_zc_bio(struct drbd_transport *transport, struct bio *bio)
+{
+	struct bio_vec bvec;
+	struct bvec_iter iter;
+
+	bio_for_each_segment(bvec, bio, iter) {
+		int err;
+
+		err = dtr_send_page(transport, DATA_STREAM, bvec.bv_page,
+				      bvec.bv_offset, bvec.bv_len,
+				      bio_iter_last(bvec, iter) ? 0 : MSG_MORE);
+		if (err)
+			return err;
+
+		if (bio_op(bio) == REQ_OP_WRITE_SAME)
+			break;
+	}
+	return 0;
+}
+
+static void dtr_set_rcvtimeo(struct drbd_transport *transport, enum drbd_stream stream, long timeout)
+{
+	struct drbd_rdma_transport *rdma_transport =
+		container_of(transport, struct drbd_rdma_transport, transport);
+
+	rdma_transport->stream[stream].rcvtimeo = timeout;
+}
+
+static long dtr_get_rcvtimeo(struct drbd_transport *transport, enum drbd_stream stream)
+{
+	struct drbd_rdma_transport *rdma_transport =
+		container_of(transport, struct drbd_rdma_transport, transport);
+
+	if (!READ_ONCE(rdma_transport->connected))
+		return -ENOTCONN;
+
+	return rdma_transport->stream[stream].rcvtimeo;
+}
+
+static bool dtr_stream_ok(struct drbd_transport *transport, enum drbd_stream stream)
+{
+	struct drbd_rdma_transport *rdma_transport =
+		container_of(transport, struct drbd_rdma_transport, transport);
+
+	return READ_ONCE(rdma_transport->connected) &&
+		!READ_ONCE(rdma_transport->stream[stream].broken);
+}
+
+static bool dtr_hint(struct drbd_transport *transport, enum drbd_stream stream,
+		enum drbd_tr_hints hint)
+{
+	struct drbd_rdma_transport *rdma_transport =
+		container_of(transport, struct drbd_rdma_transport, transport);
+
+	if (!READ_ONCE(rdma_transport->connected))
+		return false;
+
+	/* Every send_page() is posted right away, so CORK, UNCORK, NODELAY
+	 * and QUICKACK have nothing to do. */
+	return true;
+}
+
+static void dtr_debugfs_show(struct drbd_transport *transport, struct seq_file *m)
+{
+	struct drbd_rdma_transport *rdma_transport =
+		container_of(transport, struct drbd_rdma_transport, transport);
+	enum drbd_stream i;
+
+	/* BUMP me if you change the file format/content/presentation */
+	seq_printf(m, "v: %u\n\n", 0);
+
+	if (!READ_ONCE(rdma_transport->connected))
+		return;
+
+	for (i = DATA_STREAM; i <= CONTROL_STREAM ; i++) {
+		struct dtr_stream *s = &rdma_transport->stream[i];
+
+		seq_printf(m, "%s stream%s\n", i == DATA_STREAM ? "data" : "control",
+			   READ_ONCE(s->broken) ? " (broken)" : "");
+		seq_printf(m, "send: credits: %d/%u posted: %d (%d Byte) total: %llu Byte\n",
+			   atomic_read(&s->tx_credits), s->peer_credits,
+			   atomic_read(&s->tx_posted), atomic_read(&s->tx_bytes),
+			   (unsigned long long)s->bytes_sent);
+		seq_printf(m, "receive: buffers: %u ready: %u Byte credits due: %d credit msgs: %llu"
+			   " total: %llu Byte\n",
+			   s->nr_rx_descs, READ_ONCE(s->rx_ready_bytes),
+			   atomic_read(&s->rx_credits_due), (unsigned long long)s->credit_msgs,
+			   (unsigned long long)s->bytes_received);
+		if (i == DATA_STREAM)
+			seq_printf(m, "pages: flipped: %llu copied: %llu\n",
+				   (unsigned long long)s->pages_flipped,
+				   (unsigned long long)s->pages_copied);
+	}
+}
+
+static int dtr_add_path(struct drbd_transport *transport, struct drbd_path *drbd_path)
+{
+	struct drbd_rdma_transport *rdma_transport =
+		container_of(transport, struct drbd_rdma_transport, transport);
+	struct dtr_path *path = container_of(drbd_path, struct dtr_path, path);
+
+	drbd_path->established = false;
+	spin_lock_init(&path->lock);
+	INIT_LIST_HEAD(&path->pending);
+
+	spin_lock(&rdma_transport->paths_lock);
+	list_add(&drbd_path->list, &transport->paths);
+	spin_unlock(&rdma_transport->paths_lock);
+
+	return 0;
+}
+
+static int dtr_remove_path(struct drbd_transport *transport, struct drbd_path *drbd_path)
+{
+	struct drbd_rdma_transport *rdma_transport =
+		container_of(transport, struct drbd_rdma_transport, transport);
+	struct dtr_path *path = container_of(drbd_path, struct dtr_path, path);
+
+	if (drbd_path->established)
+		return -EBUSY;
+
+	spin_lock(&rdma_transport->paths_lock);
+	list_del_init(&drbd_path->list);
+	spin_unlock(&rdma_transport->paths_lock);
+	drbd_put_listener(drbd_path);
+	dtr_purge_pending(path);
+
+	return 0;
+}
+
+static int __init dtr_initialize(void)
+{
+	return drbd_register_transport_class(&rdma_transport_class,
+					     DRBD_TRANSPORT_API_VERSION,
+					     sizeof(struct drbd_transport));
+}
+
+static void __exit dtr_cleanup(void)
+{
+	drbd_unregister_transport_class(&rdma_transport_class);
+}
+
+module_init(dtr_initialize)
+module_exit(dtr_cleanup)
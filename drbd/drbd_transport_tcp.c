@@ -17,6 +17,8 @@
 #include <linux/net.h>
 #include <linux/tcp.h>
 #include <linux/highmem.h>
+#include <net/tcp.h>
+#include <linux/drbd.h>
 #include <linux/drbd_genl_api.h>
 #include <linux/drbd_config.h>
 #include <drbd_protocol.h>
@@ -31,6 +33,21 @@ MODULE_DESCRIPTION("TCP (SDP, SSOCKS) transport layer for DRBD");
 MODULE_LICENSE("GPL");
 MODULE_VERSION(REL_VERSION);
 
+static bool dtt_autotune_sndbuf = true;
+MODULE_PARM_DESC(autotune_sndbuf, "Grow the send buffer from measured RTT and throughput if sndbuf-size is 0");
+module_param_named(autotune_sndbuf, dtt_autotune_sndbuf, bool, 0644);
+
+/* Busy polling of the control stream (SO_BUSY_POLL), so that the ack receiver
+ * picks up P_WRITE_ACK and friends without waiting for the interrupt and the
+ * wakeup.  Per connection, taken into account when it gets established. */
+static char dtt_busy_poll[256];
+MODULE_PARM_DESC(busy_poll, "Busy poll the control stream, as connection-name:usecs[,connection-name:usecs...]");
+module_param_string(busy_poll, dtt_busy_poll, sizeof(dtt_busy_poll), 0644);
+
+static unsigned int dtt_busy_poll_idle_usecs = 1000;
+MODULE_PARM_DESC(busy_poll_idle_usecs, "Stop busy polling if the control stream was idle for that long");
+module_param_named(busy_poll_idle_usecs, dtt_busy_poll_idle_usecs, uint, 0644);
+
 struct buffer {
 	void *base;
 	void *pos;
@@ -38,12 +55,30 @@ struct buffer {
 
 #define DTT_CONNECTING 1
 
+#define DTT_AUTOTUNE_INTERVAL (HZ / 10)
+
+struct dtt_autotune {
+	struct sock *sk;	/* the data socket the samples below belong to */
+	unsigned long last;	/* jiffies of the last sample */
+	u64 bytes_acked;	/* tp->bytes_acked at the last sample */
+	u64 rate;		/* acked bytes per second, smoothed */
+};
+
+struct dtt_busy_poll {
+	unsigned int usecs;	/* spin budget, 0 if not configured */
+	u64 last_rx_ns;		/* the control stream last had something for us */
+	unsigned long polled;	/* receives with busy polling */
+	unsigned long idle;	/* receives without, because we were idle */
+};
+
 struct drbd_tcp_transport {
 	struct drbd_transport transport; /* Must be first! */
 	spinlock_t paths_lock;
 	unsigned long flags;
 	struct socket *stream[2];
 	struct buffer rbuf[2];
+	struct dtt_autotune autotune;
+	struct dtt_busy_poll busy_poll;
 };
 
 struct dtt_listener {
@@ -83,7 +118,7 @@ static int dtt_send_zc_bio(struct drbd_transport *, struct bio *bio);
 static bool dtt_stream_ok(struct drbd_transport *transport, enum drbd_stream stream);
 static bool dtt_hint(struct drbd_transport *transport, enum drbd_stream stream, enum drbd_tr_hints hint);
 static void dtt_debugfs_show(struct drbd_transport *transport, struct seq_file *m);
-static void dtt_update_congested(struct drbd_tcp_transport *tcp_transport);
+static void dtt_update_congested(struct drbd_tcp_transport *tcp_transport, enum drbd_stream stream);
 static int dtt_add_path(struct drbd_transport *, struct drbd_path *path);
 static int dtt_remove_path(struct drbd_transport *, struct drbd_path *);
 
@@ -290,6 +325,64 @@ static int dtt_recv_short(struct socket *socket, void *buf, size_t size, int fla
 	return kernel_recvmsg(socket, &msg, &iov, 1, size, msg.msg_flags);
 }
 
+#ifdef CONFIG_NET_RX_BUSY_POLL
+/* Returns the spin budget configured for the connection, or 0. */
+static unsigned int dtt_busy_poll_configured(struct drbd_transport *transport)
+{
+	char name[SHARED_SECRET_MAX];
+	char *params, *p, *tok, *usecs;
+	unsigned int rv = 0;
+
+	rcu_read_lock();
+	strscpy(name, rcu_dereference(transport->net_conf)->name, sizeof(name));
+	rcu_read_unlock();
+
+	params = kstrdup(dtt_busy_poll, GFP_KERNEL);
+	if (!params)
+		return 0;
+	p = params;
+	while ((tok = strsep(&p, ",")) != NULL) {
+		usecs = strrchr(tok, ':');
+		if (!usecs)
+			continue;
+		*usecs++ = 0;
+		if (strcmp(strim(tok), name))
+			continue;
+		if (kstrtouint(strim(usecs), 10, &rv))
+			rv = 0;
+		break;
+	}
+	kfree(params);
+	return rv;
+}
+
+/* Busy poll only while acks keep coming; an idle connection should not
+ * burn a CPU. */
+static void dtt_busy_poll_prepare(struct drbd_tcp_transport *tcp_transport, struct sock *sk)
+{
+	struct dtt_busy_poll *bp = &tcp_transport->busy_poll;
+	unsigned int usecs = 0;
+
+	if (ktime_get_ns() - bp->last_rx_ns < (u64)dtt_busy_poll_idle_usecs * NSEC_PER_USEC) {
+		usecs = bp->usecs;
+		bp->polled++;
+	} else {
+		bp->idle++;
+	}
+	if (READ_ONCE(sk->sk_ll_usec) != usecs)
+		WRITE_ONCE(sk->sk_ll_usec, usecs);
+}
+#else
+static unsigned int dtt_busy_poll_configured(struct drbd_transport *transport)
+{
+	return 0;
+}
+
+static void dtt_busy_poll_prepare(struct drbd_tcp_transport *tcp_transport, struct sock *sk)
+{
+}
+#endif
+
 static int dtt_recv(struct drbd_transport *transport, enum drbd_stream stream, void **buf, size_t size, int flags)
 {
 	struct drbd_tcp_transport *tcp_transport =
@@ -301,6 +394,9 @@ static int dtt_recv(struct drbd_transport *transport, enum drbd_stream stream, v
 	if (!socket)
 		return -ENOTCONN;
 
+	if (stream == CONTROL_STREAM && tcp_transport->busy_poll.usecs)
+		dtt_busy_poll_prepare(tcp_transport, socket->sk);
+
 	if (flags & CALLER_BUFFER) {
 		buffer = *buf;
 		rv = dtt_recv_short(socket, buffer, size, flags & ~CALLER_BUFFER);
@@ -318,8 +414,11 @@ static int dtt_recv(struct drbd_transport *transport, enum drbd_stream stream, v
 			*buf = buffer;
 	}
 
-	if (rv > 0)
+	if (rv > 0) {
 		tcp_transport->rbuf[stream].pos = buffer + rv;
+		if (stream == CONTROL_STREAM)
+			tcp_transport->busy_poll.last_rx_ns = ktime_get_ns();
+	}
 
 	return rv;
 }
@@ -1053,6 +1152,11 @@ randomize:
 	tcp_transport->stream[DATA_STREAM] = dsocket;
 	tcp_transport->stream[CONTROL_STREAM] = csocket;
 
+	tcp_transport->busy_poll = (struct dtt_busy_poll) {
+		.usecs = dtt_busy_poll_configured(transport),
+		.last_rx_ns = ktime_get_ns(),
+	};
+
 	rcu_read_lock();
 	nc = rcu_dereference(transport->net_conf);
 
@@ -1119,7 +1223,57 @@ static bool dtt_stream_ok(struct drbd_transport *transport, enum drbd_stream str
 	return socket && socket->sk;
 }
 
-static void dtt_update_congested(struct drbd_tcp_transport *tcp_transport)
+/* With sndbuf-size 0 the kernel sizes the send buffer from the congestion
+ * window, which lags behind on long fat pipes, while NET_CONGESTED and the
+ * resync request throttle in make_resync_request() are relative to
+ * sk_sndbuf.  So estimate the bandwidth delay product from the acked byte
+ * rate and the smoothed RTT, and grow sk_sndbuf towards it.  Only grow,
+ * only while the buffer is what limits us, and not beyond tcp_wmem[2].
+ * The buffer is not locked, the kernel may still grow it further.
+ * Called from the send path of the data stream only, with its mutex held. */
+static void dtt_autotune_sndbuf_sample(struct drbd_tcp_transport *tcp_transport, struct sock *sk)
+{
+	struct dtt_autotune *at = &tcp_transport->autotune;
+	struct tcp_sock *tp = tcp_sk(sk);
+	unsigned long now = jiffies;
+	u64 acked, sample, bdp;
+	int target;
+
+	if (!dtt_autotune_sndbuf || sk->sk_userlocks & SOCK_SNDBUF_LOCK)
+		return;
+
+	if (at->sk != sk || tp->bytes_acked < at->bytes_acked) {
+		at->sk = sk;
+		at->last = now;
+		at->bytes_acked = tp->bytes_acked;
+		at->rate = 0;
+		return;
+	}
+	if (time_before(now, at->last + DTT_AUTOTUNE_INTERVAL))
+		return;
+
+	acked = tp->bytes_acked;
+	sample = div64_u64((acked - at->bytes_acked) * HZ, now - at->last);
+	at->rate = at->rate ? (at->rate * 3 + sample) / 4 : sample;
+	at->bytes_acked = acked;
+	at->last = now;
+
+	/* make_resync_request() backs off at half the buffer, so a quarter
+	 * full counts as being limited by it */
+	if (sk->sk_wmem_queued < sk->sk_sndbuf / 4 || tcp_under_memory_pressure(sk))
+		return;
+
+	/* twice the BDP as payload, and sk_sndbuf accounts for skb overhead as well */
+	bdp = div_u64(at->rate * (tp->srtt_us >> 3), USEC_PER_SEC);
+	target = min_t(u64, bdp * 4, sock_net(sk)->ipv4.sysctl_tcp_wmem[2]);
+	if (target > sk->sk_sndbuf) {
+		lock_sock(sk);
+		sk->sk_sndbuf = max(sk->sk_sndbuf, target);
+		release_sock(sk);
+	}
+}
+
+static void dtt_update_congested(struct drbd_tcp_transport *tcp_transport, enum drbd_stream stream)
 {
 	struct socket *socket = tcp_transport->stream[DATA_STREAM];
 	struct sock *sock;
@@ -1128,6 +1282,8 @@ static void dtt_update_congested(struct drbd_tcp_transport *tcp_transport)
 		return;
 
 	sock = socket->sk;
+	if (stream == DATA_STREAM)
+		dtt_autotune_sndbuf_sample(tcp_transport, sock);
 	if (sock->sk_wmem_queued > sock->sk_sndbuf * 4 / 5)
 		set_bit(NET_CONGESTED, &tcp_transport->transport.flags);
 }
@@ -1146,7 +1302,7 @@ static int dtt_send_page(struct drbd_transport *transport, enum drbd_stream stre
 		return -ENOTCONN;
 
 	msg_flags |= MSG_NOSIGNAL;
-	dtt_update_congested(tcp_transport);
+	dtt_update_congested(tcp_transport, stream);
 	set_fs(KERNEL_DS);
 	do {
 		int sent;
@@ -1266,6 +1422,9 @@ static void dtt_debugfs_show_stream(struct seq_file *m, struct socket *socket)
 		   tp->write_seq - tp->snd_una);
 	seq_printf(m, "send buffer size: %u Byte\n", sk->sk_sndbuf);
 	seq_printf(m, "send buffer used: %u Byte\n", sk->sk_wmem_queued);
+	seq_printf(m, "send buffer locked: %s\n",
+		   sk->sk_userlocks & SOCK_SNDBUF_LOCK ? "yes" : "no");
+	seq_printf(m, "smoothed rtt: %u usec\n", tp->srtt_us >> 3);
 }
 
 static void dtt_debugfs_show(struct drbd_transport *transport, struct seq_file *m)
@@ -1275,7 +1434,7 @@ static void dtt_debugfs_show(struct drbd_transport *transport, struct seq_file *
 	enum drbd_stream i;
 
 	/* BUMP me if you change the file format/content/presentation */
-	seq_printf(m, "v: %u\n\n", 0);
+	seq_printf(m, "v: %u\n\n", 1);
 
 	for (i = DATA_STREAM; i <= CONTROL_STREAM ; i++) {
 		struct socket *socket = tcp_transport->stream[i];
@@ -1283,6 +1442,14 @@ static void dtt_debugfs_show(struct drbd_transport *transport, struct seq_file *
 		if (socket) {
 			seq_printf(m, "%s stream\n", i == DATA_STREAM ? "data" : "control");
 			dtt_debugfs_show_stream(m, socket);
+			if (i == DATA_STREAM && tcp_transport->autotune.sk == socket->sk)
+				seq_printf(m, "acked rate: %llu Byte/s\n",
+					   (unsigned long long)tcp_transport->autotune.rate);
+			if (i == CONTROL_STREAM && tcp_transport->busy_poll.usecs)
+				seq_printf(m, "busy poll: %u usec, %lu receives polled, %lu idle\n",
+					   tcp_transport->busy_poll.usecs,
+					   tcp_transport->busy_poll.polled,
+					   tcp_transport->busy_poll.idle);
 		}
 	}
 
@@ -15,6 +15,7 @@
 #define LRU_CACHE_H
 
 #include <linux/list.h>
+#include <linux/atomic.h>
 #include <linux/slab.h>
 #include <linux/bitops.h>
 #include <linux/string.h> /* for memset */
@@ -147,7 +148,9 @@ write intent log information, three of which are mentioned here.
 struct lc_element {
 	struct hlist_node colision;
 	struct list_head list;		 /* LRU list or free list */
-	unsigned refcnt;
+	/* Changes from and to zero only with the lock of the user, see
+	 * lc_try_get_rcu() and lc_put_rcu() */
+	atomic_t refcnt;
 	/* back "pointer" into lc_cache->element[index],
 	 * for paranoia, and for "lc_element_to_index" */
 	unsigned lc_index;
@@ -246,9 +249,12 @@ extern void lc_del(struct lru_cache *lc, struct lc_element *element);
 
 extern struct lc_element *lc_get_cumulative(struct lru_cache *lc, unsigned int enr);
 extern struct lc_element *lc_try_get(struct lru_cache *lc, unsigned int enr);
+extern struct lc_element *lc_find_rcu(struct lru_cache *lc, unsigned int enr);
+extern struct lc_element *lc_try_get_rcu(struct lru_cache *lc, unsigned int enr);
 extern struct lc_element *lc_find(struct lru_cache *lc, unsigned int enr);
 extern struct lc_element *lc_get(struct lru_cache *lc, unsigned int enr);
 extern unsigned int lc_put(struct lru_cache *lc, struct lc_element *e);
+extern bool lc_put_rcu(struct lru_cache *lc, struct lc_element *e);
 extern void lc_committed(struct lru_cache *lc);
 
 struct seq_file;
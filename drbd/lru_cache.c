@@ -9,6 +9,7 @@
 
 #include <linux/module.h>
 #include <linux/bitops.h>
+#include <linux/rculist.h>
 #include <linux/slab.h>
 #include <linux/string.h> /* for memset */
 #include <linux/seq_file.h> /* for seq_printf */
@@ -276,7 +277,7 @@ struct lc_element *lc_find(struct lru_cache *lc, unsigned int enr)
 bool lc_is_used(struct lru_cache *lc, unsigned int enr)
 {
 	struct lc_element *e = __lc_find(lc, enr, 1);
-	return e && e->refcnt;
+	return e && atomic_read(&e->refcnt);
 }
 
 /**
@@ -291,10 +292,10 @@ void lc_del(struct lru_cache *lc, struct lc_element *e)
 {
 	PARANOIA_ENTRY();
 	PARANOIA_LC_ELEMENT(lc, e);
-	BUG_ON(e->refcnt);
+	BUG_ON(atomic_read(&e->refcnt));
 
 	e->lc_number = e->lc_new_number = LC_FREE;
-	hlist_del_init(&e->colision);
+	hlist_del_init_rcu(&e->colision);
 	list_move(&e->list, &lc->free);
 	RETURN();
 }
@@ -314,10 +315,11 @@ static struct lc_element *lc_prepare_for_change(struct lru_cache *lc, unsigned n
 	e = list_entry(n, struct lc_element, list);
 	PARANOIA_LC_ELEMENT(lc, e);
 
-	e->lc_new_number = new_number;
+	WRITE_ONCE(e->lc_new_number, new_number);
+	/* keeps ->next, lc_find_rcu() may be walking past it */
 	if (!hlist_unhashed(&e->colision))
 		__hlist_del(&e->colision);
-	hlist_add_head(&e->colision, lc_hash_slot(lc, new_number));
+	hlist_add_head_rcu(&e->colision, lc_hash_slot(lc, new_number));
 	list_move(&e->list, &lc->to_be_changed);
 
 	return e;
@@ -364,13 +366,13 @@ static struct lc_element *__lc_get(struct lru_cache *lc, unsigned int enr, unsig
 				RETURN(NULL);
 			/* ... unless the caller is aware of the implications,
 			 * probably preparing a cumulative transaction. */
-			++e->refcnt;
+			atomic_inc(&e->refcnt);
 			++lc->hits;
 			RETURN(e);
 		}
 		/* else: lc_new_number == lc_number; a real hit. */
 		++lc->hits;
-		if (e->refcnt++ == 0)
+		if (atomic_inc_return(&e->refcnt) == 1)
 			lc->used++;
 		list_move(&e->list, &lc->in_use); /* Not evictable... */
 		RETURN(e);
@@ -411,7 +413,7 @@ static struct lc_element *__lc_get(struct lru_cache *lc, unsigned int enr, unsig
 	BUG_ON(!e);
 
 	clear_bit(__LC_STARVING, &lc->flags);
-	BUG_ON(++e->refcnt != 1);
+	BUG_ON(atomic_inc_return(&e->refcnt) != 1);
 	lc->used++;
 	lc->pending_changes++;
 
@@ -520,7 +522,7 @@ void lc_committed(struct lru_cache *lc)
 	list_for_each_entry_safe(e, tmp, &lc->to_be_changed, list) {
 		/* count number of changes, not number of transactions */
 		++lc->changed;
-		e->lc_number = e->lc_new_number;
+		WRITE_ONCE(e->lc_number, e->lc_new_number);
 		list_move(&e->list, &lc->in_use);
 	}
 	lc->pending_changes = 0;
@@ -539,17 +541,96 @@ void lc_committed(struct lru_cache *lc)
  */
 unsigned int lc_put(struct lru_cache *lc, struct lc_element *e)
 {
+	unsigned int refcnt;
+
 	PARANOIA_ENTRY();
 	PARANOIA_LC_ELEMENT(lc, e);
-	BUG_ON(e->refcnt == 0);
+	BUG_ON(atomic_read(&e->refcnt) == 0);
 	BUG_ON(e->lc_number != e->lc_new_number);
-	if (--e->refcnt == 0) {
+	refcnt = atomic_dec_return(&e->refcnt);
+	if (refcnt == 0) {
 		/* move it to the front of LRU. */
 		list_move(&e->list, &lc->lru);
 		lc->used--;
 		clear_bit_unlock(__LC_STARVING, &lc->flags);
 	}
-	RETURN(e->refcnt);
+	RETURN(refcnt);
+}
+
+/**
+ * lc_find_rcu - lc_find() without the lock, for elements in use
+ * @lc: the lru cache to operate on
+ * @enr: the label to look up
+ *
+ * For a user that holds a reference to the element labeled @enr, which keeps
+ * it from changing.  May return NULL when the lookup raced with a change of
+ * some other element; use lc_find() then.  The caller holds rcu_read_lock().
+ */
+struct lc_element *lc_find_rcu(struct lru_cache *lc, unsigned int enr)
+{
+	struct lc_element *e;
+	unsigned int n = 0;
+
+	/* An element moved to another chain meanwhile takes us along;
+	 * give up rather than walk around forever. */
+	hlist_for_each_entry_rcu(e, lc_hash_slot(lc, enr), colision) {
+		if (++n > lc->nr_elements)
+			break;
+		if (READ_ONCE(e->lc_new_number) != enr)
+			continue;
+		if (READ_ONCE(e->lc_number) != enr)
+			break;
+		return e;
+	}
+	return NULL;
+}
+
+/**
+ * lc_try_get_rcu - lc_try_get() without the lock, for elements in use
+ * @lc: the lru cache to operate on
+ * @enr: the label to look up
+ *
+ * Only finds an element that is in the active set and already has a
+ * reference, and takes one more.  That does not change the lists, so like
+ * lc_find_rcu() and lc_put_rcu(), this may run concurrently with the other
+ * functions here.
+ * Not counted in the statistics.  The caller holds rcu_read_lock().
+ *
+ * Return values:
+ *  NULL
+ *     The element is not in use, about to be changed, @lc is locked or
+ *     starving, or the lookup raced with a change.  Use lc_try_get().
+ *
+ *  pointer to an element
+ *     Which may have been recycled for another label meanwhile; the user
+ *     needs to check lc_number and lc_new_number, and give it back with
+ *     lc_put_rcu() or lc_put() if they do not match.
+ */
+struct lc_element *lc_try_get_rcu(struct lru_cache *lc, unsigned int enr)
+{
+	struct lc_element *e;
+
+	if (READ_ONCE(lc->flags) & (LC_LOCKED | LC_STARVING))
+		return NULL;
+
+	e = lc_find_rcu(lc, enr);
+	/* A change from zero needs the lock, for the lists */
+	if (e && atomic_inc_not_zero(&e->refcnt))
+		return e;
+	return NULL;
+}
+
+/**
+ * lc_put_rcu - lc_put() without the lock, unless it is the last reference
+ * @lc: the lru cache to operate on
+ * @e: the element to put
+ *
+ * Returns false if it would have dropped the last reference, which moves @e
+ * to the lru list; then the user needs to lc_put() it with the lock held.
+ */
+bool lc_put_rcu(struct lru_cache *lc, struct lc_element *e)
+{
+	return atomic_add_unless(&e->refcnt, -1, 1);
 }
 
 /**
@@ -594,14 +675,14 @@ void lc_set(struct lru_cache *lc, unsigned int enr, int index)
 
 	e = lc_element_by_index(lc, index);
 	BUG_ON(e->lc_number != e->lc_new_number);
-	BUG_ON(e->refcnt != 0);
+	BUG_ON(atomic_read(&e->refcnt) != 0);
 
 	e->lc_number = e->lc_new_number = enr;
-	hlist_del_init(&e->colision);
+	hlist_del_init_rcu(&e->colision);
 	if (enr == LC_FREE)
 		lh = &lc->free;
 	else {
-		hlist_add_head(&e->colision, lc_hash_slot(lc, enr));
+		hlist_add_head_rcu(&e->colision, lc_hash_slot(lc, enr));
 		lh = &lc->lru;
 	}
 	list_move(&e->list, lh);
@@ -628,10 +709,10 @@ void lc_seq_dump_details(struct seq_file *seq, struct lru_cache *lc, char *utext
 		e = lc_element_by_index(lc, i);
 		if (e->lc_number != e->lc_new_number)
 			seq_printf(seq, "\t%5d: %6d %8d %6d ",
-				i, e->lc_number, e->lc_new_number, e->refcnt);
+				i, e->lc_number, e->lc_new_number, atomic_read(&e->refcnt));
 		else
 			seq_printf(seq, "\t%5d: %6d %-8s %6d ",
-				i, e->lc_number, "-\"-", e->refcnt);
+				i, e->lc_number, "-\"-", atomic_read(&e->refcnt));
 		if (detail)
 			detail(seq, e);
 		seq_putc(seq, '\n');